@@ -0,0 +1,1394 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    capture.cpp
+
+Abstract:
+
+    This module contains the per-processor capture rings
+    holding the records of forwarded transfers.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "capture.h"
+#include "channel.h"
+#include "peripheral.h"
+
+#include "capture.tmh"
+
+C_ASSERT((CAPTURE_RING_SIZE & (CAPTURE_RING_SIZE - 1)) == 0);
+C_ASSERT((CAPTURE_HISTORY_SIZE & (CAPTURE_HISTORY_SIZE - 1)) == 0);
+C_ASSERT(CAPTURE_HISTORY_SIZE <= CAPTURE_RING_SIZE);
+
+static
+VOID
+SpbCaptureReadFilter(
+	_In_  WDFKEY                  Key,
+	_In_  PCUNICODE_STRING        ValueName,
+	_Out_writes_(SPB_PROBE_FILTER_MAX_INSNS) PSPB_PROBE_FILTER_INSN pProgram,
+	_Out_ ULONG*                  pCount,
+	_Out_ ULONG*                  pBytesNeeded
+)
+/*++
+
+  Routine Description:
+
+    This routine reads and validates a filter program.
+
+  Arguments:
+
+    Key - the device key
+    ValueName - the name of the binary value holding the program
+    pProgram - receives the instructions
+    pCount - receives the number of instructions, 0 if the
+        value is missing or invalid
+    pBytesNeeded - receives the number of payload bytes
+        the program may load
+
+  Return Value:
+
+    None
+
+--*/
+{
+	ULONG valueLength = 0;
+	ULONG valueType = REG_NONE;
+	NTSTATUS status;
+
+	*pCount = 0;
+	*pBytesNeeded = 0;
+
+	status = WdfRegistryQueryValue(
+		Key,
+		ValueName,
+		SPB_PROBE_FILTER_MAX_INSNS * sizeof(SPB_PROBE_FILTER_INSN),
+		pProgram,
+		&valueLength,
+		&valueType);
+
+	if (NT_SUCCESS(status) &&
+		valueType == REG_BINARY &&
+		(valueLength % sizeof(SPB_PROBE_FILTER_INSN)) == 0 &&
+		SpbProbeFilterValidate(
+			pProgram,
+			valueLength / sizeof(SPB_PROBE_FILTER_INSN),
+			pBytesNeeded))
+	{
+		*pCount = valueLength / sizeof(SPB_PROBE_FILTER_INSN);
+	}
+	else if (status != STATUS_OBJECT_NAME_NOT_FOUND)
+	{
+		*pBytesNeeded = 0;
+
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_FLAG_TRANSFER,
+			"Ignoring invalid filter %wZ - %!STATUS!",
+			ValueName,
+			status);
+	}
+}
+
+static
+VOID
+SpbCaptureReadSettings(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine reads the capture settings from the device
+    key, keeping the defaults for missing or invalid values.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	DECLARE_CONST_UNICODE_STRING(modeName, L"CaptureMode");
+	DECLARE_CONST_UNICODE_STRING(truncationName, L"CaptureTruncation");
+	DECLARE_CONST_UNICODE_STRING(lengthName, L"CaptureLength");
+	DECLARE_CONST_UNICODE_STRING(repeatsName, L"CaptureRepeats");
+	DECLARE_CONST_UNICODE_STRING(filterName, L"CaptureFilter");
+	DECLARE_CONST_UNICODE_STRING(triggerName, L"CaptureTrigger");
+	DECLARE_CONST_UNICODE_STRING(preTriggerName, L"CapturePreTrigger");
+	DECLARE_CONST_UNICODE_STRING(postTriggerName, L"CapturePostTrigger");
+	DECLARE_CONST_UNICODE_STRING(latencyName, L"CaptureTriggerLatency");
+	DECLARE_CONST_UNICODE_STRING(patternName, L"CaptureTriggerFilter");
+
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	PPBC_CAPTURE_TRIGGER pTrigger = &pCapture->Trigger;
+	LARGE_INTEGER frequency;
+	WDFKEY key;
+	ULONG value;
+	NTSTATUS status;
+
+	pCapture->Mode = CAPTURE_DEFAULT_MODE;
+	pCapture->Truncation = CAPTURE_DEFAULT_TRUNCATION;
+	pCapture->TruncationLength = CAPTURE_DEFAULT_LENGTH;
+	pCapture->CollapseRepeats = TRUE;
+	pCapture->FilterCount = 0;
+	pCapture->FilterBytes = 0;
+
+	RtlZeroMemory(pTrigger, sizeof(*pTrigger));
+	pTrigger->PreTrigger = CAPTURE_DEFAULT_PRE_TRIGGER;
+	pTrigger->PostTrigger = CAPTURE_DEFAULT_POST_TRIGGER;
+
+	KeQueryPerformanceCounter(&frequency);
+
+	status = WdfDeviceOpenRegistryKey(
+		pDevice->FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &modeName, &value)) &&
+		value <= SPB_PROBE_MODE_FULL)
+	{
+		pCapture->Mode = value;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &truncationName, &value)) &&
+		value <= SPB_PROBE_TRUNCATE_LENGTH_ONLY)
+	{
+		pCapture->Truncation = value;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &lengthName, &value)))
+	{
+		pCapture->TruncationLength = value;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &repeatsName, &value)))
+	{
+		pCapture->CollapseRepeats = (value != 0);
+	}
+
+	SpbCaptureReadFilter(
+		key,
+		&filterName,
+		pCapture->Filter,
+		&pCapture->FilterCount,
+		&pCapture->FilterBytes);
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &triggerName, &value)))
+	{
+		pTrigger->Conditions = value & SPB_PROBE_TRIGGER_ALL;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &preTriggerName, &value)))
+	{
+		pTrigger->PreTrigger = min(value, CAPTURE_HISTORY_MAX_REQUESTS);
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &postTriggerName, &value)))
+	{
+		pTrigger->PostTrigger = value;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &latencyName, &value)))
+	{
+		pTrigger->Latency = (LONGLONG)value * frequency.QuadPart / 1000000;
+	}
+
+	SpbCaptureReadFilter(
+		key,
+		&patternName,
+		pTrigger->Pattern,
+		&pTrigger->PatternCount,
+		&pTrigger->PatternBytes);
+
+	if (pTrigger->PatternCount == 0)
+	{
+		pTrigger->Conditions &= ~SPB_PROBE_TRIGGER_PATTERN;
+	}
+
+	if (pTrigger->Latency == 0)
+	{
+		pTrigger->Conditions &= ~SPB_PROBE_TRIGGER_LATENCY;
+	}
+
+	WdfRegistryClose(key);
+
+exit:
+
+	pCapture->TraceCompletion = SpbPeripheralGetTraceCompletion(pCapture->Mode);
+
+	//
+	// Runtime changes start from the settings read here.
+	//
+
+	pCapture->ControlSequence = 0;
+	pCapture->ControlPending = 0;
+	pCapture->Control.Version = SPB_PROBE_CONTROL_VERSION;
+	pCapture->Control.Flags = 0;
+	pCapture->Control.Mode = pCapture->Mode;
+	pCapture->Control.Truncation = pCapture->Truncation;
+	pCapture->Control.TruncationLength = pCapture->TruncationLength;
+	pCapture->Control.CollapseRepeats = pCapture->CollapseRepeats;
+	pCapture->Control.FilterCount = pCapture->FilterCount;
+	pCapture->Control.Reserved = 0;
+
+	RtlCopyMemory(
+		pCapture->Control.Filter,
+		pCapture->Filter,
+		sizeof(pCapture->Control.Filter));
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Capture mode %lu, truncation %lu, length %lu, repeats %!bool!, "
+		"filter of %lu instructions, trigger 0x%lx (%lu/%lu requests)",
+		pCapture->Mode,
+		pCapture->Truncation,
+		pCapture->TruncationLength,
+		pCapture->CollapseRepeats,
+		pCapture->FilterCount,
+		pTrigger->Conditions,
+		pTrigger->PreTrigger,
+		pTrigger->PostTrigger);
+}
+
+NTSTATUS
+SpbCaptureCreateWorkItem(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine creates the work item draining the capture rings
+    and the lock serializing the control requests.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	WDF_WORKITEM_CONFIG config;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	NTSTATUS status;
+
+	WDF_WORKITEM_CONFIG_INIT(&config, SpbCaptureOnDrain);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfWorkItemCreate(
+		&config,
+		&attributes,
+		&pDevice->Capture.DrainWorkItem);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Failed to create capture work item - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->Capture.ControlLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Failed to create capture control lock - %!STATUS!",
+			status);
+	}
+
+exit:
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+
+	return status;
+}
+
+NTSTATUS
+SpbCaptureInitialize(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine reads the capture settings and allocates
+    one capture ring per processor.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	ULONG ringCount;
+	SIZE_T dataOffset;
+	SIZE_T allocationSize;
+	PUCHAR pAllocation;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	NT_ASSERT(pCapture->pRings == NULL);
+
+	SpbCaptureReadSettings(pDevice);
+
+	RtlZeroMemory(&pCapture->Repeat, sizeof(pCapture->Repeat));
+
+	ringCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	//
+	// Ring headers first, followed by the ring buffers and
+	// the history in trigger mode.
+	//
+
+	dataOffset = ALIGN_UP_BY(ringCount * sizeof(PBC_CAPTURE_RING), 8);
+	allocationSize = dataOffset + (SIZE_T)ringCount * CAPTURE_RING_SIZE;
+
+	if (pCapture->Trigger.Conditions != 0)
+	{
+		allocationSize += CAPTURE_HISTORY_SIZE;
+	}
+
+	pAllocation = (PUCHAR)ExAllocatePoolWithTag(
+		NonPagedPoolNx,
+		allocationSize,
+		SI2C_POOL_TAG);
+
+	if (pAllocation == NULL)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Failed to allocate %lu capture rings - %!STATUS!",
+			ringCount,
+			status);
+
+		goto exit;
+	}
+
+	RtlZeroMemory(pAllocation, allocationSize);
+
+	pCapture->pRings = (PPBC_CAPTURE_RING)pAllocation;
+	pCapture->RingCount = ringCount;
+	pCapture->Draining = 0;
+
+	for (ULONG i = 0; i < ringCount; i++)
+	{
+		pCapture->pRings[i].pData =
+			pAllocation + dataOffset + (SIZE_T)i * CAPTURE_RING_SIZE;
+	}
+
+	if (pCapture->Trigger.Conditions != 0)
+	{
+		pCapture->Trigger.pHistory =
+			pAllocation + dataOffset + (SIZE_T)ringCount * CAPTURE_RING_SIZE;
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Allocated %lu capture rings of %lu bytes",
+		ringCount,
+		(ULONG)CAPTURE_RING_SIZE);
+
+exit:
+	FuncExit(TRACE_FLAG_TRANSFER);
+
+	return status;
+}
+
+VOID
+SpbCaptureCleanup(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine drains and frees the capture rings.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+
+	//
+	// Wait for a scheduled drain before freeing the rings.
+	//
+
+	WdfWorkItemFlush(pCapture->DrainWorkItem);
+
+	if (pCapture->pRings != NULL)
+	{
+		SpbCaptureFlushRepeats(pDevice);
+		SpbCaptureDrain(pDevice);
+
+		ExFreePoolWithTag(pCapture->pRings, SI2C_POOL_TAG);
+		pCapture->pRings = NULL;
+		pCapture->RingCount = 0;
+		pCapture->Trigger.pHistory = NULL;
+	}
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+}
+
+static
+VOID
+SpbCaptureHistoryEvict(
+	_In_  PPBC_CAPTURE_TRIGGER  pTrigger
+)
+/*++
+
+  Routine Description:
+
+    This routine drops the oldest request of the history.
+
+  Arguments:
+
+    pTrigger - a pointer to the trigger state
+
+  Return Value:
+
+    None
+
+--*/
+{
+	NT_ASSERT(pTrigger->Count != 0);
+
+	pTrigger->First = (pTrigger->First + 1) % CAPTURE_HISTORY_MAX_REQUESTS;
+	pTrigger->Count -= 1;
+
+	pTrigger->Tail = (pTrigger->Count != 0) ?
+		pTrigger->Requests[pTrigger->First] : pTrigger->Head;
+}
+
+static
+PSPB_PROBE_RECORD
+SpbCaptureHistoryReserve(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  ULONG             RecordSize
+)
+/*++
+
+  Routine Description:
+
+    This routine reserves room for a record in the history,
+    dropping the oldest requests as needed.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    RecordSize - the record size, payload included
+
+  Return Value:
+
+    A pointer to the record, or NULL if it does not fit
+    beside the other records of the current request
+
+--*/
+{
+	PPBC_CAPTURE_TRIGGER pTrigger = &pDevice->Capture.Trigger;
+	PPBC_CAPTURE_ENTRY pEntry;
+	ULONG entrySize = ALIGN_UP_BY(sizeof(PBC_CAPTURE_ENTRY) + RecordSize, 8);
+	ULONG offset = pTrigger->Head & (CAPTURE_HISTORY_SIZE - 1);
+	ULONG padding = (offset + entrySize > CAPTURE_HISTORY_SIZE) ?
+		CAPTURE_HISTORY_SIZE - offset : 0;
+
+	if (pTrigger->Count == 0)
+	{
+		return NULL;
+	}
+
+	while ((pTrigger->Head - pTrigger->Tail) + padding + entrySize >
+		CAPTURE_HISTORY_SIZE)
+	{
+		if (pTrigger->Count == 1)
+		{
+			return NULL;
+		}
+
+		SpbCaptureHistoryEvict(pTrigger);
+	}
+
+	if (padding != 0)
+	{
+		pEntry = (PPBC_CAPTURE_ENTRY)(pTrigger->pHistory + offset);
+		pEntry->Size = padding;
+		pEntry->State = PBC_CAPTURE_ENTRY_PADDING;
+
+		offset = 0;
+	}
+
+	pEntry = (PPBC_CAPTURE_ENTRY)(pTrigger->pHistory + offset);
+	pEntry->Size = entrySize;
+	pEntry->State = PBC_CAPTURE_ENTRY_FREE;
+
+	pTrigger->Head += padding + entrySize;
+
+	return (PSPB_PROBE_RECORD)(pEntry + 1);
+}
+
+VOID
+SpbCaptureBeginRequest(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine starts a new request in trigger mode. Outside of
+    the window following a trigger, its records go to the history,
+    which is trimmed to the configured number of requests.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE_TRIGGER pTrigger = &pDevice->Capture.Trigger;
+
+	if (pTrigger->pHistory == NULL || pTrigger->PostRemaining != 0)
+	{
+		return;
+	}
+
+	if (pTrigger->PreTrigger == 0)
+	{
+		//
+		// No history kept, records of this request
+		// are simply not captured.
+		//
+
+		pTrigger->Count = 0;
+		pTrigger->Tail = pTrigger->Head;
+		return;
+	}
+
+	while (pTrigger->Count >= pTrigger->PreTrigger)
+	{
+		SpbCaptureHistoryEvict(pTrigger);
+	}
+
+	pTrigger->Requests[
+		(pTrigger->First + pTrigger->Count) % CAPTURE_HISTORY_MAX_REQUESTS] =
+		pTrigger->Head;
+	pTrigger->Count += 1;
+}
+
+VOID
+SpbCaptureEndRequest(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  ULONG             Reason,
+	_In_  NTSTATUS          Status
+)
+/*++
+
+  Routine Description:
+
+    This routine completes a request in trigger mode. If it fired
+    the trigger, the history is moved to the capture rings together
+    with a trigger record, and the next requests are captured
+    directly.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Reason - the SPB_PROBE_TRIGGER_* conditions met by the request
+    Status - the completion status of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE_TRIGGER pTrigger = &pDevice->Capture.Trigger;
+	PSPB_PROBE_RECORD pRecord;
+	PSPB_PROBE_TRIGGER pPayload;
+
+	if (pTrigger->pHistory == NULL)
+	{
+		return;
+	}
+
+	if (Reason == 0)
+	{
+		if (pTrigger->PostRemaining != 0)
+		{
+			if (pTrigger->PostRemaining == 1)
+			{
+				//
+				// Report pending repeats before going back
+				// to the history.
+				//
+
+				SpbCaptureFlushRepeats(pDevice);
+			}
+
+			pTrigger->PostRemaining -= 1;
+		}
+
+		return;
+	}
+
+	SpbCaptureFlushRepeats(pDevice);
+
+	//
+	// Switch to direct capture while the history and the trigger
+	// record are moved over. The post-trigger count is only set
+	// once they are in the rings, so that a count of 0 goes back
+	// to the history straight away.
+	//
+
+	pTrigger->PostRemaining = 1;
+
+	while (pTrigger->Tail != pTrigger->Head)
+	{
+		PPBC_CAPTURE_ENTRY pEntry = (PPBC_CAPTURE_ENTRY)
+			(pTrigger->pHistory + (pTrigger->Tail & (CAPTURE_HISTORY_SIZE - 1)));
+
+		if (pEntry->State == PBC_CAPTURE_ENTRY_RECORD)
+		{
+			PSPB_PROBE_RECORD pHistoryRecord = (PSPB_PROBE_RECORD)(pEntry + 1);
+
+			pRecord = SpbCaptureReserve(pDevice, pHistoryRecord->Size);
+
+			if (pRecord != NULL)
+			{
+				RtlCopyMemory(pRecord, pHistoryRecord, pHistoryRecord->Size);
+				SpbCaptureCommit(pRecord);
+			}
+		}
+
+		pTrigger->Tail += pEntry->Size;
+	}
+
+	pTrigger->First = 0;
+	pTrigger->Count = 0;
+
+	pRecord = SpbCaptureReserve(
+		pDevice,
+		sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_TRIGGER));
+
+	if (pRecord != NULL)
+	{
+		pRecord->Size = sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_TRIGGER);
+		pRecord->Version = SPB_PROBE_RECORD_VERSION;
+		pRecord->Type = SPB_PROBE_RECORD_TYPE_TRIGGER;
+		pRecord->Direction = 0;
+		pRecord->TransferIndex = 0;
+		pRecord->PeripheralId = pDevice->Capture.PeripheralId;
+		pRecord->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+		pRecord->Status = Status;
+		pRecord->TransferLength = 0;
+		pRecord->Offset = 0;
+		pRecord->WireTime = 0;
+		pRecord->ArrivalTimestamp = 0;
+		pRecord->SendTimestamp = 0;
+		pRecord->ControllerTimestamp = 0;
+
+		pPayload = (PSPB_PROBE_TRIGGER)(pRecord + 1);
+		pPayload->Reason = Reason;
+		pPayload->Reserved = 0;
+
+		SpbCaptureCommit(pRecord);
+	}
+
+	pTrigger->PostRemaining = pTrigger->PostTrigger;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Capture triggered (0x%lx) - %!STATUS!",
+		Reason,
+		Status);
+}
+
+PSPB_PROBE_RECORD
+SpbCaptureReserve(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  ULONG             RecordSize
+)
+/*++
+
+  Routine Description:
+
+    This routine reserves room for a record in the current
+    processor's ring, or in the history while a trigger is
+    awaited. It never blocks: when the ring is full the record
+    is counted as dropped.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    RecordSize - the record size, payload included
+
+  Return Value:
+
+    A pointer to the record to fill in and pass to
+    SpbCaptureCommit, or NULL if the record was dropped
+
+--*/
+{
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	PPBC_CAPTURE_RING pRing;
+	PPBC_CAPTURE_ENTRY pEntry;
+	ULONG entrySize;
+	ULONG padding;
+	ULONG offset;
+	ULONG head;
+	ULONG tail;
+
+	if (pCapture->pRings == NULL)
+	{
+		return NULL;
+	}
+
+	if (pCapture->Trigger.pHistory != NULL &&
+		pCapture->Trigger.PostRemaining == 0)
+	{
+		return SpbCaptureHistoryReserve(pDevice, RecordSize);
+	}
+
+	pRing = &pCapture->pRings[
+		KeGetCurrentProcessorNumberEx(NULL) % pCapture->RingCount];
+
+	entrySize = ALIGN_UP_BY(sizeof(PBC_CAPTURE_ENTRY) + RecordSize, 8);
+
+	if (entrySize > CAPTURE_RING_SIZE)
+	{
+		InterlockedIncrement(&pRing->Dropped);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		//
+		// Read the tail before the head, so that a stale tail can
+		// only underestimate the free space.
+		//
+
+		tail = (ULONG)ReadAcquire(&pRing->Tail);
+		head = (ULONG)ReadAcquire(&pRing->Head);
+
+		//
+		// Entries are contiguous, pad up to the end of the ring
+		// when the entry does not fit before it.
+		//
+
+		offset = head & (CAPTURE_RING_SIZE - 1);
+		padding = (offset + entrySize > CAPTURE_RING_SIZE) ?
+			CAPTURE_RING_SIZE - offset : 0;
+
+		if ((head - tail) + padding + entrySize > CAPTURE_RING_SIZE)
+		{
+			InterlockedIncrement(&pRing->Dropped);
+			return NULL;
+		}
+
+		if (InterlockedCompareExchange(
+				&pRing->Head,
+				(LONG)(head + padding + entrySize),
+				(LONG)head) == (LONG)head)
+		{
+			break;
+		}
+	}
+
+	if (padding != 0)
+	{
+		pEntry = (PPBC_CAPTURE_ENTRY)(pRing->pData + offset);
+		pEntry->Size = padding;
+		InterlockedExchange(&pEntry->State, PBC_CAPTURE_ENTRY_PADDING);
+
+		offset = 0;
+	}
+
+	pEntry = (PPBC_CAPTURE_ENTRY)(pRing->pData + offset);
+	pEntry->Size = entrySize;
+
+	return (PSPB_PROBE_RECORD)(pEntry + 1);
+}
+
+VOID
+SpbCaptureCommit(
+	_In_  PSPB_PROBE_RECORD pRecord
+)
+/*++
+
+  Routine Description:
+
+    This routine publishes a record filled in after
+    SpbCaptureReserve to the consumer.
+
+  Arguments:
+
+    pRecord - the record returned by SpbCaptureReserve
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE_ENTRY pEntry = ((PPBC_CAPTURE_ENTRY)pRecord) - 1;
+
+	InterlockedExchange(&pEntry->State, PBC_CAPTURE_ENTRY_RECORD);
+}
+
+VOID
+SpbCaptureFlushRepeats(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine emits a repeat record for the repeats of the
+    last request counted so far, if any.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE_REPEAT pRepeat = &pDevice->Capture.Repeat;
+	PSPB_PROBE_RECORD pRecord;
+	PSPB_PROBE_REPEAT pPayload;
+
+	if (pRepeat->Count == 0)
+	{
+		return;
+	}
+
+	pRecord = SpbCaptureReserve(
+		pDevice,
+		sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_REPEAT));
+
+	if (pRecord != NULL)
+	{
+		pRecord->Size = sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_REPEAT);
+		pRecord->Version = SPB_PROBE_RECORD_VERSION;
+		pRecord->Type = SPB_PROBE_RECORD_TYPE_REPEAT;
+		pRecord->Direction = 0;
+		pRecord->TransferIndex = 0;
+		pRecord->PeripheralId = pRepeat->PeripheralId;
+		pRecord->Timestamp = pRepeat->FirstTimestamp;
+		pRecord->Status = pRepeat->Status;
+		pRecord->TransferLength = 0;
+		pRecord->Offset = 0;
+		pRecord->WireTime = 0;
+		pRecord->ArrivalTimestamp = 0;
+		pRecord->SendTimestamp = 0;
+		pRecord->ControllerTimestamp = 0;
+
+		pPayload = (PSPB_PROBE_REPEAT)(pRecord + 1);
+		pPayload->Count = pRepeat->Count;
+		pPayload->Reserved = 0;
+		pPayload->LastTimestamp = pRepeat->LastTimestamp;
+
+		SpbCaptureCommit(pRecord);
+	}
+
+	pRepeat->Count = 0;
+}
+
+VOID
+SpbCaptureControl(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine completes an IOCTL_SPB_PROBE_CONTROL request.
+    The new settings are only recorded here, the completion path
+    switches to them before the next client request, so that a
+    request in progress is captured with a single set of settings.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the control request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	PSPB_PROBE_CONTROL pInput = NULL;
+	PSPB_PROBE_CONTROL pOutput = NULL;
+	PSPB_PROBE_CONTROL pControl = &pCapture->Control;
+	SPB_PROBE_CONTROL control;
+	ULONG_PTR information = 0;
+	ULONG bytesNeeded;
+	ULONG flags;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(
+		FxRequest,
+		sizeof(SPB_PROBE_CONTROL),
+		(PVOID*)&pInput,
+		NULL);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	//
+	// Work on a copy, the buffer is shared with the output.
+	//
+
+	control = *pInput;
+	flags = control.Flags;
+
+	if (control.Version != SPB_PROBE_CONTROL_VERSION ||
+		(flags & ~SPB_PROBE_CONTROL_ALL) != 0 ||
+		((flags & SPB_PROBE_CONTROL_MODE) &&
+			control.Mode > SPB_PROBE_MODE_FULL) ||
+		((flags & SPB_PROBE_CONTROL_TRUNCATION) &&
+			control.Truncation > SPB_PROBE_TRUNCATE_LENGTH_ONLY) ||
+		((flags & SPB_PROBE_CONTROL_FILTER) &&
+			control.FilterCount != 0 &&
+			!SpbProbeFilterValidate(control.Filter, control.FilterCount, &bytesNeeded)))
+	{
+		status = STATUS_INVALID_PARAMETER;
+		goto exit;
+	}
+
+	//
+	// Concurrent control requests are applied one after the
+	// other. The odd sequence tells the completion path to leave
+	// Control alone for now. A query does not touch the sequence,
+	// the completion path would otherwise drop a pending change
+	// it is taking when the query lands, with nothing setting
+	// ControlPending again.
+	//
+
+	WdfSpinLockAcquire(pCapture->ControlLock);
+
+	if (flags != 0)
+	{
+		InterlockedIncrement(&pCapture->ControlSequence);
+	}
+
+	if (flags & SPB_PROBE_CONTROL_MODE)
+	{
+		pControl->Mode = control.Mode;
+	}
+
+	if (flags & SPB_PROBE_CONTROL_TRUNCATION)
+	{
+		pControl->Truncation = control.Truncation;
+		pControl->TruncationLength = control.TruncationLength;
+	}
+
+	if (flags & SPB_PROBE_CONTROL_REPEATS)
+	{
+		pControl->CollapseRepeats = (control.CollapseRepeats != 0);
+	}
+
+	if (flags & SPB_PROBE_CONTROL_FILTER)
+	{
+		pControl->FilterCount = control.FilterCount;
+
+		RtlCopyMemory(
+			pControl->Filter,
+			control.Filter,
+			control.FilterCount * sizeof(SPB_PROBE_FILTER_INSN));
+	}
+
+	control = *pControl;
+
+	if (flags != 0)
+	{
+		InterlockedIncrement(&pCapture->ControlSequence);
+		InterlockedExchange(&pCapture->ControlPending, 1);
+	}
+
+	WdfSpinLockRelease(pCapture->ControlLock);
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Capture control 0x%lx: mode %lu, truncation %lu, length %lu, "
+		"repeats %lu, filter of %lu instructions",
+		flags,
+		control.Mode,
+		control.Truncation,
+		control.TruncationLength,
+		control.CollapseRepeats,
+		control.FilterCount);
+
+	if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(
+			FxRequest,
+			sizeof(SPB_PROBE_CONTROL),
+			(PVOID*)&pOutput,
+			NULL)))
+	{
+		*pOutput = control;
+		pOutput->Flags = 0;
+		information = sizeof(SPB_PROBE_CONTROL);
+	}
+
+exit:
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Rejected capture control request %p - %!STATUS!",
+			FxRequest,
+			status);
+	}
+
+	WdfRequestCompleteWithInformation(FxRequest, status, information);
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+}
+
+VOID
+SpbCaptureApplyControl(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine switches to the settings requested by
+    IOCTL_SPB_PROBE_CONTROL, if any. It is called by the
+    completion path, the only user of the settings, before
+    a client request is captured.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	SPB_PROBE_CONTROL control;
+	ULONG bytesNeeded = 0;
+	LONG sequence;
+
+	if (ReadAcquire(&pCapture->ControlPending) == 0)
+	{
+		return;
+	}
+
+	//
+	// A writer sets ControlPending again once done, a change
+	// missed here is applied before the next request.
+	//
+
+	sequence = ReadAcquire(&pCapture->ControlSequence);
+
+	if ((sequence & 1) != 0)
+	{
+		return;
+	}
+
+	InterlockedExchange(&pCapture->ControlPending, 0);
+
+	control = pCapture->Control;
+
+	//
+	// The copy must be complete before the sequence is checked
+	// again, an acquire only orders the loads that follow it.
+	//
+
+	MemoryBarrier();
+
+	if (ReadAcquire(&pCapture->ControlSequence) != sequence)
+	{
+		return;
+	}
+
+	//
+	// Repeats counted so far are reported with the old settings,
+	// and the next request is never taken for one of them.
+	//
+
+	SpbCaptureFlushRepeats(pDevice);
+	pCapture->Repeat.Length = 0;
+
+	if (control.FilterCount != 0)
+	{
+		SpbProbeFilterValidate(control.Filter, control.FilterCount, &bytesNeeded);
+	}
+
+	WriteULongNoFence(&pCapture->Mode, control.Mode);
+	pCapture->TraceCompletion = SpbPeripheralGetTraceCompletion(control.Mode);
+	pCapture->Truncation = control.Truncation;
+	pCapture->TruncationLength = control.TruncationLength;
+	pCapture->CollapseRepeats = (control.CollapseRepeats != 0);
+	pCapture->FilterCount = control.FilterCount;
+	pCapture->FilterBytes = bytesNeeded;
+
+	RtlCopyMemory(pCapture->Filter, control.Filter, sizeof(pCapture->Filter));
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Switched to capture mode %lu, truncation %lu, length %lu, "
+		"repeats %!bool!, filter of %lu instructions",
+		pCapture->Mode,
+		pCapture->Truncation,
+		pCapture->TruncationLength,
+		pCapture->CollapseRepeats,
+		pCapture->FilterCount);
+}
+
+VOID
+SpbCaptureScheduleDrain(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine queues the drain of the capture rings, so that
+    emitting the records stays off the request completion path.
+    Scheduling an already queued drain does nothing.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	if (pDevice->Capture.pRings != NULL)
+	{
+		WdfWorkItemEnqueue(pDevice->Capture.DrainWorkItem);
+	}
+}
+
+VOID
+SpbCaptureOnDrain(
+	_In_  WDFWORKITEM       FxWorkItem
+)
+/*++
+
+  Routine Description:
+
+    This event is called at passive level by a system worker
+    thread when a scheduled drain runs.
+
+  Arguments:
+
+    FxWorkItem - a handle to the drain work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_DEVICE pDevice = GetDeviceContext(
+		WdfWorkItemGetParentObject(FxWorkItem));
+
+	SpbCaptureDrain(pDevice);
+}
+
+VOID
+SpbCaptureDrain(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine consumes the committed records of every ring and
+    writes them to the capture channel when one is attached, or
+    traces them otherwise. Only one consumer runs at a time, a
+    caller finding the rings already being drained returns
+    immediately.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	LONG droppedTotal = 0;
+
+	if (pCapture->pRings == NULL)
+	{
+		return;
+	}
+
+	if (InterlockedCompareExchange(&pCapture->Draining, 1, 0) != 0)
+	{
+		return;
+	}
+
+	WdfSpinLockAcquire(pDevice->Channel.Lock);
+
+	for (ULONG i = 0; i < pCapture->RingCount; i++)
+	{
+		PPBC_CAPTURE_RING pRing = &pCapture->pRings[i];
+		ULONG tail = (ULONG)pRing->Tail;
+		LONG dropped;
+
+		while (tail != (ULONG)ReadAcquire(&pRing->Head))
+		{
+			PPBC_CAPTURE_ENTRY pEntry = (PPBC_CAPTURE_ENTRY)
+				(pRing->pData + (tail & (CAPTURE_RING_SIZE - 1)));
+			LONG state = ReadAcquire(&pEntry->State);
+			ULONG size;
+
+			if (state == PBC_CAPTURE_ENTRY_FREE)
+			{
+				//
+				// Reserved but not committed yet, pick it
+				// up on the next drain.
+				//
+
+				break;
+			}
+
+			size = pEntry->Size;
+
+			if (state == PBC_CAPTURE_ENTRY_RECORD)
+			{
+				PSPB_PROBE_RECORD pRecord = (PSPB_PROBE_RECORD)(pEntry + 1);
+
+				if (pDevice->Channel.pHeader != NULL)
+				{
+					if (!SpbChannelWrite(pDevice, pRecord))
+					{
+						//
+						// The consumer is behind. Nothing tells the
+						// driver when it catches up, so a record left
+						// in the ring could wait for the next request
+						// indefinitely; count it as dropped instead.
+						//
+
+						InterlockedIncrement(&pRing->Dropped);
+					}
+				}
+				else
+				{
+					Trace(
+						TRACE_LEVEL_ERROR,
+						TRACE_FLAG_TRANSFER,
+						"record: %!HEXDUMP!",
+						WppHexDump(pRecord, (USHORT)pRecord->Size));
+				}
+			}
+
+			//
+			// Hand the space back zeroed, so that producers
+			// reserving it start from a free entry.
+			//
+
+			RtlZeroMemory(pEntry, size);
+
+			tail += size;
+			WriteRelease(&pRing->Tail, (LONG)tail);
+		}
+
+		dropped = ReadNoFence(&pRing->Dropped);
+		droppedTotal += dropped;
+
+		if (dropped != pRing->DroppedReported)
+		{
+			Trace(
+				TRACE_LEVEL_WARNING,
+				TRACE_FLAG_TRANSFER,
+				"Capture ring %lu full, %ld records dropped",
+				i,
+				dropped - pRing->DroppedReported);
+
+			pRing->DroppedReported = dropped;
+		}
+	}
+
+	if (pDevice->Channel.pHeader != NULL)
+	{
+		WriteRelease(&pDevice->Channel.pHeader->Dropped, droppedTotal);
+	}
+
+	WdfSpinLockRelease(pDevice->Channel.Lock);
+
+	InterlockedExchange(&pCapture->Draining, 0);
+}
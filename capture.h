@@ -0,0 +1,79 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the transfer capture rings.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+EVT_WDF_WORKITEM                   SpbCaptureOnDrain;
+
+NTSTATUS
+SpbCaptureCreateWorkItem(
+    _In_  PPBC_DEVICE       pDevice);
+
+NTSTATUS
+SpbCaptureInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbCaptureCleanup(
+    _In_  PPBC_DEVICE       pDevice);
+
+PSPB_PROBE_RECORD
+SpbCaptureReserve(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  ULONG             RecordSize);
+
+VOID
+SpbCaptureCommit(
+    _In_  PSPB_PROBE_RECORD pRecord);
+
+VOID
+SpbCaptureBeginRequest(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbCaptureEndRequest(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  ULONG             Reason,
+    _In_  NTSTATUS          Status);
+
+VOID
+SpbCaptureFlushRepeats(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbCaptureControl(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  WDFREQUEST        FxRequest);
+
+VOID
+SpbCaptureApplyControl(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbCaptureScheduleDrain(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbCaptureDrain(
+    _In_  PPBC_DEVICE       pDevice);
+
+#endif // _CAPTURE_H_
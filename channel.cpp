@@ -0,0 +1,438 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    channel.cpp
+
+Abstract:
+
+    This module contains the capture channel, which shares the
+    captured records with a user-mode consumer through the buffer
+    of a pending IOCTL_SPB_PROBE_MAP_CAPTURE request.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "channel.h"
+
+#include "channel.tmh"
+
+#define CHANNEL_DATA_OFFSET      ALIGN_UP_BY(sizeof(SPB_PROBE_CHANNEL), 64)
+#define CHANNEL_MAX_DATA_SIZE    0x40000000
+
+C_ASSERT(ALIGN_UP_BY(sizeof(SPB_PROBE_RECORD) + SPB_PROBE_RECORD_MAX_PAYLOAD, 8) <= PAGE_SIZE);
+
+NTSTATUS
+SpbChannelInitialize(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine creates the lock protecting the channel.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	WDF_OBJECT_ATTRIBUTES attributes;
+	NTSTATUS status;
+
+	pDevice->Channel.Request = WDF_NO_HANDLE;
+	pDevice->Channel.pHeader = NULL;
+	pDevice->Channel.pData = NULL;
+	pDevice->Channel.IdleStopped = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->Channel.Lock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Failed to create channel lock - %!STATUS!",
+			status);
+	}
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+
+	return status;
+}
+
+VOID
+SpbChannelAttach(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine attaches the output buffer of an
+    IOCTL_SPB_PROBE_MAP_CAPTURE request as the capture channel.
+    The request stays pending until it is cancelled or the
+    device is stopped. It is completed here on failure. With
+    IDLE_POLICY_PERFORMANCE the device stays in D0 meanwhile.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the consumer request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_CHANNEL pChannel = &pDevice->Channel;
+	PPBC_REQUEST pRequest = GetRequestContext(FxRequest);
+	PSPB_PROBE_CHANNEL pHeader = NULL;
+	PMDL pMdl;
+	size_t length = 0;
+	ULONG dataSize = 0;
+	BOOLEAN idleStopped = FALSE;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveOutputWdmMdl(FxRequest, &pMdl);
+
+	if (NT_SUCCESS(status))
+	{
+		length = MmGetMdlByteCount(pMdl);
+
+		if (length < CHANNEL_DATA_OFFSET + PAGE_SIZE)
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		pHeader = (PSPB_PROBE_CHANNEL)MmGetSystemAddressForMdlSafe(
+			pMdl,
+			NormalPagePriority | MdlMappingNoExecute);
+
+		if (pHeader == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Invalid channel buffer for request %p (length = %Iu) - %!STATUS!",
+			FxRequest,
+			length,
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Use the largest power of two fitting after the header.
+	//
+
+	length = min(length - CHANNEL_DATA_OFFSET, CHANNEL_MAX_DATA_SIZE);
+	dataSize = 1UL << RtlFindMostSignificantBit((ULONGLONG)length);
+
+	pHeader->Magic = SPB_PROBE_CHANNEL_MAGIC;
+	pHeader->Version = SPB_PROBE_CHANNEL_VERSION;
+	pHeader->DataOffset = CHANNEL_DATA_OFFSET;
+	pHeader->DataSize = dataSize;
+	pHeader->Head = 0;
+	pHeader->Tail = 0;
+	pHeader->Dropped = 0;
+	pHeader->Reserved = 0;
+
+	pRequest->FxDevice = pDevice->FxDevice;
+
+	//
+	// Keep the capture session free of resume latency.
+	//
+
+	if (pDevice->IdlePolicy == IDLE_POLICY_PERFORMANCE)
+	{
+		idleStopped = NT_SUCCESS(
+			WdfDeviceStopIdle(pDevice->FxDevice, WdfFalse));
+	}
+
+	WdfSpinLockAcquire(pChannel->Lock);
+
+	if (pChannel->Request != WDF_NO_HANDLE)
+	{
+		status = STATUS_DEVICE_BUSY;
+	}
+	else
+	{
+		status = WdfRequestMarkCancelableEx(FxRequest, SpbChannelOnCancel);
+
+		if (NT_SUCCESS(status))
+		{
+			pChannel->Request = FxRequest;
+			pChannel->pHeader = pHeader;
+			pChannel->pData = (PUCHAR)pHeader + CHANNEL_DATA_OFFSET;
+			pChannel->DataSize = dataSize;
+			pChannel->Head = 0;
+			pChannel->IdleStopped = idleStopped;
+		}
+	}
+
+	WdfSpinLockRelease(pChannel->Lock);
+
+	if (!NT_SUCCESS(status))
+	{
+		if (idleStopped)
+		{
+			WdfDeviceResumeIdle(pDevice->FxDevice);
+		}
+
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_TRANSFER,
+			"Failed to attach channel request %p - %!STATUS!",
+			FxRequest,
+			status);
+
+		goto exit;
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Attached channel request %p with %lu bytes of data",
+		FxRequest,
+		dataSize);
+
+exit:
+
+	if (!NT_SUCCESS(status))
+	{
+		WdfRequestComplete(FxRequest, status);
+	}
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+}
+
+VOID
+SpbChannelDetach(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine detaches the capture channel, if any,
+    and completes the consumer request.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_CHANNEL pChannel = &pDevice->Channel;
+	WDFREQUEST request;
+	BOOLEAN idleStopped;
+	NTSTATUS status;
+
+	WdfSpinLockAcquire(pChannel->Lock);
+
+	request = pChannel->Request;
+	idleStopped = pChannel->IdleStopped;
+	pChannel->Request = WDF_NO_HANDLE;
+	pChannel->pHeader = NULL;
+	pChannel->pData = NULL;
+	pChannel->IdleStopped = FALSE;
+
+	WdfSpinLockRelease(pChannel->Lock);
+
+	if (idleStopped)
+	{
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+
+	if (request != WDF_NO_HANDLE)
+	{
+		status = WdfRequestUnmarkCancelable(request);
+
+		if (status != STATUS_CANCELLED)
+		{
+			//
+			// Otherwise SpbChannelOnCancel completes the request.
+			//
+
+			WdfRequestComplete(request, STATUS_SUCCESS);
+		}
+
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_TRANSFER,
+			"Detached channel request %p",
+			request);
+	}
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+}
+
+VOID
+SpbChannelOnCancel(
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This event is called when the consumer request is cancelled,
+    typically because the consumer process closed its handle.
+
+  Arguments:
+
+    FxRequest - the consumer request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_TRANSFER);
+
+	PPBC_REQUEST pRequest = GetRequestContext(FxRequest);
+	PPBC_DEVICE pDevice = GetDeviceContext(pRequest->FxDevice);
+	PPBC_CHANNEL pChannel = &pDevice->Channel;
+	BOOLEAN idleStopped = FALSE;
+
+	//
+	// Once the lock is released no consumer is writing to the
+	// buffer anymore and the request can be completed.
+	//
+
+	WdfSpinLockAcquire(pChannel->Lock);
+
+	if (pChannel->Request == FxRequest)
+	{
+		idleStopped = pChannel->IdleStopped;
+		pChannel->Request = WDF_NO_HANDLE;
+		pChannel->pHeader = NULL;
+		pChannel->pData = NULL;
+		pChannel->IdleStopped = FALSE;
+	}
+
+	WdfSpinLockRelease(pChannel->Lock);
+
+	if (idleStopped)
+	{
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_TRANSFER,
+		"Channel request %p cancelled",
+		FxRequest);
+
+	WdfRequestComplete(FxRequest, STATUS_CANCELLED);
+
+	FuncExit(TRACE_FLAG_TRANSFER);
+}
+
+BOOLEAN
+SpbChannelWrite(
+	_In_  PPBC_DEVICE              pDevice,
+	_In_  const SPB_PROBE_RECORD*  pRecord
+)
+/*++
+
+  Routine Description:
+
+    This routine appends a record to the capture channel. It must
+    be called with the channel lock held and a channel attached.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pRecord - the record to append
+
+  Return Value:
+
+    FALSE if the channel is full, TRUE otherwise
+
+--*/
+{
+	PPBC_CHANNEL pChannel = &pDevice->Channel;
+	ULONG size = ALIGN_UP_BY(pRecord->Size, 8);
+	ULONG offset = pChannel->Head & (pChannel->DataSize - 1);
+	ULONG padding;
+	ULONG tail;
+	ULONG used;
+
+	NT_ASSERT(pChannel->pHeader != NULL);
+
+	padding = (offset + size > pChannel->DataSize) ?
+		pChannel->DataSize - offset : 0;
+
+	//
+	// Tail comes from the consumer and is not trusted. A bogus
+	// value can make the channel look full, or look empty and let
+	// records the consumer has not read be overwritten, but every
+	// write stays within DataSize whatever its value.
+	//
+
+	tail = (ULONG)ReadAcquire(&pChannel->pHeader->Tail);
+	used = pChannel->Head - tail;
+
+	if (used > pChannel->DataSize ||
+		padding + size > pChannel->DataSize - used)
+	{
+		return FALSE;
+	}
+
+	if (padding != 0)
+	{
+		PSPB_PROBE_RECORD pPadding = (PSPB_PROBE_RECORD)(pChannel->pData + offset);
+
+		pPadding->Size = padding;
+		pPadding->Version = SPB_PROBE_RECORD_VERSION;
+		pPadding->Type = SPB_PROBE_RECORD_TYPE_PADDING;
+
+		offset = 0;
+	}
+
+	RtlCopyMemory(pChannel->pData + offset, pRecord, pRecord->Size);
+
+	pChannel->Head += padding + size;
+	WriteRelease(&pChannel->pHeader->Head, (LONG)pChannel->Head);
+
+	return TRUE;
+}
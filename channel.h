@@ -0,0 +1,45 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    channel.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the user-mode capture channel.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+EVT_WDF_REQUEST_CANCEL             SpbChannelOnCancel;
+
+NTSTATUS
+SpbChannelInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbChannelAttach(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  WDFREQUEST        FxRequest);
+
+VOID
+SpbChannelDetach(
+    _In_  PPBC_DEVICE       pDevice);
+
+BOOLEAN
+SpbChannelWrite(
+    _In_  PPBC_DEVICE              pDevice,
+    _In_  const SPB_PROBE_RECORD*  pRecord);
+
+#endif // _CHANNEL_H_
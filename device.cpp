@@ -22,6 +22,9 @@ Revision History:
 #include "internal.h"
 #include "device.h"
 #include "peripheral.h"
+#include "capture.h"
+#include "channel.h"
+#include "stats.h"
 
 #include "device.tmh"
 
@@ -44,7 +47,9 @@ OnPrepareHardware(
 
 Routine Description:
 
-This routine caches the SPB resource connection ID.
+This routine caches the SPB resource connection IDs, creates
+their SPB targets and the forward requests, and allocates the
+capture rings.
 
 Arguments:
 
@@ -63,11 +68,12 @@ Status
 	FuncEntry(TRACE_FLAG_WDFLOADING);
 
 	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
-	BOOLEAN fSpbResourceFound = FALSE;
 	NTSTATUS status = STATUS_SUCCESS;
 
 	UNREFERENCED_PARAMETER(FxResourcesRaw);
 
+	pDevice->ConnectionCount = 0;
+
 	//
 	// Parse the peripheral's resources.
 	//
@@ -88,7 +94,7 @@ Status
 		case CmResourceTypeConnection:
 
 			//
-			// Look for I2C or SPI resource and save connection ID.
+			// Look for I2C or SPI resources and save connection IDs.
 			//
 
 			Class = pDescriptor->u.Connection.Class;
@@ -98,28 +104,39 @@ Status
 				((Type == CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C) ||
 				(Type == CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI)))
 			{
-				if (fSpbResourceFound == FALSE)
+				LARGE_INTEGER peripheralId;
+
+				peripheralId.LowPart = pDescriptor->u.Connection.IdLowPart;
+				peripheralId.HighPart = pDescriptor->u.Connection.IdHighPart;
+
+				if (pDevice->ConnectionCount < FORWARD_MAX_CONNECTIONS)
 				{
-					pDevice->PeripheralId.LowPart =
-						pDescriptor->u.Connection.IdLowPart;
-					pDevice->PeripheralId.HighPart =
-						pDescriptor->u.Connection.IdHighPart;
+					PPBC_CONNECTION pConnection =
+						&pDevice->Connections[pDevice->ConnectionCount];
+
+					pConnection->PeripheralId = peripheralId;
+					pConnection->HasAddress = FALSE;
+					pConnection->Address = 0;
+					pConnection->TrueSpbController = WDF_NO_HANDLE;
+					pConnection->Opened = FALSE;
+
+					SpbStatsInitialize(&pConnection->Stats);
 
-					fSpbResourceFound = TRUE;
+					pDevice->ConnectionCount += 1;
 
 					Trace(
 						TRACE_LEVEL_INFORMATION,
 						TRACE_FLAG_WDFLOADING,
 						"SPB resource found with ID=0x%llx",
-						pDevice->PeripheralId.QuadPart);
+						peripheralId.QuadPart);
 				}
 				else
 				{
 					Trace(
 						TRACE_LEVEL_WARNING,
 						TRACE_FLAG_WDFLOADING,
-						"Duplicate SPB resource found with ID=0x%llx",
-						pDevice->PeripheralId.QuadPart);
+						"Extra SPB resource ignored with ID=0x%llx",
+						peripheralId.QuadPart);
 				}
 			}
 
@@ -139,7 +156,7 @@ Status
 	// An SPB resource is required.
 	//
 
-	if (fSpbResourceFound == FALSE)
+	if (pDevice->ConnectionCount == 0)
 	{
 		status = STATUS_NOT_FOUND;
 		Trace(
@@ -149,6 +166,111 @@ Status
 			status);
 	}
 
+	//
+	// Map the connections to the target addresses.
+	//
+
+	if (NT_SUCCESS(status) && pDevice->ConnectionCount > 1)
+	{
+		PbcConnectionsReadAddresses(pDevice);
+	}
+
+	//
+	// Create the SPB target of each connection. They are
+	// kept across D0 transitions, which only stop and
+	// start them.
+	//
+
+	for (ULONG i = 0; NT_SUCCESS(status) && i < pDevice->ConnectionCount; i += 1)
+	{
+		WDF_OBJECT_ATTRIBUTES targetAttributes;
+		WDF_OBJECT_ATTRIBUTES_INIT(&targetAttributes);
+
+		status = WdfIoTargetCreate(
+			pDevice->FxDevice,
+			&targetAttributes,
+			&pDevice->Connections[i].TrueSpbController);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_FLAG_WDFLOADING,
+				"Failed to create IO target - %!STATUS!",
+				status);
+		}
+	}
+
+	//
+	// Create the forward requests and their transfer list
+	// memory, reused by every request sent.
+	//
+
+	for (ULONG i = 0; NT_SUCCESS(status) && i < pDevice->QueueDepth; i += 1)
+	{
+		PPBC_FORWARD pForward = &pDevice->Forwards[i];
+		WDF_OBJECT_ATTRIBUTES requestAttributes;
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, PBC_REQUEST);
+
+		pForward->InputMemory = WDF_NO_HANDLE;
+		pForward->ClientRequest = nullptr;
+
+		status = WdfRequestCreate(
+			&requestAttributes,
+			nullptr,
+			&pForward->SpbRequest);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_FLAG_WDFLOADING,
+				"Failed to create IO request - %!STATUS!",
+				status);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			PPBC_REQUEST pRequest = GetRequestContext(
+				pForward->SpbRequest);
+
+			pRequest->FxDevice = pDevice->FxDevice;
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			WDF_OBJECT_ATTRIBUTES memoryAttributes;
+			WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttributes);
+			memoryAttributes.ParentObject = pDevice->FxDevice;
+
+			status = WdfMemoryCreate(
+				&memoryAttributes,
+				NonPagedPoolNx,
+				SI2C_POOL_TAG,
+				FORWARD_TRANSFER_LIST_SIZE(FORWARD_MAX_TRANSFERS),
+				&pForward->InputMemory,
+				(PVOID*)&pForward->pTransferList);
+
+			if (!NT_SUCCESS(status))
+			{
+				Trace(
+					TRACE_LEVEL_ERROR,
+					TRACE_FLAG_WDFLOADING,
+					"Failed to create transfer list memory - %!STATUS!",
+					status);
+			}
+		}
+	}
+
+	//
+	// Allocate the capture rings.
+	//
+
+	if (NT_SUCCESS(status))
+	{
+		status = SpbCaptureInitialize(pDevice);
+	}
+
 	FuncExit(TRACE_FLAG_WDFLOADING);
 
 	return status;
@@ -163,6 +285,10 @@ OnReleaseHardware(
 
 Routine Description:
 
+This routine deletes the SPB targets, closing them, and the
+forward requests, frees the capture rings and detaches the
+capture channel.
+
 Arguments:
 
 FxDevice - a handle to the framework device object
@@ -177,10 +303,44 @@ Status
 {
 	FuncEntry(TRACE_FLAG_WDFLOADING);
 
+	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
 
 	UNREFERENCED_PARAMETER(FxResourcesTranslated);
 
+	for (ULONG i = 0; i < pDevice->ConnectionCount; i += 1)
+	{
+		PPBC_CONNECTION pConnection = &pDevice->Connections[i];
+
+		if (pConnection->TrueSpbController != WDF_NO_HANDLE)
+		{
+			WdfObjectDelete(pConnection->TrueSpbController);
+			pConnection->TrueSpbController = WDF_NO_HANDLE;
+			pConnection->Opened = FALSE;
+		}
+	}
+
+	for (ULONG i = 0; i < pDevice->QueueDepth; i += 1)
+	{
+		PPBC_FORWARD pForward = &pDevice->Forwards[i];
+
+		if (pForward->SpbRequest != WDF_NO_HANDLE)
+		{
+			WdfObjectDelete(pForward->SpbRequest);
+			pForward->SpbRequest = WDF_NO_HANDLE;
+		}
+
+		if (pForward->InputMemory != WDF_NO_HANDLE)
+		{
+			WdfObjectDelete(pForward->InputMemory);
+			pForward->InputMemory = WDF_NO_HANDLE;
+			pForward->pTransferList = NULL;
+		}
+	}
+
+	SpbCaptureCleanup(pDevice);
+	SpbChannelDetach(pDevice);
+
 	FuncExit(TRACE_FLAG_WDFLOADING);
 
 	return status;
@@ -195,7 +355,7 @@ OnD0Entry(
 
 Routine Description:
 
-This routine allocates objects needed by the driver.
+This routine starts the SPB targets again.
 
 Arguments:
 
@@ -216,63 +376,31 @@ Status
 	NTSTATUS status;
 
 	//
-	// Create the SPB target.
+	// Restart the SPB targets opened before the device
+	// left D0, the others are started when opened.
 	//
 
-	WDF_OBJECT_ATTRIBUTES targetAttributes;
-	WDF_OBJECT_ATTRIBUTES_INIT(&targetAttributes);
+	status = STATUS_SUCCESS;
 
-	status = WdfIoTargetCreate(
-		pDevice->FxDevice,
-		&targetAttributes,
-		&pDevice->TrueSpbController);
-
-	if (!NT_SUCCESS(status))
+	for (ULONG i = 0; NT_SUCCESS(status) && i < pDevice->ConnectionCount; i += 1)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_WDFLOADING,
-			"Failed to create IO target - %!STATUS!",
-			status);
-	}
-
-	//
-	// InputMemory will be created when an SPB request is about to be
-	// sent. Indicate that it is not yet initialized.
-	//
-
-	pDevice->InputMemory = WDF_NO_HANDLE;
-
-	//
-	// Create the SPB request.
-	//
+		PPBC_CONNECTION pConnection = &pDevice->Connections[i];
 
-	if (NT_SUCCESS(status))
-	{
-		WDF_OBJECT_ATTRIBUTES requestAttributes;
-		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, PBC_REQUEST);
+		if (!pConnection->Opened)
+		{
+			continue;
+		}
 
-		status = WdfRequestCreate(
-			&requestAttributes,
-			nullptr,
-			&pDevice->SpbRequest);
+		status = WdfIoTargetStart(pConnection->TrueSpbController);
 
 		if (!NT_SUCCESS(status))
 		{
 			Trace(
 				TRACE_LEVEL_ERROR,
 				TRACE_FLAG_WDFLOADING,
-				"Failed to create IO request - %!STATUS!",
+				"Failed to start IO target - %!STATUS!",
 				status);
 		}
-
-		if (NT_SUCCESS(status))
-		{
-			PPBC_REQUEST pRequest = GetRequestContext(
-				pDevice->SpbRequest);
-
-			pRequest->FxDevice = pDevice->FxDevice;
-		}
 	}
 
 	FuncExit(TRACE_FLAG_WDFLOADING);
@@ -289,7 +417,8 @@ OnD0Exit(
 
 Routine Description:
 
-This routine destroys objects needed by the driver.
+This routine stops the SPB targets, cancelling the
+requests sent to them.
 
 Arguments:
 
@@ -308,22 +437,16 @@ Status
 
 	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
 
-	if (pDevice->TrueSpbController != WDF_NO_HANDLE)
+	for (ULONG i = 0; i < pDevice->ConnectionCount; i += 1)
 	{
-		WdfObjectDelete(pDevice->TrueSpbController);
-		pDevice->TrueSpbController = WDF_NO_HANDLE;
-	}
-
-	if (pDevice->SpbRequest != WDF_NO_HANDLE)
-	{
-		WdfObjectDelete(pDevice->SpbRequest);
-		pDevice->SpbRequest = WDF_NO_HANDLE;
-	}
+		PPBC_CONNECTION pConnection = &pDevice->Connections[i];
 
-	if (pDevice->InputMemory != WDF_NO_HANDLE)
-	{
-		WdfObjectDelete(pDevice->InputMemory);
-		pDevice->InputMemory = WDF_NO_HANDLE;
+		if (pConnection->Opened)
+		{
+			WdfIoTargetStop(
+				pConnection->TrueSpbController,
+				WdfIoTargetCancelSentIo);
+		}
 	}
 
 	FuncExit(TRACE_FLAG_WDFLOADING);
@@ -388,10 +511,57 @@ OnTargetConnect(
 	// Initialize target context.
 	//
 
+	pTarget->pConnection = &pDevice->Connections[0];
+
 	if (NT_SUCCESS(status))
 	{
 		pTarget->SpbTarget = SpbTarget;
+		pTarget->FxDevice = SpbController;
 		pTarget->pCurrentRequest = NULL;
+		pTarget->LockHeld = FALSE;
+		pTarget->HeldRequest = NULL;
+		pTarget->HeldTimer = WDF_NO_HANDLE;
+		pTarget->pConnection = PbcTargetGetConnection(
+			pDevice,
+			&pTarget->Settings);
+
+		SpbStatsSetBus(&pTarget->pConnection->Stats, &pTarget->Settings);
+
+		//
+		// Only lock windows of I2C targets are coalesced, a
+		// target without the timer is forwarded as it is.
+		//
+
+		if (pDevice->CoalesceLocks &&
+			(pTarget->Settings.BusType == SPB_PROBE_BUS_I2C))
+		{
+			WDF_TIMER_CONFIG timerConfig;
+			WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+			WDF_TIMER_CONFIG_INIT(&timerConfig, SpbPeripheralOnHeldTimer);
+			timerConfig.AutomaticSerialization = FALSE;
+			timerConfig.UseHighResolutionTimer = WdfTrue;
+
+			WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+			timerAttributes.ParentObject = SpbTarget;
+
+			status = WdfTimerCreate(
+				&timerConfig,
+				&timerAttributes,
+				&pTarget->HeldTimer);
+
+			if (!NT_SUCCESS(status))
+			{
+				Trace(
+					TRACE_LEVEL_ERROR,
+					TRACE_FLAG_SPBDDI,
+					"Failed to create the held write timer of SPBTARGET %p - %!STATUS!",
+					SpbTarget,
+					status);
+
+				pTarget->HeldTimer = WDF_NO_HANDLE;
+			}
+		}
 
 		Trace(
 			TRACE_LEVEL_INFORMATION,
@@ -402,7 +572,7 @@ OnTargetConnect(
 			pDevice->FxDevice);
 	}
 
-	status = SpbPeripheralOpen(pDevice);
+	status = SpbPeripheralOpen(pDevice, pTarget->pConnection);
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
@@ -449,7 +619,19 @@ None
 	NT_ASSERT(pDevice != NULL);
 	NT_ASSERT(pTarget != NULL);
 
-	SpbPeripheralClose(pDevice);
+	//
+	// The unlock sent any write still held, a timer
+	// callback may still be running.
+	//
+
+	if (pTarget->HeldTimer != WDF_NO_HANDLE)
+	{
+		WdfTimerStop(pTarget->HeldTimer, TRUE);
+	}
+
+	NT_ASSERT(pTarget->HeldRequest == NULL);
+
+	SpbPeripheralClose(pDevice, pTarget->pConnection);
 
 	FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -483,13 +665,15 @@ OnControllerLock(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    SpbStatsArrive(GetDeviceContext(SpbController), SpbTarget, SpbRequest, SPB_PROBE_KIND_LOCK);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     
     NT_ASSERT(pDevice  != NULL);
     NT_ASSERT(pTarget  != NULL);
 
-	SpbPeripheralLock(pDevice, SpbRequest);
+	SpbPeripheralDispatch(pDevice, pTarget, SpbRequest);
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
@@ -531,6 +715,8 @@ OnControllerUnlock(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    SpbStatsArrive(GetDeviceContext(SpbController), SpbTarget, SpbRequest, SPB_PROBE_KIND_UNLOCK);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     
@@ -538,7 +724,7 @@ OnControllerUnlock(
     NT_ASSERT(pTarget  != NULL);
 
 	
-	SpbPeripheralUnlock(pDevice, SpbRequest);
+	SpbPeripheralDispatch(pDevice, pTarget, SpbRequest);
     
 	Trace(
 		TRACE_LEVEL_INFORMATION,
@@ -584,6 +770,8 @@ OnRead(
 	
 	FuncEntry(TRACE_FLAG_SPBDDI);
 
+	SpbStatsArrive(pDevice, SpbTarget, SpbRequest, SPB_PROBE_KIND_READ);
+
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBDDI,
@@ -594,7 +782,7 @@ OnRead(
         SpbTarget,
         SpbController);
 
-	SpbPeripheralRead(pDevice, SpbRequest, WdfFalse);
+	SpbPeripheralDispatch(pDevice, GetTargetContext(SpbTarget), SpbRequest);
 
     FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -632,6 +820,8 @@ OnWrite(
 
 	FuncEntry(TRACE_FLAG_SPBDDI);
 
+	SpbStatsArrive(pDevice, SpbTarget, SpbRequest, SPB_PROBE_KIND_WRITE);
+
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBDDI,
@@ -642,7 +832,7 @@ OnWrite(
         SpbTarget,
         SpbController);
 
-	SpbPeripheralWrite(pDevice, SpbRequest, WdfFalse);
+	SpbPeripheralDispatch(pDevice, GetTargetContext(SpbTarget), SpbRequest);
 
 	FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -678,6 +868,13 @@ OnSequence(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    SpbStatsArrive(
+        GetDeviceContext(SpbController),
+        SpbTarget,
+        SpbRequest,
+        (TransferCount == 1) ?
+            SPB_PROBE_KIND_SEQUENCE_1 : SPB_PROBE_KIND_SEQUENCE_N);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     PPBC_REQUEST pRequest = GetRequestContext(SpbRequest);
@@ -707,7 +904,7 @@ OnSequence(
         SpbTarget,
         SpbController);
 
-	SpbPeripheralSequence(pDevice, SpbRequest, TransferCount);
+	SpbPeripheralDispatch(pDevice, pTarget, SpbRequest);
     
     FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -767,8 +964,73 @@ OnOtherInCallerContext(
     }
 
     //
-    // TODO: verify the driver supports this DeviceIoContol code,
-    //       otherwise mark as STATUS_NOT_SUPPORTED and complete.
+    // The capture channel request is kept pending by the driver
+    // instead of being enqueued.
+    //
+
+    if (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SPB_PROBE_MAP_CAPTURE)
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+
+        SpbChannelAttach(pDevice, FxRequest);
+
+        FuncExit(TRACE_FLAG_SPBDDI);
+        return;
+    }
+
+    //
+    // Statistics queries are answered right away and never
+    // wait behind client requests in the queue.
+    //
+
+    if (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SPB_PROBE_QUERY_LATENCY)
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+
+        SpbStatsQueryLatency(pDevice, FxRequest);
+
+        FuncExit(TRACE_FLAG_SPBDDI);
+        return;
+    }
+
+    if (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SPB_PROBE_QUERY_STATS)
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+
+        SpbStatsQueryCounters(pDevice, FxRequest);
+
+        FuncExit(TRACE_FLAG_SPBDDI);
+        return;
+    }
+
+    if (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SPB_PROBE_QUERY_BUS)
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+
+        SpbStatsQueryBus(pDevice, FxRequest);
+
+        FuncExit(TRACE_FLAG_SPBDDI);
+        return;
+    }
+
+    if (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+        IOCTL_SPB_PROBE_CONTROL)
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+
+        SpbCaptureControl(pDevice, FxRequest);
+
+        FuncExit(TRACE_FLAG_SPBDDI);
+        return;
+    }
+
+    //
+    // Other codes are left to the controller, which fails
+    // the ones it does not support.
     //
 
     //
@@ -845,6 +1107,10 @@ None.  The request is completed asynchronously.
 	NTSTATUS status = STATUS_SUCCESS;
 	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
 
+	// Indexes of the write and read transfers.
+	const ULONG fullDuplexWriteIndex = 0;
+	const ULONG fullDuplexReadIndex = 1;
+
 	UNREFERENCED_PARAMETER(SpbController);
 	UNREFERENCED_PARAMETER(SpbTarget);
 	UNREFERENCED_PARAMETER(SpbRequest);
@@ -872,9 +1138,6 @@ None.  The request is completed asynchronously.
 	// Retrieve the write and read transfer descriptors.
 	//
 
-	const ULONG fullDuplexWriteIndex = 0;
-	const ULONG fullDuplexReadIndex = 1;
-
 	SPB_TRANSFER_DESCRIPTOR writeDescriptor;
 	SPB_TRANSFER_DESCRIPTOR readDescriptor;
 	PMDL pWriteMdl;
@@ -928,7 +1191,7 @@ None.  The request is completed asynchronously.
 		goto exit;
 	}
 	
-	SpbPeripheralFullDuplex(pDevice, SpbRequest);
+	SpbPeripheralDispatch(pDevice, GetTargetContext(SpbTarget), SpbRequest);
 	//if (InputBufferLength && OutputBufferLength)
 	//{
 	//	SpbPeripheralFullDuplex(pDevice, SpbRequest, OutputBufferLength, InputBufferLength);
@@ -986,6 +1249,13 @@ OnOther(
 --*/
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
+
+    SpbStatsArrive(
+        GetDeviceContext(SpbController),
+        SpbTarget,
+        SpbRequest,
+        (IoControlCode == IOCTL_SPB_FULL_DUPLEX) ?
+            SPB_PROBE_KIND_FULL_DUPLEX : SPB_PROBE_KIND_OTHER);
     
     NTSTATUS status = STATUS_NOT_SUPPORTED;
 
@@ -1023,7 +1293,10 @@ OnOther(
 
 	if (!NT_SUCCESS(status))
 	{
-		SpbRequestComplete(SpbRequest, status);
+		SpbPeripheralFailRequest(
+			GetDeviceContext(SpbController),
+			SpbRequest,
+			status);
 	}
     
     FuncExit(TRACE_FLAG_SPBDDI);
@@ -1106,6 +1379,8 @@ Status
 			i2cDescriptor->ConnectionSpeed,
 			i2cDescriptor->SlaveAddress);
 
+		pSettings->BusType = SPB_PROBE_BUS_I2C;
+
 		// Target address
 		pSettings->Address = (ULONG)i2cDescriptor->SlaveAddress;
 
@@ -1134,6 +1409,10 @@ Status
 			spiDescriptor->ConnectionSpeed
 		);
 
+		pSettings->BusType = SPB_PROBE_BUS_SPI;
+		pSettings->AddressMode = AddressMode7Bit;
+		pSettings->Address = 0;
+
 		// Clock speed
 		pSettings->ConnectionSpeed = spiDescriptor->ConnectionSpeed;
 		status = STATUS_SUCCESS;
@@ -1153,3 +1432,123 @@ Status
 	return STATUS_SUCCESS;
 }
 
+VOID
+PbcConnectionsReadAddresses(
+	_In_  PPBC_DEVICE                pDevice
+)
+/*++
+
+Routine Description:
+
+This routine reads the ConnectionAddresses binary value of the
+device key, the target address of each connection resource in
+resource order.
+
+Arguments:
+
+pDevice - a pointer to the PBC device context
+
+Return Value:
+
+None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_PBCLOADING);
+
+	DECLARE_CONST_UNICODE_STRING(addressesName, L"ConnectionAddresses");
+
+	USHORT addresses[FORWARD_MAX_CONNECTIONS];
+	ULONG valueLength = 0;
+	ULONG valueType = REG_NONE;
+	WDFKEY key;
+	NTSTATUS status;
+
+	status = WdfDeviceOpenRegistryKey(
+		pDevice->FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (NT_SUCCESS(status))
+	{
+		status = WdfRegistryQueryValue(
+			key,
+			&addressesName,
+			sizeof(addresses),
+			addresses,
+			&valueLength,
+			&valueType);
+
+		WdfRegistryClose(key);
+	}
+
+	if (!NT_SUCCESS(status) ||
+		valueType != REG_BINARY ||
+		(valueLength % sizeof(USHORT)) != 0)
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_FLAG_PBCLOADING,
+			"No valid connection addresses, all targets use "
+			"the first connection - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	for (ULONG i = 0;
+		i < valueLength / sizeof(USHORT) && i < pDevice->ConnectionCount;
+		i += 1)
+	{
+		pDevice->Connections[i].HasAddress = TRUE;
+		pDevice->Connections[i].Address = addresses[i];
+
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_PBCLOADING,
+			"Connection ID=0x%llx serves address 0x%hx",
+			pDevice->Connections[i].PeripheralId.QuadPart,
+			addresses[i]);
+	}
+
+exit:
+
+	FuncExit(TRACE_FLAG_PBCLOADING);
+}
+
+PPBC_CONNECTION
+PbcTargetGetConnection(
+	_In_  PPBC_DEVICE                pDevice,
+	_In_  const PBC_TARGET_SETTINGS* pSettings
+)
+/*++
+
+Routine Description:
+
+This routine selects the connection serving a target.
+
+Arguments:
+
+pDevice - a pointer to the PBC device context
+pSettings - a pointer the the target's settings
+
+Return Value:
+
+The connection mapped to the target address, the
+first connection if none is
+
+--*/
+{
+	for (ULONG i = 0; i < pDevice->ConnectionCount; i += 1)
+	{
+		if (pDevice->Connections[i].HasAddress &&
+			pDevice->Connections[i].Address == pSettings->Address)
+		{
+			return &pDevice->Connections[i];
+		}
+	}
+
+	return &pDevice->Connections[0];
+}
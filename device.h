@@ -61,6 +61,15 @@ PbcTargetGetSettings(
 	_In_     PVOID                   ConnectionParameters,
 	_Out_    PPBC_TARGET_SETTINGS    pSettings);
 
+VOID
+PbcConnectionsReadAddresses(
+	_In_     PPBC_DEVICE             pDevice);
+
+PPBC_CONNECTION
+PbcTargetGetConnection(
+	_In_     PPBC_DEVICE             pDevice,
+	_In_     const PBC_TARGET_SETTINGS* pSettings);
+
 #if 0
 NTSTATUS
 FORCEINLINE
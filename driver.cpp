@@ -22,6 +22,10 @@ Revision History:
 #include "internal.h"
 #include "driver.h"
 #include "device.h"
+#include "peripheral.h"
+#include "capture.h"
+#include "channel.h"
+#include "stats.h"
 #include "ntstrsafe.h"
 
 #include "driver.tmh"
@@ -199,6 +203,40 @@ OnDeviceAdd(
 
         pDevice->FxDevice = fxDevice;
     }
+
+    //
+    // Create the capture channel lock.
+    //
+
+    status = SpbChannelInitialize(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // Create the work item draining the capture rings.
+    //
+
+    status = SpbCaptureCreateWorkItem(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // Create the objects sharing the forward requests,
+    // the queue depth decides how requests are dispatched.
+    //
+
+    status = SpbPeripheralInitialize(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
         
     //
     // Ensure device is disable-able
@@ -231,7 +269,8 @@ OnDeviceAdd(
         // Register for IO callbacks.
         //
 
-        spbConfig.ControllerDispatchType = WdfIoQueueDispatchSequential;
+        spbConfig.ControllerDispatchType = (pDevice->QueueDepth > 1) ?
+            WdfIoQueueDispatchParallel : WdfIoQueueDispatchSequential;
         spbConfig.PowerManaged           = WdfTrue;
         spbConfig.EvtSpbIoRead           = OnRead;
         spbConfig.EvtSpbIoWrite          = OnWrite;
@@ -0,0 +1,133 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    forward.h
+
+Abstract:
+
+    This module contains the pairing state of a forward request
+    and the client request it carries. It only depends on the
+    interlocked routines, so that the transitions can be checked
+    in user mode.
+
+Environment:
+
+    kernel-mode and user-mode
+
+Revision History:
+
+--*/
+
+#ifndef _FORWARD_H_
+#define _FORWARD_H_
+
+//
+// Pairing state of a forward request and its client request, a
+// set of FORWARD_STATE_* bits. The sender, the cancel routine of
+// the client request and the completion routine each set their
+// done bit once they stop touching the pair, and the one setting
+// the last bit of FORWARD_STATE_DONE completes the client request
+// and releases the forward request.
+//
+
+// Paired with a client request, not sent yet.
+#define FORWARD_STATE_SUBMITTED     0x00
+
+// Sent to the controller.
+#define FORWARD_STATE_SENT          0x01
+#define FORWARD_STATE_SEND_DONE     0x02
+
+// Client request cancelled, and cancel routine finished or
+// known never to run.
+#define FORWARD_STATE_CANCELLED     0x04
+#define FORWARD_STATE_CANCEL_DONE   0x08
+
+// Completed by the controller, or failed to be sent.
+#define FORWARD_STATE_COMPLETING    0x10
+
+#define FORWARD_STATE_DONE \
+    (FORWARD_STATE_SEND_DONE | FORWARD_STATE_CANCEL_DONE | FORWARD_STATE_COMPLETING)
+
+FORCEINLINE
+BOOLEAN
+SpbForwardStateSent(
+    _Inout_ volatile LONG*  pState
+    )
+/*++
+
+  Routine Description:
+
+    This routine records that the forward request was sent,
+    once WdfRequestSend returned.
+
+  Return Value:
+
+    TRUE if the client request was cancelled before, and the
+    sender has to cancel the sent request on behalf of the
+    cancel routine
+
+--*/
+{
+    LONG state = InterlockedOr(pState, FORWARD_STATE_SENT);
+
+    return (state & (FORWARD_STATE_CANCELLED | FORWARD_STATE_COMPLETING)) ==
+        FORWARD_STATE_CANCELLED;
+}
+
+FORCEINLINE
+BOOLEAN
+SpbForwardStateCancelled(
+    _Inout_ volatile LONG*  pState
+    )
+/*++
+
+  Routine Description:
+
+    This routine records that the client request was cancelled,
+    from its cancel routine.
+
+  Return Value:
+
+    TRUE if the forward request is in the controller and the
+    cancel routine has to cancel it, FALSE if it is not sent yet
+    (the sender cancels it) or already completed
+
+--*/
+{
+    LONG state = InterlockedOr(pState, FORWARD_STATE_CANCELLED);
+
+    return (state & (FORWARD_STATE_SENT | FORWARD_STATE_COMPLETING)) ==
+        FORWARD_STATE_SENT;
+}
+
+FORCEINLINE
+BOOLEAN
+SpbForwardStateDone(
+    _Inout_ volatile LONG*  pState,
+    _In_    LONG            Flags
+    )
+/*++
+
+  Routine Description:
+
+    This routine sets done bits of FORWARD_STATE_DONE. The caller
+    must not touch the pair afterwards, unless it is told to
+    complete it.
+
+  Return Value:
+
+    TRUE if Flags were the last bits the pair was waiting for,
+    the caller then completes it
+
+--*/
+{
+    LONG state = InterlockedOr(pState, Flags);
+
+    return ((state & FORWARD_STATE_DONE) != FORWARD_STATE_DONE) &&
+        (((state | Flags) & FORWARD_STATE_DONE) == FORWARD_STATE_DONE);
+}
+
+#endif // _FORWARD_H_
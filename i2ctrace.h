@@ -51,4 +51,33 @@ extern "C"
 // USEPREFIX(FuncExit, "%!STDPREFIX! [%!FUNC!] <--");
 // end_wpp
 
+//
+// Binary buffer logging, "%!HEXDUMP!" takes a WPP_HEXDUMP_BUFFER
+// built with WppHexDump(). Used to emit transfer records.
+//
+
+typedef struct WPP_HEXDUMP_BUFFER
+{
+    const VOID*  Buffer;
+    USHORT       Length;
+}
+WPP_HEXDUMP_BUFFER;
+
+FORCEINLINE
+WPP_HEXDUMP_BUFFER
+WppHexDump(
+    _In_reads_bytes_(Length) const VOID* Buffer,
+    _In_ USHORT Length
+    )
+{
+    WPP_HEXDUMP_BUFFER hexDump = { Buffer, Length };
+    return hexDump;
+}
+
+#define WPP_LOGHEXDUMP(x) WPP_LOGPAIR(sizeof(USHORT), &(x).Length) WPP_LOGPAIR((x).Length, (x).Buffer)
+
+// begin_wpp config
+// DEFINE_CPLX_TYPE(HEXDUMP, WPP_LOGHEXDUMP, WPP_HEXDUMP_BUFFER, ItemHEXDump, "s", _HEX_, 0, 2);
+// end_wpp
+
 #endif // _I2CTRACE_H_
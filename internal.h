@@ -42,6 +42,8 @@ Revision History:
 
 #include "SPBCx.h"
 #include "i2ctrace.h"
+#include "spbprobe.h"
+#include "forward.h"
 
 #define RESHUB_USE_HELPER_ROUTINES
 #include "reshub.h"
@@ -107,6 +109,77 @@ typedef struct _PNP_SPI_SERIAL_BUS_DESCRIPTOR {
 #define IDLE_TIMEOUT_MONITOR_ON  2000
 #define IDLE_TIMEOUT_MONITOR_OFF 50
 
+// Values of IdlePolicy. The device stays in D0 while a target
+// is connected, only while client requests need it, or also
+// while a capture channel is attached.
+#define IDLE_POLICY_CONNECTED    0
+#define IDLE_POLICY_CLIENT       1
+#define IDLE_POLICY_PERFORMANCE  2
+
+//
+// Forward settings.
+//
+
+// Forward requests allocated per device, QueueDepth upper bound.
+#define FORWARD_MAX_DEPTH        8
+
+// Default for the QueueDepth value, 1 keeps dispatch sequential.
+#define FORWARD_DEFAULT_DEPTH    1
+
+// Entries of the transfer list of a forward request, longer
+// sequences are failed. SPBCx bounds a sequence only by the ULONG
+// TransferCount of SPB_TRANSFER_LIST, so this is the probe's own
+// limit on what it forwards, including a held write. The list
+// memory of every forward request is sized for it up front.
+#define FORWARD_MAX_TRANSFERS    64
+
+// Connection resources used by one probe.
+#define FORWARD_MAX_CONNECTIONS  8
+
+// Longest time a write is held in a lock window when
+// CoalesceLocks is set, waiting for a transfer to carry it.
+#define FORWARD_HELD_WRITE_TIMEOUT_US  100
+
+// Size of a transfer list holding Count entries.
+#define FORWARD_TRANSFER_LIST_SIZE(Count) \
+    (sizeof(SPB_TRANSFER_LIST) + ((Count) - 1) * sizeof(SPB_TRANSFER_LIST_ENTRY))
+
+//
+// Capture settings.
+//
+
+// Size of each per-processor capture ring, must be a power of two.
+#define CAPTURE_RING_SIZE        (64 * 1024)
+
+// Default for the CaptureMode value.
+#define CAPTURE_DEFAULT_MODE         SPB_PROBE_MODE_FULL
+
+// Defaults for the CaptureTruncation and CaptureLength values.
+#define CAPTURE_DEFAULT_TRUNCATION   SPB_PROBE_TRUNCATE_FULL
+#define CAPTURE_DEFAULT_LENGTH       64
+
+// Largest request, transfer headers included, checked for repeats.
+#define CAPTURE_REPEAT_MAX_LENGTH    256
+
+// Repeats collapsed before a repeat record is emitted anyway.
+#define CAPTURE_REPEAT_MAX_COUNT     1024
+
+// Largest request, and number of transfers, copied once to the
+// inline buffer and captured from there.
+#define CAPTURE_INLINE_SIZE          64
+#define CAPTURE_INLINE_MAX_TRANSFERS 4
+
+// Size of the trigger mode history, must be a power of two no
+// bigger than CAPTURE_RING_SIZE.
+#define CAPTURE_HISTORY_SIZE         (32 * 1024)
+
+// Requests kept in the history, CapturePreTrigger upper bound.
+#define CAPTURE_HISTORY_MAX_REQUESTS 64
+
+// Defaults for the CapturePreTrigger and CapturePostTrigger values.
+#define CAPTURE_DEFAULT_PRE_TRIGGER  16
+#define CAPTURE_DEFAULT_POST_TRIGGER 16
+
 //
 // Target settings.
 //
@@ -120,12 +193,377 @@ ADDRESS_MODE, *PADDRESS_MODE;
 
 typedef struct PBC_TARGET_SETTINGS
 {
+    ULONG                         BusType;
     ADDRESS_MODE                  AddressMode;
     USHORT                        Address;
     ULONG                         ConnectionSpeed;
 }
 PBC_TARGET_SETTINGS, *PPBC_TARGET_SETTINGS;
 
+/////////////////////////////////////////////////
+//
+// Capture definitions.
+//
+/////////////////////////////////////////////////
+
+//
+// Capture ring entry. Every record stored in a ring is preceded
+// by this header. State is written last by the producer, once the
+// record is complete, and the consumer zeroes entries it is done
+// with so that a reserved entry always reads as uncommitted.
+//
+
+#define PBC_CAPTURE_ENTRY_FREE     0
+#define PBC_CAPTURE_ENTRY_RECORD   1
+#define PBC_CAPTURE_ENTRY_PADDING  2
+
+typedef struct PBC_CAPTURE_ENTRY
+{
+    // Size of the entry, header included, multiple of 8.
+    ULONG                          Size;
+
+    // PBC_CAPTURE_ENTRY_*
+    volatile LONG                  State;
+
+    // Followed by the record.
+}
+PBC_CAPTURE_ENTRY, *PPBC_CAPTURE_ENTRY;
+
+//
+// Capture ring. Producers reserve space by advancing Head with a
+// compare-exchange and never wait, a full ring drops the record.
+// Positions are free running and wrap modulo CAPTURE_RING_SIZE.
+//
+
+typedef struct PBC_CAPTURE_RING
+{
+    // Position of the next byte to reserve.
+    volatile LONG                  Head;
+
+    // Position of the next byte to consume.
+    volatile LONG                  Tail;
+
+    // Number of records dropped because the ring or the
+    // capture channel was full.
+    volatile LONG                  Dropped;
+
+    // Dropped value last reported by the consumer.
+    LONG                           DroppedReported;
+
+    // CAPTURE_RING_SIZE bytes of entries.
+    PUCHAR                         pData;
+}
+PBC_CAPTURE_RING, *PPBC_CAPTURE_RING;
+
+//
+// Repeat detection. Requests complete one at a time, the last
+// one is kept serialized (direction and length of every transfer
+// followed by its payload) to be compared with the next.
+//
+
+typedef struct PBC_CAPTURE_REPEAT
+{
+    // Length of the last request, 0 if it cannot be repeated.
+    ULONG                          Length;
+
+    // Number of repeats not reported yet.
+    ULONG                          Count;
+
+    // Completion times of the first and last repeats.
+    LONGLONG                       FirstTimestamp;
+    LONGLONG                       LastTimestamp;
+
+    // Completion status of the last request.
+    NTSTATUS                       Status;
+
+    // Connection of the last request.
+    LONGLONG                       PeripheralId;
+
+    // The last request serialized.
+    UCHAR                          Data[CAPTURE_REPEAT_MAX_LENGTH];
+}
+PBC_CAPTURE_REPEAT, *PPBC_CAPTURE_REPEAT;
+
+//
+// Inline buffer. Requests complete one at a time, the payload
+// of a small one is copied from the client MDLs once and the
+// filters, repeat detection and records all read that copy.
+//
+
+typedef struct PBC_CAPTURE_INLINE_TRANSFER
+{
+    SPB_TRANSFER_DIRECTION         Direction;
+
+    // Length of the transfer and its position in Data.
+    ULONG                          Length;
+    ULONG                          Offset;
+}
+PBC_CAPTURE_INLINE_TRANSFER, *PPBC_CAPTURE_INLINE_TRANSFER;
+
+typedef struct PBC_CAPTURE_INLINE
+{
+    // Transfers of the request being captured, 0 if
+    // it is not small enough to be copied.
+    ULONG                          Count;
+
+    PBC_CAPTURE_INLINE_TRANSFER    Transfers[CAPTURE_INLINE_MAX_TRANSFERS];
+
+    UCHAR                          Data[CAPTURE_INLINE_SIZE];
+}
+PBC_CAPTURE_INLINE, *PPBC_CAPTURE_INLINE;
+
+//
+// Trigger mode. Until a trigger fires the records are written to a
+// history instead of the capture rings. Requests complete one at a
+// time, so the history is a plain ring of capture entries, with the
+// position of the first entry of every request it holds.
+//
+
+typedef struct PBC_CAPTURE_TRIGGER
+{
+    // SPB_PROBE_TRIGGER_* conditions, 0 when disabled.
+    ULONG                          Conditions;
+
+    // Requests kept before and captured after a trigger.
+    ULONG                          PreTrigger;
+    ULONG                          PostTrigger;
+
+    // Requests left to capture since the last trigger.
+    ULONG                          PostRemaining;
+
+    // Latency condition, in performance counter ticks.
+    LONGLONG                       Latency;
+
+    // Pattern condition, see the capture filter.
+    SPB_PROBE_FILTER_INSN          Pattern[SPB_PROBE_FILTER_MAX_INSNS];
+    ULONG                          PatternCount;
+    ULONG                          PatternBytes;
+
+    // CAPTURE_HISTORY_SIZE bytes of entries.
+    PUCHAR                         pHistory;
+
+    // Free running positions in the history.
+    ULONG                          Head;
+    ULONG                          Tail;
+
+    // Positions of the requests in the history, Count
+    // of them starting at index First.
+    ULONG                          Requests[CAPTURE_HISTORY_MAX_REQUESTS];
+    ULONG                          First;
+    ULONG                          Count;
+}
+PBC_CAPTURE_TRIGGER, *PPBC_CAPTURE_TRIGGER;
+
+//
+// Completion path of a capture mode, called for every client
+// request about to be completed. Returns whether records may
+// have been captured.
+//
+
+struct PBC_DEVICE;
+
+typedef
+BOOLEAN
+PBC_TRACE_COMPLETION(
+    _In_  struct PBC_DEVICE*       pDevice,
+    _In_  SPBREQUEST               ClientRequest,
+    _In_  NTSTATUS                 Status,
+    _In_  ULONG_PTR                BytesCompleted);
+
+typedef PBC_TRACE_COMPLETION *PFN_PBC_TRACE_COMPLETION;
+
+//
+// Capture state, one ring per processor carved out of
+// a single nonpaged allocation.
+//
+
+typedef struct PBC_CAPTURE
+{
+    // Number of rings.
+    ULONG                          RingCount;
+
+    // Array of RingCount rings, NULL when capture is unavailable.
+    PPBC_CAPTURE_RING              pRings;
+
+    // Nonzero while a consumer is draining the rings.
+    volatile LONG                  Draining;
+
+    // Drains the rings after the client request is completed.
+    WDFWORKITEM                    DrainWorkItem;
+
+    // SPB_PROBE_MODE_* and its completion path.
+    ULONG                          Mode;
+    PFN_PBC_TRACE_COMPLETION       TraceCompletion;
+
+    // Connection of the request being captured.
+    LONGLONG                       PeripheralId;
+
+    // SPB_PROBE_TRUNCATE_* policy for transfer payloads.
+    ULONG                          Truncation;
+
+    // Number of bytes kept by the truncation policy.
+    ULONG                          TruncationLength;
+
+    // Whether repeated requests are collapsed.
+    BOOLEAN                        CollapseRepeats;
+
+    // Capture filter, FilterCount is 0 when every transfer
+    // is captured.
+    SPB_PROBE_FILTER_INSN          Filter[SPB_PROBE_FILTER_MAX_INSNS];
+    ULONG                          FilterCount;
+
+    // Payload bytes the filter may load.
+    ULONG                          FilterBytes;
+
+    PBC_CAPTURE_TRIGGER            Trigger;
+
+    PBC_CAPTURE_REPEAT             Repeat;
+
+    PBC_CAPTURE_INLINE             Inline;
+
+    //
+    // Settings requested by IOCTL_SPB_PROBE_CONTROL, applied by the
+    // completion path before the next request. ControlSequence is
+    // odd while Control is written, ControlPending is set once it
+    // holds settings not applied yet. ControlLock serializes the
+    // control requests with each other.
+    //
+
+    WDFSPINLOCK                    ControlLock;
+    volatile LONG                  ControlSequence;
+    volatile LONG                  ControlPending;
+    SPB_PROBE_CONTROL              Control;
+}
+PBC_CAPTURE, *PPBC_CAPTURE;
+
+//
+// Capture channel. Records are copied from the capture rings into
+// the buffer of a pending consumer request instead of being traced.
+// Lock serializes the consumer with channel attach and detach.
+//
+
+typedef struct PBC_CHANNEL
+{
+    // Pending consumer request, WDF_NO_HANDLE when detached.
+    WDFREQUEST                     Request;
+
+    // System mapping of the consumer buffer.
+    PSPB_PROBE_CHANNEL             pHeader;
+
+    // Data area of the consumer buffer.
+    PUCHAR                         pData;
+
+    // Size of the data area, a power of two.
+    ULONG                          DataSize;
+
+    // Bytes produced. Kept here rather than trusted
+    // from the shared header.
+    ULONG                          Head;
+
+    // Set while the attached channel keeps the device in D0.
+    BOOLEAN                        IdleStopped;
+
+    WDFSPINLOCK                    Lock;
+}
+PBC_CHANNEL, *PPBC_CHANNEL;
+
+//
+// Request statistics. Updated with interlocked operations
+// only, so that recording never waits and a query reads a
+// snapshot that is at worst a few requests behind.
+//
+
+typedef struct PBC_STATS
+{
+    // Performance counter frequency, in ticks per second.
+    LONGLONG                       Frequency;
+
+    // Request counters.
+    SPB_PROBE_STATS                Counters;
+
+    // Client request latencies in microseconds,
+    // indexed by SPB_PROBE_KIND_*.
+    SPB_PROBE_HISTOGRAM            Latency[SPB_PROBE_KIND_COUNT];
+
+    // Bus occupancy windows.
+    SPB_PROBE_BUS                  Bus;
+
+    // Length of a bus window, in performance counter ticks.
+    LONGLONG                       WindowTicks;
+
+    // Controller completion of the last request, 0 if none.
+    LONGLONG                       LastControllerTimestamp;
+}
+PBC_STATS, *PPBC_STATS;
+
+/////////////////////////////////////////////////
+//
+// Forward definitions.
+//
+/////////////////////////////////////////////////
+
+//
+// Connection resource of the probe, each one is forwarded
+// to its own peripheral on the true controller.
+//
+
+typedef struct PBC_CONNECTION
+{
+    // Connection ID of the peripheral.
+    LARGE_INTEGER                  PeripheralId;
+
+    // Address routing the targets to the connection,
+    // only set when the device key maps the connections.
+    BOOLEAN                        HasAddress;
+    USHORT                         Address;
+
+    // Forward IO target, created with the hardware resources and
+    // opened by the first target connected. It then stays open
+    // until the resources are released, D0 transitions only stop
+    // and start it.
+    WDFIOTARGET                    TrueSpbController;
+    BOOLEAN                        Opened;
+
+    // Statistics of the requests of the targets routed to the
+    // connection, estimated for its bus settings.
+    PBC_STATS                      Stats;
+}
+PBC_CONNECTION, *PPBC_CONNECTION;
+
+//
+// Forward request to the true controller, paired with the
+// client request it carries while it is in use.
+//
+
+typedef struct PBC_FORWARD
+{
+    // Request sent to the true controller.
+    WDFREQUEST                     SpbRequest;
+
+    // Transfer list memory, allocated with the request and
+    // reused by every request.
+    WDFMEMORY                      InputMemory;
+    PSPB_TRANSFER_LIST             pTransferList;
+
+    // Client request carried, NULL while the forward is free.
+    SPBREQUEST                     ClientRequest;
+
+    // IO target of the connection the client request goes to.
+    WDFIOTARGET                    IoTarget;
+
+    // Index in the device forward pool.
+    ULONG                          Index;
+
+    // FORWARD_STATE_* bits of the pair, see forward.h.
+    volatile LONG                  State;
+
+    // Completion status and information of the client
+    // request, kept until the pair is done.
+    NTSTATUS                       Status;
+    ULONG_PTR                      Information;
+}
+PBC_FORWARD, *PPBC_FORWARD;
+
 /////////////////////////////////////////////////
 //
 // Context definitions.
@@ -146,34 +584,51 @@ struct PBC_DEVICE
     WDFDEVICE                      FxDevice;
 
 	//
-	// Connection ID for SPB peripheral
+	// Connections to the SPB peripherals, the first
+	// ConnectionCount are valid.
 	//
 
-	LARGE_INTEGER PeripheralId;
-	
+	PBC_CONNECTION Connections[FORWARD_MAX_CONNECTIONS];
+	ULONG ConnectionCount;
+
+	//
+	// Forward requests, only the first QueueDepth are
+	// allocated. Bit i of ForwardsBusy is set while
+	// Forwards[i] carries a client request.
+	//
+
+	PBC_FORWARD Forwards[FORWARD_MAX_DEPTH];
+	ULONG QueueDepth;
+	ULONG ForwardsBusy;
+	volatile LONG DispatchPasses;
+
 	//
-	// SPB controller target
+	// Set from the CoalesceLocks value when QueueDepth is 2
+	// or more, writes in the lock windows of I2C targets are
+	// then held for the next transfer.
 	//
 
-	WDFIOTARGET TrueSpbController;
+	BOOLEAN CoalesceLocks;
 
 	//
-	// SPB request object
+	// IDLE_POLICY_* set from the IdlePolicy value.
 	//
 
-	WDFREQUEST SpbRequest;
+	ULONG IdlePolicy;
 
 	//
-	// Input memory for request. Valid while request in progress.
+	// Client requests waiting for a free forward request,
+	// and the lock protecting ForwardsBusy and the queue.
 	//
 
-	WDFMEMORY InputMemory;
+	WDFQUEUE PendingQueue;
+	WDFSPINLOCK ForwardLock;
 
 	//
-	// Client request object
+	// Serializes the capture of completed client requests.
 	//
 
-	SPBREQUEST ClientRequest;
+	WDFSPINLOCK CompletionLock;
 
     // Target that the controller is currently
     // configured for. In most cases this value is only
@@ -184,6 +639,12 @@ struct PBC_DEVICE
     
     // The power setting callback handle
     PVOID                          pMonitorPowerSettingHandle;
+
+    // Captured transfer records.
+    PBC_CAPTURE                    Capture;
+
+    // User-mode consumer of the captured records.
+    PBC_CHANNEL                    Channel;
 };
 
 //
@@ -203,6 +664,21 @@ struct PBC_TARGET
     // when this target is the controller's current
     // target.
     PPBC_REQUEST                   pCurrentRequest;
+
+    // Connection the target requests are forwarded to.
+    PPBC_CONNECTION                pConnection;
+
+    // Device the target is connected to.
+    WDFDEVICE                      FxDevice;
+
+    // Set while the controller lock of the target is held, and
+    // the write held in its window, if any. Protected by the
+    // forward lock. The timer sends a write no transfer came
+    // to carry, it is only created for the targets whose lock
+    // windows are coalesced.
+    BOOLEAN                        LockHeld;
+    SPBREQUEST                     HeldRequest;
+    WDFTIMER                       HeldTimer;
 };
 
 //
@@ -226,6 +702,47 @@ struct PBC_REQUEST
     // Handle to the SPB request.
     SPBREQUEST                     SpbRequest;
 
+    //
+    // Performance counter values stamped on the client request
+    // when it reaches the driver, is forwarded to the controller,
+    // is completed by the controller and is completed back to the
+    // client. Stages the request did not go through are 0.
+    //
+
+    LONGLONG                       ArrivalTimestamp;
+    LONGLONG                       SendTimestamp;
+    LONGLONG                       ControllerTimestamp;
+    LONGLONG                       CompleteTimestamp;
+
+    // SPB_PROBE_KIND_* of the client request.
+    ULONG                          Kind;
+
+    // Connection and forward request carrying the
+    // client request, if any.
+    PPBC_CONNECTION                pConnection;
+    PPBC_FORWARD                   pForward;
+
+    // Settings of the target of the request, the wire time of
+    // its transfers is estimated for them. NULL until routed.
+    const PBC_TARGET_SETTINGS*     pSettings;
+
+    // Target of the request, NULL until routed.
+    PPBC_TARGET                    pTarget;
+
+    // Set if the request was held in a lock window and sent
+    // ahead of another request, without a round trip of its own.
+    BOOLEAN                        Coalesced;
+
+    // Set while the request keeps the device in D0, see
+    // IDLE_POLICY_CLIENT.
+    BOOLEAN                        IdleStopped;
+
+    // Write of the lock window sent ahead of the request
+    // transfers, if any, completed with the request status.
+    // HeldLength is set once the sequence is built.
+    SPBREQUEST                     HeldRequest;
+    ULONG                          HeldLength;
+
 };
 
 //
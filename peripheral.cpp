@@ -21,22 +21,36 @@ Revision History:
 
 #include "internal.h"
 #include "peripheral.h"
+#include "capture.h"
+#include "stats.h"
 
 #include "peripheral.tmh"
 
+//
+// The trace routines are instantiated per capture mode,
+// their tests of the mode are constant on purpose.
+//
+
+#pragma warning(disable:4127)
+
 NTSTATUS
 SpbPeripheralOpen(
-    _In_  PPBC_DEVICE       pDevice
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_CONNECTION   pConnection
     )
 /*++
  
   Routine Description:
 
-    This routine opens a handle to the SPB controller.
+    This routine opens a handle to the SPB controller for the
+    connection of a new target, unless an earlier target already
+    did. With IDLE_POLICY_CONNECTED the device then stays in D0
+    until the target is gone.
 
   Arguments:
 
     pDevice - a pointer to the device context
+    pConnection - a pointer to the connection
 
   Return Value:
 
@@ -57,16 +71,22 @@ SpbPeripheralOpen(
 
 	WdfDeviceStopIdle(pDevice->FxDevice, WdfTrue);
 
-	if (pDevice->TrueSpbController == WDF_NO_HANDLE)
+	if (pConnection->TrueSpbController == WDF_NO_HANDLE)
 	{
 		status = STATUS_NOT_SUPPORTED;
 		goto exit;
 	}
 
+	if (pConnection->Opened)
+	{
+		status = STATUS_SUCCESS;
+		goto exit;
+	}
+
 	RESOURCE_HUB_CREATE_PATH_FROM_ID(
         &DevicePath,
-        pDevice->PeripheralId.LowPart,
-        pDevice->PeripheralId.HighPart);
+        pConnection->PeripheralId.LowPart,
+        pConnection->PeripheralId.HighPart);
 
     Trace(
         TRACE_LEVEL_INFORMATION,
@@ -88,7 +108,7 @@ SpbPeripheralOpen(
     openParams.FileAttributes = FILE_ATTRIBUTE_NORMAL;
     
     status = WdfIoTargetOpen(
-        pDevice->TrueSpbController,
+        pConnection->TrueSpbController,
         &openParams);
      
     if (!NT_SUCCESS(status)) 
@@ -99,8 +119,19 @@ SpbPeripheralOpen(
             "Failed to open SPB target - %!STATUS!",
             status);
     }
+    else
+    {
+        pConnection->Opened = TRUE;
+    }
 
 exit:
+
+	if (!NT_SUCCESS(status) ||
+		(pDevice->IdlePolicy != IDLE_POLICY_CONNECTED))
+	{
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+
     FuncExit(TRACE_FLAG_SPBDDI);
 
     return status;
@@ -108,17 +139,22 @@ exit:
 
 NTSTATUS
 SpbPeripheralClose(
-    _In_  PPBC_DEVICE       pDevice
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_CONNECTION   pConnection
     )
 /*++
  
   Routine Description:
 
-    This routine closes a handle to the SPB controller.
+    This routine lets the device idle again once a target is
+    gone, with IDLE_POLICY_CONNECTED. The handle to the SPB
+    controller is kept open for the next target and closed
+    when the hardware is released.
 
   Arguments:
 
     pDevice - a pointer to the device context
+    pConnection - a pointer to the connection
 
   Return Value:
 
@@ -128,17 +164,17 @@ SpbPeripheralClose(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-	UNREFERENCED_PARAMETER(pDevice);
+	UNREFERENCED_PARAMETER(pConnection);
 
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Closing handle to SPB target");
+        "Releasing SPB target");
 
-	if (pDevice->TrueSpbController != WDF_NO_HANDLE)
-		WdfIoTargetClose(pDevice->TrueSpbController);
-
-	WdfDeviceResumeIdle(pDevice->FxDevice);
+	if (pDevice->IdlePolicy == IDLE_POLICY_CONNECTED)
+	{
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
 
     FuncExit(TRACE_FLAG_SPBAPI);
     
@@ -169,7 +205,7 @@ SpbPeripheralLock(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-    UNREFERENCED_PARAMETER(spbRequest);
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
 
     NTSTATUS status;
 
@@ -177,21 +213,21 @@ SpbPeripheralLock(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Formatting SPB request %p for IOCTL_SPB_LOCK_CONTROLLER",
-        pDevice->SpbRequest);
+        pForward->SpbRequest);
         
     //
     // Save the client request.
     //
 
-    pDevice->ClientRequest = spbRequest;
+    pForward->ClientRequest = spbRequest;
 
     //
     // Initialize the SPB request for lock and send.
     //
 
     status = WdfIoTargetFormatRequestForIoctl(
-        pDevice->TrueSpbController,
-        pDevice->SpbRequest,
+        pForward->IoTarget,
+        pForward->SpbRequest,
         IOCTL_SPB_LOCK_CONTROLLER,
         nullptr,
         nullptr,
@@ -202,7 +238,7 @@ SpbPeripheralLock(
     {
         status = SpbPeripheralSendRequest(
             pDevice,
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             spbRequest);
     }
 
@@ -213,11 +249,12 @@ SpbPeripheralLock(
             TRACE_FLAG_SPBAPI,
             "Failed to send SPB request %p for "
             "IOCTL_SPB_LOCK_CONTROLLER - %!STATUS!",
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             status);
 
         SpbPeripheralCompleteRequestPair(
             pDevice,
+            pForward,
             status,
             0);
     }
@@ -249,7 +286,7 @@ SpbPeripheralUnlock(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-    UNREFERENCED_PARAMETER(spbRequest);
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
 
     NTSTATUS status;
 
@@ -257,21 +294,21 @@ SpbPeripheralUnlock(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Formatting SPB request %p for IOCTL_SPB_UNLOCK_CONTROLLER",
-        pDevice->SpbRequest);
+        pForward->SpbRequest);
         
     //
     // Save the client request.
     //
 
-    pDevice->ClientRequest = spbRequest;
+    pForward->ClientRequest = spbRequest;
 
     //
     // Initialize the SPB request for unlock and send.
     //
 
     status = WdfIoTargetFormatRequestForIoctl(
-        pDevice->TrueSpbController,
-        pDevice->SpbRequest,
+        pForward->IoTarget,
+        pForward->SpbRequest,
         IOCTL_SPB_UNLOCK_CONTROLLER,
         nullptr,
         nullptr,
@@ -282,7 +319,7 @@ SpbPeripheralUnlock(
     {
         status = SpbPeripheralSendRequest(
             pDevice,
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             spbRequest);
     }
 
@@ -293,11 +330,12 @@ SpbPeripheralUnlock(
             TRACE_FLAG_SPBAPI,
             "Failed to send SPB request %p for "
             "IOCTL_SPB_UNLOCK_CONTROLLER - %!STATUS!",
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             status);
 
         SpbPeripheralCompleteRequestPair(
             pDevice,
+            pForward,
             status,
             0);
     }
@@ -329,7 +367,7 @@ SpbPeripheralLockConnection(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-    UNREFERENCED_PARAMETER(spbRequest);
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
 
     NTSTATUS status;
 
@@ -337,21 +375,21 @@ SpbPeripheralLockConnection(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Formatting SPB request %p for IOCTL_SPB_LOCK_CONNECTION",
-        pDevice->SpbRequest);
+        pForward->SpbRequest);
         
     //
     // Save the client request.
     //
 
-    pDevice->ClientRequest = spbRequest;
+    pForward->ClientRequest = spbRequest;
 
     //
     // Initialize the SPB request for lock and send.
     //
 
     status = WdfIoTargetFormatRequestForIoctl(
-        pDevice->TrueSpbController,
-        pDevice->SpbRequest,
+        pForward->IoTarget,
+        pForward->SpbRequest,
         IOCTL_SPB_LOCK_CONNECTION,
         nullptr,
         nullptr,
@@ -362,7 +400,7 @@ SpbPeripheralLockConnection(
     {
         status = SpbPeripheralSendRequest(
             pDevice,
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             spbRequest);
     }
 
@@ -373,11 +411,12 @@ SpbPeripheralLockConnection(
             TRACE_FLAG_SPBAPI,
             "Failed to send SPB request %p for "
             "IOCTL_SPB_LOCK_CONNECTION - %!STATUS!",
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             status);
 
         SpbPeripheralCompleteRequestPair(
             pDevice,
+            pForward,
             status,
             0);
     }
@@ -409,7 +448,7 @@ SpbPeripheralUnlockConnection(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-    UNREFERENCED_PARAMETER(spbRequest);
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
 
     NTSTATUS status;
 
@@ -417,21 +456,21 @@ SpbPeripheralUnlockConnection(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Formatting SPB request %p for IOCTL_SPB_UNLOCK_CONNECTION",
-        pDevice->SpbRequest);
+        pForward->SpbRequest);
         
     //
     // Save the client request.
     //
 
-    pDevice->ClientRequest = spbRequest;
+    pForward->ClientRequest = spbRequest;
 
     //
     // Initialize the SPB request for unlock and send.
     //
 
     status = WdfIoTargetFormatRequestForIoctl(
-        pDevice->TrueSpbController,
-        pDevice->SpbRequest,
+        pForward->IoTarget,
+        pForward->SpbRequest,
         IOCTL_SPB_UNLOCK_CONNECTION,
         nullptr,
         nullptr,
@@ -442,7 +481,7 @@ SpbPeripheralUnlockConnection(
     {
         status = SpbPeripheralSendRequest(
             pDevice,
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             spbRequest);
     }
 
@@ -453,11 +492,12 @@ SpbPeripheralUnlockConnection(
             TRACE_FLAG_SPBAPI,
             "Failed to send SPB request %p for "
             "IOCTL_SPB_UNLOCK_CONNECTION - %!STATUS!",
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             status);
 
         SpbPeripheralCompleteRequestPair(
             pDevice,
+            pForward,
             status,
             0);
     }
@@ -465,275 +505,1597 @@ SpbPeripheralUnlockConnection(
     FuncExit(TRACE_FLAG_SPBAPI);
 }
 
+//
+// Copies the payload of a request small enough for the inline
+// buffer, its transfers are then read from the copy.
+//
+
 VOID
-SpbTraceBufferIndex(
+SpbTraceLoadInline(
 	_In_ PPBC_DEVICE pDevice,
 	_In_ SPBREQUEST  clientRequest,
-	_In_ ULONG       index
+	_In_ ULONG       transferCount
 )
 {
-	SPB_TRANSFER_DESCRIPTOR transferDescriptor;
-	PMDL pMdl;
-	const ULONG max_len = 1024;
-	UCHAR pBuffer[max_len] = { 0 };
-	CHAR pPrefix[32]; /*  format "device NNN: ##nn write llll -" */
-	CHAR pDataString[5 + 3 * 16 + 1]; /* format "0000: XX XX XX XX" */
-	int dataIndex;
-	SPB_TRANSFER_DESCRIPTOR_INIT(&transferDescriptor);
+	PPBC_CAPTURE_INLINE pInline = &pDevice->Capture.Inline;
+	SPB_TRANSFER_DESCRIPTOR transferDescriptors[CAPTURE_INLINE_MAX_TRANSFERS];
+	PMDL pMdls[CAPTURE_INLINE_MAX_TRANSFERS];
+	ULONG offset = 0;
 
-	SpbRequestGetTransferParameters(
-		clientRequest,
-		index,
-		&transferDescriptor,
-		&pMdl);
+	pInline->Count = 0;
+
+	if (transferCount > CAPTURE_INLINE_MAX_TRANSFERS)
+	{
+		return;
+	}
+
+	//
+	// Size the whole request before copying anything, a
+	// request that does not fit is read from its MDLs.
+	//
 
-	for (ULONG offset = 0; offset < (ULONG)transferDescriptor.TransferLength; offset += max_len)
+	for (ULONG i = 0; i < transferCount; i += 1)
 	{
-		ULONG length = min((ULONG)transferDescriptor.TransferLength - offset, max_len);
+		SPB_TRANSFER_DESCRIPTOR_INIT(&transferDescriptors[i]);
 
-		for (ULONG i = 0; i < length; i++)
+		SpbRequestGetTransferParameters(
+			clientRequest,
+			i,
+			&transferDescriptors[i],
+			&pMdls[i]);
+
+		if (transferDescriptors[i].TransferLength > CAPTURE_INLINE_SIZE - offset)
 		{
-			RequestGetByte(pMdl, transferDescriptor.TransferLength, i + offset, &pBuffer[i]);
+			return;
 		}
 
-		sprintf_s(pPrefix, sizeof(pPrefix),
-			"device %3I64d: %c#%02d %5s %4lu - ",
-			pDevice->PeripheralId.QuadPart,
-			index == 0 ? '#' : ' ',
-			index,
-			transferDescriptor.Direction == SpbTransferDirectionToDevice ? "write" : "read",
-			(unsigned long)transferDescriptor.TransferLength
-		);
+		offset += (ULONG)transferDescriptors[i].TransferLength;
+	}
+
+	offset = 0;
 
-		dataIndex = 0;
-		dataIndex += sprintf(&pDataString[dataIndex], "%04x: %02x", offset, pBuffer[0]);
-		for (ULONG i = 1; i <= length; i++)
+	for (ULONG i = 0; i < transferCount; i += 1)
+	{
+		ULONG transferLength = (ULONG)transferDescriptors[i].TransferLength;
+		MDL_SPAN_ITERATOR span;
+		size_t copied;
+
+		MdlSpanIteratorInit(&span, pMdls[i], transferLength);
+
+		if (!NT_SUCCESS(MdlSpanCopy(&span, &pInline->Data[offset], transferLength, &copied)) ||
+			copied != transferLength)
 		{
-			if ((i % 16 == 0) || i == length)
-			{
-				Trace(
-					TRACE_LEVEL_ERROR,
-					TRACE_FLAG_SPBAPI,
-					"%s %s",
-					pPrefix,
-					pDataString
-				);
-				if (i == length)
-				{
-					break;
-				}
-				dataIndex = 0;
-				dataIndex += sprintf(&pDataString[dataIndex], "%04x:", i + offset);
-			}
-			dataIndex += sprintf(&pDataString[dataIndex], " %02x", pBuffer[i]);
+			return;
 		}
+
+		pInline->Transfers[i].Direction = transferDescriptors[i].Direction;
+		pInline->Transfers[i].Length = transferLength;
+		pInline->Transfers[i].Offset = offset;
+
+		offset += transferLength;
 	}
+
+	pInline->Count = transferCount;
 }
 
+//
+// Returns the descriptor of a transfer of the request being
+// captured, and a span iterator at the start of its payload.
+//
+
 VOID
-SpbTraceBuffers(
-	_In_ PPBC_DEVICE pDevice,
-	_In_ SPBREQUEST clientRequest
+SpbTraceGetTransfer(
+	_In_  PPBC_DEVICE              pDevice,
+	_In_  SPBREQUEST               clientRequest,
+	_In_  ULONG                    index,
+	_Out_ PSPB_TRANSFER_DESCRIPTOR pTransferDescriptor,
+	_Out_ PMDL_SPAN_ITERATOR       pSpan
 )
 {
-	SPB_REQUEST_PARAMETERS parameters;
-	
-	SPB_REQUEST_PARAMETERS_INIT(&parameters);
+	PPBC_CAPTURE_INLINE pInline = &pDevice->Capture.Inline;
+	PMDL pMdl;
 
-	SpbRequestGetParameters(clientRequest, &parameters);
+	SPB_TRANSFER_DESCRIPTOR_INIT(pTransferDescriptor);
 
-	for (ULONG i = 0; i < parameters.SequenceTransferCount; i += 1)
+	if (index < pInline->Count)
 	{
-		SpbTraceBufferIndex(pDevice, clientRequest, i);
+		pTransferDescriptor->Direction = pInline->Transfers[index].Direction;
+		pTransferDescriptor->TransferLength = pInline->Transfers[index].Length;
+
+		MdlSpanIteratorInitInline(
+			pSpan,
+			&pInline->Data[pInline->Transfers[index].Offset],
+			pInline->Transfers[index].Length);
+		return;
 	}
 
+	SpbRequestGetTransferParameters(
+		clientRequest,
+		index,
+		pTransferDescriptor,
+		&pMdl);
+
+	MdlSpanIteratorInit(pSpan, pMdl, pTransferDescriptor->TransferLength);
 }
 
 VOID
-SpbPeripheralRead(
-    _In_  PPBC_DEVICE       pDevice,
-    _In_   SPBREQUEST       spbRequest,
-	_In_  BOOLEAN           FullDuplex
-    )
-/*++
- 
-  Routine Description:
+SpbTraceBufferRange(
+	_In_    PPBC_DEVICE              pDevice,
+	_In_    const SPB_PROBE_RECORD*  pHeader,
+	_Inout_ PMDL_SPAN_ITERATOR       pSpan,
+	_In_    ULONG                    offset,
+	_In_    ULONG                    length
+)
+{
+	PSPB_PROBE_RECORD pRecord;
+	PUCHAR pPayload;
+	size_t copied;
+	ULONG end = offset + length;
 
-    This routine reads from the SPB controller.
+	//
+	// The span iterator is positioned at offset, each record picks
+	// up where the previous one stopped. An empty range still gets
+	// a record so that the transfer length shows up in the trace.
+	//
 
-  Arguments:
+	do
+	{
+		ULONG chunk = min(end - offset, SPB_PROBE_RECORD_MAX_PAYLOAD);
 
-    pDevice - a pointer to the device context
-    spbRequest - the framework request object
+		pRecord = SpbCaptureReserve(
+			pDevice,
+			sizeof(SPB_PROBE_RECORD) + chunk);
 
-  Return Value:
+		if (pRecord == NULL)
+		{
+			//
+			// Ring full, the record is accounted as dropped.
+			//
 
-    None
+			break;
+		}
 
---*/
-{
-    FuncEntry(TRACE_FLAG_SPBAPI);
+		*pRecord = *pHeader;
+		pRecord->Size = sizeof(SPB_PROBE_RECORD) + chunk;
+		pRecord->Offset = offset;
 
-    UNREFERENCED_PARAMETER(spbRequest);
+		pPayload = (PUCHAR)(pRecord + 1);
 
-	WDFMEMORY memory = nullptr;
-    NTSTATUS status;
+		MdlSpanCopy(pSpan, pPayload, chunk, &copied);
 
-    Trace(
-        TRACE_LEVEL_INFORMATION,
-        TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for read",
-        pDevice->SpbRequest);
-        
-    //
-    // Save the client request.
-    //
+		if (copied < chunk)
+		{
+			//
+			// Unmappable or short MDL chain, dump zeroes for the
+			// missing bytes rather than stale data.
+			//
 
-    pDevice->ClientRequest = spbRequest;
+			RtlZeroMemory(&pPayload[copied], chunk - copied);
+		}
 
-    //
-    // Initialize the SPB request for read and send.
-    //
+		SpbCaptureCommit(pRecord);
 
-	if (!FullDuplex)
+		offset += chunk;
+
+	} while (offset < end);
+}
+
+template <ULONG Mode>
+VOID
+SpbTraceBufferIndex(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ ULONG       index,
+	_In_ NTSTATUS    status
+)
+{
+	SPB_TRANSFER_DESCRIPTOR transferDescriptor;
+	MDL_SPAN_ITERATOR span;
+	PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+	SPB_PROBE_RECORD header;
+	ULONG transferLength;
+	ULONG headLength;
+	ULONG tailLength = 0;
+	ULONG keepLength = pDevice->Capture.TruncationLength;
+
+	SpbTraceGetTransfer(
+		pDevice,
+		clientRequest,
+		index,
+		&transferDescriptor,
+		&span);
+
+	transferLength = (ULONG)transferDescriptor.TransferLength;
+
+	header.Size = 0;
+	header.Version = SPB_PROBE_RECORD_VERSION;
+	header.Type = SPB_PROBE_RECORD_TYPE_TRANSFER;
+	header.Direction =
+		(transferDescriptor.Direction == SpbTransferDirectionToDevice) ?
+		SPB_PROBE_DIRECTION_WRITE : SPB_PROBE_DIRECTION_READ;
+	header.TransferIndex = (UCHAR)index;
+	header.PeripheralId = pDevice->Capture.PeripheralId;
+	header.Timestamp = pRequest->CompleteTimestamp;
+	header.Status = status;
+	header.TransferLength = transferLength;
+	header.Offset = 0;
+	header.WireTime = SpbStatsWireTime(
+		&pRequest->pConnection->Stats,
+		pRequest,
+		transferLength);
+	header.ArrivalTimestamp = pRequest->ArrivalTimestamp;
+	header.SendTimestamp = pRequest->SendTimestamp;
+	header.ControllerTimestamp = pRequest->ControllerTimestamp;
+
+	//
+	// Apply the truncation policy, the records always carry
+	// the length of the whole transfer. A summary is a single
+	// record without payload.
+	//
+
+	if (Mode == SPB_PROBE_MODE_SUMMARY)
 	{
-		status = WdfRequestRetrieveOutputMemory(
-			spbRequest,
-			&memory);
+		SpbTraceBufferRange(pDevice, &header, &span, 0, 0);
+		return;
 	}
-	else
+
+	switch (pDevice->Capture.Truncation)
 	{
-		status = WdfRequestRetrieveInputMemory(
-			spbRequest,
-			&memory);
-	}
+	case SPB_PROBE_TRUNCATE_FIRST:
+		headLength = min(transferLength, keepLength);
+		break;
 
-	if (NT_SUCCESS(status))
-    {
-		status = WdfIoTargetFormatRequestForRead(
-			pDevice->TrueSpbController,
-			pDevice->SpbRequest,
-			memory,
-			nullptr,
-			nullptr);
+	case SPB_PROBE_TRUNCATE_HEAD_TAIL:
+		headLength = transferLength;
 
-        if (NT_SUCCESS(status))
-        {
-            status = SpbPeripheralSendRequest(
-                pDevice,
-                pDevice->SpbRequest,
-                spbRequest);
-        }
-    }
+		if ((ULONGLONG)transferLength > 2 * (ULONGLONG)keepLength)
+		{
+			headLength = keepLength;
+			tailLength = keepLength;
+		}
+		break;
 
-    if (!NT_SUCCESS(status))
-    {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
-            "read - %!STATUS!",
-            pDevice->SpbRequest,
-            status);
+	case SPB_PROBE_TRUNCATE_LENGTH_ONLY:
+		headLength = 0;
+		break;
 
-        SpbPeripheralCompleteRequestPair(
-            pDevice,
-            status,
-            0);
-    }
+	default:
+		headLength = transferLength;
+		break;
+	}
 
-    FuncExit(TRACE_FLAG_SPBAPI);
-}
+	//
+	// Walk the payload once for the whole transfer.
+	//
 
-VOID
-SpbPeripheralWrite(
-    _In_  PPBC_DEVICE       pDevice,
-    _In_   SPBREQUEST       spbRequest,
-	_In_  BOOLEAN           FullDuplex
-    )
-/*++
- 
-  Routine Description:
+	SpbTraceBufferRange(pDevice, &header, &span, 0, headLength);
 
-    This routine writes to the SPB controller.
+	if (tailLength != 0)
+	{
+		MdlSpanSkip(&span, transferLength - headLength - tailLength);
 
-  Arguments:
+		SpbTraceBufferRange(
+			pDevice,
+			&header,
+			&span,
+			transferLength - tailLength,
+			tailLength);
+	}
+}
 
-    pDevice - a pointer to the device context
-    spbRequest - the framework request object
+BOOLEAN
+SpbTraceFilterMatch(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ const SPB_PROBE_FILTER_INSN* pProgram,
+	_In_ ULONG       programCount,
+	_In_ ULONG       bytesNeeded,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ ULONG       index,
+	_In_ NTSTATUS    status
+)
+{
+	SPB_TRANSFER_DESCRIPTOR transferDescriptor;
+	SPB_PROBE_FILTER_INPUT input;
+	MDL_SPAN_ITERATOR span;
+	size_t copied = 0;
 
-  Return Value:
+	SpbTraceGetTransfer(
+		pDevice,
+		clientRequest,
+		index,
+		&transferDescriptor,
+		&span);
 
-    None
+	input.Fields[SPB_PROBE_FILTER_FIELD_DIRECTION] =
+		(transferDescriptor.Direction == SpbTransferDirectionToDevice) ?
+		SPB_PROBE_DIRECTION_WRITE : SPB_PROBE_DIRECTION_READ;
+	input.Fields[SPB_PROBE_FILTER_FIELD_LENGTH] =
+		(ULONG)transferDescriptor.TransferLength;
+	input.Fields[SPB_PROBE_FILTER_FIELD_STATUS] = (ULONG)status;
+	input.Fields[SPB_PROBE_FILTER_FIELD_INDEX] = index;
 
---*/
-{
-    FuncEntry(TRACE_FLAG_SPBAPI);
+	//
+	// Only copy the payload bytes the program may look at.
+	//
 
-    UNREFERENCED_PARAMETER(spbRequest);
+	if (bytesNeeded != 0)
+	{
+		MdlSpanCopy(&span, input.Bytes, bytesNeeded, &copied);
+	}
 
-    WDFMEMORY memory = nullptr;
-	NTSTATUS status;
+	input.ByteCount = (ULONG)copied;
 
-    Trace(
-        TRACE_LEVEL_INFORMATION,
-        TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for write",
-        pDevice->SpbRequest);
-        
-    //
-    // Save the client request.
-    //
+	return SpbProbeFilterRun(pProgram, programCount, &input) != 0;
+}
 
-    pDevice->ClientRequest = spbRequest;
+ULONG
+SpbTraceTriggerReason(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ ULONG       transferCount,
+	_In_ NTSTATUS    status
+)
+{
+	PPBC_CAPTURE_TRIGGER pTrigger = &pDevice->Capture.Trigger;
+	PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+	ULONG reason = 0;
 
-	//
-    // Initialize the SPB request for write and send.
-    //
+	if ((pTrigger->Conditions & SPB_PROBE_TRIGGER_STATUS) &&
+		!NT_SUCCESS(status))
+	{
+		reason |= SPB_PROBE_TRIGGER_STATUS;
+	}
 
-	if (!FullDuplex)
+	if ((pTrigger->Conditions & SPB_PROBE_TRIGGER_LATENCY) &&
+		pRequest->SendTimestamp != 0 &&
+		pRequest->ControllerTimestamp - pRequest->SendTimestamp >=
+			pTrigger->Latency)
 	{
-		status = WdfRequestRetrieveInputMemory(
-			spbRequest,
-			&memory);
+		reason |= SPB_PROBE_TRIGGER_LATENCY;
 	}
-	else
+
+	if (pTrigger->Conditions & SPB_PROBE_TRIGGER_PATTERN)
 	{
-		status = WdfRequestRetrieveOutputMemory(
-			spbRequest,
-			&memory);
+		for (ULONG i = 0; i < transferCount; i += 1)
+		{
+			if (SpbTraceFilterMatch(
+					pDevice,
+					pTrigger->Pattern,
+					pTrigger->PatternCount,
+					pTrigger->PatternBytes,
+					clientRequest,
+					i,
+					status))
+			{
+				reason |= SPB_PROBE_TRIGGER_PATTERN;
+				break;
+			}
+		}
 	}
 
-    if (NT_SUCCESS(status))
-    {
-        status = WdfIoTargetFormatRequestForWrite(
-            pDevice->TrueSpbController,
-            pDevice->SpbRequest,
-            memory,
-            nullptr,
-            nullptr);
+	return reason;
+}
 
-        if (NT_SUCCESS(status))
-        {
-            status = SpbPeripheralSendRequest(
-                pDevice,
-                pDevice->SpbRequest,
-                spbRequest);
-        }
-    }
+BOOLEAN
+SpbTraceIsRepeat(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ ULONG       transferCount,
+	_In_ NTSTATUS    status,
+	_In_ LONGLONG    timestamp
+)
+{
+	PPBC_CAPTURE_REPEAT pRepeat = &pDevice->Capture.Repeat;
+	UCHAR data[CAPTURE_REPEAT_MAX_LENGTH];
+	ULONG length = 0;
 
-    if (!NT_SUCCESS(status))
-    {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_FLAG_SPBAPI,
+	//
+	// Serialize the request, giving up on requests too
+	// big to be worth comparing.
+	//
+
+	for (ULONG i = 0; i < transferCount; i += 1)
+	{
+		SPB_TRANSFER_DESCRIPTOR transferDescriptor;
+		MDL_SPAN_ITERATOR span;
+		size_t copied;
+		ULONG transferLength;
+
+		SpbTraceGetTransfer(
+			pDevice,
+			clientRequest,
+			i,
+			&transferDescriptor,
+			&span);
+
+		transferLength = (ULONG)transferDescriptor.TransferLength;
+
+		if (length + 1 + sizeof(ULONG) > sizeof(data) ||
+			transferLength > sizeof(data) - 1 - sizeof(ULONG) - length)
+		{
+			length = 0;
+			break;
+		}
+
+		data[length++] = (UCHAR)transferDescriptor.Direction;
+		RtlCopyMemory(&data[length], &transferLength, sizeof(ULONG));
+		length += sizeof(ULONG);
+
+		if (!NT_SUCCESS(MdlSpanCopy(&span, &data[length], transferLength, &copied)) ||
+			copied != transferLength)
+		{
+			length = 0;
+			break;
+		}
+
+		length += transferLength;
+	}
+
+	if (length != 0 &&
+		length == pRepeat->Length &&
+		status == pRepeat->Status &&
+		pDevice->Capture.PeripheralId == pRepeat->PeripheralId &&
+		RtlEqualMemory(data, pRepeat->Data, length))
+	{
+		if (pRepeat->Count == 0)
+		{
+			pRepeat->FirstTimestamp = timestamp;
+		}
+
+		pRepeat->Count += 1;
+		pRepeat->LastTimestamp = timestamp;
+
+		if (pRepeat->Count == CAPTURE_REPEAT_MAX_COUNT)
+		{
+			SpbCaptureFlushRepeats(pDevice);
+		}
+
+		return TRUE;
+	}
+
+	//
+	// A different request, report the repeats of the
+	// previous one and remember this one instead.
+	//
+
+	SpbCaptureFlushRepeats(pDevice);
+
+	RtlCopyMemory(pRepeat->Data, data, length);
+	pRepeat->Length = length;
+	pRepeat->Status = status;
+	pRepeat->PeripheralId = pDevice->Capture.PeripheralId;
+
+	return FALSE;
+}
+
+template <ULONG Mode>
+VOID
+SpbTraceRequest(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ ULONG       transferCount,
+	_In_ NTSTATUS    status
+)
+{
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	ULONG matches = MAXULONG;
+	ULONG i;
+
+	//
+	// Run the filter first, a request without any matching
+	// transfer is left alone. The results of the first 32
+	// transfers are kept for the loop below, the filter only
+	// runs again for the transfers past them.
+	//
+
+	if (pCapture->FilterCount != 0)
+	{
+		matches = 0;
+
+		for (i = 0; i < transferCount; i += 1)
+		{
+			if (i >= 32 && matches != 0)
+			{
+				break;
+			}
+
+			if (SpbTraceFilterMatch(
+					pDevice,
+					pCapture->Filter,
+					pCapture->FilterCount,
+					pCapture->FilterBytes,
+					clientRequest,
+					i,
+					status))
+			{
+				if (i >= 32)
+				{
+					break;
+				}
+
+				matches |= (1UL << i);
+			}
+		}
+
+		if (i == transferCount && matches == 0)
+		{
+			return;
+		}
+	}
+
+	//
+	// Repeats are told apart by their payload,
+	// which summaries do not have.
+	//
+
+	if (Mode == SPB_PROBE_MODE_FULL &&
+		pCapture->CollapseRepeats &&
+		SpbTraceIsRepeat(
+			pDevice,
+			clientRequest,
+			transferCount,
+			status,
+			GetRequestContext(clientRequest)->CompleteTimestamp))
+	{
+		return;
+	}
+
+	for (i = 0; i < transferCount; i += 1)
+	{
+		if (i < 32)
+		{
+			if ((matches & (1UL << i)) == 0)
+			{
+				continue;
+			}
+		}
+		else if (pCapture->FilterCount != 0 &&
+			!SpbTraceFilterMatch(
+				pDevice,
+				pCapture->Filter,
+				pCapture->FilterCount,
+				pCapture->FilterBytes,
+				clientRequest,
+				i,
+				status))
+		{
+			continue;
+		}
+
+		SpbTraceBufferIndex<Mode>(pDevice, clientRequest, i, status);
+	}
+}
+
+template <ULONG Mode>
+VOID
+SpbTraceBuffers(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ NTSTATUS    status
+)
+{
+	PPBC_CAPTURE pCapture = &pDevice->Capture;
+	SPB_REQUEST_PARAMETERS parameters;
+	ULONG reason = 0;
+	ULONG passes;
+	
+	SPB_REQUEST_PARAMETERS_INIT(&parameters);
+
+	SpbRequestGetParameters(clientRequest, &parameters);
+
+	if (parameters.SequenceTransferCount == 0)
+	{
+		return;
+	}
+
+	//
+	// Only copy the payload of a small request if more than one
+	// pass is going to read it: the filter, the trigger pattern,
+	// the repeat detection and the records. The copy costs more
+	// than a single pass over the client buffers.
+	//
+
+	passes =
+		(pCapture->FilterBytes != 0) +
+		((pCapture->Trigger.Conditions & SPB_PROBE_TRIGGER_PATTERN) != 0 &&
+			pCapture->Trigger.PatternBytes != 0) +
+		(Mode == SPB_PROBE_MODE_FULL && pCapture->CollapseRepeats) +
+		(Mode == SPB_PROBE_MODE_FULL &&
+			pCapture->Truncation != SPB_PROBE_TRUNCATE_LENGTH_ONLY);
+
+	if (passes > 1)
+	{
+		SpbTraceLoadInline(
+			pDevice,
+			clientRequest,
+			parameters.SequenceTransferCount);
+	}
+	else
+	{
+		pCapture->Inline.Count = 0;
+	}
+
+	if (pCapture->Trigger.Conditions != 0)
+	{
+		reason = SpbTraceTriggerReason(
+			pDevice,
+			clientRequest,
+			parameters.SequenceTransferCount,
+			status);
+
+		SpbCaptureBeginRequest(pDevice);
+	}
+
+	SpbTraceRequest<Mode>(
+		pDevice,
+		clientRequest,
+		parameters.SequenceTransferCount,
+		status);
+
+	if (pCapture->Trigger.Conditions != 0)
+	{
+		SpbCaptureEndRequest(pDevice, reason, status);
+	}
+}
+
+//
+// One instantiation per SPB_PROBE_MODE_*, so that the completion
+// path of a mode carries no test or code of the modes above it.
+//
+
+template <ULONG Mode>
+BOOLEAN
+SpbTraceCompletion(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ NTSTATUS    status,
+	_In_ ULONG_PTR   bytesCompleted
+)
+{
+	if (Mode == SPB_PROBE_MODE_NONE)
+	{
+		SpbStatsLeave(pDevice, clientRequest);
+	}
+	else
+	{
+		SpbStatsRecord(pDevice, clientRequest, status, bytesCompleted);
+	}
+
+	if (Mode >= SPB_PROBE_MODE_SUMMARY)
+	{
+		SpbTraceBuffers<Mode>(pDevice, clientRequest, status);
+	}
+
+	return (Mode >= SPB_PROBE_MODE_SUMMARY);
+}
+
+PFN_PBC_TRACE_COMPLETION
+SpbPeripheralGetTraceCompletion(
+	_In_  ULONG             Mode
+)
+/*++
+
+  Routine Description:
+
+    This routine returns the completion path of a capture mode.
+
+  Arguments:
+
+    Mode - the SPB_PROBE_MODE_* capture mode
+
+  Return Value:
+
+    The completion path, SPB_PROBE_MODE_FULL for an unknown mode
+
+--*/
+{
+	switch (Mode)
+	{
+	case SPB_PROBE_MODE_NONE:
+		return SpbTraceCompletion<SPB_PROBE_MODE_NONE>;
+
+	case SPB_PROBE_MODE_COUNTERS:
+		return SpbTraceCompletion<SPB_PROBE_MODE_COUNTERS>;
+
+	case SPB_PROBE_MODE_SUMMARY:
+		return SpbTraceCompletion<SPB_PROBE_MODE_SUMMARY>;
+
+	default:
+		return SpbTraceCompletion<SPB_PROBE_MODE_FULL>;
+	}
+}
+
+//
+// Lets the device idle again once a client request which
+// waited for a forward request is completed.
+//
+
+static
+VOID
+SpbPeripheralResumeIdle(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        clientRequest
+)
+{
+	PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+
+	if (pRequest->IdleStopped)
+	{
+		pRequest->IdleStopped = FALSE;
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+}
+
+static
+BOOLEAN
+SpbPeripheralTraceCompletion(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        clientRequest,
+	_In_  NTSTATUS          status,
+	_In_  ULONG_PTR         bytesCompleted
+)
+/*++
+
+  Routine Description:
+
+    This routine stamps the completion of a client request and
+    runs the completion path of the capture mode. Completions
+    are serialized, as the capture state is not shared. Without
+    capture nor a pending control request, the request is only
+    taken out of the requests in flight, without a timestamp or
+    the lock.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    clientRequest - the client request
+    status - the client completion status
+    bytesCompleted - the number of bytes completed
+
+  Return Value:
+
+    TRUE if the capture rings need to be drained
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+	PPBC_CONNECTION pConnection;
+	BOOLEAN drain;
+
+	//
+	// The mode only changes under the lock below. A completion
+	// racing with a switch out of SPB_PROBE_MODE_NONE is left
+	// out of the capture, as if it completed just before it.
+	//
+
+	if (ReadULongNoFence(&pDevice->Capture.Mode) == SPB_PROBE_MODE_NONE &&
+		ReadNoFence(&pDevice->Capture.ControlPending) == 0)
+	{
+		SpbStatsLeave(pDevice, clientRequest);
+		return FALSE;
+	}
+
+	pRequest->CompleteTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	//
+	// Requests failed before being routed belong to the
+	// first connection.
+	//
+
+	if (pRequest->pConnection == NULL)
+	{
+		pRequest->pConnection = &pDevice->Connections[0];
+	}
+
+	pConnection = pRequest->pConnection;
+
+	WdfSpinLockAcquire(pDevice->CompletionLock);
+
+	SpbCaptureApplyControl(pDevice);
+
+	pDevice->Capture.PeripheralId = pConnection->PeripheralId.QuadPart;
+
+	drain = pDevice->Capture.TraceCompletion(
+		pDevice,
+		clientRequest,
+		status,
+		bytesCompleted);
+
+	WdfSpinLockRelease(pDevice->CompletionLock);
+
+	return drain;
+}
+
+NTSTATUS
+SpbPeripheralInitialize(
+	_In_  PPBC_DEVICE       pDevice
+)
+/*++
+
+  Routine Description:
+
+    This routine reads the QueueDepth, CoalesceLocks and
+    IdlePolicy values from the device key and creates the
+    objects sharing the forward requests.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_WDFLOADING);
+
+	DECLARE_CONST_UNICODE_STRING(depthName, L"QueueDepth");
+	DECLARE_CONST_UNICODE_STRING(coalesceName, L"CoalesceLocks");
+	DECLARE_CONST_UNICODE_STRING(idleName, L"IdlePolicy");
+
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDFKEY key;
+	ULONG value;
+	NTSTATUS status;
+
+	for (ULONG i = 0; i < FORWARD_MAX_DEPTH; i += 1)
+	{
+		pDevice->Forwards[i].SpbRequest = WDF_NO_HANDLE;
+		pDevice->Forwards[i].InputMemory = WDF_NO_HANDLE;
+		pDevice->Forwards[i].pTransferList = NULL;
+		pDevice->Forwards[i].ClientRequest = nullptr;
+		pDevice->Forwards[i].Index = i;
+	}
+
+	pDevice->QueueDepth = FORWARD_DEFAULT_DEPTH;
+	pDevice->ForwardsBusy = 0;
+	pDevice->DispatchPasses = 0;
+	pDevice->CoalesceLocks = FALSE;
+	pDevice->IdlePolicy = IDLE_POLICY_CONNECTED;
+
+	status = WdfDeviceOpenRegistryKey(
+		pDevice->FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (NT_SUCCESS(status))
+	{
+		if (NT_SUCCESS(WdfRegistryQueryULong(key, &depthName, &value)) &&
+			value != 0)
+		{
+			pDevice->QueueDepth = min(value, FORWARD_MAX_DEPTH);
+		}
+
+		//
+		// A held write stays with the driver, a sequential
+		// queue would not present the request carrying it.
+		//
+
+		if (NT_SUCCESS(WdfRegistryQueryULong(key, &coalesceName, &value)))
+		{
+			pDevice->CoalesceLocks = (value != 0) && (pDevice->QueueDepth > 1);
+		}
+
+		if (NT_SUCCESS(WdfRegistryQueryULong(key, &idleName, &value)) &&
+			value <= IDLE_POLICY_PERFORMANCE)
+		{
+			pDevice->IdlePolicy = value;
+		}
+
+		WdfRegistryClose(key);
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->ForwardLock);
+
+	if (NT_SUCCESS(status))
+	{
+		status = WdfSpinLockCreate(&attributes, &pDevice->CompletionLock);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+		queueConfig.PowerManaged = WdfFalse;
+		queueConfig.EvtIoCanceledOnQueue = SpbPeripheralOnPendingCanceled;
+
+		status = WdfIoQueueCreate(
+			pDevice->FxDevice,
+			&queueConfig,
+			WDF_NO_OBJECT_ATTRIBUTES,
+			&pDevice->PendingQueue);
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_WDFLOADING,
+			"Failed to create forward objects - %!STATUS!",
+			status);
+	}
+	else
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_WDFLOADING,
+			"Using %lu forward requests, lock coalescing %!bool!, "
+			"idle policy %lu",
+			pDevice->QueueDepth,
+			pDevice->CoalesceLocks,
+			pDevice->IdlePolicy);
+	}
+
+	FuncExit(TRACE_FLAG_WDFLOADING);
+
+	return status;
+}
+
+//
+// Returns a free forward request, if any. The forward
+// lock must be held.
+//
+
+static
+PPBC_FORWARD
+SpbPeripheralAcquireForward(
+	_In_  PPBC_DEVICE       pDevice
+)
+{
+	ULONG available;
+	ULONG index;
+
+	available = ~pDevice->ForwardsBusy & ((1UL << pDevice->QueueDepth) - 1);
+
+	if (!BitScanForward(&index, available))
+	{
+		return NULL;
+	}
+
+	pDevice->ForwardsBusy |= 1UL << index;
+
+	return &pDevice->Forwards[index];
+}
+
+static
+VOID
+SpbPeripheralStart(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  PPBC_FORWARD      pForward,
+	_In_  SPBREQUEST        spbRequest
+)
+{
+	PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+	SPB_REQUEST_PARAMETERS parameters;
+
+	pRequest->pForward = pForward;
+	pForward->IoTarget = pRequest->pConnection->TrueSpbController;
+	pForward->State = FORWARD_STATE_SUBMITTED;
+
+	//
+	// A request carrying the write held in its lock window
+	// is sent as a sequence starting with that write.
+	//
+
+	if (pRequest->HeldRequest != NULL)
+	{
+		SPB_REQUEST_PARAMETERS_INIT(&parameters);
+		SpbRequestGetParameters(spbRequest, &parameters);
+
+		SpbPeripheralSequence(
+			pDevice,
+			spbRequest,
+			parameters.SequenceTransferCount);
+		return;
+	}
+
+	switch (pRequest->Kind)
+	{
+	case SPB_PROBE_KIND_LOCK:
+		SpbPeripheralLock(pDevice, spbRequest);
+		break;
+
+	case SPB_PROBE_KIND_UNLOCK:
+		SpbPeripheralUnlock(pDevice, spbRequest);
+		break;
+
+	case SPB_PROBE_KIND_READ:
+		SpbPeripheralRead(pDevice, spbRequest, WdfFalse);
+		break;
+
+	case SPB_PROBE_KIND_WRITE:
+		SpbPeripheralWrite(pDevice, spbRequest, WdfFalse);
+		break;
+
+	case SPB_PROBE_KIND_SEQUENCE_1:
+	case SPB_PROBE_KIND_SEQUENCE_N:
+		SPB_REQUEST_PARAMETERS_INIT(&parameters);
+		SpbRequestGetParameters(spbRequest, &parameters);
+
+		SpbPeripheralSequence(
+			pDevice,
+			spbRequest,
+			parameters.SequenceTransferCount);
+		break;
+
+	case SPB_PROBE_KIND_FULL_DUPLEX:
+		SpbPeripheralFullDuplex(pDevice, spbRequest);
+		break;
+
+	default:
+		NT_ASSERTMSG("Only SPB transfers are forwarded", FALSE);
+
+		pForward->ClientRequest = spbRequest;
+		SpbPeripheralCompleteRequestPair(
+			pDevice,
+			pForward,
+			STATUS_NOT_SUPPORTED,
+			0);
+		break;
+	}
+}
+
+static
+VOID
+SpbPeripheralDispatchPending(
+	_In_  PPBC_DEVICE       pDevice
+)
+{
+	PPBC_FORWARD pForward;
+	WDFREQUEST request;
+
+	//
+	// A single caller at a time pairs the pending requests
+	// with the free forward requests, the others only ask it
+	// for another pass. A request failing synchronously thus
+	// does not recurse into the next one.
+	//
+
+	if (InterlockedIncrement(&pDevice->DispatchPasses) != 1)
+	{
+		return;
+	}
+
+	do
+	{
+		for (;;)
+		{
+			WdfSpinLockAcquire(pDevice->ForwardLock);
+
+			pForward = SpbPeripheralAcquireForward(pDevice);
+
+			if (pForward != NULL &&
+				!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+					pDevice->PendingQueue,
+					&request)))
+			{
+				pDevice->ForwardsBusy &= ~(1UL << pForward->Index);
+				pForward = NULL;
+			}
+
+			WdfSpinLockRelease(pDevice->ForwardLock);
+
+			if (pForward == NULL)
+			{
+				break;
+			}
+
+			SpbPeripheralStart(pDevice, pForward, (SPBREQUEST)request);
+		}
+	}
+	while (InterlockedDecrement(&pDevice->DispatchPasses) != 0);
+}
+
+static
+VOID
+SpbPeripheralReleaseForward(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  PPBC_FORWARD      pForward
+)
+{
+	WdfSpinLockAcquire(pDevice->ForwardLock);
+
+	pDevice->ForwardsBusy &= ~(1UL << pForward->Index);
+
+	WdfSpinLockRelease(pDevice->ForwardLock);
+
+	SpbPeripheralDispatchPending(pDevice);
+}
+
+static
+VOID
+SpbPeripheralForward(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        spbRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine sends a routed client request on a free forward
+    request, or queues it until one is released. The request is
+    only completed here on failure.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+	PPBC_FORWARD pForward;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	//
+	// Queue the request under the lock, so that a forward
+	// request released meanwhile finds it.
+	//
+
+	WdfSpinLockAcquire(pDevice->ForwardLock);
+
+	pForward = SpbPeripheralAcquireForward(pDevice);
+
+	if (pForward == NULL)
+	{
+		//
+		// A queued request no longer holds the device in D0
+		// through the SPB controller queue, hold it here
+		// unless connected targets already do.
+		//
+
+		if (pDevice->IdlePolicy != IDLE_POLICY_CONNECTED)
+		{
+			pRequest->IdleStopped = NT_SUCCESS(
+				WdfDeviceStopIdle(pDevice->FxDevice, WdfFalse));
+		}
+
+		status = WdfRequestForwardToIoQueue(
+			spbRequest,
+			pDevice->PendingQueue);
+	}
+
+	WdfSpinLockRelease(pDevice->ForwardLock);
+
+	if (pForward != NULL)
+	{
+		SpbPeripheralStart(pDevice, pForward, spbRequest);
+	}
+	else if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBAPI,
+			"Failed to queue client request %p - %!STATUS!",
+			spbRequest,
+			status);
+
+		SpbPeripheralFailRequest(pDevice, spbRequest, status);
+	}
+	else
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_SPBAPI,
+			"Queued client request %p until a forward request is free",
+			spbRequest);
+	}
+}
+
+static
+BOOLEAN
+SpbPeripheralCoalesce(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  PPBC_TARGET       pTarget,
+	_In_  SPBREQUEST        spbRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine coalesces the lock windows of I2C targets when
+    CoalesceLocks is set. Once the controller lock of the target
+    is taken, a write is held and sent ahead of the next transfer
+    of the window in a single sequence, which the controller
+    issues with a repeated start. The held write is completed
+    with the status of that sequence. An unlock, a request which
+    cannot carry the write, or the timer if no request comes in
+    time, sends it alone first.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client request
+
+  Return Value:
+
+    TRUE if the request is held, FALSE if it still
+    has to be forwarded
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+	SPB_REQUEST_PARAMETERS parameters;
+	SPBREQUEST heldRequest;
+	BOOLEAN carry = FALSE;
+	BOOLEAN hold = FALSE;
+
+	pRequest->HeldRequest = NULL;
+	pRequest->HeldLength = 0;
+
+	if (pTarget->HeldTimer == WDF_NO_HANDLE)
+	{
+		return FALSE;
+	}
+
+	//
+	// Only the transfers sent as one sequence can carry the
+	// held write, if the list has room for it.
+	//
+
+	switch (pRequest->Kind)
+	{
+	case SPB_PROBE_KIND_READ:
+	case SPB_PROBE_KIND_WRITE:
+		carry = TRUE;
+		break;
+
+	case SPB_PROBE_KIND_SEQUENCE_1:
+	case SPB_PROBE_KIND_SEQUENCE_N:
+		SPB_REQUEST_PARAMETERS_INIT(&parameters);
+		SpbRequestGetParameters(spbRequest, &parameters);
+
+		carry = (parameters.SequenceTransferCount < FORWARD_MAX_TRANSFERS);
+		break;
+	}
+
+	WdfSpinLockAcquire(pDevice->ForwardLock);
+
+	heldRequest = pTarget->HeldRequest;
+	pTarget->HeldRequest = NULL;
+
+	if (pRequest->Kind == SPB_PROBE_KIND_UNLOCK)
+	{
+		pTarget->LockHeld = FALSE;
+	}
+	else if ((heldRequest == NULL) &&
+		pTarget->LockHeld &&
+		(pRequest->Kind == SPB_PROBE_KIND_WRITE))
+	{
+		pTarget->HeldRequest = spbRequest;
+		hold = TRUE;
+
+		WdfTimerStart(
+			pTarget->HeldTimer,
+			WDF_REL_TIMEOUT_IN_US(FORWARD_HELD_WRITE_TIMEOUT_US));
+	}
+	else if ((heldRequest != NULL) && carry)
+	{
+		pRequest->HeldRequest = heldRequest;
+		heldRequest = NULL;
+	}
+
+	WdfSpinLockRelease(pDevice->ForwardLock);
+
+	if (hold)
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_SPBAPI,
+			"Holding client request %p in the lock window of target %p",
+			spbRequest,
+			pTarget->SpbTarget);
+
+		return TRUE;
+	}
+
+	if (pRequest->HeldRequest != NULL)
+	{
+		WdfTimerStop(pTarget->HeldTimer, FALSE);
+
+		GetRequestContext(pRequest->HeldRequest)->Coalesced = TRUE;
+	}
+	else if (heldRequest != NULL)
+	{
+		WdfTimerStop(pTarget->HeldTimer, FALSE);
+
+		SpbPeripheralForward(pDevice, heldRequest);
+	}
+
+	return FALSE;
+}
+
+VOID
+SpbPeripheralOnHeldTimer(
+	_In_  WDFTIMER          FxTimer
+)
+/*++
+
+  Routine Description:
+
+    This routine sends the write held in a lock window alone,
+    when no transfer of the window came to carry it in time.
+
+  Arguments:
+
+    FxTimer - the held write timer of the target
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBAPI);
+
+	PPBC_TARGET pTarget = GetTargetContext(WdfTimerGetParentObject(FxTimer));
+	PPBC_DEVICE pDevice = GetDeviceContext(pTarget->FxDevice);
+	SPBREQUEST heldRequest;
+
+	WdfSpinLockAcquire(pDevice->ForwardLock);
+
+	heldRequest = pTarget->HeldRequest;
+	pTarget->HeldRequest = NULL;
+
+	WdfSpinLockRelease(pDevice->ForwardLock);
+
+	if (heldRequest != NULL)
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_FLAG_SPBAPI,
+			"Sending client request %p held in the lock window of target %p",
+			heldRequest,
+			pTarget->SpbTarget);
+
+		SpbPeripheralForward(pDevice, heldRequest);
+	}
+
+	FuncExit(TRACE_FLAG_SPBAPI);
+}
+
+VOID
+SpbPeripheralDispatch(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  PPBC_TARGET       pTarget,
+	_In_  SPBREQUEST        spbRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine sends a client request to the SPB controller
+    of its target connection on a free forward request, or
+    queues it until one is released, unless it is held in a
+    lock window. The request is only completed here on failure.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBAPI);
+
+	PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+
+	pRequest->pConnection = pTarget->pConnection;
+	pRequest->pSettings = &pTarget->Settings;
+	pRequest->pTarget = pTarget;
+	pRequest->IdleStopped = FALSE;
+
+	if (!SpbPeripheralCoalesce(pDevice, pTarget, spbRequest))
+	{
+		SpbPeripheralForward(pDevice, spbRequest);
+	}
+
+	FuncExit(TRACE_FLAG_SPBAPI);
+}
+
+VOID
+SpbPeripheralRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_   SPBREQUEST       spbRequest,
+	_In_  BOOLEAN           FullDuplex
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine reads from the SPB controller.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the framework request object
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
+
+	WDFMEMORY memory = nullptr;
+    NTSTATUS status;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Formatting SPB request %p for read",
+        pForward->SpbRequest);
+        
+    //
+    // Save the client request.
+    //
+
+    pForward->ClientRequest = spbRequest;
+
+    //
+    // Initialize the SPB request for read and send.
+    //
+
+	if (!FullDuplex)
+	{
+		status = WdfRequestRetrieveOutputMemory(
+			spbRequest,
+			&memory);
+	}
+	else
+	{
+		status = WdfRequestRetrieveInputMemory(
+			spbRequest,
+			&memory);
+	}
+
+	if (NT_SUCCESS(status))
+    {
+		status = WdfIoTargetFormatRequestForRead(
+			pForward->IoTarget,
+			pForward->SpbRequest,
+			memory,
+			nullptr,
+			nullptr);
+
+        if (NT_SUCCESS(status))
+        {
+            status = SpbPeripheralSendRequest(
+                pDevice,
+                pForward->SpbRequest,
+                spbRequest);
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBAPI,
+            "Failed to send SPB request %p for "
+            "read - %!STATUS!",
+            pForward->SpbRequest,
+            status);
+
+        SpbPeripheralCompleteRequestPair(
+            pDevice,
+            pForward,
+            status,
+            0);
+    }
+
+    FuncExit(TRACE_FLAG_SPBAPI);
+}
+
+VOID
+SpbPeripheralWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_   SPBREQUEST       spbRequest,
+	_In_  BOOLEAN           FullDuplex
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine writes to the SPB controller.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the framework request object
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
+
+    WDFMEMORY memory = nullptr;
+	NTSTATUS status;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Formatting SPB request %p for write",
+        pForward->SpbRequest);
+        
+    //
+    // Save the client request.
+    //
+
+    pForward->ClientRequest = spbRequest;
+
+	//
+    // Initialize the SPB request for write and send.
+    //
+
+	if (!FullDuplex)
+	{
+		status = WdfRequestRetrieveInputMemory(
+			spbRequest,
+			&memory);
+	}
+	else
+	{
+		status = WdfRequestRetrieveOutputMemory(
+			spbRequest,
+			&memory);
+	}
+
+    if (NT_SUCCESS(status))
+    {
+        status = WdfIoTargetFormatRequestForWrite(
+            pForward->IoTarget,
+            pForward->SpbRequest,
+            memory,
+            nullptr,
+            nullptr);
+
+        if (NT_SUCCESS(status))
+        {
+            status = SpbPeripheralSendRequest(
+                pDevice,
+                pForward->SpbRequest,
+                spbRequest);
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBAPI,
             "Failed to send SPB request %p for "
             "write - %!STATUS!",
-            pDevice->SpbRequest,
+            pForward->SpbRequest,
             status);
 
         SpbPeripheralCompleteRequestPair(
             pDevice,
+            pForward,
             status,
             0);
     }
@@ -765,25 +2127,23 @@ None
 {
 	FuncEntry(TRACE_FLAG_SPBAPI);
 
-	UNREFERENCED_PARAMETER(spbRequest);
+	PPBC_FORWARD pForward = GetRequestContext(spbRequest)->pForward;
 
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
+	PSPB_TRANSFER_LIST pList = pForward->pTransferList;
+	WDFMEMORY_OFFSET listOffset;
 	NTSTATUS status;
 
-	pRequest = GetRequestContext(pDevice->SpbRequest);
-
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
 		"Formatting SPB request %p for IOCTL_SPB_FULL_DUPLEX",
-		pDevice->SpbRequest);
+		pForward->SpbRequest);
 
 	//
 	// Save the client request.
 	//
 
-	pDevice->ClientRequest = spbRequest;
+	pForward->ClientRequest = spbRequest;
 
 	//
 	// Get input and output buffers.
@@ -818,8 +2178,7 @@ None
 
 	const ULONG transfers = 2;
 
-	SPB_TRANSFER_LIST_AND_ENTRIES(transfers) seq;
-	SPB_TRANSFER_LIST_INIT(&(seq.List), transfers);
+	SPB_TRANSFER_LIST_INIT(pList, transfers);
 
 	{
 		//
@@ -830,226 +2189,31 @@ None
 
 		const ULONG index = 0;
 
-		seq.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+		pList->Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
 			SpbTransferDirectionToDevice,
 			0,
 			pWriteMdl);
 
-		seq.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+		pList->Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
 			SpbTransferDirectionFromDevice,
 			0,
 			pReadMdl);
 	}
 
 	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
-	//
-
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
-
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
-			status);
-
-		goto Done;
-	}
-
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Built full duplex transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(writeDescriptor.TransferLength + readDescriptor.TransferLength));
-
-	//
-	// Send full duplex IOCTL.
-	//
-
-	//
-	// Format and send the full duplex request.
-	//
-
-	status = WdfIoTargetFormatRequestForIoctl(
-		pDevice->TrueSpbController,
-		pDevice->SpbRequest,
-		IOCTL_SPB_FULL_DUPLEX,
-		pDevice->InputMemory,
-		nullptr,
-		nullptr,
-		nullptr);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to format request - %!STATUS!",
-			status);
-
-		goto Done;
-	}
-
-	status = SpbPeripheralSendRequest(
-		pDevice,
-		pDevice->SpbRequest,
-		spbRequest);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
-			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
-			pDevice->SpbRequest,
-			status);
-
-		goto Done;
-	}
-
-Done:
-
-	if (!NT_SUCCESS(status))
-	{
-		SpbPeripheralCompleteRequestPair(
-			pDevice,
-			status,
-			0);
-	}
-
-	FuncExit(TRACE_FLAG_SPBAPI);
-}
-
-NTSTATUS
-SpbPeripheralSequence1(
-	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest
-)
-/*++
-
-Routine Description:
-
-This routine sends a sequence of 1 transfer to the SPB controller.
-
-Arguments:
-
-pDevice - a pointer to the device context
-spbRequest - the framework request object
-
-Return Value:
-
-None
-
---*/
-{
-	FuncEntry(TRACE_FLAG_SPBAPI);
-
-	UNREFERENCED_PARAMETER(spbRequest);
-
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
-	NTSTATUS status;
-
-	pRequest = GetRequestContext(pDevice->SpbRequest);
-
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Formatting SPB request %p for IOCTL_SPB_EXECUTE_SEQUENCE",
-		pDevice->SpbRequest);
-
-	//
-	// Save the client request.
-	//
-
-	pDevice->ClientRequest = spbRequest;
-
-	//
-	// Get buffer.
-	//
-
-	SPB_TRANSFER_DESCRIPTOR firstDescriptor;
-	PMDL pFirstMdl;
-
-	SPB_TRANSFER_DESCRIPTOR_INIT(&firstDescriptor);
-
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		0,
-		&firstDescriptor,
-		&pFirstMdl);
-
-	//
-	// Build full duplex transfer using SPB transfer list.
-	//
-
-	const ULONG transfers = 2;
-
-	SPB_TRANSFER_LIST seq;
-	SPB_TRANSFER_LIST_INIT(&seq, 1);
-
-	{
-		//
-		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
-		// the warning. This is a false positive from OACR.
-		// 
-
-		const ULONG index = 0;
-
-		seq.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			firstDescriptor.Direction,
-			0,
-			pFirstMdl);
-	}
-
-	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
+	// The transfer list memory of the forward request is
+	// allocated once with the request, only send the entries used.
 	//
 
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
-
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
-			status);
-
-		goto Done;
-	}
+	listOffset.BufferOffset = 0;
+	listOffset.BufferLength = FORWARD_TRANSFER_LIST_SIZE(transfers);
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
-		"Built sequence transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(firstDescriptor.TransferLength));
+		"Built full duplex transfer %p with byte length=%lu",
+		pList,
+		(ULONG)(writeDescriptor.TransferLength + readDescriptor.TransferLength));
 
 	//
 	// Send full duplex IOCTL.
@@ -1060,11 +2224,11 @@ None
 	//
 
 	status = WdfIoTargetFormatRequestForIoctl(
-		pDevice->TrueSpbController,
-		pDevice->SpbRequest,
-		IOCTL_SPB_EXECUTE_SEQUENCE,
-		pDevice->InputMemory,
-		nullptr,
+		pForward->IoTarget,
+		pForward->SpbRequest,
+		IOCTL_SPB_FULL_DUPLEX,
+		pForward->InputMemory,
+		&listOffset,
 		nullptr,
 		nullptr);
 
@@ -1081,7 +2245,7 @@ None
 
 	status = SpbPeripheralSendRequest(
 		pDevice,
-		pDevice->SpbRequest,
+		pForward->SpbRequest,
 		spbRequest);
 
 	if (!NT_SUCCESS(status))
@@ -1090,8 +2254,8 @@ None
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBAPI,
 			"Failed to send SPB request %p for "
-			"IOCTL_SPB_EXECUTE_SEQUENCE - %!STATUS!",
-			pDevice->SpbRequest,
+			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
+			pForward->SpbRequest,
 			status);
 
 		goto Done;
@@ -1099,26 +2263,37 @@ None
 
 Done:
 
-	FuncExit(TRACE_FLAG_SPBAPI);
+	if (!NT_SUCCESS(status))
+	{
+		SpbPeripheralCompleteRequestPair(
+			pDevice,
+			pForward,
+			status,
+			0);
+	}
 
-	return status;
+	FuncExit(TRACE_FLAG_SPBAPI);
 }
 
-NTSTATUS
-SpbPeripheralSequence2(
+VOID
+SpbPeripheralSequence(
 	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest
+	_In_  SPBREQUEST        spbRequest,
+	_In_  ULONG             TransferCount
 )
 /*++
 
 Routine Description:
 
-This routine sends a sequence of 2 transfers to the SPB controller.
+This routine sends a sequence of transfers to the SPB controller,
+keeping the direction and delay of each transfer. The write held
+in the lock window of the request, if any, is sent first.
 
 Arguments:
 
 pDevice - a pointer to the device context
 spbRequest - the framework request object
+TransferCount - the transfer count
 
 Return Value:
 
@@ -1128,127 +2303,118 @@ None
 {
 	FuncEntry(TRACE_FLAG_SPBAPI);
 
-	UNREFERENCED_PARAMETER(spbRequest);
+	PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+	PPBC_FORWARD pForward = pRequest->pForward;
 
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
-	NTSTATUS status;
-
-	pRequest = GetRequestContext(pDevice->SpbRequest);
+	PSPB_TRANSFER_LIST pList = pForward->pTransferList;
+	WDFMEMORY_OFFSET listOffset;
+	ULONG heldCount = (pRequest->HeldRequest != NULL) ? 1 : 0;
+	size_t length = 0;
+	NTSTATUS status = STATUS_SUCCESS;
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
 		"Formatting SPB request %p for IOCTL_SPB_EXECUTE_SEQUENCE",
-		pDevice->SpbRequest);
+		pForward->SpbRequest);
 
 	//
 	// Save the client request.
 	//
 
-	pDevice->ClientRequest = spbRequest;
+	pForward->ClientRequest = spbRequest;
 
 	//
-	// Get input and output buffers.
+	// The transfer list memory of the forward request is
+	// allocated once with the request and bounds the sequence.
 	//
 
-	SPB_TRANSFER_DESCRIPTOR firstDescriptor;
-	SPB_TRANSFER_DESCRIPTOR secondDescriptor;
-	PMDL pFirstMdl;
-	PMDL pSecondMdl;
-
-	SPB_TRANSFER_DESCRIPTOR_INIT(&firstDescriptor);
-	SPB_TRANSFER_DESCRIPTOR_INIT(&secondDescriptor);
+	if ((TransferCount + heldCount == 0) ||
+		(TransferCount + heldCount > FORWARD_MAX_TRANSFERS))
+	{
+		status = STATUS_NOT_SUPPORTED;
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		0,
-		&firstDescriptor,
-		&pFirstMdl);
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBAPI,
+			"Sequence of %lu transfers is not supported - %!STATUS!",
+			TransferCount + heldCount,
+			status);
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		1,
-		&secondDescriptor,
-		&pSecondMdl);
+		goto Done;
+	}
 
 	//
-	// Build full duplex transfer using SPB transfer list.
+	// Build the sequence using SPB transfer list, starting
+	// with the write held in the lock window, if any.
 	//
 
-	const ULONG transfers = 2;
-
-	SPB_TRANSFER_LIST_AND_ENTRIES(transfers) seq;
-	SPB_TRANSFER_LIST_INIT(&(seq.List), transfers);
+	SPB_TRANSFER_LIST_INIT(pList, TransferCount + heldCount);
 
+	if (heldCount != 0)
 	{
-		//
-		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
-		// the warning. This is a false positive from OACR.
-		// 
+		SPB_TRANSFER_DESCRIPTOR descriptor;
+		PMDL pMdl;
 
-		const ULONG index = 0;
+		SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
 
-		seq.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			firstDescriptor.Direction,
+		SpbRequestGetTransferParameters(
+			pRequest->HeldRequest,
 			0,
-			pFirstMdl);
+			&descriptor,
+			&pMdl);
 
-		seq.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			secondDescriptor.Direction,
-			0,
-			pSecondMdl);
-	}
+		pList->Transfers[0] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+			SpbTransferDirectionToDevice,
+			descriptor.DelayInUs,
+			pMdl);
 
-	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
-	//
+		pRequest->HeldLength = (ULONG)descriptor.TransferLength;
+		length += descriptor.TransferLength;
+	}
 
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
+	for (ULONG index = 0; index < TransferCount; index += 1)
+	{
+		SPB_TRANSFER_DESCRIPTOR descriptor;
+		PMDL pMdl;
 
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
 
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
+		SpbRequestGetTransferParameters(
+			spbRequest,
+			index,
+			&descriptor,
+			&pMdl);
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
-			status);
+		pList->Transfers[heldCount + index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+			descriptor.Direction,
+			descriptor.DelayInUs,
+			pMdl);
 
-		goto Done;
+		length += descriptor.TransferLength;
 	}
 
+	listOffset.BufferOffset = 0;
+	listOffset.BufferLength = FORWARD_TRANSFER_LIST_SIZE(TransferCount + heldCount);
+
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
-		"Built sequence transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(firstDescriptor.TransferLength + secondDescriptor.TransferLength));
-
-	//
-	// Send full duplex IOCTL.
-	//
+		"Built sequence transfer %p with %lu transfers and byte length=%lu",
+		pList,
+		TransferCount + heldCount,
+		(ULONG)length);
 
 	//
-	// Format and send the full duplex request.
+	// Format and send the sequence request.
 	//
 
 	status = WdfIoTargetFormatRequestForIoctl(
-		pDevice->TrueSpbController,
-		pDevice->SpbRequest,
+		pForward->IoTarget,
+		pForward->SpbRequest,
 		IOCTL_SPB_EXECUTE_SEQUENCE,
-		pDevice->InputMemory,
-		nullptr,
+		pForward->InputMemory,
+		&listOffset,
 		nullptr,
 		nullptr);
 
@@ -1265,7 +2431,7 @@ None
 
 	status = SpbPeripheralSendRequest(
 		pDevice,
-		pDevice->SpbRequest,
+		pForward->SpbRequest,
 		spbRequest);
 
 	if (!NT_SUCCESS(status))
@@ -1275,7 +2441,7 @@ None
 			TRACE_FLAG_SPBAPI,
 			"Failed to send SPB request %p for "
 			"IOCTL_SPB_EXECUTE_SEQUENCE - %!STATUS!",
-			pDevice->SpbRequest,
+			pForward->SpbRequest,
 			status);
 
 		goto Done;
@@ -1283,73 +2449,54 @@ None
 
 Done:
 
-	FuncExit(TRACE_FLAG_SPBAPI);
+	if (!NT_SUCCESS(status))
+	{
+		SpbPeripheralCompleteRequestPair(
+			pDevice,
+			pForward,
+			status,
+			0);
+	}
 
-	return status;
+	FuncExit(TRACE_FLAG_SPBAPI);
 }
 
+static
 VOID
-SpbPeripheralSequence(
+SpbPeripheralPairDone(
 	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest,
-	_In_  ULONG             TransferCount
+	_In_  PPBC_FORWARD      pForward,
+	_In_  LONG              Flags
 )
 /*++
 
-Routine Description:
+  Routine Description:
 
-This routine sends a sequence of 2 transfers to the SPB controller.
+    This routine sets FORWARD_STATE_* bits of a pair, and completes
+    the pair if they were the last ones it was waiting for.
 
-Arguments:
+  Arguments:
 
-pDevice - a pointer to the device context
-spbRequest - the framework request object
-TransferCount - the transfer count
+    pDevice - a pointer to the device context
+    pForward - the forward request carrying the client request
+    Flags - the FORWARD_STATE_* bits to set
 
-Return Value:
+  Return Value:
 
-None
+    None
 
 --*/
 {
-	FuncEntry(TRACE_FLAG_SPBAPI);
-
-	NTSTATUS status = STATUS_NOT_SUPPORTED;
-
-	switch (TransferCount)
-	{
-	case 1:
-		status = SpbPeripheralSequence1(pDevice, spbRequest);
-		break;
-	case 2:
-		status = SpbPeripheralSequence2(pDevice, spbRequest);
-		break;
-	}
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
-			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
-			pDevice->SpbRequest,
-			status);
-
-		goto Done;
-	}
-
-Done:
-
-	if (!NT_SUCCESS(status))
+	if (!SpbForwardStateDone(&pForward->State, Flags))
 	{
-		SpbPeripheralCompleteRequestPair(
-			pDevice,
-			status,
-			0);
+		return;
 	}
 
-	FuncExit(TRACE_FLAG_SPBAPI);
+	SpbPeripheralCompleteRequestPair(
+		pDevice,
+		pForward,
+		pForward->Status,
+		pForward->Information);
 }
 
 NTSTATUS
@@ -1372,13 +2519,17 @@ SpbPeripheralSendRequest(
 
   Return Value:
 
-    Status
+    Status. On failure the caller completes the request pair,
+    except for STATUS_PENDING, returned when the send failed
+    but the cancel routine of the client request still has to
+    run, the pair is then completed once it has.
 
 --*/
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
     
     PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    PPBC_FORWARD pForward = pRequest->pForward;
     NTSTATUS status = STATUS_SUCCESS;
 
     Trace(
@@ -1394,6 +2545,7 @@ SpbPeripheralSendRequest(
     //
 
     pRequest->FxDevice = pDevice->FxDevice;
+    pRequest->SendTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
 
     //
     // Mark the client request as cancellable.
@@ -1415,14 +2567,28 @@ SpbPeripheralSendRequest(
         WdfRequestSetCompletionRoutine(
             SpbRequest,
             SpbPeripheralOnCompletion,
-            GetRequestContext(SpbRequest));
+            pForward);
 
         BOOLEAN fSent = WdfRequestSend(
             SpbRequest,
-            pDevice->TrueSpbController,
+            pForward->IoTarget,
             WDF_NO_SEND_OPTIONS);
 
-        if (!fSent)
+        if (fSent)
+        {
+            //
+            // A cancel routine which ran before the request was
+            // sent left it to the sender to cancel it.
+            //
+
+            if (SpbForwardStateSent(&pForward->State))
+            {
+                WdfRequestCancelSentRequest(SpbRequest);
+            }
+
+            SpbPeripheralPairDone(pDevice, pForward, FORWARD_STATE_SEND_DONE);
+        }
+        else
         {
             status = WdfRequestGetStatus(SpbRequest);
 
@@ -1448,6 +2614,21 @@ SpbPeripheralSendRequest(
                     "%!STATUS!",
                     ClientRequest,
                     cancelStatus);
+
+                //
+                // The cancel routine still owns the pair, it is
+                // completed once it is done with it.
+                //
+
+                pForward->Status = status;
+                pForward->Information = 0;
+
+                SpbPeripheralPairDone(
+                    pDevice,
+                    pForward,
+                    FORWARD_STATE_SEND_DONE | FORWARD_STATE_COMPLETING);
+
+                status = STATUS_PENDING;
             }
         }
     }
@@ -1475,7 +2656,7 @@ SpbPeripheralOnCompletion(
     spbRequest - the framework request object
     FxTarget - the framework IO target object
     Params - a pointer to the request completion parameters
-    Context - the request context
+    Context - the forward request carrying the client request
 
   Return Value:
 
@@ -1486,8 +2667,8 @@ SpbPeripheralOnCompletion(
     FuncEntry(TRACE_FLAG_SPBAPI);
     
     UNREFERENCED_PARAMETER(FxTarget);
-    UNREFERENCED_PARAMETER(Context);
     
+    PPBC_FORWARD pForward = (PPBC_FORWARD)Context;
     PPBC_REQUEST pRequest;
     PPBC_DEVICE pDevice;
     NTSTATUS status;
@@ -1499,6 +2680,9 @@ SpbPeripheralOnCompletion(
 
     status = Params->IoStatus.Status;
 
+    GetRequestContext(pForward->ClientRequest)->ControllerTimestamp =
+        KeQueryPerformanceCounter(NULL).QuadPart;
+
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
@@ -1589,10 +2773,30 @@ SpbPeripheralOnCompletion(
 	//}
 
     //
-    // Unmark the client request as cancellable
+    // Keep the completion of the client request, the pair may
+    // still be waiting for the sender or the cancel routine.
+    //
+
+    bytesCompleted = Params->IoStatus.Information;
+
+    //
+    // The bytes of a held write belong to the held request,
+    // completed with the request carrying it.
+    //
+
+    bytesCompleted -= min(
+        bytesCompleted,
+        (ULONG_PTR)GetRequestContext(pForward->ClientRequest)->HeldLength);
+
+    pForward->Status = status;
+    pForward->Information = bytesCompleted;
+
+    //
+    // Unmark the client request as cancellable, its cancel
+    // routine will not run anymore if this succeeds.
     //
 
-    cancelStatus = WdfRequestUnmarkCancelable(pDevice->ClientRequest);
+    cancelStatus = WdfRequestUnmarkCancelable(pForward->ClientRequest);
 
     if (!NT_SUCCESS(cancelStatus))
     {
@@ -1603,20 +2807,19 @@ SpbPeripheralOnCompletion(
             TRACE_LEVEL_INFORMATION, 
             TRACE_FLAG_SPBAPI, 
             "Client request %p has already been cancelled - %!STATUS!",
-            pDevice->ClientRequest,
+            pForward->ClientRequest,
             cancelStatus);
     }
 
     //
-    // Complete the request pair
+    // Complete the request pair if nobody else holds it.
     //
 
-    bytesCompleted = Params->IoStatus.Information;
-
-    SpbPeripheralCompleteRequestPair(
+    SpbPeripheralPairDone(
         pDevice,
-        status,
-        bytesCompleted);
+        pForward,
+        FORWARD_STATE_COMPLETING |
+            (NT_SUCCESS(cancelStatus) ? FORWARD_STATE_CANCEL_DONE : 0));
     
     FuncExit(TRACE_FLAG_SPBAPI);
 }
@@ -1643,13 +2846,15 @@ Return Value:
     FuncEntry(TRACE_FLAG_SPBAPI);
 
     PPBC_REQUEST pRequest;
-    PPBC_DEVICE pDevice;
+    PPBC_FORWARD pForward;
 
     pRequest = GetRequestContext(spbRequest);
-    pDevice = GetDeviceContext(pRequest->FxDevice);
+    pForward = pRequest->pForward;
 
     //
-    // Attempt to cancel the SPB request
+    // Attempt to cancel the SPB request. The forward request
+    // is not reused before FORWARD_STATE_CANCEL_DONE is set,
+    // and a request not sent yet is cancelled by the sender.
     //
     
     Trace(
@@ -1658,28 +2863,78 @@ Return Value:
         "Cancel received for client request %p, "
         "attempting to cancel SPB request %p",
         spbRequest,
-        pDevice->SpbRequest);
+        pForward->SpbRequest);
+
+    if (SpbForwardStateCancelled(&pForward->State))
+    {
+        WdfRequestCancelSentRequest(pForward->SpbRequest);
+    }
 
-    WdfRequestCancelSentRequest(pDevice->SpbRequest);
+    SpbPeripheralPairDone(
+        GetDeviceContext(pRequest->FxDevice),
+        pForward,
+        FORWARD_STATE_CANCEL_DONE);
 
     FuncExit(TRACE_FLAG_SPBAPI);
 }
 
+//
+// Completes the write held in a lock window and carried by a
+// client request, with the status of the request.
+//
+
+static
+VOID
+SpbPeripheralCompleteHeld(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        clientRequest,
+	_In_  NTSTATUS          status
+)
+{
+	PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+	SPBREQUEST heldRequest = pRequest->HeldRequest;
+	ULONG_PTR bytesCompleted;
+	BOOLEAN drain;
+
+	if (heldRequest == NULL)
+	{
+		return;
+	}
+
+	pRequest->HeldRequest = NULL;
+	bytesCompleted = NT_SUCCESS(status) ? pRequest->HeldLength : 0;
+
+	drain = SpbPeripheralTraceCompletion(
+		pDevice,
+		heldRequest,
+		status,
+		bytesCompleted);
+
+	WdfRequestCompleteWithInformation(heldRequest, status, bytesCompleted);
+
+	if (drain)
+	{
+		SpbCaptureScheduleDrain(pDevice);
+	}
+}
+
 VOID
 SpbPeripheralCompleteRequestPair(
     _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_FORWARD     pForward,
     _In_  NTSTATUS         status,
     _In_  ULONG_PTR        bytesCompleted
     )
 /*++
 Routine Description:
 
-    This routine marks the SpbRequest as reuse
-    and completes the client request.
+    This routine marks the SpbRequest as reuse, completes
+    the client request and releases the forward request.
 
 Arguments:
 
     pDevice - the device context
+    pForward - the forward request carrying the client request
     status - the client completion status
     bytesCompleted - the number of bytes completed
         for the client request
@@ -1692,16 +2947,15 @@ Return Value:
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-    PPBC_REQUEST pRequest;
-    pRequest = GetRequestContext(pDevice->SpbRequest);
+    BOOLEAN drain;
 
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Marking SPB request %p for reuse, and completing "
         "client request %p with %!STATUS! and bytes=%lu",
-        pDevice->SpbRequest,
-        pDevice->ClientRequest,
+        pForward->SpbRequest,
+        pForward->ClientRequest,
         status,
         (ULONG)bytesCompleted);
 
@@ -1715,27 +2969,48 @@ Return Value:
         WDF_REQUEST_REUSE_NO_FLAGS,
         STATUS_SUCCESS);
 
-    WdfRequestReuse(pDevice->SpbRequest, &params);
-
-    if (pDevice->InputMemory != WDF_NO_HANDLE)
-    {
-        WdfObjectDelete(pDevice->InputMemory);
-        pDevice->InputMemory = WDF_NO_HANDLE;
-    }
+    WdfRequestReuse(pForward->SpbRequest, &params);
 
     //
     // Complete the client request
     //
 
-    if (pDevice->ClientRequest != nullptr)
+    if (pForward->ClientRequest != nullptr)
     {
-        SPBREQUEST clientRequest = pDevice->ClientRequest;
-        pDevice->ClientRequest = nullptr;
+        SPBREQUEST clientRequest = pForward->ClientRequest;
+        pForward->ClientRequest = nullptr;
+
+		PPBC_REQUEST pRequest = GetRequestContext(clientRequest);
+
+		//
+		// The lock window of the target starts once the
+		// controller lock is taken.
+		//
+
+		if ((pRequest->Kind == SPB_PROBE_KIND_LOCK) &&
+			NT_SUCCESS(status) &&
+			(pRequest->pTarget->HeldTimer != WDF_NO_HANDLE))
+		{
+			WdfSpinLockAcquire(pDevice->ForwardLock);
+			pRequest->pTarget->LockHeld = TRUE;
+			WdfSpinLockRelease(pDevice->ForwardLock);
+		}
+
+		SpbPeripheralCompleteHeld(pDevice, clientRequest, status);
+
+		//
+		// Only snapshot the transfers here, the records are
+		// emitted once the client request is completed.
+		//
 
-		SpbTraceBuffers(pDevice, clientRequest);
+		drain = SpbPeripheralTraceCompletion(
+			pDevice,
+			clientRequest,
+			status,
+			bytesCompleted);
 
         // In order to satisfy SDV, assume clientRequest
-        // is equal to pDevice->ClientRequest. This suppresses
+        // is equal to pForward->ClientRequest. This suppresses
         // a warning in the driver's cancellation path. 
         //
         // Typically when WdfRequestUnmarkCancelable returns 
@@ -1747,13 +3022,106 @@ Return Value:
         // cautious when copying code from this sample, paying 
         // close attention to the cancellation logic.
         //
-        _Analysis_assume_(clientRequest == pDevice->ClientRequest);
+        _Analysis_assume_(clientRequest == pForward->ClientRequest);
+
+        SpbPeripheralResumeIdle(pDevice, clientRequest);
         
         WdfRequestCompleteWithInformation(
             clientRequest,
             status,
             bytesCompleted);
+
+        if (drain)
+        {
+            SpbCaptureScheduleDrain(pDevice);
+        }
     }
 
+    //
+    // Hand the forward request to the next pending
+    // client request, if any.
+    //
+
+    SpbPeripheralReleaseForward(pDevice, pForward);
+
     FuncExit(TRACE_FLAG_SPBAPI);
 }
+
+VOID
+SpbPeripheralFailRequest(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        spbRequest,
+	_In_  NTSTATUS          status
+)
+/*++
+
+  Routine Description:
+
+    This routine completes a client request which was never
+    sent to the SPB controller.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the client request
+    status - the client completion status
+
+  Return Value:
+
+    None
+
+--*/
+{
+	BOOLEAN drain;
+
+	SpbPeripheralCompleteHeld(pDevice, spbRequest, status);
+
+	drain = SpbPeripheralTraceCompletion(pDevice, spbRequest, status, 0);
+
+	SpbPeripheralResumeIdle(pDevice, spbRequest);
+
+	SpbRequestComplete(spbRequest, status);
+
+	if (drain)
+	{
+		SpbCaptureScheduleDrain(pDevice);
+	}
+}
+
+VOID
+SpbPeripheralOnPendingCanceled(
+	_In_  WDFQUEUE          FxQueue,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This event is called when a client request is cancelled
+    while it waits for a forward request.
+
+  Arguments:
+
+    FxQueue - the pending queue
+    FxRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBAPI);
+
+	PPBC_DEVICE pDevice = GetDeviceContext(WdfIoQueueGetDevice(FxQueue));
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_SPBAPI,
+		"Pending client request %p cancelled",
+		FxRequest);
+
+	SpbPeripheralFailRequest(pDevice, (SPBREQUEST)FxRequest, STATUS_CANCELLED);
+
+	FuncExit(TRACE_FLAG_SPBAPI);
+}
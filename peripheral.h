@@ -27,13 +27,35 @@ EVT_WDF_REQUEST_CANCEL             SpbPeripheralOnCancel;
 
 EVT_WDF_REQUEST_CANCEL             SpbPeripheralOnWaitOnInterruptCancel;
 
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE SpbPeripheralOnPendingCanceled;
+
+EVT_WDF_TIMER                      SpbPeripheralOnHeldTimer;
+
 NTSTATUS
 SpbPeripheralOpen(
-    _In_  PPBC_DEVICE  pDevice);
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_CONNECTION   pConnection);
 
 NTSTATUS
 SpbPeripheralClose(
-    _In_  PPBC_DEVICE  pDevice);
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_CONNECTION   pConnection);
+
+NTSTATUS
+SpbPeripheralInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+SpbPeripheralDispatch(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest);
+
+VOID
+SpbPeripheralFailRequest(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        spbRequest,
+    _In_  NTSTATUS          status);
 
 VOID
 SpbPeripheralLock(
@@ -78,25 +100,20 @@ SpbPeripheralSequence(
 	_In_  SPBREQUEST        spbRequest,
 	_In_  ULONG             TransferCount);
 
-NTSTATUS
-SpbPeripheralSequence1(
-	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest);
-
-NTSTATUS
-SpbPeripheralSequence2(
-	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest);
-
 NTSTATUS
 SpbPeripheralSendRequest(
     _In_  PPBC_DEVICE       pDevice,
     _In_  WDFREQUEST        SpbRequest,
     _In_  WDFREQUEST        ClientRequest);
 
+PFN_PBC_TRACE_COMPLETION
+SpbPeripheralGetTraceCompletion(
+	_In_  ULONG             Mode);
+
 VOID
 SpbPeripheralCompleteRequestPair(
     _In_  PPBC_DEVICE        pDevice,
+    _In_  PPBC_FORWARD       pForward,
     _In_  NTSTATUS          status,
     _In_  ULONG_PTR         bytesCompleted);
 
@@ -177,4 +194,317 @@ otherwise STATUS_SUCCESS
 	return status;
 }
 
+//
+// MDL span iterator. Walks a transfer's MDL chain front to back,
+// mapping each MDL only once and handing out contiguous spans of
+// its buffer, so that dumping a transfer costs O(length) instead
+// of one chain walk per byte.
+//
+
+typedef struct MDL_SPAN_ITERATOR
+{
+	// MDL holding the current position, NULL once exhausted.
+	PMDL                          Mdl;
+
+	// Offset of the current position within Mdl.
+	size_t                        MdlOffset;
+
+	// Bytes left before the end of the transfer.
+	size_t                        Remaining;
+
+	// System address of Mdl, NULL until it has been mapped.
+	PUCHAR                        pMapping;
+
+	// Current position in the copy of the transfer the iterator
+	// walks instead of the MDL chain, NULL for an MDL chain.
+	PUCHAR                        pInline;
+}
+MDL_SPAN_ITERATOR, *PMDL_SPAN_ITERATOR;
+
+VOID
+FORCEINLINE
+MdlSpanIteratorInit(
+	_Out_ PMDL_SPAN_ITERATOR  pIterator,
+	_In_  PMDL                mdl,
+	_In_  size_t              mdlLength
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to position a span iterator
+at the start of a transfer descriptor buffer.
+
+Arguments:
+
+pIterator - a pointer to the iterator to initialize
+
+mdl - the first MDL of the transfer
+
+mdlLength - the transfer length
+
+Return Value:
+
+None
+
+--*/
+{
+	pIterator->Mdl = mdl;
+	pIterator->MdlOffset = 0;
+	pIterator->Remaining = mdlLength;
+	pIterator->pMapping = NULL;
+	pIterator->pInline = NULL;
+}
+
+VOID
+FORCEINLINE
+MdlSpanIteratorInitInline(
+	_Out_ PMDL_SPAN_ITERATOR  pIterator,
+	_In_  PUCHAR              pBuffer,
+	_In_  size_t              length
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to position a span iterator
+at the start of a copy of a transfer, which is then handed
+out as a single span.
+
+Arguments:
+
+pIterator - a pointer to the iterator to initialize
+
+pBuffer - the copy of the transfer
+
+length - the transfer length
+
+Return Value:
+
+None
+
+--*/
+{
+	pIterator->Mdl = NULL;
+	pIterator->MdlOffset = 0;
+	pIterator->Remaining = length;
+	pIterator->pMapping = NULL;
+	pIterator->pInline = pBuffer;
+}
+
+NTSTATUS
+FORCEINLINE
+MdlSpanIteratorNext(
+	_Inout_ PMDL_SPAN_ITERATOR  pIterator,
+	_In_    size_t              MaxLength,
+	_Out_   PUCHAR*             ppSpan,
+	_Out_   size_t*             pSpanLength
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to retrieve the next contiguous
+span of the transfer descriptor buffer and advance past it.
+
+Arguments:
+
+pIterator - a pointer to the span iterator
+
+MaxLength - the maximum number of bytes to return
+
+ppSpan - pointer to the location for the span address
+
+pSpanLength - pointer to the location for the span length
+
+Return Value:
+
+STATUS_NO_MORE_ENTRIES at the end of the transfer,
+STATUS_INSUFFICIENT_RESOURCES if an MDL cannot be mapped,
+otherwise STATUS_SUCCESS
+
+--*/
+{
+	size_t mdlByteCount;
+	size_t spanLength;
+
+	*ppSpan = NULL;
+	*pSpanLength = 0;
+
+	if (pIterator->pInline != NULL)
+	{
+		if (pIterator->Remaining == 0)
+		{
+			return STATUS_NO_MORE_ENTRIES;
+		}
+
+		spanLength = min(pIterator->Remaining, MaxLength);
+
+		*ppSpan = pIterator->pInline;
+		*pSpanLength = spanLength;
+
+		pIterator->pInline += spanLength;
+		pIterator->Remaining -= spanLength;
+
+		return STATUS_SUCCESS;
+	}
+
+	while (pIterator->Remaining != 0 && pIterator->Mdl != NULL)
+	{
+		mdlByteCount = MmGetMdlByteCount(pIterator->Mdl);
+
+		if (pIterator->MdlOffset >= mdlByteCount)
+		{
+			//
+			// Current MDL consumed, move to the next one.
+			//
+
+			pIterator->Mdl = pIterator->Mdl->Next;
+			pIterator->MdlOffset = 0;
+			pIterator->pMapping = NULL;
+			continue;
+		}
+
+		if (pIterator->pMapping == NULL)
+		{
+			pIterator->pMapping = (PUCHAR)MmGetSystemAddressForMdlSafe(
+				pIterator->Mdl,
+				NormalPagePriority | MdlMappingNoExecute);
+
+			if (pIterator->pMapping == NULL)
+			{
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+
+		spanLength = min(mdlByteCount - pIterator->MdlOffset, pIterator->Remaining);
+		spanLength = min(spanLength, MaxLength);
+
+		*ppSpan = pIterator->pMapping + pIterator->MdlOffset;
+		*pSpanLength = spanLength;
+
+		pIterator->MdlOffset += spanLength;
+		pIterator->Remaining -= spanLength;
+
+		return STATUS_SUCCESS;
+	}
+
+	return STATUS_NO_MORE_ENTRIES;
+}
+
+VOID
+FORCEINLINE
+MdlSpanSkip(
+	_Inout_ PMDL_SPAN_ITERATOR  pIterator,
+	_In_    size_t              Length
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to advance a span iterator
+without mapping the bytes skipped.
+
+Arguments:
+
+pIterator - a pointer to the span iterator
+
+Length - the number of bytes to skip
+
+Return Value:
+
+None
+
+--*/
+{
+	size_t mdlByteCount;
+	size_t skipLength;
+
+	Length = min(Length, pIterator->Remaining);
+
+	if (pIterator->pInline != NULL)
+	{
+		pIterator->pInline += Length;
+		pIterator->Remaining -= Length;
+		return;
+	}
+
+	while (Length != 0 && pIterator->Mdl != NULL)
+	{
+		mdlByteCount = MmGetMdlByteCount(pIterator->Mdl);
+
+		if (pIterator->MdlOffset >= mdlByteCount)
+		{
+			pIterator->Mdl = pIterator->Mdl->Next;
+			pIterator->MdlOffset = 0;
+			pIterator->pMapping = NULL;
+			continue;
+		}
+
+		skipLength = min(mdlByteCount - pIterator->MdlOffset, Length);
+
+		pIterator->MdlOffset += skipLength;
+		pIterator->Remaining -= skipLength;
+		Length -= skipLength;
+	}
+}
+
+NTSTATUS
+FORCEINLINE
+MdlSpanCopy(
+	_Inout_ PMDL_SPAN_ITERATOR        pIterator,
+	_Out_writes_bytes_to_(Length, *pCopied) PUCHAR pBuffer,
+	_In_    size_t                    Length,
+	_Out_   size_t*                   pCopied
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to bulk copy the next bytes of
+the transfer descriptor buffer, one contiguous span at a time.
+
+Arguments:
+
+pIterator - a pointer to the span iterator
+
+pBuffer - the destination buffer
+
+Length - the number of bytes to copy
+
+pCopied - pointer to the location for the number of bytes copied
+
+Return Value:
+
+STATUS_SUCCESS if Length bytes were copied, otherwise the
+status of the span which stopped the copy
+
+--*/
+{
+	PUCHAR pSpan;
+	size_t spanLength;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	*pCopied = 0;
+
+	while (*pCopied < Length)
+	{
+		status = MdlSpanIteratorNext(
+			pIterator,
+			Length - *pCopied,
+			&pSpan,
+			&spanLength);
+
+		if (!NT_SUCCESS(status))
+		{
+			break;
+		}
+
+		RtlCopyMemory(pBuffer + *pCopied, pSpan, spanLength);
+		*pCopied += spanLength;
+	}
+
+	return status;
+}
+
 #endif // _PERIPHERAL_H_
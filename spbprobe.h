@@ -0,0 +1,1629 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    spbprobe.h
+
+Abstract:
+
+    This module contains the definitions shared between the
+    probe driver and the tools decoding its output.
+
+Environment:
+
+    kernel-mode and user-mode
+
+Revision History:
+
+--*/
+
+#ifndef _SPBPROBE_H_
+#define _SPBPROBE_H_
+
+/////////////////////////////////////////////////
+//
+// Transfer records.
+//
+/////////////////////////////////////////////////
+
+//
+// Every transfer of a completed client request is emitted as one
+// binary record (a header followed by the raw payload) instead of
+// one formatted text line per 16 bytes. Transfers larger than
+// SPB_PROBE_RECORD_MAX_PAYLOAD are split into several records,
+// Offset giving the position of the payload within the transfer.
+//
+
+#define SPB_PROBE_RECORD_VERSION        2
+#define SPB_PROBE_RECORD_MAX_PAYLOAD    1024
+
+#define SPB_PROBE_RECORD_TYPE_PADDING   0
+#define SPB_PROBE_RECORD_TYPE_TRANSFER  1
+#define SPB_PROBE_RECORD_TYPE_REPEAT    2
+#define SPB_PROBE_RECORD_TYPE_TRIGGER   3
+
+#define SPB_PROBE_DIRECTION_READ        0
+#define SPB_PROBE_DIRECTION_WRITE       1
+
+typedef struct SPB_PROBE_RECORD
+{
+    // Size of the record, payload included.
+    ULONG                          Size;
+
+    // SPB_PROBE_RECORD_VERSION
+    UCHAR                          Version;
+
+    // SPB_PROBE_RECORD_TYPE_*
+    UCHAR                          Type;
+
+    // SPB_PROBE_DIRECTION_*
+    UCHAR                          Direction;
+
+    // Index of the transfer within the client request.
+    UCHAR                          TransferIndex;
+
+    // Connection ID of the probed peripheral.
+    LONGLONG                       PeripheralId;
+
+    // Performance counter value at completion of the client request.
+    LONGLONG                       Timestamp;
+
+    // Completion status (NTSTATUS) of the client request.
+    LONG                           Status;
+
+    // Length of the whole transfer.
+    ULONG                          TransferLength;
+
+    // Offset of the payload within the transfer.
+    ULONG                          Offset;
+
+    // Estimated time on the wire of the whole transfer, in
+    // nanoseconds, 0 if unknown. See SpbProbeBusWireTime.
+    ULONG                          WireTime;
+
+    // Performance counter values when the client request reached
+    // the probe, was forwarded to the controller and was completed
+    // by the controller, 0 for stages it did not go through.
+    LONGLONG                       ArrivalTimestamp;
+    LONGLONG                       SendTimestamp;
+    LONGLONG                       ControllerTimestamp;
+
+    // Followed by Size - sizeof(SPB_PROBE_RECORD) payload bytes.
+}
+SPB_PROBE_RECORD, *PSPB_PROBE_RECORD;
+
+C_ASSERT(sizeof(SPB_PROBE_RECORD) == 64);
+
+//
+// A client request identical to the previous one of the same device
+// (same transfers, lengths, payload bytes and status) is not
+// recorded again. Once a different request completes, an
+// SPB_PROBE_RECORD_TYPE_REPEAT record reports how many times the
+// previous one was repeated. Its Timestamp is the completion of the
+// first repeat and its payload is an SPB_PROBE_REPEAT.
+//
+
+typedef struct SPB_PROBE_REPEAT
+{
+    // Number of repeats.
+    ULONG                          Count;
+
+    ULONG                          Reserved;
+
+    // Performance counter value at completion of the last repeat.
+    LONGLONG                       LastTimestamp;
+}
+SPB_PROBE_REPEAT, *PSPB_PROBE_REPEAT;
+
+//
+// In trigger mode, an SPB_PROBE_RECORD_TYPE_TRIGGER record marks
+// the completion of the request which fired the trigger. Its
+// payload is an SPB_PROBE_TRIGGER.
+//
+
+typedef struct SPB_PROBE_TRIGGER
+{
+    // SPB_PROBE_TRIGGER_* conditions met.
+    ULONG                          Reason;
+
+    ULONG                          Reserved;
+}
+SPB_PROBE_TRIGGER, *PSPB_PROBE_TRIGGER;
+
+/////////////////////////////////////////////////
+//
+// Capture settings.
+//
+/////////////////////////////////////////////////
+
+//
+// Capture mode, read from the CaptureMode value of the device key.
+// Every mode does what the ones before it do.
+//
+
+// Requests are only forwarded, and counted in flight.
+#define SPB_PROBE_MODE_NONE             0
+
+// Request counters, latency histograms and bus occupancy.
+#define SPB_PROBE_MODE_COUNTERS         1
+
+// One record without payload per captured transfer.
+#define SPB_PROBE_MODE_SUMMARY          2
+
+// Records with the payload allowed by the truncation policy.
+#define SPB_PROBE_MODE_FULL             3
+
+//
+// Truncation policy applied to the payload of every transfer,
+// read from the CaptureTruncation value of the device key.
+// TransferLength always holds the length of the whole transfer,
+// the records only cover the captured part of the payload. The
+// number of bytes kept (N) comes from the CaptureLength value.
+//
+
+// Whole payload.
+#define SPB_PROBE_TRUNCATE_FULL         0
+
+// First N bytes.
+#define SPB_PROBE_TRUNCATE_FIRST        1
+
+// First and last N bytes, whole payload up to 2 * N bytes.
+#define SPB_PROBE_TRUNCATE_HEAD_TAIL    2
+
+// No payload, only the transfer length.
+#define SPB_PROBE_TRUNCATE_LENGTH_ONLY  3
+
+//
+// Trigger mode, enabled by setting the CaptureTrigger value to a
+// combination of the conditions below. Requests are kept in a
+// history holding the last CapturePreTrigger of them, and nothing
+// is emitted until a request meets one of the conditions. The
+// history is then emitted, followed by the next CapturePostTrigger
+// requests.
+//
+
+// The request failed.
+#define SPB_PROBE_TRIGGER_STATUS        0x1
+
+// A transfer matched the CaptureTriggerFilter program.
+#define SPB_PROBE_TRIGGER_PATTERN       0x2
+
+// The request took more than CaptureTriggerLatency microseconds
+// to complete once forwarded to the controller.
+#define SPB_PROBE_TRIGGER_LATENCY       0x4
+
+#define SPB_PROBE_TRIGGER_ALL           0x7
+
+/////////////////////////////////////////////////
+//
+// Capture filter.
+//
+/////////////////////////////////////////////////
+
+//
+// A filter is a small program, in the spirit of classic BPF, run
+// against every transfer of a completed request before anything is
+// copied. It is read from the CaptureFilter binary value of the
+// device key as an array of SPB_PROBE_FILTER_INSN. Only transfers
+// for which it returns nonzero are captured.
+//
+// The program works on a single 32-bit accumulator. Jumps are
+// forward only and the last instruction must be a return, so that
+// a validated program always terminates.
+//
+
+#define SPB_PROBE_FILTER_MAX_INSNS      32
+
+// Largest payload offset a program can load.
+#define SPB_PROBE_FILTER_MAX_BYTES      16
+
+// A = field K (SPB_PROBE_FILTER_FIELD_*)
+#define SPB_PROBE_FILTER_LD_FIELD       0x01
+
+// A = payload byte K, the transfer is rejected past its end.
+#define SPB_PROBE_FILTER_LD_BYTE        0x02
+
+// A &= K
+#define SPB_PROBE_FILTER_AND            0x03
+
+// Skip JumpTrue instructions if the condition holds,
+// JumpFalse otherwise.
+#define SPB_PROBE_FILTER_JEQ            0x10  // A == K
+#define SPB_PROBE_FILTER_JGT            0x11  // A > K
+#define SPB_PROBE_FILTER_JGE            0x12  // A >= K
+#define SPB_PROBE_FILTER_JSET           0x13  // (A & K) != 0
+
+// Return K.
+#define SPB_PROBE_FILTER_RET            0x20
+
+// SPB_PROBE_DIRECTION_*
+#define SPB_PROBE_FILTER_FIELD_DIRECTION  0
+
+// Length of the transfer.
+#define SPB_PROBE_FILTER_FIELD_LENGTH     1
+
+// Completion status of the request.
+#define SPB_PROBE_FILTER_FIELD_STATUS     2
+
+// Index of the transfer within the request.
+#define SPB_PROBE_FILTER_FIELD_INDEX      3
+
+#define SPB_PROBE_FILTER_FIELD_COUNT      4
+
+typedef struct SPB_PROBE_FILTER_INSN
+{
+    // SPB_PROBE_FILTER_*
+    UCHAR                          Code;
+
+    // Instructions skipped by conditional jumps.
+    UCHAR                          JumpTrue;
+    UCHAR                          JumpFalse;
+
+    UCHAR                          Reserved;
+
+    ULONG                          K;
+}
+SPB_PROBE_FILTER_INSN, *PSPB_PROBE_FILTER_INSN;
+
+C_ASSERT(sizeof(SPB_PROBE_FILTER_INSN) == 8);
+
+typedef struct SPB_PROBE_FILTER_INPUT
+{
+    // SPB_PROBE_FILTER_FIELD_* values.
+    ULONG                          Fields[SPB_PROBE_FILTER_FIELD_COUNT];
+
+    // First payload bytes, ByteCount of them.
+    ULONG                          ByteCount;
+    UCHAR                          Bytes[SPB_PROBE_FILTER_MAX_BYTES];
+}
+SPB_PROBE_FILTER_INPUT, *PSPB_PROBE_FILTER_INPUT;
+
+FORCEINLINE
+BOOLEAN
+SpbProbeFilterValidate(
+    _In_reads_(Count) const SPB_PROBE_FILTER_INSN*  pProgram,
+    _In_  ULONG                                     Count,
+    _Out_ ULONG*                                    pBytesNeeded
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks that a program only uses known
+    instructions and jumps within itself.
+
+  Arguments:
+
+    pProgram - the instructions
+    Count - the number of instructions
+    pBytesNeeded - receives the number of payload
+        bytes the program may load
+
+  Return Value:
+
+    TRUE if the program can be run
+
+--*/
+{
+    *pBytesNeeded = 0;
+
+    if (Count == 0 ||
+        Count > SPB_PROBE_FILTER_MAX_INSNS ||
+        pProgram[Count - 1].Code != SPB_PROBE_FILTER_RET)
+    {
+        return FALSE;
+    }
+
+    for (ULONG pc = 0; pc < Count; pc++)
+    {
+        const SPB_PROBE_FILTER_INSN* pInsn = &pProgram[pc];
+
+        switch (pInsn->Code)
+        {
+        case SPB_PROBE_FILTER_LD_FIELD:
+            if (pInsn->K >= SPB_PROBE_FILTER_FIELD_COUNT)
+            {
+                return FALSE;
+            }
+            break;
+
+        case SPB_PROBE_FILTER_LD_BYTE:
+            if (pInsn->K >= SPB_PROBE_FILTER_MAX_BYTES)
+            {
+                return FALSE;
+            }
+
+            if (pInsn->K + 1 > *pBytesNeeded)
+            {
+                *pBytesNeeded = pInsn->K + 1;
+            }
+            break;
+
+        case SPB_PROBE_FILTER_AND:
+        case SPB_PROBE_FILTER_RET:
+            break;
+
+        case SPB_PROBE_FILTER_JEQ:
+        case SPB_PROBE_FILTER_JGT:
+        case SPB_PROBE_FILTER_JGE:
+        case SPB_PROBE_FILTER_JSET:
+            if (pc + 1 + pInsn->JumpTrue >= Count ||
+                pc + 1 + pInsn->JumpFalse >= Count)
+            {
+                return FALSE;
+            }
+            break;
+
+        default:
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+FORCEINLINE
+ULONG
+SpbProbeFilterRun(
+    _In_reads_(Count) const SPB_PROBE_FILTER_INSN*  pProgram,
+    _In_  ULONG                                     Count,
+    _In_  const SPB_PROBE_FILTER_INPUT*             pInput
+    )
+/*++
+
+  Routine Description:
+
+    This routine runs a program validated by
+    SpbProbeFilterValidate against a transfer.
+
+  Arguments:
+
+    pProgram - the instructions
+    Count - the number of instructions
+    pInput - the transfer
+
+  Return Value:
+
+    The value returned by the program, 0 to reject the transfer
+
+--*/
+{
+    ULONG a = 0;
+    ULONG pc = 0;
+
+    while (pc < Count)
+    {
+        const SPB_PROBE_FILTER_INSN* pInsn = &pProgram[pc++];
+        BOOLEAN condition;
+
+        switch (pInsn->Code)
+        {
+        case SPB_PROBE_FILTER_LD_FIELD:
+            a = pInput->Fields[pInsn->K];
+            continue;
+
+        case SPB_PROBE_FILTER_LD_BYTE:
+            if (pInsn->K >= pInput->ByteCount)
+            {
+                return 0;
+            }
+            a = pInput->Bytes[pInsn->K];
+            continue;
+
+        case SPB_PROBE_FILTER_AND:
+            a &= pInsn->K;
+            continue;
+
+        case SPB_PROBE_FILTER_JEQ:
+            condition = (a == pInsn->K);
+            break;
+
+        case SPB_PROBE_FILTER_JGT:
+            condition = (a > pInsn->K);
+            break;
+
+        case SPB_PROBE_FILTER_JGE:
+            condition = (a >= pInsn->K);
+            break;
+
+        case SPB_PROBE_FILTER_JSET:
+            condition = ((a & pInsn->K) != 0);
+            break;
+
+        default:
+            return pInsn->K;
+        }
+
+        pc += condition ? pInsn->JumpTrue : pInsn->JumpFalse;
+    }
+
+    return 0;
+}
+
+//
+// Builder for the common case of a conjunction of comparisons:
+//
+//   SPB_PROBE_FILTER_BUILDER builder;
+//
+//   SpbProbeFilterBuilderInit(&builder);
+//   SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_DIRECTION,
+//       MAXULONG, SPB_PROBE_FILTER_EQ, SPB_PROBE_DIRECTION_WRITE);
+//   SpbProbeFilterBuilderAddByte(&builder, 0, 0xff, SPB_PROBE_FILTER_EQ, 0x20);
+//   count = SpbProbeFilterBuilderFinish(&builder);
+//
+// builds "only writes whose first byte is 0x20" in builder.Program.
+//
+
+#define SPB_PROBE_FILTER_EQ             0
+#define SPB_PROBE_FILTER_NE             1
+#define SPB_PROBE_FILTER_GT             2
+#define SPB_PROBE_FILTER_GE             3
+#define SPB_PROBE_FILTER_LT             4
+#define SPB_PROBE_FILTER_LE             5
+
+typedef struct SPB_PROBE_FILTER_BUILDER
+{
+    SPB_PROBE_FILTER_INSN          Program[SPB_PROBE_FILTER_MAX_INSNS];
+
+    // Instructions emitted so far.
+    ULONG                          Count;
+
+    // Set once an instruction did not fit.
+    BOOLEAN                        Overflow;
+}
+SPB_PROBE_FILTER_BUILDER, *PSPB_PROBE_FILTER_BUILDER;
+
+FORCEINLINE
+VOID
+SpbProbeFilterBuilderInit(
+    _Out_ PSPB_PROBE_FILTER_BUILDER  pBuilder
+    )
+{
+    pBuilder->Count = 0;
+    pBuilder->Overflow = FALSE;
+}
+
+FORCEINLINE
+VOID
+SpbProbeFilterBuilderEmit(
+    _Inout_ PSPB_PROBE_FILTER_BUILDER  pBuilder,
+    _In_    UCHAR                      Code,
+    _In_    UCHAR                      JumpTrue,
+    _In_    UCHAR                      JumpFalse,
+    _In_    ULONG                      K
+    )
+/*++
+
+  Routine Description:
+
+    This is a helper routine used to append an instruction.
+
+--*/
+{
+    PSPB_PROBE_FILTER_INSN pInsn;
+
+    if (pBuilder->Count == SPB_PROBE_FILTER_MAX_INSNS)
+    {
+        pBuilder->Overflow = TRUE;
+        return;
+    }
+
+    pInsn = &pBuilder->Program[pBuilder->Count++];
+    pInsn->Code = Code;
+    pInsn->JumpTrue = JumpTrue;
+    pInsn->JumpFalse = JumpFalse;
+    pInsn->Reserved = 0;
+    pInsn->K = K;
+}
+
+FORCEINLINE
+VOID
+SpbProbeFilterBuilderCompare(
+    _Inout_ PSPB_PROBE_FILTER_BUILDER  pBuilder,
+    _In_    ULONG                      Mask,
+    _In_    ULONG                      Operator,
+    _In_    ULONG                      Value
+    )
+/*++
+
+  Routine Description:
+
+    This is a helper routine used to append the comparison of the
+    accumulator. The conditional jump falls through to the next
+    term on success, and to the reject instruction otherwise, which
+    SpbProbeFilterBuilderFinish patches in as 0xff placeholders.
+
+--*/
+{
+    static const UCHAR codes[] =
+    {
+        SPB_PROBE_FILTER_JEQ,   // EQ
+        SPB_PROBE_FILTER_JEQ,   // NE
+        SPB_PROBE_FILTER_JGT,   // GT
+        SPB_PROBE_FILTER_JGE,   // GE
+        SPB_PROBE_FILTER_JGE,   // LT
+        SPB_PROBE_FILTER_JGT,   // LE
+    };
+
+    BOOLEAN negate;
+
+    if (Operator > SPB_PROBE_FILTER_LE)
+    {
+        pBuilder->Overflow = TRUE;
+        return;
+    }
+
+    negate = (Operator == SPB_PROBE_FILTER_NE ||
+              Operator == SPB_PROBE_FILTER_LT ||
+              Operator == SPB_PROBE_FILTER_LE);
+
+    if (Mask != MAXULONG)
+    {
+        SpbProbeFilterBuilderEmit(pBuilder, SPB_PROBE_FILTER_AND, 0, 0, Mask);
+    }
+
+    SpbProbeFilterBuilderEmit(
+        pBuilder,
+        codes[Operator],
+        negate ? 0xff : 0,
+        negate ? 0 : 0xff,
+        Value);
+}
+
+FORCEINLINE
+VOID
+SpbProbeFilterBuilderAddField(
+    _Inout_ PSPB_PROBE_FILTER_BUILDER  pBuilder,
+    _In_    ULONG                      Field,
+    _In_    ULONG                      Mask,
+    _In_    ULONG                      Operator,
+    _In_    ULONG                      Value
+    )
+/*++
+
+  Routine Description:
+
+    This routine adds "(Field & Mask) Operator Value" to the
+    conditions a transfer must meet.
+
+--*/
+{
+    SpbProbeFilterBuilderEmit(pBuilder, SPB_PROBE_FILTER_LD_FIELD, 0, 0, Field);
+    SpbProbeFilterBuilderCompare(pBuilder, Mask, Operator, Value);
+}
+
+FORCEINLINE
+VOID
+SpbProbeFilterBuilderAddByte(
+    _Inout_ PSPB_PROBE_FILTER_BUILDER  pBuilder,
+    _In_    ULONG                      Offset,
+    _In_    ULONG                      Mask,
+    _In_    ULONG                      Operator,
+    _In_    ULONG                      Value
+    )
+/*++
+
+  Routine Description:
+
+    This routine adds "(payload[Offset] & Mask) Operator Value"
+    to the conditions a transfer must meet.
+
+--*/
+{
+    SpbProbeFilterBuilderEmit(pBuilder, SPB_PROBE_FILTER_LD_BYTE, 0, 0, Offset);
+    SpbProbeFilterBuilderCompare(pBuilder, Mask, Operator, Value);
+}
+
+FORCEINLINE
+ULONG
+SpbProbeFilterBuilderFinish(
+    _Inout_ PSPB_PROBE_FILTER_BUILDER  pBuilder
+    )
+/*++
+
+  Routine Description:
+
+    This routine terminates the program and resolves the jumps
+    to the reject instruction.
+
+  Return Value:
+
+    Number of instructions in pBuilder->Program, 0 if the
+    conditions did not fit
+
+--*/
+{
+    ULONG reject;
+
+    SpbProbeFilterBuilderEmit(pBuilder, SPB_PROBE_FILTER_RET, 0, 0, 1);
+    SpbProbeFilterBuilderEmit(pBuilder, SPB_PROBE_FILTER_RET, 0, 0, 0);
+
+    if (pBuilder->Overflow)
+    {
+        return 0;
+    }
+
+    reject = pBuilder->Count - 1;
+
+    for (ULONG pc = 0; pc < reject; pc++)
+    {
+        PSPB_PROBE_FILTER_INSN pInsn = &pBuilder->Program[pc];
+
+        if (pInsn->JumpTrue == 0xff)
+        {
+            pInsn->JumpTrue = (UCHAR)(reject - pc - 1);
+        }
+
+        if (pInsn->JumpFalse == 0xff)
+        {
+            pInsn->JumpFalse = (UCHAR)(reject - pc - 1);
+        }
+    }
+
+    return pBuilder->Count;
+}
+
+/////////////////////////////////////////////////
+//
+// Latency histograms.
+//
+/////////////////////////////////////////////////
+
+//
+// The probe keeps one histogram of the client request latency
+// (arrival to completion, in microseconds) per kind of request.
+// Buckets are log-linear: values below 16 get their own bucket,
+// then every power of two is split into 16 buckets, which bounds
+// the relative error to 1/16.
+//
+
+#define SPB_PROBE_KIND_READ             0
+#define SPB_PROBE_KIND_WRITE            1
+#define SPB_PROBE_KIND_SEQUENCE_1       2   // single transfer sequence
+#define SPB_PROBE_KIND_SEQUENCE_N       3   // sequence of 2 transfers or more
+#define SPB_PROBE_KIND_FULL_DUPLEX      4
+#define SPB_PROBE_KIND_LOCK             5
+#define SPB_PROBE_KIND_UNLOCK           6
+#define SPB_PROBE_KIND_OTHER            7
+#define SPB_PROBE_KIND_COUNT            8
+
+#define SPB_PROBE_HISTOGRAM_SUB_BITS    4
+#define SPB_PROBE_HISTOGRAM_SUB_COUNT   (1 << SPB_PROBE_HISTOGRAM_SUB_BITS)
+
+// Enough for 32-bit values.
+#define SPB_PROBE_HISTOGRAM_BUCKETS \
+    ((32 - SPB_PROBE_HISTOGRAM_SUB_BITS + 1) * SPB_PROBE_HISTOGRAM_SUB_COUNT)
+
+typedef struct SPB_PROBE_HISTOGRAM
+{
+    // Number of values recorded.
+    ULONG                          Count;
+
+    // Largest value recorded.
+    ULONG                          Max;
+
+    // Sum of the values recorded.
+    ULONGLONG                      Sum;
+
+    ULONG                          Buckets[SPB_PROBE_HISTOGRAM_BUCKETS];
+}
+SPB_PROBE_HISTOGRAM, *PSPB_PROBE_HISTOGRAM;
+
+typedef struct SPB_PROBE_LATENCY
+{
+    // SPB_PROBE_LATENCY_VERSION
+    ULONG                          Version;
+
+    // SPB_PROBE_KIND_COUNT
+    ULONG                          KindCount;
+
+    // SPB_PROBE_HISTOGRAM_BUCKETS
+    ULONG                          BucketCount;
+
+    ULONG                          Reserved;
+
+    // Indexed by SPB_PROBE_KIND_*.
+    SPB_PROBE_HISTOGRAM            Histograms[SPB_PROBE_KIND_COUNT];
+}
+SPB_PROBE_LATENCY, *PSPB_PROBE_LATENCY;
+
+#define SPB_PROBE_LATENCY_VERSION       1
+
+FORCEINLINE
+ULONG
+SpbProbeHistogramBucket(
+    _In_  ULONG  Value
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the bucket a value is counted in.
+
+--*/
+{
+    ULONG exponent;
+
+    if (Value < SPB_PROBE_HISTOGRAM_SUB_COUNT)
+    {
+        return Value;
+    }
+
+    //
+    // Value >> exponent is in [SUB_COUNT, 2 * SUB_COUNT).
+    //
+
+    BitScanReverse(&exponent, Value);
+    exponent -= SPB_PROBE_HISTOGRAM_SUB_BITS;
+
+    return (exponent + 1) * SPB_PROBE_HISTOGRAM_SUB_COUNT +
+        ((Value >> exponent) - SPB_PROBE_HISTOGRAM_SUB_COUNT);
+}
+
+FORCEINLINE
+ULONGLONG
+SpbProbeHistogramBucketLimit(
+    _In_  ULONG  Bucket
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the smallest value above a bucket.
+
+--*/
+{
+    ULONG exponent;
+    ULONG sub;
+
+    if (Bucket < SPB_PROBE_HISTOGRAM_SUB_COUNT)
+    {
+        return (ULONGLONG)Bucket + 1;
+    }
+
+    exponent = Bucket / SPB_PROBE_HISTOGRAM_SUB_COUNT - 1;
+    sub = Bucket % SPB_PROBE_HISTOGRAM_SUB_COUNT;
+
+    return ((ULONGLONG)SPB_PROBE_HISTOGRAM_SUB_COUNT + sub + 1) << exponent;
+}
+
+FORCEINLINE
+ULONGLONG
+SpbProbeHistogramPercentile(
+    _In_  const SPB_PROBE_HISTOGRAM*  pHistogram,
+    _In_  ULONG                       PartsPerMillion
+    )
+/*++
+
+  Routine Description:
+
+    This routine estimates a percentile of the recorded values,
+    e.g. 990000 for p99 or 999000 for p99.9.
+
+  Return Value:
+
+    An upper bound of the percentile, 0 if no value was recorded
+
+--*/
+{
+    ULONGLONG rank;
+    ULONGLONG seen = 0;
+
+    if (pHistogram->Count == 0)
+    {
+        return 0;
+    }
+
+    //
+    // Number of values at or below the percentile, at least one.
+    //
+
+    rank = ((ULONGLONG)pHistogram->Count * PartsPerMillion + 999999) / 1000000;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (ULONG i = 0; i < SPB_PROBE_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += pHistogram->Buckets[i];
+
+        if (seen >= rank)
+        {
+            ULONGLONG limit = SpbProbeHistogramBucketLimit(i) - 1;
+
+            return (limit < pHistogram->Max) ? limit : pHistogram->Max;
+        }
+    }
+
+    return pHistogram->Max;
+}
+
+/////////////////////////////////////////////////
+//
+// Request counters.
+//
+/////////////////////////////////////////////////
+
+//
+// Failed requests are counted per completion status for the
+// first SPB_PROBE_STATS_MAX_STATUSES distinct statuses seen,
+// the others only in OtherFailures. Cancelled requests are
+// counted apart and not as failures.
+//
+
+#define SPB_PROBE_STATS_MAX_STATUSES    8
+
+typedef struct SPB_PROBE_STATUS_COUNT
+{
+    // NTSTATUS, 0 for an unused entry.
+    LONG                           Status;
+
+    ULONG                          Count;
+}
+SPB_PROBE_STATUS_COUNT, *PSPB_PROBE_STATUS_COUNT;
+
+typedef struct SPB_PROBE_STATS
+{
+    // SPB_PROBE_STATS_VERSION
+    ULONG                          Version;
+
+    ULONG                          Reserved;
+
+    // Client requests completed.
+    ULONGLONG                      Transactions;
+
+    // Bytes transferred from and to the peripheral.
+    ULONGLONG                      BytesRead;
+    ULONGLONG                      BytesWritten;
+
+    // Client requests failed and cancelled.
+    ULONGLONG                      Failures;
+    ULONGLONG                      Cancellations;
+
+    // Client requests currently in the driver, and
+    // the largest number seen at once.
+    ULONG                          InFlight;
+    ULONG                          InFlightMax;
+
+    // Failures whose status has no entry in FailureStatuses.
+    ULONG                          OtherFailures;
+
+    // Writes held in a lock window and sent along the next
+    // request, without a round trip of their own, see
+    // CoalesceLocks.
+    ULONG                          Coalesced;
+
+    SPB_PROBE_STATUS_COUNT         FailureStatuses[SPB_PROBE_STATS_MAX_STATUSES];
+}
+SPB_PROBE_STATS, *PSPB_PROBE_STATS;
+
+#define SPB_PROBE_STATS_VERSION         1
+
+/////////////////////////////////////////////////
+//
+// Bus occupancy.
+//
+/////////////////////////////////////////////////
+
+//
+// The time every request keeps the bus busy is estimated from the
+// connection speed and address mode of the target and the number
+// of bytes transferred, and compared over consecutive windows with
+// the time the controller took and the time the bus stayed idle
+// between requests of the connection. A connection whose controller
+// time is close to its wire time is bus-bound; a large controller
+// time, or a bus mostly idle while requests are slow, points at the
+// drivers.
+//
+
+#define SPB_PROBE_BUS_UNKNOWN           0
+#define SPB_PROBE_BUS_I2C               1
+#define SPB_PROBE_BUS_SPI               2
+
+#define SPB_PROBE_BUS_WINDOWS           32
+#define SPB_PROBE_BUS_WINDOW_LENGTH     100000  // microseconds
+
+typedef struct SPB_PROBE_BUS_WINDOW
+{
+    // Number of the window, in SPB_PROBE_BUS_WINDOW_LENGTH units
+    // of the performance counter, 0 if the window is unused.
+    ULONGLONG                      Index;
+
+    // Requests completed by the controller during the window.
+    ULONG                          Requests;
+
+    // Estimated time on the wire, in nanoseconds.
+    ULONG                          WireTime;
+
+    // Time spent by the requests in the controller, in nanoseconds.
+    ULONG                          ControllerTime;
+
+    // Time without any request in the controller, and the
+    // longest such gap, in nanoseconds.
+    ULONG                          IdleTime;
+    ULONG                          MaxIdle;
+
+    ULONG                          Reserved;
+}
+SPB_PROBE_BUS_WINDOW, *PSPB_PROBE_BUS_WINDOW;
+
+typedef struct SPB_PROBE_BUS
+{
+    // SPB_PROBE_BUS_VERSION
+    ULONG                          Version;
+
+    // SPB_PROBE_BUS_* of the connection, and its clock frequency
+    // in Hz, taken from the first target connected through it.
+    ULONG                          BusType;
+    ULONG                          ConnectionSpeed;
+
+    // 7 or 10 on I2C.
+    ULONG                          AddressBits;
+
+    // Index of the window holding the query time.
+    ULONGLONG                      Current;
+
+    // Ring of windows, the one of index i is at
+    // i % SPB_PROBE_BUS_WINDOWS.
+    SPB_PROBE_BUS_WINDOW           Windows[SPB_PROBE_BUS_WINDOWS];
+}
+SPB_PROBE_BUS, *PSPB_PROBE_BUS;
+
+#define SPB_PROBE_BUS_VERSION           1
+
+FORCEINLINE
+ULONG
+SpbProbeBusWireTime(
+    _In_  ULONG  BusType,
+    _In_  ULONG  ConnectionSpeed,
+    _In_  ULONG  AddressBits,
+    _In_  ULONG  Length
+    )
+/*++
+
+  Routine Description:
+
+    This routine estimates the time a transfer of Length bytes
+    keeps the bus busy. On I2C every byte, address included, takes
+    9 clocks and the start and stop conditions about one each. On
+    SPI every byte takes 8 clocks. Clock stretching, inter-byte
+    delays and controller setup are not accounted for.
+
+  Return Value:
+
+    The time in nanoseconds, 0 if unknown
+
+--*/
+{
+    ULONGLONG bits;
+    ULONGLONG time;
+
+    if (ConnectionSpeed == 0)
+    {
+        return 0;
+    }
+
+    switch (BusType)
+    {
+    case SPB_PROBE_BUS_I2C:
+        bits = 2 + 9 * ((ULONGLONG)Length + ((AddressBits > 7) ? 2 : 1));
+        break;
+
+    case SPB_PROBE_BUS_SPI:
+        bits = 8 * (ULONGLONG)Length;
+        break;
+
+    default:
+        return 0;
+    }
+
+    time = bits * 1000000000 / ConnectionSpeed;
+
+    return (time > MAXULONG) ? MAXULONG : (ULONG)time;
+}
+
+FORCEINLINE
+ULONG
+SpbProbeBusUtilization(
+    _In_  const SPB_PROBE_BUS_WINDOW*  pWindow
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the estimated share of a window the
+    bus was busy, in hundredths of a percent.
+
+--*/
+{
+    ULONGLONG share = (ULONGLONG)pWindow->WireTime * 10000 /
+        ((ULONGLONG)SPB_PROBE_BUS_WINDOW_LENGTH * 1000);
+
+    return (share > 10000) ? 10000 : (ULONG)share;
+}
+
+/////////////////////////////////////////////////
+//
+// Runtime control.
+//
+/////////////////////////////////////////////////
+
+//
+// IOCTL_SPB_PROBE_CONTROL changes the capture settings selected
+// by Flags without reloading the driver. The settings are switched
+// at once between two client request completions; the trigger
+// settings can only be changed in the device key. Concurrent
+// requests are applied one after the other, each returns the
+// settings in force once its own change is made.
+//
+
+#define SPB_PROBE_CONTROL_MODE          0x01    // Mode
+#define SPB_PROBE_CONTROL_TRUNCATION    0x02    // Truncation, TruncationLength
+#define SPB_PROBE_CONTROL_REPEATS       0x04    // CollapseRepeats
+#define SPB_PROBE_CONTROL_FILTER        0x08    // FilterCount, Filter
+#define SPB_PROBE_CONTROL_ALL           0x0f
+
+typedef struct SPB_PROBE_CONTROL
+{
+    // SPB_PROBE_CONTROL_VERSION
+    ULONG                          Version;
+
+    // SPB_PROBE_CONTROL_* settings to change.
+    ULONG                          Flags;
+
+    // SPB_PROBE_MODE_*
+    ULONG                          Mode;
+
+    // SPB_PROBE_TRUNCATE_* and its number of bytes.
+    ULONG                          Truncation;
+    ULONG                          TruncationLength;
+
+    // Nonzero to collapse repeated requests.
+    ULONG                          CollapseRepeats;
+
+    // Capture filter, 0 instructions to capture every transfer.
+    ULONG                          FilterCount;
+
+    ULONG                          Reserved;
+
+    SPB_PROBE_FILTER_INSN          Filter[SPB_PROBE_FILTER_MAX_INSNS];
+}
+SPB_PROBE_CONTROL, *PSPB_PROBE_CONTROL;
+
+#define SPB_PROBE_CONTROL_VERSION       1
+
+/////////////////////////////////////////////////
+//
+// Control codes.
+//
+/////////////////////////////////////////////////
+
+//
+// Unsigned, so that CTL_CODE does not shift it into the sign bit
+// of an int and the codes compare as ULONG.
+//
+
+#define FILE_DEVICE_SPB_PROBE           0x8000U
+
+//
+// Attaches a capture channel. The output buffer, an
+// SPB_PROBE_CHANNEL followed by its data area, is locked and
+// filled with records by the driver for as long as the request
+// stays pending. Cancel the request to detach the channel.
+//
+
+#define IOCTL_SPB_PROBE_MAP_CAPTURE \
+    CTL_CODE(FILE_DEVICE_SPB_PROBE, 0x800, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+//
+// The statistics are kept per connection resource of the probe.
+// The queries below take an optional ULONG input, the index of
+// the connection in resource order, and default to the first.
+//
+
+//
+// Returns an SPB_PROBE_LATENCY snapshot of the latency histograms.
+//
+
+#define IOCTL_SPB_PROBE_QUERY_LATENCY \
+    CTL_CODE(FILE_DEVICE_SPB_PROBE, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Returns an SPB_PROBE_STATS snapshot of the request counters.
+//
+
+#define IOCTL_SPB_PROBE_QUERY_STATS \
+    CTL_CODE(FILE_DEVICE_SPB_PROBE, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Returns an SPB_PROBE_BUS snapshot of the bus occupancy windows.
+//
+
+#define IOCTL_SPB_PROBE_QUERY_BUS \
+    CTL_CODE(FILE_DEVICE_SPB_PROBE, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Takes an SPB_PROBE_CONTROL and returns, if there is an output
+// buffer, the SPB_PROBE_CONTROL holding all the settings in effect
+// once the change is applied. Flags 0 only queries the settings.
+//
+
+#define IOCTL_SPB_PROBE_CONTROL \
+    CTL_CODE(FILE_DEVICE_SPB_PROBE, 0x804, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/////////////////////////////////////////////////
+//
+// Capture channel.
+//
+/////////////////////////////////////////////////
+
+//
+// Single producer, single consumer ring shared with a user-mode
+// consumer. The driver appends 8 byte aligned records at Head, a
+// record that would cross the end of the data area is preceded by
+// a SPB_PROBE_RECORD_TYPE_PADDING record filling the gap. The
+// consumer reads records up to Head and then advances Tail, no
+// system call is needed per record.
+//
+
+#define SPB_PROBE_CHANNEL_MAGIC         0x4C4E4843  // 'CHNL'
+#define SPB_PROBE_CHANNEL_VERSION       1
+
+typedef struct SPB_PROBE_CHANNEL
+{
+    // SPB_PROBE_CHANNEL_MAGIC
+    ULONG                          Magic;
+
+    // SPB_PROBE_CHANNEL_VERSION
+    ULONG                          Version;
+
+    // Offset of the data area from the start of the channel.
+    ULONG                          DataOffset;
+
+    // Size of the data area, a power of two.
+    ULONG                          DataSize;
+
+    // Bytes produced, written by the driver.
+    volatile LONG                  Head;
+
+    // Bytes consumed, written by the consumer.
+    volatile LONG                  Tail;
+
+    // Records lost because the capture buffers or this
+    // channel were full.
+    volatile LONG                  Dropped;
+
+    ULONG                          Reserved;
+}
+SPB_PROBE_CHANNEL, *PSPB_PROBE_CHANNEL;
+
+typedef
+VOID
+SPB_PROBE_RECORD_CALLBACK(
+    _In_opt_ PVOID                    Context,
+    _In_     const SPB_PROBE_RECORD*  pRecord);
+
+typedef SPB_PROBE_RECORD_CALLBACK *PSPB_PROBE_RECORD_CALLBACK;
+
+FORCEINLINE
+ULONG
+SpbProbeChannelRead(
+    _Inout_  PSPB_PROBE_CHANNEL          pChannel,
+    _In_     PSPB_PROBE_RECORD_CALLBACK  Callback,
+    _In_opt_ PVOID                       Context
+    )
+/*++
+
+  Routine Description:
+
+    This routine hands every record available in a capture
+    channel to Callback, then releases their space.
+
+  Arguments:
+
+    pChannel - a pointer to the channel buffer
+    Callback - routine invoked for every record
+    Context - context passed to Callback
+
+  Return Value:
+
+    Number of records read
+
+--*/
+{
+    const UCHAR* pData = (const UCHAR*)pChannel + pChannel->DataOffset;
+    ULONG mask = pChannel->DataSize - 1;
+    ULONG head = (ULONG)ReadAcquire(&pChannel->Head);
+    ULONG tail = (ULONG)pChannel->Tail;
+    ULONG records = 0;
+
+    while (tail != head)
+    {
+        const SPB_PROBE_RECORD* pRecord =
+            (const SPB_PROBE_RECORD*)(pData + (tail & mask));
+
+        if (pRecord->Type != SPB_PROBE_RECORD_TYPE_PADDING)
+        {
+            Callback(Context, pRecord);
+            records++;
+        }
+
+        tail += (pRecord->Size + 7) & ~7UL;
+    }
+
+    WriteRelease(&pChannel->Tail, (LONG)tail);
+
+    return records;
+}
+
+/////////////////////////////////////////////////
+//
+// Record decoder.
+//
+/////////////////////////////////////////////////
+
+//
+// Reproduces the text the probe used to trace for each transfer:
+//
+//   device NNN: ##nn write llll -  0000: xx xx xx ...
+//
+// one line per 16 payload bytes. Callable from kernel and user mode,
+// it only depends on the record itself.
+//
+
+#define SPB_PROBE_LINE_MAX  128
+
+//
+// Full 16 byte lines are formatted with SSE2 where it is part of
+// the baseline instruction set, which also makes it usable from
+// kernel mode without saving the extended processor state. Tools
+// built with gcc or clang get it from __SSE2__. Define
+// SPB_PROBE_NO_SIMD to force the scalar formatter.
+//
+
+#if !defined(SPB_PROBE_NO_SIMD) && \
+    (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+     defined(__SSE2__))
+#define SPB_PROBE_SSE2      1
+#include <emmintrin.h>
+#else
+#define SPB_PROBE_SSE2      0
+#endif
+
+typedef
+VOID
+SPB_PROBE_LINE_CALLBACK(
+    _In_opt_ PVOID        Context,
+    _In_z_   const CHAR*  pLine);
+
+typedef SPB_PROBE_LINE_CALLBACK *PSPB_PROBE_LINE_CALLBACK;
+
+FORCEINLINE
+CHAR*
+SpbProbeFormatDecimal(
+    _Out_writes_(21) CHAR*  p,
+    _In_  LONGLONG          Value,
+    _In_  ULONG             Width,
+    _In_  CHAR              Pad
+    )
+/*++
+
+  Routine Description:
+
+    This is a helper routine used to append a right aligned
+    decimal number, as "%<Pad><Width>I64d" would.
+
+  Return Value:
+
+    Pointer past the last character written
+
+--*/
+{
+    CHAR digits[21];
+    ULONG count = 0;
+    ULONGLONG magnitude = (Value < 0) ? 0 - (ULONGLONG)Value : (ULONGLONG)Value;
+
+    do
+    {
+        digits[count++] = (CHAR)('0' + (magnitude % 10));
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (Value < 0)
+    {
+        digits[count++] = '-';
+    }
+
+    while (Width > count)
+    {
+        *p++ = Pad;
+        Width--;
+    }
+
+    while (count != 0)
+    {
+        *p++ = digits[--count];
+    }
+
+    return p;
+}
+
+FORCEINLINE
+CHAR*
+SpbProbeFormatHex(
+    _Out_writes_(8) CHAR*  p,
+    _In_  ULONG            Value,
+    _In_  ULONG            Width
+    )
+/*++
+
+  Routine Description:
+
+    This is a helper routine used to append a zero padded
+    lowercase hexadecimal number, as "%0<Width>x" would.
+
+  Return Value:
+
+    Pointer past the last character written
+
+--*/
+{
+    static const CHAR hexDigits[] = "0123456789abcdef";
+    ULONG count = 1;
+
+    while (count < 8 && (Value >> (4 * count)) != 0)
+    {
+        count++;
+    }
+
+    if (count < Width)
+    {
+        count = Width;
+    }
+
+    while (count != 0)
+    {
+        count--;
+        *p++ = hexDigits[(Value >> (4 * count)) & 0xf];
+    }
+
+    return p;
+}
+
+FORCEINLINE
+CHAR*
+SpbProbeFormatBytes(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    )
+/*++
+
+  Routine Description:
+
+    This is a helper routine used to append " %02x" for each byte.
+
+  Return Value:
+
+    Pointer past the last character written
+
+--*/
+{
+    static const CHAR hexDigits[] = "0123456789abcdef";
+
+#if SPB_PROBE_SSE2
+    if (Count == 16)
+    {
+        //
+        // Convert both nibbles of every byte at once: '0' + n,
+        // plus 'a' - '0' - 10 where n is above 9.
+        //
+
+        const __m128i mask = _mm_set1_epi8(0x0f);
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i digit = _mm_set1_epi8('0');
+        const __m128i letter = _mm_set1_epi8('a' - '0' - 10);
+        __m128i bytes = _mm_loadu_si128((const __m128i*)pBytes);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i low = _mm_and_si128(bytes, mask);
+        CHAR hex[32];
+
+        high = _mm_add_epi8(
+            _mm_add_epi8(high, digit),
+            _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter));
+        low = _mm_add_epi8(
+            _mm_add_epi8(low, digit),
+            _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter));
+
+        _mm_storeu_si128((__m128i*)hex, _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)(hex + 16), _mm_unpackhi_epi8(high, low));
+
+        for (ULONG i = 0; i < 16; i++)
+        {
+            p[0] = ' ';
+            p[1] = hex[2 * i];
+            p[2] = hex[2 * i + 1];
+            p += 3;
+        }
+
+        return p;
+    }
+#endif
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        *p++ = ' ';
+        *p++ = hexDigits[pBytes[i] >> 4];
+        *p++ = hexDigits[pBytes[i] & 0xf];
+    }
+
+    return p;
+}
+
+FORCEINLINE
+ULONG
+SpbProbeFormatRecord(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    )
+/*++
+
+  Routine Description:
+
+    This routine decodes a transfer, repeat or trigger record
+    into text lines.
+
+  Arguments:
+
+    pRecord - a pointer to the record, followed by its payload
+    Callback - routine invoked for every decoded line
+    Context - context passed to Callback
+
+  Return Value:
+
+    Number of lines decoded
+
+--*/
+{
+    const UCHAR* pPayload = (const UCHAR*)(pRecord + 1);
+    CHAR line[SPB_PROBE_LINE_MAX];
+    CHAR* pPrefixEnd;
+    CHAR* p;
+    ULONG length;
+    ULONG lines = 0;
+
+    if (pRecord->Type == SPB_PROBE_RECORD_TYPE_REPEAT &&
+        pRecord->Size >= sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_REPEAT))
+    {
+        const SPB_PROBE_REPEAT* pRepeat = (const SPB_PROBE_REPEAT*)pPayload;
+
+        //
+        // "device %3I64d: repeated %lu times"
+        //
+
+        p = line;
+        *p++ = 'd'; *p++ = 'e'; *p++ = 'v'; *p++ = 'i'; *p++ = 'c'; *p++ = 'e'; *p++ = ' ';
+        p = SpbProbeFormatDecimal(p, pRecord->PeripheralId, 3, ' ');
+        *p++ = ':';
+        *p++ = ' ';
+        *p++ = 'r'; *p++ = 'e'; *p++ = 'p'; *p++ = 'e'; *p++ = 'a'; *p++ = 't'; *p++ = 'e'; *p++ = 'd';
+        *p++ = ' ';
+        p = SpbProbeFormatDecimal(p, pRepeat->Count, 0, ' ');
+        *p++ = ' ';
+        *p++ = 't'; *p++ = 'i'; *p++ = 'm'; *p++ = 'e'; *p++ = 's';
+        *p = '\0';
+
+        Callback(Context, line);
+        return 1;
+    }
+
+    if (pRecord->Type == SPB_PROBE_RECORD_TYPE_TRIGGER &&
+        pRecord->Size >= sizeof(SPB_PROBE_RECORD) + sizeof(SPB_PROBE_TRIGGER))
+    {
+        const SPB_PROBE_TRIGGER* pTrigger = (const SPB_PROBE_TRIGGER*)pPayload;
+
+        //
+        // "device %3I64d: trigger %x"
+        //
+
+        p = line;
+        *p++ = 'd'; *p++ = 'e'; *p++ = 'v'; *p++ = 'i'; *p++ = 'c'; *p++ = 'e'; *p++ = ' ';
+        p = SpbProbeFormatDecimal(p, pRecord->PeripheralId, 3, ' ');
+        *p++ = ':';
+        *p++ = ' ';
+        *p++ = 't'; *p++ = 'r'; *p++ = 'i'; *p++ = 'g'; *p++ = 'g'; *p++ = 'e'; *p++ = 'r';
+        *p++ = ' ';
+        p = SpbProbeFormatHex(p, pTrigger->Reason, 0);
+        *p = '\0';
+
+        Callback(Context, line);
+        return 1;
+    }
+
+    if (pRecord->Type != SPB_PROBE_RECORD_TYPE_TRANSFER ||
+        pRecord->Size < sizeof(SPB_PROBE_RECORD))
+    {
+        return 0;
+    }
+
+    length = pRecord->Size - sizeof(SPB_PROBE_RECORD);
+
+    if (length == 0 && pRecord->TransferLength == 0)
+    {
+        return 0;
+    }
+
+    //
+    // "device %3I64d: %c#%02d %5s %4lu - "
+    //
+
+    p = line;
+    *p++ = 'd'; *p++ = 'e'; *p++ = 'v'; *p++ = 'i'; *p++ = 'c'; *p++ = 'e'; *p++ = ' ';
+    p = SpbProbeFormatDecimal(p, pRecord->PeripheralId, 3, ' ');
+    *p++ = ':';
+    *p++ = ' ';
+    *p++ = (pRecord->TransferIndex == 0) ? '#' : ' ';
+    *p++ = '#';
+    p = SpbProbeFormatDecimal(p, pRecord->TransferIndex, 2, '0');
+    *p++ = ' ';
+
+    if (pRecord->Direction == SPB_PROBE_DIRECTION_WRITE)
+    {
+        *p++ = 'w'; *p++ = 'r'; *p++ = 'i'; *p++ = 't'; *p++ = 'e';
+    }
+    else
+    {
+        *p++ = ' '; *p++ = 'r'; *p++ = 'e'; *p++ = 'a'; *p++ = 'd';
+    }
+
+    *p++ = ' ';
+    p = SpbProbeFormatDecimal(p, pRecord->TransferLength, 4, ' ');
+    *p++ = ' ';
+    *p++ = '-';
+    *p++ = ' ';
+
+    //
+    // Prefix and data were joined with "%s %s".
+    //
+
+    *p++ = ' ';
+    pPrefixEnd = p;
+
+    if (length == 0)
+    {
+        //
+        // Payload not captured, only report the length.
+        //
+
+        *pPrefixEnd = '\0';
+
+        Callback(Context, line);
+        return 1;
+    }
+
+    //
+    // "%04x: xx xx ..." for every 16 bytes.
+    //
+
+    for (ULONG i = 0; i < length; i += 16)
+    {
+        ULONG count = (length - i < 16) ? length - i : 16;
+
+        p = SpbProbeFormatHex(pPrefixEnd, pRecord->Offset + i, 4);
+        *p++ = ':';
+        p = SpbProbeFormatBytes(p, pPayload + i, count);
+        *p = '\0';
+
+        Callback(Context, line);
+        lines++;
+    }
+
+    return lines;
+}
+
+#endif // _SPBPROBE_H_
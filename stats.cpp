@@ -0,0 +1,935 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    stats.cpp
+
+Abstract:
+
+    This module contains the request statistics: counters and
+    latency histograms per kind of client request, kept for each
+    connection, and the IOCTLs returning them to user mode.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "stats.h"
+
+#include "stats.tmh"
+
+VOID
+SpbStatsInitialize(
+	_In_  PPBC_STATS        pStats
+)
+/*++
+
+  Routine Description:
+
+    This routine resets the statistics of a connection.
+
+  Arguments:
+
+    pStats - a pointer to the statistics of the connection
+
+  Return Value:
+
+    None
+
+--*/
+{
+	LARGE_INTEGER frequency;
+
+	RtlZeroMemory(pStats, sizeof(*pStats));
+
+	KeQueryPerformanceCounter(&frequency);
+	pStats->Frequency = frequency.QuadPart;
+	pStats->WindowTicks =
+		frequency.QuadPart * SPB_PROBE_BUS_WINDOW_LENGTH / 1000000;
+
+	pStats->Bus.Version = SPB_PROBE_BUS_VERSION;
+}
+
+VOID
+SpbStatsSetBus(
+	_In_  PPBC_STATS                  pStats,
+	_In_  const PBC_TARGET_SETTINGS*  pSettings
+)
+/*++
+
+  Routine Description:
+
+    This routine sets the bus settings reported for a connection
+    from the first target routed to it. Targets connected later
+    leave them alone, the wire time of every request is estimated
+    for the settings of its own target.
+
+  Arguments:
+
+    pStats - a pointer to the statistics of the connection
+    pSettings - the settings of a target routed to the connection
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PSPB_PROBE_BUS pBus = &pStats->Bus;
+
+	if (pBus->BusType != SPB_PROBE_BUS_UNKNOWN)
+	{
+		return;
+	}
+
+	pBus->BusType = pSettings->BusType;
+	pBus->ConnectionSpeed = pSettings->ConnectionSpeed;
+	pBus->AddressBits = (pSettings->AddressMode == AddressMode10Bit) ? 10 : 7;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_PBCLOADING,
+		"Estimating bus occupancy for bus type %lu at %lu Hz",
+		pBus->BusType,
+		pBus->ConnectionSpeed);
+}
+
+ULONG
+SpbStatsWireTime(
+	_In_  PPBC_STATS        pStats,
+	_In_  PPBC_REQUEST      pRequest,
+	_In_  ULONG_PTR         Length
+)
+/*++
+
+  Routine Description:
+
+    This routine estimates the time a transfer of a client
+    request keeps the bus busy, for the settings of the target
+    of the request.
+
+  Arguments:
+
+    pStats - a pointer to the statistics of the connection
+        of the request, whose bus settings stand in for a
+        request that was not routed
+    pRequest - a pointer to the request context
+    Length - the length of the transfer
+
+  Return Value:
+
+    The time on the wire, in nanoseconds
+
+--*/
+{
+	const PBC_TARGET_SETTINGS* pSettings = pRequest->pSettings;
+	ULONG length = (Length > MAXULONG) ? MAXULONG : (ULONG)Length;
+
+	if (pSettings == NULL)
+	{
+		return SpbProbeBusWireTime(
+			pStats->Bus.BusType,
+			pStats->Bus.ConnectionSpeed,
+			pStats->Bus.AddressBits,
+			length);
+	}
+
+	return SpbProbeBusWireTime(
+		pSettings->BusType,
+		pSettings->ConnectionSpeed,
+		(pSettings->AddressMode == AddressMode10Bit) ? 10 : 7,
+		length);
+}
+
+static
+PPBC_STATS
+SpbStatsOf(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  PPBC_REQUEST      pRequest
+)
+{
+	//
+	// Requests are routed when they arrive, the first
+	// connection only stands in for a request that was not.
+	//
+
+	return (pRequest->pConnection != NULL) ?
+		&pRequest->pConnection->Stats : &pDevice->Connections[0].Stats;
+}
+
+static
+VOID
+SpbStatsUpdateMax(
+	_Inout_  volatile LONG*        pMax,
+	_In_     ULONG                 Value
+)
+{
+	LONG max = ReadNoFence(pMax);
+
+	while ((ULONG)max < Value)
+	{
+		LONG previous = InterlockedCompareExchangeNoFence(
+			pMax,
+			(LONG)Value,
+			max);
+
+		if (previous == max)
+		{
+			break;
+		}
+
+		max = previous;
+	}
+}
+
+VOID
+SpbStatsArrive(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBTARGET         SpbTarget,
+	_In_  SPBREQUEST        ClientRequest,
+	_In_  ULONG             Kind
+)
+/*++
+
+  Routine Description:
+
+    This routine stamps a client request when it reaches the
+    driver, routes it to the connection of its target and counts
+    it in flight there until SpbStatsRecord.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    SpbTarget - the target of the request
+    ClientRequest - the client request
+    Kind - the SPB_PROBE_KIND_* of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+	PSPB_PROBE_STATS pCounters;
+	LONG inFlight;
+
+	pRequest->ArrivalTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	pRequest->Kind = Kind;
+	pRequest->pConnection = GetTargetContext(SpbTarget)->pConnection;
+	pRequest->pSettings = &GetTargetContext(SpbTarget)->Settings;
+
+	pCounters = &SpbStatsOf(pDevice, pRequest)->Counters;
+
+	inFlight = InterlockedIncrementNoFence((volatile LONG*)&pCounters->InFlight);
+
+	SpbStatsUpdateMax(
+		(volatile LONG*)&pCounters->InFlightMax,
+		(ULONG)inFlight);
+}
+
+static
+VOID
+SpbStatsCountFailure(
+	_Inout_  PSPB_PROBE_STATS      pCounters,
+	_In_     NTSTATUS              Status
+)
+{
+	InterlockedIncrement64((volatile LONG64*)&pCounters->Failures);
+
+	//
+	// Entries are claimed once and never released, so the
+	// first free entry ends the search.
+	//
+
+	for (ULONG i = 0; i < SPB_PROBE_STATS_MAX_STATUSES; i++)
+	{
+		PSPB_PROBE_STATUS_COUNT pEntry = &pCounters->FailureStatuses[i];
+		LONG entryStatus = ReadNoFence((volatile LONG*)&pEntry->Status);
+
+		if (entryStatus == 0)
+		{
+			entryStatus = InterlockedCompareExchangeNoFence(
+				(volatile LONG*)&pEntry->Status,
+				Status,
+				0);
+
+			if (entryStatus == 0)
+			{
+				entryStatus = Status;
+			}
+		}
+
+		if (entryStatus == Status)
+		{
+			InterlockedIncrementNoFence((volatile LONG*)&pEntry->Count);
+			return;
+		}
+	}
+
+	InterlockedIncrementNoFence((volatile LONG*)&pCounters->OtherFailures);
+}
+
+static
+ULONG
+SpbStatsCountTransfers(
+	_Inout_  PPBC_STATS            pStats,
+	_In_     SPBREQUEST            ClientRequest,
+	_In_     ULONG                 Kind,
+	_In_     ULONG_PTR             BytesCompleted
+)
+/*++
+
+  Routine Description:
+
+    This routine counts the bytes completed by a request
+    and estimates the time they kept the bus busy.
+
+  Return Value:
+
+    The time on the wire, in nanoseconds
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+	PSPB_PROBE_STATS pCounters = &pStats->Counters;
+	SPB_REQUEST_PARAMETERS parameters;
+	ULONGLONG read = 0;
+	ULONGLONG written = 0;
+	ULONGLONG wireTime = 0;
+	ULONG_PTR remaining = BytesCompleted;
+
+	if (Kind == SPB_PROBE_KIND_READ)
+	{
+		read = BytesCompleted;
+		wireTime = SpbStatsWireTime(pStats, pRequest, BytesCompleted);
+	}
+	else if (Kind == SPB_PROBE_KIND_WRITE)
+	{
+		written = BytesCompleted;
+		wireTime = SpbStatsWireTime(pStats, pRequest, BytesCompleted);
+	}
+	else
+	{
+		//
+		// The bytes completed are spread over the transfers in
+		// order, as the controller reports them for a sequence.
+		//
+
+		SPB_REQUEST_PARAMETERS_INIT(&parameters);
+		SpbRequestGetParameters(ClientRequest, &parameters);
+
+		for (ULONG i = 0; (i < parameters.SequenceTransferCount) && (remaining != 0); i++)
+		{
+			SPB_TRANSFER_DESCRIPTOR transferDescriptor;
+			PMDL pMdl;
+			ULONG_PTR length;
+
+			SPB_TRANSFER_DESCRIPTOR_INIT(&transferDescriptor);
+
+			SpbRequestGetTransferParameters(
+				ClientRequest,
+				i,
+				&transferDescriptor,
+				&pMdl);
+
+			length = min(remaining, (ULONG_PTR)transferDescriptor.TransferLength);
+			remaining -= length;
+
+			if (transferDescriptor.Direction == SpbTransferDirectionFromDevice)
+			{
+				read += length;
+			}
+			else
+			{
+				written += length;
+			}
+
+			wireTime += SpbStatsWireTime(pStats, pRequest, length);
+		}
+
+		//
+		// Both directions of a full duplex request share the clock.
+		//
+
+		if (Kind == SPB_PROBE_KIND_FULL_DUPLEX)
+		{
+			wireTime = SpbStatsWireTime(pStats, pRequest, (ULONG_PTR)max(read, written));
+		}
+	}
+
+	if (read != 0)
+	{
+		InterlockedAdd64((volatile LONG64*)&pCounters->BytesRead, (LONG64)read);
+	}
+
+	if (written != 0)
+	{
+		InterlockedAdd64((volatile LONG64*)&pCounters->BytesWritten, (LONG64)written);
+	}
+
+	return (wireTime > MAXULONG) ? MAXULONG : (ULONG)wireTime;
+}
+
+static
+ULONG
+SpbStatsNanoseconds(
+	_In_  PPBC_STATS        pStats,
+	_In_  LONGLONG          Ticks
+)
+{
+	ULONGLONG time;
+
+	if (Ticks <= 0)
+	{
+		return 0;
+	}
+
+	time = (ULONGLONG)Ticks * 1000000000 / (ULONGLONG)pStats->Frequency;
+
+	return (time > MAXULONG) ? MAXULONG : (ULONG)time;
+}
+
+static
+VOID
+SpbStatsRecordBus(
+	_Inout_  PPBC_STATS            pStats,
+	_In_     PPBC_REQUEST          pRequest,
+	_In_     ULONG                 WireTime
+)
+/*++
+
+  Routine Description:
+
+    This routine accounts a request completed by the controller
+    in the bus window of its controller completion. Completions
+    are serialized, so the windows have a single writer; a query
+    may only see the last one partially updated. Requests overlap
+    with a queue depth above 1, the bus is not idle meanwhile.
+
+--*/
+{
+	PSPB_PROBE_BUS_WINDOW pWindow;
+	ULONGLONG index;
+	ULONG idle;
+
+	if ((pRequest->SendTimestamp == 0) ||
+		(pRequest->ControllerTimestamp == 0) ||
+		(pStats->WindowTicks == 0))
+	{
+		return;
+	}
+
+	index = (ULONGLONG)pRequest->ControllerTimestamp / (ULONGLONG)pStats->WindowTicks;
+	pWindow = &pStats->Bus.Windows[index % SPB_PROBE_BUS_WINDOWS];
+
+	if (pWindow->Index != index)
+	{
+		WriteULong64NoFence(&pWindow->Index, 0);
+
+		pWindow->Requests = 0;
+		pWindow->WireTime = 0;
+		pWindow->ControllerTime = 0;
+		pWindow->IdleTime = 0;
+		pWindow->MaxIdle = 0;
+
+		WriteULong64Release(&pWindow->Index, index);
+	}
+
+	pWindow->Requests += 1;
+	pWindow->WireTime += min(WireTime, MAXULONG - pWindow->WireTime);
+
+	pWindow->ControllerTime += min(
+		SpbStatsNanoseconds(
+			pStats,
+			pRequest->ControllerTimestamp - pRequest->SendTimestamp),
+		MAXULONG - pWindow->ControllerTime);
+
+	if ((pStats->LastControllerTimestamp != 0) &&
+		(pRequest->SendTimestamp > pStats->LastControllerTimestamp))
+	{
+		idle = SpbStatsNanoseconds(
+			pStats,
+			pRequest->SendTimestamp - pStats->LastControllerTimestamp);
+
+		pWindow->IdleTime += min(idle, MAXULONG - pWindow->IdleTime);
+		pWindow->MaxIdle = max(pWindow->MaxIdle, idle);
+	}
+
+	pStats->LastControllerTimestamp = max(
+		pStats->LastControllerTimestamp,
+		pRequest->ControllerTimestamp);
+}
+
+static
+VOID
+SpbStatsRecordLatency(
+	_Inout_  PSPB_PROBE_HISTOGRAM  pHistogram,
+	_In_     ULONG                 Value
+)
+{
+	InterlockedIncrementNoFence(
+		(volatile LONG*)&pHistogram->Buckets[SpbProbeHistogramBucket(Value)]);
+	InterlockedAdd64((volatile LONG64*)&pHistogram->Sum, Value);
+
+	SpbStatsUpdateMax((volatile LONG*)&pHistogram->Max, Value);
+
+	//
+	// Count goes last so that a snapshot never holds
+	// fewer values in the buckets than its count.
+	//
+
+	InterlockedIncrement((volatile LONG*)&pHistogram->Count);
+}
+
+VOID
+SpbStatsLeave(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        ClientRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine takes a client request about to be completed
+    out of the requests in flight, without recording anything
+    else about it.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+
+	if (pRequest->ArrivalTimestamp != 0)
+	{
+		InterlockedDecrementNoFence(
+			(volatile LONG*)&SpbStatsOf(pDevice, pRequest)->Counters.InFlight);
+	}
+}
+
+VOID
+SpbStatsRecord(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        ClientRequest,
+	_In_  NTSTATUS          Status,
+	_In_  ULONG_PTR         BytesCompleted
+)
+/*++
+
+  Routine Description:
+
+    This routine records the statistics of a client request
+    about to be completed. It never waits and may run at
+    DISPATCH_LEVEL.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    Status - the completion status
+    BytesCompleted - the number of bytes completed
+
+  Return Value:
+
+    None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+	PPBC_STATS pStats;
+	PSPB_PROBE_STATS pCounters;
+	ULONG wireTime = 0;
+	LONGLONG ticks;
+	ULONGLONG micro;
+
+	if (pRequest->ArrivalTimestamp == 0)
+	{
+		return;
+	}
+
+	pStats = SpbStatsOf(pDevice, pRequest);
+	pCounters = &pStats->Counters;
+
+	InterlockedDecrementNoFence((volatile LONG*)&pCounters->InFlight);
+	InterlockedIncrement64((volatile LONG64*)&pCounters->Transactions);
+
+	if (Status == STATUS_CANCELLED)
+	{
+		InterlockedIncrement64((volatile LONG64*)&pCounters->Cancellations);
+	}
+	else if (!NT_SUCCESS(Status))
+	{
+		SpbStatsCountFailure(pCounters, Status);
+	}
+
+	if (pRequest->Coalesced)
+	{
+		InterlockedIncrementNoFence((volatile LONG*)&pCounters->Coalesced);
+	}
+
+	if (BytesCompleted != 0)
+	{
+		wireTime = SpbStatsCountTransfers(
+			pStats,
+			ClientRequest,
+			pRequest->Kind,
+			BytesCompleted);
+	}
+
+	SpbStatsRecordBus(pStats, pRequest, wireTime);
+
+	if ((pRequest->CompleteTimestamp == 0) ||
+		(pRequest->Kind >= SPB_PROBE_KIND_COUNT) ||
+		(pStats->Frequency == 0))
+	{
+		return;
+	}
+
+	ticks = pRequest->CompleteTimestamp - pRequest->ArrivalTimestamp;
+
+	if (ticks < 0)
+	{
+		ticks = 0;
+	}
+
+	micro = (ULONGLONG)ticks * 1000000 / (ULONGLONG)pStats->Frequency;
+
+	SpbStatsRecordLatency(
+		&pStats->Latency[pRequest->Kind],
+		(micro > MAXULONG) ? MAXULONG : (ULONG)micro);
+}
+
+static
+NTSTATUS
+SpbStatsGetQueried(
+	_In_   PPBC_DEVICE       pDevice,
+	_In_   WDFREQUEST        FxRequest,
+	_Out_  PPBC_STATS*       ppStats
+)
+/*++
+
+  Routine Description:
+
+    This routine returns the statistics a query request is for:
+    those of the connection whose index in resource order is the
+    ULONG input of the request, or of the first connection when
+    the request has no input.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the query request
+    ppStats - the statistics of the connection
+
+  Return Value:
+
+    Status
+
+--*/
+{
+	PULONG pIndex;
+	ULONG index = 0;
+
+	//
+	// The input is read before the buffer it shares with
+	// the output is written.
+	//
+
+	if (NT_SUCCESS(WdfRequestRetrieveInputBuffer(
+			FxRequest,
+			sizeof(ULONG),
+			(PVOID*)&pIndex,
+			NULL)))
+	{
+		index = *pIndex;
+	}
+
+	if ((index != 0) && (index >= pDevice->ConnectionCount))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Query request %p for connection %lu of %lu",
+			FxRequest,
+			index,
+			pDevice->ConnectionCount);
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*ppStats = &pDevice->Connections[index].Stats;
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+SpbStatsQueryLatency(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine completes an IOCTL_SPB_PROBE_QUERY_LATENCY
+    request with a snapshot of the latency histograms.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the query request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBDDI);
+
+	PSPB_PROBE_LATENCY pLatency = NULL;
+	PPBC_STATS pStats;
+	ULONG_PTR information = 0;
+	NTSTATUS status;
+
+	status = SpbStatsGetQueried(pDevice, FxRequest, &pStats);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(
+		FxRequest,
+		sizeof(SPB_PROBE_LATENCY),
+		(PVOID*)&pLatency,
+		NULL);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Invalid latency query buffer for request %p - %!STATUS!",
+			FxRequest,
+			status);
+
+		goto exit;
+	}
+
+	pLatency->Version = SPB_PROBE_LATENCY_VERSION;
+	pLatency->KindCount = SPB_PROBE_KIND_COUNT;
+	pLatency->BucketCount = SPB_PROBE_HISTOGRAM_BUCKETS;
+	pLatency->Reserved = 0;
+
+	for (ULONG kind = 0; kind < SPB_PROBE_KIND_COUNT; kind++)
+	{
+		PSPB_PROBE_HISTOGRAM pSource = &pStats->Latency[kind];
+		PSPB_PROBE_HISTOGRAM pTarget = &pLatency->Histograms[kind];
+
+		pTarget->Count = (ULONG)ReadAcquire((volatile LONG*)&pSource->Count);
+		pTarget->Max = (ULONG)ReadNoFence((volatile LONG*)&pSource->Max);
+		pTarget->Sum = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->Sum);
+
+		for (ULONG i = 0; i < SPB_PROBE_HISTOGRAM_BUCKETS; i++)
+		{
+			pTarget->Buckets[i] =
+				(ULONG)ReadNoFence((volatile LONG*)&pSource->Buckets[i]);
+		}
+	}
+
+	information = sizeof(SPB_PROBE_LATENCY);
+
+exit:
+
+	WdfRequestCompleteWithInformation(FxRequest, status, information);
+
+	FuncExit(TRACE_FLAG_SPBDDI);
+}
+
+VOID
+SpbStatsQueryCounters(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine completes an IOCTL_SPB_PROBE_QUERY_STATS
+    request with a snapshot of the request counters.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the query request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBDDI);
+
+	PPBC_STATS pStats;
+	PSPB_PROBE_STATS pSource;
+	PSPB_PROBE_STATS pTarget = NULL;
+	ULONG_PTR information = 0;
+	NTSTATUS status;
+
+	status = SpbStatsGetQueried(pDevice, FxRequest, &pStats);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	pSource = &pStats->Counters;
+
+	status = WdfRequestRetrieveOutputBuffer(
+		FxRequest,
+		sizeof(SPB_PROBE_STATS),
+		(PVOID*)&pTarget,
+		NULL);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Invalid stats query buffer for request %p - %!STATUS!",
+			FxRequest,
+			status);
+
+		goto exit;
+	}
+
+	pTarget->Version = SPB_PROBE_STATS_VERSION;
+	pTarget->Reserved = 0;
+	pTarget->Transactions = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->Transactions);
+	pTarget->BytesRead = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->BytesRead);
+	pTarget->BytesWritten = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->BytesWritten);
+	pTarget->Failures = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->Failures);
+	pTarget->Cancellations = (ULONGLONG)ReadNoFence64((volatile LONG64*)&pSource->Cancellations);
+	pTarget->InFlight = (ULONG)ReadNoFence((volatile LONG*)&pSource->InFlight);
+	pTarget->InFlightMax = (ULONG)ReadNoFence((volatile LONG*)&pSource->InFlightMax);
+	pTarget->OtherFailures = (ULONG)ReadNoFence((volatile LONG*)&pSource->OtherFailures);
+	pTarget->Coalesced = (ULONG)ReadNoFence((volatile LONG*)&pSource->Coalesced);
+
+	for (ULONG i = 0; i < SPB_PROBE_STATS_MAX_STATUSES; i++)
+	{
+		pTarget->FailureStatuses[i].Status =
+			ReadNoFence((volatile LONG*)&pSource->FailureStatuses[i].Status);
+		pTarget->FailureStatuses[i].Count =
+			(ULONG)ReadNoFence((volatile LONG*)&pSource->FailureStatuses[i].Count);
+	}
+
+	information = sizeof(SPB_PROBE_STATS);
+
+exit:
+
+	WdfRequestCompleteWithInformation(FxRequest, status, information);
+
+	FuncExit(TRACE_FLAG_SPBDDI);
+}
+
+VOID
+SpbStatsQueryBus(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  WDFREQUEST        FxRequest
+)
+/*++
+
+  Routine Description:
+
+    This routine completes an IOCTL_SPB_PROBE_QUERY_BUS
+    request with a snapshot of the bus occupancy windows.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    FxRequest - the query request
+
+  Return Value:
+
+    None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBDDI);
+
+	PPBC_STATS pStats;
+	PSPB_PROBE_BUS pTarget = NULL;
+	ULONG_PTR information = 0;
+	NTSTATUS status;
+
+	status = SpbStatsGetQueried(pDevice, FxRequest, &pStats);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(
+		FxRequest,
+		sizeof(SPB_PROBE_BUS),
+		(PVOID*)&pTarget,
+		NULL);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Invalid bus query buffer for request %p - %!STATUS!",
+			FxRequest,
+			status);
+
+		goto exit;
+	}
+
+	pTarget->Version = SPB_PROBE_BUS_VERSION;
+	pTarget->BusType = pStats->Bus.BusType;
+	pTarget->ConnectionSpeed = pStats->Bus.ConnectionSpeed;
+	pTarget->AddressBits = pStats->Bus.AddressBits;
+	pTarget->Current = (pStats->WindowTicks != 0) ?
+		(ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart / (ULONGLONG)pStats->WindowTicks : 0;
+
+	for (ULONG i = 0; i < SPB_PROBE_BUS_WINDOWS; i++)
+	{
+		PSPB_PROBE_BUS_WINDOW pSource = &pStats->Bus.Windows[i];
+		PSPB_PROBE_BUS_WINDOW pWindow = &pTarget->Windows[i];
+
+		pWindow->Index = ReadULong64Acquire(&pSource->Index);
+		pWindow->Requests = ReadULongNoFence(&pSource->Requests);
+		pWindow->WireTime = ReadULongNoFence(&pSource->WireTime);
+		pWindow->ControllerTime = ReadULongNoFence(&pSource->ControllerTime);
+		pWindow->IdleTime = ReadULongNoFence(&pSource->IdleTime);
+		pWindow->MaxIdle = ReadULongNoFence(&pSource->MaxIdle);
+		pWindow->Reserved = 0;
+	}
+
+	information = sizeof(SPB_PROBE_BUS);
+
+exit:
+
+	WdfRequestCompleteWithInformation(FxRequest, status, information);
+
+	FuncExit(TRACE_FLAG_SPBDDI);
+}
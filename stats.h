@@ -0,0 +1,74 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    stats.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the request statistics.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+VOID
+SpbStatsInitialize(
+    _In_  PPBC_STATS        pStats);
+
+VOID
+SpbStatsSetBus(
+    _In_  PPBC_STATS                  pStats,
+    _In_  const PBC_TARGET_SETTINGS*  pSettings);
+
+ULONG
+SpbStatsWireTime(
+    _In_  PPBC_STATS        pStats,
+    _In_  PPBC_REQUEST      pRequest,
+    _In_  ULONG_PTR         Length);
+
+VOID
+SpbStatsArrive(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBTARGET         SpbTarget,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  ULONG             Kind);
+
+VOID
+SpbStatsLeave(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest);
+
+VOID
+SpbStatsRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status,
+    _In_  ULONG_PTR         BytesCompleted);
+
+VOID
+SpbStatsQueryLatency(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  WDFREQUEST        FxRequest);
+
+VOID
+SpbStatsQueryCounters(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  WDFREQUEST        FxRequest);
+
+VOID
+SpbStatsQueryBus(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  WDFREQUEST        FxRequest);
+
+#endif // _STATS_H_
@@ -0,0 +1,820 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    capture_test.cpp
+
+Abstract:
+
+    This module runs the driver against the mock controller of
+    host/wdfhost.h with a capture channel attached, and checks the
+    records it receives once the drain work item has run.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "spbprobe.h"
+
+#define TEST_CONNECTION_ID  0x2a
+#define TEST_ADDRESS        0x50
+
+#define TEST_CHANNEL_LENGTH (64 * 1024)
+#define TEST_MAX_RECORDS    256
+
+typedef struct TEST_RECORD
+{
+    UCHAR Type;
+    UCHAR Direction;
+    UCHAR TransferIndex;
+    NTSTATUS Status;
+    ULONG TransferLength;
+    ULONG PayloadLength;
+    ULONG WireTime;
+
+    // Repeat count or trigger reason.
+    ULONG Count;
+}
+TEST_RECORD;
+
+typedef struct TEST_PROBE
+{
+    WDFDEVICE Device;
+    SPBTARGET Target;
+    WDFREQUEST Channel;
+
+    ULONG RecordCount;
+    TEST_RECORD Records[TEST_MAX_RECORDS];
+}
+TEST_PROBE;
+
+static
+VOID
+TestProbeOpen(
+    TEST_PROBE*        pProbe,
+    const HOST_VALUE*  pValues,
+    ULONG              ValueCount
+    )
+{
+    const LONGLONG id = TEST_CONNECTION_ID;
+
+    memset(pProbe, 0, sizeof(*pProbe));
+
+    pProbe->Device = HostDeviceAdd(pValues, ValueCount);
+    CHECK(pProbe->Device != nullptr);
+    CHECK_EQ(HostDeviceStart(pProbe->Device, &id, 1), STATUS_SUCCESS);
+
+    pProbe->Target = HostTargetConnect(pProbe->Device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(pProbe->Target != nullptr);
+
+    pProbe->Channel = HostSubmitIoctl(
+        pProbe->Target,
+        IOCTL_SPB_PROBE_MAP_CAPTURE,
+        nullptr,
+        0,
+        TEST_CHANNEL_LENGTH);
+
+    CHECK(!HostRequestCompleted(pProbe->Channel));
+}
+
+static
+VOID
+TestProbeClose(
+    TEST_PROBE*  pProbe
+    )
+{
+    CHECK_EQ(HostControllerPending(), 0);
+
+    HostRequestCancel(pProbe->Channel);
+    CHECK_EQ(HostRequestStatus(pProbe->Channel), STATUS_CANCELLED);
+    HostRequestFree(pProbe->Channel);
+
+    HostTargetDisconnect(pProbe->Target);
+    HostDeviceRemove(pProbe->Device);
+
+    // Nothing the driver created outlives the device.
+    CHECK_EQ(g_HostCounters.ObjectCreates, g_HostCounters.ObjectDeletes);
+    CHECK_EQ(g_HostCounters.PoolAllocations, g_HostCounters.PoolFrees);
+}
+
+static
+VOID
+TestOnRecord(
+    PVOID                    Context,
+    const SPB_PROBE_RECORD*  pRecord
+    )
+{
+    TEST_PROBE* pProbe = (TEST_PROBE*)Context;
+    TEST_RECORD* pTest;
+
+    CHECK_EQ(pRecord->Version, SPB_PROBE_RECORD_VERSION);
+
+    if (pProbe->RecordCount == TEST_MAX_RECORDS)
+    {
+        CHECK(!"too many records");
+        return;
+    }
+
+    pTest = &pProbe->Records[pProbe->RecordCount++];
+    pTest->Type = pRecord->Type;
+    pTest->Direction = pRecord->Direction;
+    pTest->TransferIndex = pRecord->TransferIndex;
+    pTest->Status = pRecord->Status;
+    pTest->TransferLength = pRecord->TransferLength;
+    pTest->PayloadLength = pRecord->Size - sizeof(SPB_PROBE_RECORD);
+    pTest->WireTime = pRecord->WireTime;
+    pTest->Count = 0;
+
+    if (pRecord->Type == SPB_PROBE_RECORD_TYPE_REPEAT)
+    {
+        pTest->Count = ((const SPB_PROBE_REPEAT*)(pRecord + 1))->Count;
+    }
+    else if (pRecord->Type == SPB_PROBE_RECORD_TYPE_TRIGGER)
+    {
+        pTest->Count = ((const SPB_PROBE_TRIGGER*)(pRecord + 1))->Reason;
+    }
+}
+
+//
+// Reads the records the drain wrote to the channel so far.
+//
+
+static
+VOID
+TestProbeRead(
+    TEST_PROBE*  pProbe
+    )
+{
+    PSPB_PROBE_CHANNEL pChannel =
+        (PSPB_PROBE_CHANNEL)HostRequestData(pProbe->Channel, 0);
+
+    CHECK_EQ(pChannel->Magic, SPB_PROBE_CHANNEL_MAGIC);
+    CHECK_EQ(pChannel->Dropped, 0);
+
+    SpbProbeChannelRead(pChannel, TestOnRecord, pProbe);
+}
+
+//
+// Sends a read of Length bytes on Target, completed by the
+// controller with Status.
+//
+
+static
+VOID
+TestReadOn(
+    SPBTARGET  Target,
+    ULONG      Length,
+    NTSTATUS   Status
+    )
+{
+    WDFREQUEST request = HostSubmitRead(Target, Length);
+
+    CHECK(HostControllerComplete(Status));
+    CHECK(HostRequestCompleted(request));
+    CHECK_EQ(HostRequestStatus(request), Status);
+
+    HostRequestFree(request);
+}
+
+static
+VOID
+TestRead(
+    TEST_PROBE*  pProbe,
+    ULONG        Length,
+    NTSTATUS     Status
+    )
+{
+    TestReadOn(pProbe->Target, Length, Status);
+}
+
+static
+VOID
+TestTransferRecord(
+    const TEST_RECORD*  pRecord,
+    ULONG               Length,
+    NTSTATUS            Status
+    )
+{
+    CHECK_EQ(pRecord->Type, SPB_PROBE_RECORD_TYPE_TRANSFER);
+    CHECK_EQ(pRecord->Direction, SPB_PROBE_DIRECTION_READ);
+    CHECK_EQ(pRecord->TransferLength, Length);
+    CHECK_EQ(pRecord->Status, Status);
+}
+
+static
+VOID
+TestTrigger(
+    ULONG  PostTrigger
+    )
+/*++
+
+  Routine Description:
+
+    Reads of 1 to 5 bytes, the fourth one failing, with a history
+    of 2 requests: the third and fourth reads are emitted with the
+    trigger record, then the next PostTrigger reads, and nothing
+    after them until the trigger fires again.
+
+--*/
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureRepeats", 0, nullptr, 0 },
+        { L"CaptureTrigger", SPB_PROBE_TRIGGER_STATUS, nullptr, 0 },
+        { L"CapturePreTrigger", 2, nullptr, 0 },
+        { L"CapturePostTrigger", PostTrigger, nullptr, 0 },
+    };
+    TEST_PROBE probe;
+    ULONG index = 0;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    TestRead(&probe, 1, STATUS_SUCCESS);
+    TestRead(&probe, 2, STATUS_SUCCESS);
+    TestRead(&probe, 3, STATUS_SUCCESS);
+
+    // Nothing is emitted before the trigger.
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 0);
+
+    TestRead(&probe, 4, STATUS_IO_DEVICE_ERROR);
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        TestRead(&probe, 5, STATUS_SUCCESS);
+    }
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 3 + min(PostTrigger, 4UL));
+
+    TestTransferRecord(&probe.Records[index++], 3, STATUS_SUCCESS);
+    TestTransferRecord(&probe.Records[index++], 4, STATUS_IO_DEVICE_ERROR);
+
+    CHECK_EQ(probe.Records[index].Type, SPB_PROBE_RECORD_TYPE_TRIGGER);
+    CHECK_EQ(probe.Records[index].Status, STATUS_IO_DEVICE_ERROR);
+    CHECK_EQ(probe.Records[index].Count, SPB_PROBE_TRIGGER_STATUS);
+    index++;
+
+    while (index < probe.RecordCount)
+    {
+        TestTransferRecord(&probe.Records[index++], 5, STATUS_SUCCESS);
+    }
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestWireTimePerTarget(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Two targets at different clocks share the first connection:
+    the wire time of each record is estimated for the clock of its
+    own target, and the bus settings of the connection stay those
+    of the first target connected.
+
+--*/
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureRepeats", 0, nullptr, 0 },
+    };
+    TEST_PROBE probe;
+    SPBTARGET slow;
+    WDFREQUEST query;
+    const SPB_PROBE_BUS* pBus;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    slow = HostTargetConnect(probe.Device, HOST_BUS_I2C, TEST_ADDRESS + 1, 100000);
+    CHECK(slow != nullptr);
+
+    TestReadOn(probe.Target, 4, STATUS_SUCCESS);
+    TestReadOn(slow, 4, STATUS_SUCCESS);
+    TestReadOn(probe.Target, 4, STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 3);
+
+    CHECK_EQ(probe.Records[0].WireTime,
+        SpbProbeBusWireTime(SPB_PROBE_BUS_I2C, 400000, 7, 4));
+    CHECK_EQ(probe.Records[1].WireTime,
+        SpbProbeBusWireTime(SPB_PROBE_BUS_I2C, 100000, 7, 4));
+    CHECK_EQ(probe.Records[2].WireTime, probe.Records[0].WireTime);
+
+    query = HostSubmitIoctl(slow, IOCTL_SPB_PROBE_QUERY_BUS, nullptr, 0, sizeof(SPB_PROBE_BUS));
+    CHECK(HostRequestCompleted(query));
+    CHECK_EQ(HostRequestStatus(query), STATUS_SUCCESS);
+
+    pBus = (const SPB_PROBE_BUS*)HostRequestData(query, 0);
+    CHECK_EQ(pBus->BusType, SPB_PROBE_BUS_I2C);
+    CHECK_EQ(pBus->ConnectionSpeed, 400000);
+
+    HostRequestFree(query);
+    HostTargetDisconnect(slow);
+
+    TestProbeClose(&probe);
+}
+
+//
+// Sends an IOCTL_SPB_PROBE_CONTROL setting the capture mode, or
+// only querying the settings if Flags is 0, and returns the
+// settings in effect.
+//
+
+static
+ULONG
+TestControl(
+    SPBTARGET  Target,
+    ULONG      Flags,
+    ULONG      Mode
+    )
+{
+    SPB_PROBE_CONTROL control = {};
+    WDFREQUEST request;
+    ULONG result;
+
+    control.Version = SPB_PROBE_CONTROL_VERSION;
+    control.Flags = Flags;
+    control.Mode = Mode;
+
+    request = HostSubmitIoctl(
+        Target,
+        IOCTL_SPB_PROBE_CONTROL,
+        &control,
+        sizeof(control),
+        sizeof(control));
+
+    CHECK(HostRequestCompleted(request));
+    CHECK_EQ(HostRequestStatus(request), STATUS_SUCCESS);
+    CHECK_EQ(HostRequestInformation(request), sizeof(control));
+
+    result = ((const SPB_PROBE_CONTROL*)HostRequestData(request, 1))->Mode;
+
+    HostRequestFree(request);
+
+    return result;
+}
+
+static SPBTARGET s_QueryTarget;
+
+static
+VOID
+TestQueryAtBarrier(
+    VOID
+    )
+{
+    g_HostBarrierHook = nullptr;
+
+    TestControl(s_QueryTarget, 0, 0);
+}
+
+static
+VOID
+TestControlQueryRace(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A query, which changes nothing, lands while the completion
+    path is taking a pending mode change: the change is still
+    made before that request is captured.
+
+--*/
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureRepeats", 0, nullptr, 0 },
+    };
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    TestRead(&probe, 4, STATUS_SUCCESS);
+
+    CHECK_EQ(TestControl(probe.Target, SPB_PROBE_CONTROL_MODE, SPB_PROBE_MODE_SUMMARY),
+        SPB_PROBE_MODE_SUMMARY);
+
+    // The query runs between the copy of the settings and the
+    // check that no change was made meanwhile.
+    s_QueryTarget = probe.Target;
+    g_HostBarrierHook = TestQueryAtBarrier;
+
+    TestRead(&probe, 4, STATUS_SUCCESS);
+    CHECK(g_HostBarrierHook == nullptr);
+
+    TestRead(&probe, 4, STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 3);
+
+    // Full payload first, summaries once switched.
+    CHECK_EQ(probe.Records[0].PayloadLength, 4);
+    CHECK_EQ(probe.Records[1].PayloadLength, 0);
+    CHECK_EQ(probe.Records[2].PayloadLength, 0);
+
+    CHECK_EQ(TestControl(probe.Target, 0, 0), SPB_PROBE_MODE_SUMMARY);
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestModeNone(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Nothing is captured in mode 0, and a switch out of it takes
+    effect on the next request even though the completion path
+    of mode 0 does not look at the settings.
+
+--*/
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureMode", SPB_PROBE_MODE_NONE, nullptr, 0 },
+        { L"CaptureRepeats", 0, nullptr, 0 },
+    };
+    TEST_PROBE probe;
+    WDFREQUEST query;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    TestRead(&probe, 4, STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 0);
+
+    CHECK_EQ(TestControl(probe.Target, SPB_PROBE_CONTROL_MODE, SPB_PROBE_MODE_FULL),
+        SPB_PROBE_MODE_FULL);
+
+    TestRead(&probe, 2, STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 1);
+    TestTransferRecord(&probe.Records[0], 2, STATUS_SUCCESS);
+    CHECK_EQ(probe.Records[0].PayloadLength, 2);
+
+    // Only the request captured was counted, none is left in flight.
+    query = HostSubmitIoctl(probe.Target, IOCTL_SPB_PROBE_QUERY_STATS, nullptr, 0, sizeof(SPB_PROBE_STATS));
+    CHECK_EQ(HostRequestStatus(query), STATUS_SUCCESS);
+    CHECK_EQ(((const SPB_PROBE_STATS*)HostRequestData(query, 0))->Transactions, 1);
+    CHECK_EQ(((const SPB_PROBE_STATS*)HostRequestData(query, 0))->InFlight, 0);
+    HostRequestFree(query);
+
+    TestProbeClose(&probe);
+}
+
+//
+// Sends a write of Length bytes on the probe target, completed
+// by the controller with Status.
+//
+
+static
+VOID
+TestWrite(
+    TEST_PROBE*   pProbe,
+    const UCHAR*  pData,
+    ULONG         Length,
+    NTSTATUS      Status
+    )
+{
+    WDFREQUEST request = HostSubmitWrite(pProbe->Target, pData, Length);
+
+    CHECK(HostControllerComplete(Status));
+    CHECK(HostRequestCompleted(request));
+    CHECK_EQ(HostRequestStatus(request), Status);
+
+    HostRequestFree(request);
+}
+
+static
+VOID
+TestWriteRecord(
+    const TEST_RECORD*  pRecord,
+    ULONG               Length,
+    NTSTATUS            Status
+    )
+{
+    CHECK_EQ(pRecord->Type, SPB_PROBE_RECORD_TYPE_TRANSFER);
+    CHECK_EQ(pRecord->Direction, SPB_PROBE_DIRECTION_WRITE);
+    CHECK_EQ(pRecord->TransferLength, Length);
+    CHECK_EQ(pRecord->PayloadLength, Length);
+    CHECK_EQ(pRecord->Status, Status);
+}
+
+static
+VOID
+TestRepeatRecord(
+    const TEST_RECORD*  pRecord,
+    ULONG               Count,
+    NTSTATUS            Status
+    )
+{
+    CHECK_EQ(pRecord->Type, SPB_PROBE_RECORD_TYPE_REPEAT);
+    CHECK_EQ(pRecord->Count, Count);
+    CHECK_EQ(pRecord->Status, Status);
+    CHECK_EQ(pRecord->PayloadLength, sizeof(SPB_PROBE_REPEAT));
+}
+
+static
+VOID
+TestRepeats(
+    ULONG  CollapseRepeats
+    )
+/*++
+
+  Routine Description:
+
+    Writes of the same bytes completed with the same status are
+    reported once, followed by a repeat record counting the others
+    when a different request completes. Writes differing by one
+    byte or by their status are not repeats, a repeat record is
+    emitted every CAPTURE_REPEAT_MAX_COUNT repeats, and requests
+    too long to be compared are always captured. With
+    CollapseRepeats 0 every request is captured.
+
+--*/
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureRepeats", CollapseRepeats, nullptr, 0 },
+    };
+    const UCHAR a[] = { 0x10, 0x20 };
+    const UCHAR b[] = { 0x10, 0x21 };
+    static UCHAR s_Long[300];
+    TEST_PROBE probe;
+    ULONG index = 0;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        TestWrite(&probe, a, sizeof(a), STATUS_SUCCESS);
+    }
+
+    // Nothing is reported until the repeats end.
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, CollapseRepeats ? 1 : 4);
+
+    TestWrite(&probe, b, sizeof(b), STATUS_SUCCESS);
+    TestWrite(&probe, b, sizeof(b), STATUS_SUCCESS);
+    TestWrite(&probe, b, sizeof(b), STATUS_IO_DEVICE_ERROR);
+    TestWrite(&probe, a, sizeof(a), STATUS_SUCCESS);
+
+    TestWrite(&probe, s_Long, sizeof(s_Long), STATUS_SUCCESS);
+    TestWrite(&probe, s_Long, sizeof(s_Long), STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+
+    if (!CollapseRepeats)
+    {
+        CHECK_EQ(probe.RecordCount, 10);
+
+        for (ULONG i = 0; i < 10; i++)
+        {
+            TestWriteRecord(
+                &probe.Records[i],
+                (i < 8) ? 2 : 300,
+                (i == 6) ? STATUS_IO_DEVICE_ERROR : STATUS_SUCCESS);
+        }
+
+        TestProbeClose(&probe);
+        return;
+    }
+
+    CHECK_EQ(probe.RecordCount, 8);
+
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestRepeatRecord(&probe.Records[index++], 3, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestRepeatRecord(&probe.Records[index++], 1, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_IO_DEVICE_ERROR);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 300, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 300, STATUS_SUCCESS);
+
+    //
+    // A long run of repeats is reported every
+    // CAPTURE_REPEAT_MAX_COUNT repeats.
+    //
+
+    for (ULONG i = 0; i < 1 + 1024 + 2; i++)
+    {
+        TestWrite(&probe, a, sizeof(a), STATUS_SUCCESS);
+    }
+
+    TestWrite(&probe, b, sizeof(b), STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, index + 4);
+
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestRepeatRecord(&probe.Records[index++], 1024, STATUS_SUCCESS);
+    TestRepeatRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+
+    TestProbeClose(&probe);
+}
+
+//
+// Sends a sequence of Count transfers, write i of one byte
+// pWrites[i], or a read of 2 bytes if pWrites[i] is 0, completed
+// by the controller with STATUS_SUCCESS.
+//
+
+static
+VOID
+TestSequence(
+    TEST_PROBE*   pProbe,
+    const UCHAR*  pWrites,
+    ULONG         Count
+    )
+{
+    HOST_TRANSFER transfers[40];
+    WDFREQUEST request;
+
+    CHECK(Count <= ARRAYSIZE(transfers));
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (pWrites[i] != 0)
+        {
+            transfers[i] = { SpbTransferDirectionToDevice, 0, 1, &pWrites[i] };
+        }
+        else
+        {
+            transfers[i] = { SpbTransferDirectionFromDevice, 0, 2, nullptr };
+        }
+    }
+
+    request = HostSubmitSequence(pProbe->Target, transfers, Count);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK(HostRequestCompleted(request));
+    CHECK_EQ(HostRequestStatus(request), STATUS_SUCCESS);
+
+    HostRequestFree(request);
+}
+
+static
+VOID
+TestFilter(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    With a CaptureFilter of "writes whose first byte is 0x20",
+    only the matching transfers of a request are captured, each
+    with its own index, including past the 32 transfers whose
+    matches the driver remembers. A request without a match
+    leaves no record, whichever transfer tells.
+
+--*/
+{
+    SPB_PROBE_FILTER_BUILDER builder;
+    ULONG count;
+
+    SpbProbeFilterBuilderInit(&builder);
+    SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_DIRECTION,
+        MAXULONG, SPB_PROBE_FILTER_EQ, SPB_PROBE_DIRECTION_WRITE);
+    SpbProbeFilterBuilderAddByte(&builder, 0, 0xff, SPB_PROBE_FILTER_EQ, 0x20);
+    count = SpbProbeFilterBuilderFinish(&builder);
+    CHECK(count != 0);
+
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureRepeats", 0, nullptr, 0 },
+        { L"CaptureFilter", 0, builder.Program, count * (ULONG)sizeof(SPB_PROBE_FILTER_INSN) },
+    };
+    const UCHAR match[] = { 0x20, 0x01 };
+    const UCHAR other[] = { 0x21, 0x01 };
+    UCHAR writes[40];
+    TEST_PROBE probe;
+    ULONG index = 0;
+
+    TestProbeOpen(&probe, values, ARRAYSIZE(values));
+
+    TestWrite(&probe, match, sizeof(match), STATUS_SUCCESS);
+    TestWrite(&probe, other, sizeof(other), STATUS_SUCCESS);
+    TestRead(&probe, 2, STATUS_SUCCESS);
+    TestWrite(&probe, match, sizeof(match), STATUS_IO_DEVICE_ERROR);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 2);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_SUCCESS);
+    TestWriteRecord(&probe.Records[index++], 2, STATUS_IO_DEVICE_ERROR);
+
+    //
+    // Every third transfer of a sequence of 40 matches, the
+    // others are reads or writes of another byte.
+    //
+
+    for (ULONG i = 0; i < ARRAYSIZE(writes); i++)
+    {
+        writes[i] = (i % 3 == 0) ? 0x20 : ((i % 3 == 1) ? 0 : 0x21);
+    }
+
+    TestSequence(&probe, writes, ARRAYSIZE(writes));
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, index + 14);
+
+    for (ULONG i = 0; i < ARRAYSIZE(writes); i += 3)
+    {
+        TestWriteRecord(&probe.Records[index], 1, STATUS_SUCCESS);
+        CHECK_EQ(probe.Records[index].TransferIndex, i);
+        index++;
+    }
+
+    //
+    // Only the last transfer matches, past the first 32.
+    //
+
+    for (ULONG i = 0; i < ARRAYSIZE(writes); i++)
+    {
+        writes[i] = (i % 2 == 0) ? 0 : 0x21;
+    }
+
+    writes[ARRAYSIZE(writes) - 1] = 0x20;
+
+    TestSequence(&probe, writes, ARRAYSIZE(writes));
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, index + 1);
+    TestWriteRecord(&probe.Records[index], 1, STATUS_SUCCESS);
+    CHECK_EQ(probe.Records[index].TransferIndex, ARRAYSIZE(writes) - 1);
+    index++;
+
+    // None does.
+    writes[ARRAYSIZE(writes) - 1] = 0x21;
+
+    TestSequence(&probe, writes, ARRAYSIZE(writes));
+    TestSequence(&probe, writes, 3);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, index);
+
+    TestProbeClose(&probe);
+
+    //
+    // A program which does not validate, here without its final
+    // return, is ignored and everything is captured.
+    //
+
+    const HOST_VALUE invalid[] =
+    {
+        { L"CaptureRepeats", 0, nullptr, 0 },
+        { L"CaptureFilter", 0, builder.Program, (count - 1) * (ULONG)sizeof(SPB_PROBE_FILTER_INSN) },
+    };
+
+    TestProbeOpen(&probe, invalid, ARRAYSIZE(invalid));
+
+    TestWrite(&probe, other, sizeof(other), STATUS_SUCCESS);
+    TestRead(&probe, 2, STATUS_SUCCESS);
+
+    TestProbeRead(&probe);
+    CHECK_EQ(probe.RecordCount, 2);
+    TestWriteRecord(&probe.Records[0], 2, STATUS_SUCCESS);
+    TestTransferRecord(&probe.Records[1], 2, STATUS_SUCCESS);
+
+    TestProbeClose(&probe);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestTrigger(0);
+    TestTrigger(1);
+    TestTrigger(2);
+    TestWireTimePerTarget();
+    TestControlQueryRace();
+    TestModeNone();
+    TestRepeats(1);
+    TestRepeats(0);
+    TestFilter();
+
+    return HostTestReport("capture_test");
+}
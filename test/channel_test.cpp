@@ -0,0 +1,405 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    channel_test.cpp
+
+Abstract:
+
+    This module checks SpbChannelWrite of channel.cpp on the
+    smallest capture channel the driver accepts: a record which
+    does not fit before the end of the data area is preceded by a
+    padding record and starts over at its beginning, the padding
+    counts against the free space, and whatever Tail the consumer
+    writes to the shared header the driver never writes outside
+    the data area.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "internal.h"
+#include "channel.h"
+
+#define TEST_CONNECTION_ID  0x2a
+#define TEST_ADDRESS        0x50
+
+// Header, one page of data and a guard the driver must not touch,
+// the data area being the largest power of two fitting after the
+// header.
+#define TEST_DATA_OFFSET    64
+#define TEST_DATA_SIZE      PAGE_SIZE
+#define TEST_GUARD_SIZE     256
+#define TEST_CHANNEL_LENGTH (TEST_DATA_OFFSET + TEST_DATA_SIZE + TEST_GUARD_SIZE)
+
+#define TEST_GUARD          0xcc
+
+#define TEST_RECORD_SIZE    1000
+#define TEST_MAX_RECORDS    16
+
+typedef struct TEST_CHANNEL
+{
+    WDFDEVICE Device;
+    SPBTARGET Target;
+    WDFREQUEST Channel;
+    PPBC_DEVICE pDevice;
+    PSPB_PROBE_CHANNEL pHeader;
+    PUCHAR pData;
+
+    // TransferLength of the records read, in order.
+    ULONG RecordCount;
+    ULONG Records[TEST_MAX_RECORDS];
+}
+TEST_CHANNEL;
+
+static
+VOID
+TestChannelOpen(
+    TEST_CHANNEL*  pTest
+    )
+{
+    const LONGLONG id = TEST_CONNECTION_ID;
+
+    memset(pTest, 0, sizeof(*pTest));
+
+    pTest->Device = HostDeviceAdd(nullptr, 0);
+    CHECK(pTest->Device != nullptr);
+    CHECK_EQ(HostDeviceStart(pTest->Device, &id, 1), STATUS_SUCCESS);
+
+    pTest->Target = HostTargetConnect(pTest->Device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(pTest->Target != nullptr);
+
+    pTest->Channel = HostSubmitIoctl(
+        pTest->Target,
+        IOCTL_SPB_PROBE_MAP_CAPTURE,
+        nullptr,
+        0,
+        TEST_CHANNEL_LENGTH);
+
+    CHECK(!HostRequestCompleted(pTest->Channel));
+
+    pTest->pDevice = GetDeviceContext(pTest->Device);
+    pTest->pHeader = pTest->pDevice->Channel.pHeader;
+    pTest->pData = (PUCHAR)pTest->pHeader + TEST_DATA_OFFSET;
+
+    CHECK(pTest->pHeader == (PSPB_PROBE_CHANNEL)HostRequestData(pTest->Channel, 0));
+    CHECK_EQ(pTest->pHeader->Magic, SPB_PROBE_CHANNEL_MAGIC);
+    CHECK_EQ(pTest->pHeader->DataOffset, TEST_DATA_OFFSET);
+    CHECK_EQ(pTest->pHeader->DataSize, TEST_DATA_SIZE);
+
+    memset(pTest->pData + TEST_DATA_SIZE, TEST_GUARD, TEST_GUARD_SIZE);
+}
+
+static
+VOID
+TestChannelClose(
+    TEST_CHANNEL*  pTest
+    )
+{
+    HostRequestCancel(pTest->Channel);
+    CHECK_EQ(HostRequestStatus(pTest->Channel), STATUS_CANCELLED);
+    HostRequestFree(pTest->Channel);
+
+    HostTargetDisconnect(pTest->Target);
+    HostDeviceRemove(pTest->Device);
+
+    CHECK_EQ(g_HostCounters.ObjectCreates, g_HostCounters.ObjectDeletes);
+    CHECK_EQ(g_HostCounters.PoolAllocations, g_HostCounters.PoolFrees);
+}
+
+//
+// Writes a record of Size bytes tagged with Tag, under the
+// channel lock as the drain does.
+//
+
+static
+BOOLEAN
+TestWrite(
+    TEST_CHANNEL*  pTest,
+    ULONG          Size,
+    ULONG          Tag
+    )
+{
+    UCHAR buffer[TEST_RECORD_SIZE + 8];
+    PSPB_PROBE_RECORD pRecord = (PSPB_PROBE_RECORD)buffer;
+    BOOLEAN written;
+
+    memset(buffer, (UCHAR)Tag, sizeof(buffer));
+    pRecord->Size = Size;
+    pRecord->Version = SPB_PROBE_RECORD_VERSION;
+    pRecord->Type = SPB_PROBE_RECORD_TYPE_TRANSFER;
+    pRecord->TransferLength = Tag;
+
+    WdfSpinLockAcquire(pTest->pDevice->Channel.Lock);
+    written = SpbChannelWrite(pTest->pDevice, pRecord);
+    WdfSpinLockRelease(pTest->pDevice->Channel.Lock);
+
+    return written;
+}
+
+static
+VOID
+TestOnRecord(
+    PVOID                    Context,
+    const SPB_PROBE_RECORD*  pRecord
+    )
+{
+    TEST_CHANNEL* pTest = (TEST_CHANNEL*)Context;
+    const UCHAR* pPayload = (const UCHAR*)(pRecord + 1);
+
+    CHECK_EQ(pRecord->Type, SPB_PROBE_RECORD_TYPE_TRANSFER);
+    CHECK_EQ(pRecord->Size, TEST_RECORD_SIZE);
+
+    // The record arrives whole, not torn by the wrap.
+    for (ULONG i = 0; i < TEST_RECORD_SIZE - sizeof(SPB_PROBE_RECORD); i++)
+    {
+        if (pPayload[i] != (UCHAR)pRecord->TransferLength)
+        {
+            CHECK(!"payload corrupted");
+            break;
+        }
+    }
+
+    if (pTest->RecordCount == TEST_MAX_RECORDS)
+    {
+        CHECK(!"too many records");
+        return;
+    }
+
+    pTest->Records[pTest->RecordCount++] = pRecord->TransferLength;
+}
+
+static
+ULONG
+TestRead(
+    TEST_CHANNEL*  pTest
+    )
+{
+    return SpbProbeChannelRead(pTest->pHeader, TestOnRecord, pTest);
+}
+
+static
+VOID
+TestGuard(
+    TEST_CHANNEL*  pTest
+    )
+{
+    for (ULONG i = 0; i < TEST_GUARD_SIZE; i++)
+    {
+        if (pTest->pData[TEST_DATA_SIZE + i] != TEST_GUARD)
+        {
+            CHECK(!"write past the data area");
+            break;
+        }
+    }
+
+    CHECK_EQ(pTest->pHeader->Magic, SPB_PROBE_CHANNEL_MAGIC);
+    CHECK_EQ(pTest->pHeader->DataOffset, TEST_DATA_OFFSET);
+    CHECK_EQ(pTest->pHeader->DataSize, TEST_DATA_SIZE);
+}
+
+static
+VOID
+TestWrapAround(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Four records fill the data area up to 96 bytes from its end.
+    Once they are read, the fifth is preceded by a 96 byte padding
+    record, which the consumer skips, and starts at offset 0.
+
+--*/
+{
+    const ULONG end = 4 * ALIGN_UP_BY(TEST_RECORD_SIZE, 8);
+    const ULONG padding = TEST_DATA_SIZE - end;
+    TEST_CHANNEL test;
+
+    TestChannelOpen(&test);
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        CHECK(TestWrite(&test, TEST_RECORD_SIZE, i + 1));
+    }
+
+    CHECK_EQ(test.pHeader->Head, end);
+
+    // Not even a small record fits behind the unread ones.
+    CHECK(!TestWrite(&test, TEST_RECORD_SIZE, 9));
+    CHECK_EQ(test.pHeader->Head, end);
+
+    CHECK_EQ(TestRead(&test), 4);
+    CHECK_EQ(test.pHeader->Tail, end);
+
+    CHECK(TestWrite(&test, TEST_RECORD_SIZE, 5));
+    CHECK_EQ(test.pHeader->Head, TEST_DATA_SIZE + ALIGN_UP_BY(TEST_RECORD_SIZE, 8));
+
+    const SPB_PROBE_RECORD* pPadding = (const SPB_PROBE_RECORD*)(test.pData + end);
+
+    CHECK_EQ(pPadding->Type, SPB_PROBE_RECORD_TYPE_PADDING);
+    CHECK_EQ(pPadding->Version, SPB_PROBE_RECORD_VERSION);
+    CHECK_EQ(pPadding->Size, padding);
+    CHECK_EQ(((const SPB_PROBE_RECORD*)test.pData)->TransferLength, 5);
+
+    CHECK_EQ(TestRead(&test), 1);
+    CHECK_EQ(test.pHeader->Tail, test.pHeader->Head);
+
+    for (ULONG i = 0; i < 5; i++)
+    {
+        CHECK_EQ(test.Records[i], i + 1);
+    }
+
+    TestGuard(&test);
+    TestChannelClose(&test);
+}
+
+static
+VOID
+TestPaddingFull(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    The padding needs room too: with the first record read, the
+    next one fits exactly with its padding, and not when the
+    consumer is 8 bytes further behind.
+
+--*/
+{
+    const ULONG size = ALIGN_UP_BY(TEST_RECORD_SIZE, 8);
+    const ULONG end = 4 * size;
+    TEST_CHANNEL test;
+
+    TestChannelOpen(&test);
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        CHECK(TestWrite(&test, TEST_RECORD_SIZE, i + 1));
+    }
+
+    // The consumer is in the middle of the first record.
+    test.pHeader->Tail = size - 8;
+
+    CHECK(!TestWrite(&test, TEST_RECORD_SIZE, 5));
+    CHECK_EQ(test.pHeader->Head, end);
+
+    // The first record is read.
+    test.pHeader->Tail = size;
+
+    CHECK(TestWrite(&test, TEST_RECORD_SIZE, 5));
+    CHECK_EQ(test.pHeader->Head, TEST_DATA_SIZE + size);
+    CHECK_EQ(test.pHeader->Head - test.pHeader->Tail, TEST_DATA_SIZE);
+
+    CHECK_EQ(TestRead(&test), 4);
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        CHECK_EQ(test.Records[i], i + 2);
+    }
+
+    TestGuard(&test);
+    TestChannelClose(&test);
+}
+
+static
+VOID
+TestUntrustedTail(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A Tail ahead of Head, or more than the data area behind it,
+    makes the channel look full. Any other value is taken as is.
+    Whatever the consumer writes, nothing is written outside the
+    data area and Head only moves forward by whole records.
+
+--*/
+{
+    const ULONG size = ALIGN_UP_BY(TEST_RECORD_SIZE, 8);
+    ULONG seed = 0x2545f491;
+    TEST_CHANNEL test;
+
+    TestChannelOpen(&test);
+
+    CHECK(TestWrite(&test, TEST_RECORD_SIZE, 1));
+
+    LONG head = test.pHeader->Head;
+
+    test.pHeader->Tail = head + 8;
+    CHECK(!TestWrite(&test, TEST_RECORD_SIZE, 2));
+
+    test.pHeader->Tail = head - TEST_DATA_SIZE - 8;
+    CHECK(!TestWrite(&test, TEST_RECORD_SIZE, 2));
+
+    test.pHeader->Tail = 0x7fffffff;
+    CHECK(!TestWrite(&test, TEST_RECORD_SIZE, 2));
+
+    CHECK_EQ(test.pHeader->Head, head);
+
+    for (ULONG i = 0; i < 4096; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+
+        LONG tail;
+
+        switch (seed >> 30)
+        {
+        case 0:
+            // Anywhere.
+            tail = (LONG)(seed * 2654435761u);
+            break;
+
+        case 1:
+            // Around the data area behind Head.
+            tail = head - TEST_DATA_SIZE + (LONG)((seed >> 8) % 64) - 32;
+            break;
+
+        default:
+            // Within the data area behind Head, even mid-record.
+            tail = head - (LONG)((seed >> 8) % (TEST_DATA_SIZE + 1));
+            break;
+        }
+
+        test.pHeader->Tail = tail;
+
+        BOOLEAN written = TestWrite(&test, TEST_RECORD_SIZE, 3);
+        ULONG used = (ULONG)(head - tail);
+        ULONG offset = (ULONG)head & (TEST_DATA_SIZE - 1);
+        ULONG padding = (offset + size > TEST_DATA_SIZE) ? TEST_DATA_SIZE - offset : 0;
+
+        CHECK_EQ(written, used <= TEST_DATA_SIZE && used + padding + size <= TEST_DATA_SIZE);
+        CHECK_EQ(test.pHeader->Head, head + (written ? (LONG)(padding + size) : 0));
+
+        head = test.pHeader->Head;
+    }
+
+    TestGuard(&test);
+    TestChannelClose(&test);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestWrapAround();
+    TestPaddingFull();
+    TestUntrustedTail();
+
+    return HostTestReport("channel_test");
+}
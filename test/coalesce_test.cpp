@@ -0,0 +1,431 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    coalesce_test.cpp
+
+Abstract:
+
+    This module runs the driver against the mock controller of
+    host/wdfhost.h with CoalesceLocks set, and checks what goes on
+    the wire for the lock windows of an I2C target: the lock and
+    unlock go to the controller, a write held once the lock is
+    taken is sent ahead of the next transfer of the window in one
+    sequence and completed with its status, and a write nothing
+    carries is sent alone.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "spbprobe.h"
+
+#define TEST_CONNECTION_ID  0x2a
+#define TEST_ADDRESS        0x50
+
+static const UCHAR s_Register[] = { 0x10, 0x20 };
+
+typedef struct TEST_PROBE
+{
+    WDFDEVICE Device;
+    SPBTARGET Target;
+}
+TEST_PROBE;
+
+static
+VOID
+TestProbeOpen(
+    TEST_PROBE*  pProbe,
+    ULONG        QueueDepth
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CoalesceLocks", 1, nullptr, 0 },
+        { L"QueueDepth", QueueDepth, nullptr, 0 },
+    };
+    const LONGLONG id = TEST_CONNECTION_ID;
+
+    HostWireClear();
+
+    pProbe->Device = HostDeviceAdd(values, ARRAYSIZE(values));
+    CHECK(pProbe->Device != nullptr);
+    CHECK_EQ(HostDeviceStart(pProbe->Device, &id, 1), STATUS_SUCCESS);
+
+    pProbe->Target = HostTargetConnect(pProbe->Device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(pProbe->Target != nullptr);
+}
+
+static
+VOID
+TestProbeClose(
+    TEST_PROBE*  pProbe
+    )
+{
+    CHECK_EQ(HostControllerPending(), 0);
+
+    HostTargetDisconnect(pProbe->Target);
+    HostDeviceRemove(pProbe->Device);
+
+    // Nothing the driver created outlives the device.
+    CHECK_EQ(g_HostCounters.ObjectCreates, g_HostCounters.ObjectDeletes);
+    CHECK_EQ(g_HostCounters.PoolAllocations, g_HostCounters.PoolFrees);
+}
+
+//
+// Checks a client request completed with the status and byte
+// count given, then frees it.
+//
+
+static
+VOID
+TestCompleted(
+    WDFREQUEST  Request,
+    NTSTATUS    Status,
+    ULONG_PTR   Information
+    )
+{
+    CHECK(HostRequestCompleted(Request));
+    CHECK_EQ(HostRequestStatus(Request), Status);
+    CHECK_EQ(HostRequestInformation(Request), Information);
+
+    HostRequestFree(Request);
+}
+
+static
+VOID
+TestLockWire(
+    const HOST_WIRE_REQUEST*  pWire,
+    ULONG                     IoControlCode
+    )
+{
+    CHECK_EQ(pWire->Kind, HOST_WIRE_IOCTL);
+    CHECK_EQ(pWire->IoControlCode, IoControlCode);
+    CHECK_EQ(pWire->ConnectionId, TEST_CONNECTION_ID);
+    CHECK_EQ(pWire->TransferCount, 0);
+}
+
+//
+// Locks the controller for the target, the lock goes on the
+// wire and completes before the window starts.
+//
+
+static
+VOID
+TestLock(
+    TEST_PROBE*  pProbe
+    )
+{
+    ULONG count = HostWireCount();
+    WDFREQUEST lock = HostSubmitLock(pProbe->Target);
+
+    CHECK(!HostRequestCompleted(lock));
+    CHECK_EQ(HostWireCount(), count + 1);
+    TestLockWire(HostWireGet(count), IOCTL_SPB_LOCK_CONTROLLER);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(lock, STATUS_SUCCESS, 0);
+}
+
+static
+VOID
+TestUnlock(
+    TEST_PROBE*  pProbe
+    )
+{
+    ULONG count = HostWireCount();
+    WDFREQUEST unlock = HostSubmitUnlock(pProbe->Target);
+
+    CHECK_EQ(HostWireCount(), count + 1);
+    TestLockWire(HostWireGet(count), IOCTL_SPB_UNLOCK_CONTROLLER);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(unlock, STATUS_SUCCESS, 0);
+}
+
+static
+VOID
+TestHeldWrite(
+    const HOST_WIRE_TRANSFER*  pTransfer
+    )
+{
+    CHECK_EQ(pTransfer->Direction, SpbTransferDirectionToDevice);
+    CHECK_EQ(pTransfer->Format, SpbTransferBufferFormatMdl);
+    CHECK_EQ(pTransfer->DelayInUs, 0);
+    CHECK_EQ(pTransfer->Length, sizeof(s_Register));
+    CHECK(memcmp(pTransfer->Data, s_Register, sizeof(s_Register)) == 0);
+}
+
+static
+VOID
+TestLockWriteReadUnlock(
+    ULONG  QueueDepth
+    )
+/*++
+
+  Routine Description:
+
+    Lock, write the register address, read the register, unlock:
+    the write is held until the read carries it, one sequence of
+    both goes on the wire between the lock and the unlock, and
+    every client request completes with its own byte count.
+
+--*/
+{
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, QueueDepth);
+    TestLock(&probe);
+
+    WDFREQUEST write = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+
+    // Held, nothing is sent.
+    CHECK(!HostRequestCompleted(write));
+    CHECK_EQ(HostWireCount(), 1);
+
+    WDFREQUEST read = HostSubmitRead(probe.Target, 4);
+
+    CHECK_EQ(HostControllerPending(), 1);
+    CHECK_EQ(HostWireCount(), 2);
+
+    const HOST_WIRE_REQUEST* pWire = HostWireGet(1);
+
+    CHECK_EQ(pWire->Kind, HOST_WIRE_IOCTL);
+    CHECK_EQ(pWire->IoControlCode, IOCTL_SPB_EXECUTE_SEQUENCE);
+    CHECK_EQ(pWire->ConnectionId, TEST_CONNECTION_ID);
+    CHECK_EQ(pWire->Status, STATUS_SUCCESS);
+    CHECK_EQ(pWire->TransferCount, 2);
+
+    TestHeldWrite(&pWire->Transfers[0]);
+
+    CHECK_EQ(pWire->Transfers[1].Direction, SpbTransferDirectionFromDevice);
+    CHECK_EQ(pWire->Transfers[1].Format, SpbTransferBufferFormatMdl);
+    CHECK_EQ(pWire->Transfers[1].Length, 4);
+
+    // Neither completes before the sequence does.
+    CHECK(!HostRequestCompleted(write));
+    CHECK(!HostRequestCompleted(read));
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+
+    // The held write does not count in the bytes of the read.
+    TestCompleted(write, STATUS_SUCCESS, sizeof(s_Register));
+    CHECK(HostRequestCompleted(read));
+    CHECK_EQ(HostRequestData(read, 0)[0], HOST_READ_PATTERN(0));
+    CHECK_EQ(HostRequestData(read, 0)[3], HOST_READ_PATTERN(3));
+    TestCompleted(read, STATUS_SUCCESS, 4);
+
+    TestUnlock(&probe);
+    CHECK_EQ(HostWireCount(), 3);
+
+    // The timer found nothing to send.
+    CHECK_EQ(HostTimerExpire(), 0);
+
+    // Only the write saved a round trip.
+    WDFREQUEST query = HostSubmitIoctl(probe.Target, IOCTL_SPB_PROBE_QUERY_STATS, nullptr, 0, sizeof(SPB_PROBE_STATS));
+    const SPB_PROBE_STATS* pStats = (const SPB_PROBE_STATS*)HostRequestData(query, 0);
+
+    CHECK_EQ(HostRequestStatus(query), STATUS_SUCCESS);
+    CHECK_EQ(pStats->Transactions, 4);
+    CHECK_EQ(pStats->Coalesced, 1);
+    CHECK_EQ(pStats->InFlight, 0);
+    HostRequestFree(query);
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestLockWriteUnlock(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Lock, write, unlock: the unlock sends the held write alone
+    ahead of it, the write completes with its own status and the
+    unlock only reaches the controller after it.
+
+--*/
+{
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, 4);
+    TestLock(&probe);
+
+    WDFREQUEST write = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+    WDFREQUEST unlock = HostSubmitUnlock(probe.Target);
+
+    CHECK_EQ(HostWireCount(), 3);
+    CHECK_EQ(HostWireGet(1)->Kind, HOST_WIRE_WRITE);
+    CHECK_EQ(HostWireGet(1)->TransferCount, 1);
+    CHECK(memcmp(HostWireGet(1)->Transfers[0].Data, s_Register, sizeof(s_Register)) == 0);
+    TestLockWire(HostWireGet(2), IOCTL_SPB_UNLOCK_CONTROLLER);
+
+    CHECK(HostControllerComplete(STATUS_IO_DEVICE_ERROR));
+    TestCompleted(write, STATUS_IO_DEVICE_ERROR, 0);
+    CHECK(!HostRequestCompleted(unlock));
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(unlock, STATUS_SUCCESS, 0);
+
+    // The window is closed, a write is sent as it is.
+    WDFREQUEST after = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+
+    CHECK_EQ(HostWireCount(), 4);
+    CHECK_EQ(HostWireGet(3)->Kind, HOST_WIRE_WRITE);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(after, STATUS_SUCCESS, sizeof(s_Register));
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestLockWriteFailedRead(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Lock, write, read failed by the controller: the held write
+    and the read carrying it both complete with the failure of
+    their sequence, without bytes.
+
+--*/
+{
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, 4);
+    TestLock(&probe);
+
+    WDFREQUEST write = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+    WDFREQUEST read = HostSubmitRead(probe.Target, 2);
+
+    CHECK_EQ(HostWireCount(), 2);
+    CHECK_EQ(HostWireGet(1)->TransferCount, 2);
+
+    CHECK(HostControllerComplete(STATUS_IO_DEVICE_ERROR));
+    TestCompleted(write, STATUS_IO_DEVICE_ERROR, 0);
+    TestCompleted(read, STATUS_IO_DEVICE_ERROR, 0);
+
+    TestUnlock(&probe);
+    CHECK_EQ(HostWireCount(), 3);
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestHeldWriteTimeout(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A write no transfer comes to carry, as a client waiting for
+    its completion leaves it, is sent alone by the timer, and the
+    next transfer of the window is sent alone too.
+
+--*/
+{
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, 4);
+    TestLock(&probe);
+
+    WDFREQUEST write = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+
+    CHECK_EQ(HostWireCount(), 1);
+    CHECK_EQ(HostTimerExpire(), 1);
+
+    CHECK_EQ(HostWireCount(), 2);
+    CHECK_EQ(HostWireGet(1)->Kind, HOST_WIRE_WRITE);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(write, STATUS_SUCCESS, sizeof(s_Register));
+
+    WDFREQUEST read = HostSubmitRead(probe.Target, 4);
+
+    CHECK_EQ(HostWireCount(), 3);
+    CHECK_EQ(HostWireGet(2)->Kind, HOST_WIRE_READ);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(read, STATUS_SUCCESS, 4);
+
+    TestUnlock(&probe);
+
+    TestProbeClose(&probe);
+}
+
+static
+VOID
+TestNotHeld(
+    ULONG     QueueDepth,
+    NTSTATUS  LockStatus
+    )
+/*++
+
+  Routine Description:
+
+    Without the controller lock, or with a sequential queue that
+    would not present the next request past a held one, a write
+    is sent as it is.
+
+--*/
+{
+    TEST_PROBE probe;
+
+    TestProbeOpen(&probe, QueueDepth);
+
+    WDFREQUEST lock = HostSubmitLock(probe.Target);
+
+    CHECK(HostControllerComplete(LockStatus));
+    TestCompleted(lock, LockStatus, 0);
+
+    WDFREQUEST write = HostSubmitWrite(probe.Target, s_Register, sizeof(s_Register));
+
+    CHECK_EQ(HostWireCount(), 2);
+    CHECK_EQ(HostWireGet(1)->Kind, HOST_WIRE_WRITE);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    TestCompleted(write, STATUS_SUCCESS, sizeof(s_Register));
+
+    if (NT_SUCCESS(LockStatus))
+    {
+        TestUnlock(&probe);
+    }
+
+    CHECK_EQ(HostTimerExpire(), 0);
+
+    TestProbeClose(&probe);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestLockWriteReadUnlock(2);
+    TestLockWriteReadUnlock(8);
+    TestLockWriteUnlock();
+    TestLockWriteFailedRead();
+    TestHeldWriteTimeout();
+    TestNotHeld(4, STATUS_IO_DEVICE_ERROR);
+    TestNotHeld(1, STATUS_SUCCESS);
+
+    return HostTestReport("coalesce_test");
+}
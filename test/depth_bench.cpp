@@ -0,0 +1,196 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    depth_bench.cpp
+
+Abstract:
+
+    This module measures the throughput of the driver at each
+    QueueDepth against a simulated controller with latency, on the
+    virtual clock of host/wdfhost.h.
+
+    The controller runs one transfer at a time on the bus. A
+    request sent at time T reaches it at T + SUBMIT_LATENCY, is on
+    the bus for the transfer time once the bus is free, and its completion
+    reaches the driver COMPLETION_LATENCY later. The client keeps
+    CLIENT_REQUESTS reads outstanding, resubmitting each one as it
+    completes. At depth 1 the bus idles for both latencies between
+    two requests; deeper pools keep requests waiting on the bus.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include <deque>
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+
+// Times in 100 ns ticks of the virtual clock. The bus times are
+// those of a 4 byte register read at 400 kHz and at 1 MHz with a
+// short turnaround.
+#define SUBMIT_LATENCY      200
+#define COMPLETION_LATENCY  300
+
+static const LONGLONG s_BusTimes[] = { 1000, 200 };
+static const ULONG s_Depths[] = { 1, 2, 4, 8 };
+
+#define CLIENT_REQUESTS     8
+#define COMPLETIONS         20000
+
+typedef struct BENCH_CONTROLLER
+{
+    LONGLONG Now;
+    LONGLONG BusFree;
+    LONGLONG BusTime;
+    LONGLONG TransferTime;
+    ULONGLONG Sends;
+    ULONG MaxInFlight;
+
+    // Times the pending requests complete at, oldest first.
+    std::deque<LONGLONG> Due;
+}
+BENCH_CONTROLLER;
+
+//
+// Schedules the requests the driver sent since the last call.
+//
+
+static
+VOID
+BenchSchedule(
+    _Inout_ BENCH_CONTROLLER*  pController
+    )
+{
+    for (; pController->Sends < g_HostCounters.Sends; pController->Sends++)
+    {
+        LONGLONG start = pController->Now + SUBMIT_LATENCY;
+
+        if (start < pController->BusFree)
+        {
+            start = pController->BusFree;
+        }
+
+        pController->BusFree = start + pController->TransferTime;
+        pController->BusTime += pController->TransferTime;
+        pController->Due.push_back(pController->BusFree + COMPLETION_LATENCY);
+    }
+
+    if (HostControllerPending() > pController->MaxInFlight)
+    {
+        pController->MaxInFlight = HostControllerPending();
+    }
+}
+
+static
+VOID
+BenchDepth(
+    _In_  ULONG     QueueDepth,
+    _In_  LONGLONG  TransferTime
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"QueueDepth", QueueDepth, nullptr, 0 },
+        { L"CaptureMode", 0, nullptr, 0 },
+    };
+    const LONGLONG id = 1;
+    BENCH_CONTROLLER controller;
+    WDFREQUEST requests[CLIENT_REQUESTS];
+    WDFDEVICE device;
+    SPBTARGET target;
+    double start;
+    double elapsed;
+
+    controller.Now = 0;
+    controller.BusFree = 0;
+    controller.BusTime = 0;
+    controller.TransferTime = TransferTime;
+    controller.MaxInFlight = 0;
+
+    HostClockSet(0);
+
+    device = HostDeviceAdd(values, ARRAYSIZE(values));
+    HostDeviceStart(device, &id, 1);
+    target = HostTargetConnect(device, HOST_BUS_I2C, 0x50, 400000);
+
+    controller.Sends = g_HostCounters.Sends;
+    start = HostNow();
+
+    for (ULONG i = 0; i < CLIENT_REQUESTS; i++)
+    {
+        requests[i] = HostSubmitRead(target, 4);
+        BenchSchedule(&controller);
+    }
+
+    for (ULONG completed = 0; completed < COMPLETIONS; completed++)
+    {
+        controller.Now = controller.Due.front();
+        controller.Due.pop_front();
+
+        HostClockSet(controller.Now);
+        HostControllerComplete(STATUS_SUCCESS);
+        BenchSchedule(&controller);
+
+        for (ULONG i = 0; i < CLIENT_REQUESTS; i++)
+        {
+            if (HostRequestCompleted(requests[i]))
+            {
+                HostRequestResubmit(requests[i]);
+                BenchSchedule(&controller);
+            }
+        }
+    }
+
+    elapsed = HostNow() - start;
+
+    printf("depth_bench: bus %lld us, QueueDepth %lu: %.0f requests/s, bus busy %.0f%%, "
+        "%lu in flight, %.0f ns host time per request\n",
+        (long long)(TransferTime / 10),
+        (unsigned long)QueueDepth,
+        COMPLETIONS * (double)HOST_CLOCK_FREQUENCY / controller.Now,
+        100.0 * controller.BusTime / controller.BusFree,
+        (unsigned long)controller.MaxInFlight,
+        elapsed / COMPLETIONS);
+
+    while (HostControllerComplete(STATUS_SUCCESS))
+    {
+    }
+
+    for (ULONG i = 0; i < CLIENT_REQUESTS; i++)
+    {
+        HostRequestFree(requests[i]);
+    }
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+}
+
+int
+main(
+    VOID
+    )
+{
+    HostWireSetLogging(FALSE);
+
+    printf("depth_bench: submit %u us, completion %u us, %u client requests\n",
+        SUBMIT_LATENCY / 10, COMPLETION_LATENCY / 10, CLIENT_REQUESTS);
+
+    for (ULONG i = 0; i < ARRAYSIZE(s_BusTimes); i++)
+    {
+        for (ULONG j = 0; j < ARRAYSIZE(s_Depths); j++)
+        {
+            BenchDepth(s_Depths[j], s_BusTimes[i]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,380 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    filter_test.cpp
+
+Abstract:
+
+    This module tests the capture filter validator, interpreter
+    and builder of spbprobe.h.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "spbprobe.h"
+
+static
+SPB_PROBE_FILTER_INSN
+Insn(
+    UCHAR  Code,
+    UCHAR  JumpTrue,
+    UCHAR  JumpFalse,
+    ULONG  K
+    )
+{
+    SPB_PROBE_FILTER_INSN insn = { Code, JumpTrue, JumpFalse, 0, K };
+    return insn;
+}
+
+static
+SPB_PROBE_FILTER_INPUT
+Input(
+    ULONG         Direction,
+    ULONG         Length,
+    ULONG         Status,
+    ULONG         Index,
+    const UCHAR*  pBytes,
+    ULONG         ByteCount
+    )
+{
+    SPB_PROBE_FILTER_INPUT input = {};
+
+    input.Fields[SPB_PROBE_FILTER_FIELD_DIRECTION] = Direction;
+    input.Fields[SPB_PROBE_FILTER_FIELD_LENGTH] = Length;
+    input.Fields[SPB_PROBE_FILTER_FIELD_STATUS] = Status;
+    input.Fields[SPB_PROBE_FILTER_FIELD_INDEX] = Index;
+    input.ByteCount = ByteCount;
+
+    if (ByteCount != 0)
+    {
+        memcpy(input.Bytes, pBytes, ByteCount);
+    }
+
+    return input;
+}
+
+static
+VOID
+TestValidate(
+    VOID
+    )
+{
+    SPB_PROBE_FILTER_INSN program[SPB_PROBE_FILTER_MAX_INSNS + 1];
+    ULONG bytesNeeded;
+
+    //
+    // Empty, too long and unterminated programs.
+    //
+
+    program[0] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    CHECK(!SpbProbeFilterValidate(program, 0, &bytesNeeded));
+    CHECK(SpbProbeFilterValidate(program, 1, &bytesNeeded));
+    CHECK_EQ(bytesNeeded, 0);
+
+    for (ULONG i = 0; i < ARRAYSIZE(program); i++)
+    {
+        program[i] = Insn(SPB_PROBE_FILTER_AND, 0, 0, 0xff);
+    }
+
+    program[SPB_PROBE_FILTER_MAX_INSNS - 1] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    program[SPB_PROBE_FILTER_MAX_INSNS] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    CHECK(SpbProbeFilterValidate(program, SPB_PROBE_FILTER_MAX_INSNS, &bytesNeeded));
+    CHECK(!SpbProbeFilterValidate(program, SPB_PROBE_FILTER_MAX_INSNS + 1, &bytesNeeded));
+    CHECK(!SpbProbeFilterValidate(program, 2, &bytesNeeded));
+
+    //
+    // Unknown instructions, fields and payload offsets.
+    //
+
+    program[0] = Insn(0x7f, 0, 0, 0);
+    program[1] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    CHECK(!SpbProbeFilterValidate(program, 2, &bytesNeeded));
+
+    program[0] = Insn(SPB_PROBE_FILTER_LD_FIELD, 0, 0, SPB_PROBE_FILTER_FIELD_COUNT - 1);
+    CHECK(SpbProbeFilterValidate(program, 2, &bytesNeeded));
+    program[0].K = SPB_PROBE_FILTER_FIELD_COUNT;
+    CHECK(!SpbProbeFilterValidate(program, 2, &bytesNeeded));
+
+    program[0] = Insn(SPB_PROBE_FILTER_LD_BYTE, 0, 0, SPB_PROBE_FILTER_MAX_BYTES - 1);
+    CHECK(SpbProbeFilterValidate(program, 2, &bytesNeeded));
+    CHECK_EQ(bytesNeeded, SPB_PROBE_FILTER_MAX_BYTES);
+    program[0].K = SPB_PROBE_FILTER_MAX_BYTES;
+    CHECK(!SpbProbeFilterValidate(program, 2, &bytesNeeded));
+
+    //
+    // The bytes needed are those of the farthest load.
+    //
+
+    program[0] = Insn(SPB_PROBE_FILTER_LD_BYTE, 0, 0, 3);
+    program[1] = Insn(SPB_PROBE_FILTER_LD_BYTE, 0, 0, 1);
+    program[2] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    CHECK(SpbProbeFilterValidate(program, 3, &bytesNeeded));
+    CHECK_EQ(bytesNeeded, 4);
+
+    //
+    // Jumps must land on an instruction of the program, so
+    // they cannot skip the final return.
+    //
+
+    for (UCHAR code = SPB_PROBE_FILTER_JEQ; code <= SPB_PROBE_FILTER_JSET; code++)
+    {
+        program[0] = Insn(code, 1, 0, 0);
+        program[1] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 0);
+        program[2] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+        CHECK(SpbProbeFilterValidate(program, 3, &bytesNeeded));
+
+        program[0] = Insn(code, 2, 0, 0);
+        CHECK(!SpbProbeFilterValidate(program, 3, &bytesNeeded));
+
+        program[0] = Insn(code, 0, 2, 0);
+        CHECK(!SpbProbeFilterValidate(program, 3, &bytesNeeded));
+
+        program[0] = Insn(code, 0xff, 0xff, 0);
+        CHECK(!SpbProbeFilterValidate(program, 3, &bytesNeeded));
+    }
+}
+
+static
+VOID
+TestRun(
+    VOID
+    )
+{
+    static const UCHAR bytes[] = { 0x20, 0x81, 0x00, 0x7f };
+    SPB_PROBE_FILTER_INPUT write = Input(SPB_PROBE_DIRECTION_WRITE, 4, 0, 0, bytes, 4);
+    SPB_PROBE_FILTER_INPUT read = Input(SPB_PROBE_DIRECTION_READ, 300, 0xc0000001, 1, bytes, 0);
+    SPB_PROBE_FILTER_INSN program[8];
+
+    //
+    // Returns K, not just a boolean.
+    //
+
+    program[0] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 7);
+    CHECK_EQ(SpbProbeFilterRun(program, 1, &write), 7);
+
+    //
+    // Every field is loaded.
+    //
+
+    for (ULONG field = 0; field < SPB_PROBE_FILTER_FIELD_COUNT; field++)
+    {
+        program[0] = Insn(SPB_PROBE_FILTER_LD_FIELD, 0, 0, field);
+        program[1] = Insn(SPB_PROBE_FILTER_JEQ, 0, 1, read.Fields[field]);
+        program[2] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+        program[3] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 0);
+        CHECK_EQ(SpbProbeFilterRun(program, 4, &read), 1);
+    }
+
+    //
+    // Payload loads, masked, and a load past the captured bytes
+    // rejects the transfer.
+    //
+
+    program[0] = Insn(SPB_PROBE_FILTER_LD_BYTE, 0, 0, 1);
+    program[1] = Insn(SPB_PROBE_FILTER_AND, 0, 0, 0x0f);
+    program[2] = Insn(SPB_PROBE_FILTER_JEQ, 0, 1, 0x01);
+    program[3] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 1);
+    program[4] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 2);
+    CHECK_EQ(SpbProbeFilterRun(program, 5, &write), 1);
+    CHECK_EQ(SpbProbeFilterRun(program, 5, &read), 0);
+
+    //
+    // Conditions and both jump offsets.
+    //
+
+    struct
+    {
+        UCHAR Code;
+        ULONG A;
+        ULONG K;
+        BOOLEAN Expected;
+    }
+    conditions[] =
+    {
+        { SPB_PROBE_FILTER_JEQ,  5, 5, TRUE },
+        { SPB_PROBE_FILTER_JEQ,  5, 6, FALSE },
+        { SPB_PROBE_FILTER_JGT,  6, 5, TRUE },
+        { SPB_PROBE_FILTER_JGT,  5, 5, FALSE },
+        { SPB_PROBE_FILTER_JGE,  5, 5, TRUE },
+        { SPB_PROBE_FILTER_JGE,  4, 5, FALSE },
+        { SPB_PROBE_FILTER_JSET, 6, 2, TRUE },
+        { SPB_PROBE_FILTER_JSET, 6, 1, FALSE },
+        { SPB_PROBE_FILTER_JGT,  MAXULONG, 0x7fffffff, TRUE },
+    };
+
+    for (ULONG i = 0; i < ARRAYSIZE(conditions); i++)
+    {
+        SPB_PROBE_FILTER_INPUT input = Input(0, conditions[i].A, 0, 0, bytes, 0);
+        ULONG bytesNeeded;
+
+        program[0] = Insn(SPB_PROBE_FILTER_LD_FIELD, 0, 0, SPB_PROBE_FILTER_FIELD_LENGTH);
+        program[1] = Insn(conditions[i].Code, 2, 1, conditions[i].K);
+        program[2] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 10);
+        program[3] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 20);
+        program[4] = Insn(SPB_PROBE_FILTER_RET, 0, 0, 30);
+
+        CHECK(SpbProbeFilterValidate(program, 5, &bytesNeeded));
+        CHECK_EQ(SpbProbeFilterRun(program, 5, &input),
+            conditions[i].Expected ? 30 : 20);
+    }
+}
+
+static
+BOOLEAN
+Compare(
+    ULONG  Value,
+    ULONG  Operator,
+    ULONG  K
+    )
+{
+    switch (Operator)
+    {
+    case SPB_PROBE_FILTER_EQ: return Value == K;
+    case SPB_PROBE_FILTER_NE: return Value != K;
+    case SPB_PROBE_FILTER_GT: return Value > K;
+    case SPB_PROBE_FILTER_GE: return Value >= K;
+    case SPB_PROBE_FILTER_LT: return Value < K;
+    default:                  return Value <= K;
+    }
+}
+
+static
+VOID
+TestBuilder(
+    VOID
+    )
+{
+    SPB_PROBE_FILTER_BUILDER builder;
+    ULONG bytesNeeded;
+    ULONG count;
+
+    //
+    // Every operator on a field and on a masked byte, checked
+    // against a direct evaluation over a range of values.
+    //
+
+    for (ULONG op = SPB_PROBE_FILTER_EQ; op <= SPB_PROBE_FILTER_LE; op++)
+    {
+        SpbProbeFilterBuilderInit(&builder);
+        SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_LENGTH,
+            MAXULONG, op, 8);
+        SpbProbeFilterBuilderAddByte(&builder, 0, 0xf0, op, 0x40);
+        count = SpbProbeFilterBuilderFinish(&builder);
+
+        CHECK(count != 0);
+        CHECK(SpbProbeFilterValidate(builder.Program, count, &bytesNeeded));
+        CHECK_EQ(bytesNeeded, 1);
+
+        for (ULONG length = 0; length < 16; length++)
+        {
+            for (ULONG byte = 0; byte < 0x100; byte += 0x0b)
+            {
+                UCHAR payload = (UCHAR)byte;
+                SPB_PROBE_FILTER_INPUT input =
+                    Input(SPB_PROBE_DIRECTION_WRITE, length, 0, 0, &payload, 1);
+                BOOLEAN expected =
+                    Compare(length, op, 8) && Compare(byte & 0xf0, op, 0x40);
+
+                CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input) != 0,
+                    expected);
+            }
+        }
+    }
+
+    //
+    // The example of spbprobe.h, and a transfer too short
+    // for the byte it tests.
+    //
+
+    {
+        static const UCHAR match[] = { 0x20, 0x01 };
+        static const UCHAR other[] = { 0x21, 0x01 };
+        SPB_PROBE_FILTER_INPUT input;
+
+        SpbProbeFilterBuilderInit(&builder);
+        SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_DIRECTION,
+            MAXULONG, SPB_PROBE_FILTER_EQ, SPB_PROBE_DIRECTION_WRITE);
+        SpbProbeFilterBuilderAddByte(&builder, 0, 0xff, SPB_PROBE_FILTER_EQ, 0x20);
+        count = SpbProbeFilterBuilderFinish(&builder);
+
+        CHECK(SpbProbeFilterValidate(builder.Program, count, &bytesNeeded));
+
+        input = Input(SPB_PROBE_DIRECTION_WRITE, 2, 0, 0, match, 2);
+        CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input), 1);
+
+        input = Input(SPB_PROBE_DIRECTION_READ, 2, 0, 0, match, 2);
+        CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input), 0);
+
+        input = Input(SPB_PROBE_DIRECTION_WRITE, 2, 0, 0, other, 2);
+        CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input), 0);
+
+        input = Input(SPB_PROBE_DIRECTION_WRITE, 0, 0, 0, match, 0);
+        CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input), 0);
+    }
+
+    //
+    // Unknown operators and programs that do not fit fail.
+    //
+
+    SpbProbeFilterBuilderInit(&builder);
+    SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_LENGTH,
+        MAXULONG, SPB_PROBE_FILTER_LE + 1, 0);
+    CHECK_EQ(SpbProbeFilterBuilderFinish(&builder), 0);
+
+    SpbProbeFilterBuilderInit(&builder);
+
+    for (ULONG i = 0; i < SPB_PROBE_FILTER_MAX_INSNS / 2; i++)
+    {
+        SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_LENGTH,
+            MAXULONG, SPB_PROBE_FILTER_GE, i);
+    }
+
+    CHECK_EQ(SpbProbeFilterBuilderFinish(&builder), 0);
+
+    //
+    // The longest conjunction that fits still jumps to the
+    // reject instruction.
+    //
+
+    SpbProbeFilterBuilderInit(&builder);
+
+    for (ULONG i = 0; i < SPB_PROBE_FILTER_MAX_INSNS / 2 - 1; i++)
+    {
+        SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_LENGTH,
+            MAXULONG, SPB_PROBE_FILTER_GE, i);
+    }
+
+    count = SpbProbeFilterBuilderFinish(&builder);
+    CHECK_EQ(count, SPB_PROBE_FILTER_MAX_INSNS);
+    CHECK(SpbProbeFilterValidate(builder.Program, count, &bytesNeeded));
+
+    for (ULONG length = 0; length < SPB_PROBE_FILTER_MAX_INSNS; length++)
+    {
+        SPB_PROBE_FILTER_INPUT input = Input(0, length, 0, 0, NULL, 0);
+
+        CHECK_EQ(SpbProbeFilterRun(builder.Program, count, &input),
+            (length >= SPB_PROBE_FILTER_MAX_INSNS / 2 - 2) ? 1 : 0);
+    }
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestValidate();
+    TestRun();
+    TestBuilder();
+
+    return HostTestReport("filter_test");
+}
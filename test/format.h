@@ -0,0 +1,66 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    format.h
+
+Abstract:
+
+    This module declares the two builds of the record decoder
+    used by the format tests and benchmark. Both are called out of
+    line, so that they are timed alike.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+//
+// The decoder as spbprobe.h builds it for the host, with SSE2 where
+// the host has it, in format_simd.cpp.
+//
+
+// Whether SPB_PROBE_SSE2 was selected.
+extern const BOOLEAN FormatSimdEnabled;
+
+CHAR*
+FormatBytesSimd(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    );
+
+ULONG
+FormatRecordSimd(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    );
+
+//
+// The decoder built with SPB_PROBE_NO_SIMD, in format_scalar.cpp.
+//
+
+CHAR*
+FormatBytesScalar(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    );
+
+ULONG
+FormatRecordScalar(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    );
+
+#endif // _FORMAT_H_
@@ -0,0 +1,132 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    format_bench.cpp
+
+Abstract:
+
+    This module compares the SSE2 and scalar builds of the hex
+    formatting of the record decoder. The two are timed in turns
+    within the same program and the best round of each is kept,
+    which filters out most of the noise of a shared host.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "spbprobe.h"
+#include "format.h"
+
+#define ROUNDS      25
+#define ITERATIONS  500000
+#define RECORDS     5000
+
+typedef struct FORMAT_PAYLOAD
+{
+    SPB_PROBE_RECORD Header;
+    UCHAR Payload[SPB_PROBE_RECORD_MAX_PAYLOAD];
+}
+FORMAT_PAYLOAD;
+
+static
+VOID
+CountLine(
+    _In_opt_ PVOID        Context,
+    _In_z_   const CHAR*  pLine
+    )
+{
+    HOST_KEEP(pLine);
+    (*(ULONG*)Context)++;
+}
+
+static
+double
+TimeBytes(
+    _In_  CHAR* (*FormatBytes)(CHAR*, const UCHAR*, ULONG),
+    _In_  const FORMAT_PAYLOAD*  pRecord
+    )
+{
+    CHAR text[3 * 16];
+    double start = HostNow();
+
+    for (ULONG i = 0; i < ITERATIONS; i++)
+    {
+        HOST_KEEP(FormatBytes(text, pRecord->Payload + (i & 0x3f0), 16));
+    }
+
+    return (HostNow() - start) / ITERATIONS;
+}
+
+static
+double
+TimeRecord(
+    _In_  ULONG (*FormatRecord)(const SPB_PROBE_RECORD*, PSPB_PROBE_LINE_CALLBACK, PVOID),
+    _In_  const FORMAT_PAYLOAD*  pRecord
+    )
+{
+    ULONG lines = 0;
+    double start = HostNow();
+
+    for (ULONG i = 0; i < RECORDS; i++)
+    {
+        FormatRecord(&pRecord->Header, CountLine, &lines);
+    }
+
+    return (HostNow() - start) / lines;
+}
+
+int
+main(
+    VOID
+    )
+{
+    static FORMAT_PAYLOAD record;
+    double best[4] = { 1e300, 1e300, 1e300, 1e300 };
+
+    for (ULONG i = 0; i < sizeof(record.Payload); i++)
+    {
+        record.Payload[i] = (UCHAR)(i * 13 + 5);
+    }
+
+    record.Header.Size = sizeof(record);
+    record.Header.Version = SPB_PROBE_RECORD_VERSION;
+    record.Header.Type = SPB_PROBE_RECORD_TYPE_TRANSFER;
+    record.Header.Direction = SPB_PROBE_DIRECTION_READ;
+    record.Header.PeripheralId = 1;
+    record.Header.TransferLength = sizeof(record.Payload);
+
+    for (ULONG round = 0; round < ROUNDS; round++)
+    {
+        double times[4] =
+        {
+            TimeBytes(FormatBytesSimd, &record),
+            TimeBytes(FormatBytesScalar, &record),
+            TimeRecord(FormatRecordSimd, &record),
+            TimeRecord(FormatRecordScalar, &record),
+        };
+
+        for (ULONG i = 0; i < 4; i++)
+        {
+            if (times[i] < best[i])
+            {
+                best[i] = times[i];
+            }
+        }
+    }
+
+    printf("format_bench: SpbProbeFormatBytes, 16 bytes: %s %.2f ns, scalar %.2f ns\n",
+        FormatSimdEnabled ? "sse2" : "default", best[0], best[1]);
+    printf("format_bench: SpbProbeFormatRecord, per line: %s %.2f ns, scalar %.2f ns\n",
+        FormatSimdEnabled ? "sse2" : "default", best[2], best[3]);
+
+    return 0;
+}
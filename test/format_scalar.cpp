@@ -0,0 +1,49 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    format_scalar.cpp
+
+Abstract:
+
+    This module builds the record decoder of spbprobe.h without
+    its SIMD paths, so that the format tests and benchmark can run
+    both formatters in the same program.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#define SPB_PROBE_NO_SIMD
+
+#include "hostwin.h"
+#include "spbprobe.h"
+#include "format.h"
+
+C_ASSERT(!SPB_PROBE_SSE2);
+
+CHAR*
+FormatBytesScalar(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    )
+{
+    return SpbProbeFormatBytes(p, pBytes, Count);
+}
+
+ULONG
+FormatRecordScalar(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    )
+{
+    return SpbProbeFormatRecord(pRecord, Callback, Context);
+}
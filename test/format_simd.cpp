@@ -0,0 +1,46 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    format_simd.cpp
+
+Abstract:
+
+    This module builds the record decoder of spbprobe.h as the
+    host compiler selects it.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "spbprobe.h"
+#include "format.h"
+
+extern const BOOLEAN FormatSimdEnabled = SPB_PROBE_SSE2;
+
+CHAR*
+FormatBytesSimd(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    )
+{
+    return SpbProbeFormatBytes(p, pBytes, Count);
+}
+
+ULONG
+FormatRecordSimd(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    )
+{
+    return SpbProbeFormatRecord(pRecord, Callback, Context);
+}
@@ -0,0 +1,186 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    format_test.cpp
+
+Abstract:
+
+    This module checks both builds of the record decoder of
+    spbprobe.h against the printf formats it replaces.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "spbprobe.h"
+#include "format.h"
+
+#include <string>
+#include <vector>
+
+static
+VOID
+CollectLine(
+    _In_opt_ PVOID        Context,
+    _In_z_   const CHAR*  pLine
+    )
+{
+    ((std::vector<std::string>*)Context)->push_back(pLine);
+}
+
+typedef
+CHAR*
+FORMAT_BYTES(
+    _Out_writes_(3 * Count) CHAR*   p,
+    _In_reads_(Count) const UCHAR*  pBytes,
+    _In_  ULONG                     Count
+    );
+
+typedef
+ULONG
+FORMAT_RECORD(
+    _In_  const SPB_PROBE_RECORD*   pRecord,
+    _In_  PSPB_PROBE_LINE_CALLBACK  Callback,
+    _In_opt_ PVOID                  Context
+    );
+
+static
+VOID
+TestBytes(
+    _In_  FORMAT_BYTES*  FormatBytes
+    )
+{
+    UCHAR bytes[16];
+    CHAR text[3 * 16 + 1];
+    CHAR expected[3 * 16 + 1];
+
+    //
+    // Every byte value at every position of a full line, and
+    // every partial line length.
+    //
+
+    for (ULONG value = 0; value < 0x100; value++)
+    {
+        for (ULONG i = 0; i < 16; i++)
+        {
+            bytes[i] = (UCHAR)(value + 17 * i);
+            snprintf(expected + 3 * i, 4, " %02x", bytes[i]);
+        }
+
+        for (ULONG count = 0; count <= 16; count++)
+        {
+            CHAR* p = FormatBytes(text, bytes, count);
+
+            *p = '\0';
+            CHECK_EQ(p - text, 3 * count);
+            CHECK(strncmp(text, expected, 3 * count) == 0);
+        }
+    }
+}
+
+static
+VOID
+TestRecord(
+    _In_  FORMAT_RECORD*  FormatRecord
+    )
+{
+    struct
+    {
+        SPB_PROBE_RECORD Header;
+        UCHAR Payload[40];
+    }
+    record = {};
+    std::vector<std::string> lines;
+    CHAR expected[SPB_PROBE_LINE_MAX];
+
+    for (ULONG i = 0; i < sizeof(record.Payload); i++)
+    {
+        record.Payload[i] = (UCHAR)(0xf0 ^ (i * 7));
+    }
+
+    record.Header.Size = sizeof(record);
+    record.Header.Version = SPB_PROBE_RECORD_VERSION;
+    record.Header.Type = SPB_PROBE_RECORD_TYPE_TRANSFER;
+    record.Header.Direction = SPB_PROBE_DIRECTION_WRITE;
+    record.Header.TransferIndex = 0;
+    record.Header.PeripheralId = 42;
+    record.Header.TransferLength = 1064;
+    record.Header.Offset = 1024;
+
+    CHECK_EQ(FormatRecord(&record.Header, CollectLine, &lines), 3);
+    CHECK_EQ(lines.size(), 3);
+
+    for (ULONG line = 0; line < lines.size(); line++)
+    {
+        ULONG count = (line == 2) ? 8 : 16;
+        int length = snprintf(expected, sizeof(expected),
+            "device %3lld: %c#%02d %5s %4lu -  %04x:",
+            (long long)record.Header.PeripheralId, '#', 0, "write",
+            (unsigned long)record.Header.TransferLength,
+            (unsigned)(record.Header.Offset + 16 * line));
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            length += snprintf(expected + length, sizeof(expected) - length,
+                " %02x", record.Payload[16 * line + i]);
+        }
+
+        CHECK(lines[line] == expected);
+    }
+
+    //
+    // Later transfers of a read, and a transfer whose payload
+    // was not captured.
+    //
+
+    lines.clear();
+    record.Header.Direction = SPB_PROBE_DIRECTION_READ;
+    record.Header.TransferIndex = 3;
+    record.Header.PeripheralId = -7;
+    record.Header.TransferLength = 5;
+    record.Header.Offset = 0;
+    record.Header.Size = sizeof(record.Header) + 5;
+
+    CHECK_EQ(FormatRecord(&record.Header, CollectLine, &lines), 1);
+    snprintf(expected, sizeof(expected),
+        "device  -7:  #03  read    5 -  0000: %02x %02x %02x %02x %02x",
+        record.Payload[0], record.Payload[1], record.Payload[2],
+        record.Payload[3], record.Payload[4]);
+    CHECK(lines.size() == 1 && lines[0] == expected);
+
+    lines.clear();
+    record.Header.Size = sizeof(record.Header);
+
+    CHECK_EQ(FormatRecord(&record.Header, CollectLine, &lines), 1);
+    CHECK(lines.size() == 1 && lines[0] == "device  -7:  #03  read    5 -  ");
+}
+
+int
+main(
+    VOID
+    )
+{
+    //
+    // gcc and clang builds select the SSE2 formatter too.
+    //
+
+#if defined(__SSE2__)
+    CHECK(FormatSimdEnabled);
+#endif
+
+    TestBytes(FormatBytesSimd);
+    TestRecord(FormatRecordSimd);
+    TestBytes(FormatBytesScalar);
+    TestRecord(FormatRecordScalar);
+
+    return HostTestReport("format_test");
+}
@@ -0,0 +1,617 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    forward_test.cpp
+
+Abstract:
+
+    This module explores every interleaving of the three parties
+    of a request pair (the sender, the cancel routine of the client
+    request and the completion routine of the forward request) and
+    of the framework cancelling the client request, through the
+    transitions of forward.h.
+
+    Every step of a party is one access to shared state, an
+    interlocked operation or a framework call, in the order
+    SpbPeripheralSendRequest, SpbPeripheralOnCancel and
+    SpbPeripheralOnCompletion make them. In every interleaving the
+    pair must be completed exactly once, after the last access of
+    any party, once the forward request is out of the controller
+    and the client request is no longer cancelable, and the sent
+    request must only be cancelled while it can be.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "forward.h"
+
+//
+// Party states, DONE once a party returned.
+//
+
+#define PARTY_IDLE          0
+#define PARTY_DONE          0xff
+
+typedef struct MODEL
+{
+    // Pairing state.
+    volatile LONG State;
+
+    // The client request is marked cancelable, and the framework
+    // was asked to cancel it (and called the cancel routine if it
+    // was marked cancelable then).
+    bool Cancelable;
+    bool CancelRequested;
+    bool CancelRoutine;
+
+    // The forward request was sent and its completion routine has
+    // not run yet, and the sent request was cancelled.
+    bool Sent;
+    bool InController;
+    bool CancelSent;
+
+    // Completion routine: WdfRequestUnmarkCancelable succeeded.
+    bool CompletionUnmarked;
+
+    // Program counters of the sender, the cancel routine and the
+    // completion routine.
+    UCHAR Sender;
+    UCHAR Cancel;
+    UCHAR Completion;
+
+    // Completions of the pair, and the party which completed it.
+    ULONG Completions;
+    CHAR CompletedBy;
+}
+MODEL;
+
+typedef struct EXPLORATION
+{
+    // The controller completes requests by itself, rather than
+    // only once cancelled.
+    bool Spontaneous;
+
+    // The sender ignores SpbForwardStateSent, to check that the
+    // exploration catches a lost cancellation.
+    bool Broken;
+
+    ULONG Interleavings;
+    ULONG Violations;
+
+    // Interleavings completed by each party, and those where the
+    // send failed after the client request was cancelled.
+    ULONG CompletedBy[128];
+    ULONG SendFailedCancelled;
+    ULONG SentCancelled;
+}
+EXPLORATION;
+
+static
+VOID
+Violation(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const char*   pWhat
+    )
+{
+    if (pExploration->Violations++ == 0 && !pExploration->Broken)
+    {
+        fprintf(stderr, "forward_test: %s\n", pWhat);
+    }
+}
+
+static
+VOID
+Touch(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks that a party may still access the pair.
+
+--*/
+{
+    if (pModel->Completions != 0)
+    {
+        Violation(pExploration, "pair accessed after its completion");
+    }
+}
+
+static
+VOID
+Complete(
+    _Inout_ EXPLORATION*  pExploration,
+    _Inout_ MODEL*        pModel,
+    _In_    CHAR          Party
+    )
+{
+    if (pModel->InController)
+    {
+        Violation(pExploration, "forward request released in the controller");
+    }
+
+    if (pModel->Cancelable)
+    {
+        Violation(pExploration, "client request completed while cancelable");
+    }
+
+    pModel->Completions++;
+    pModel->CompletedBy = Party;
+}
+
+static
+VOID
+CancelSentRequest(
+    _Inout_ EXPLORATION*  pExploration,
+    _Inout_ MODEL*        pModel
+    )
+{
+    Touch(pExploration, pModel);
+
+    if (!pModel->Sent)
+    {
+        Violation(pExploration, "request cancelled before it was sent");
+    }
+
+    pModel->CancelSent = true;
+}
+
+//
+// WdfRequestUnmarkCancelable, TRUE if it succeeded and the cancel
+// routine will not run.
+//
+
+static
+bool
+Unmark(
+    _Inout_ MODEL*  pModel
+    )
+{
+    if (!pModel->Cancelable)
+    {
+        return false;
+    }
+
+    pModel->Cancelable = false;
+    return true;
+}
+
+static
+VOID
+Explore(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    );
+
+static
+VOID
+StepSender(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    )
+/*++
+
+  Routine Description:
+
+    This routine runs the next step of SpbPeripheralSendRequest and
+    of its caller, which completes the pair itself on failure.
+
+--*/
+{
+    MODEL next = *pModel;
+
+    Touch(pExploration, &next);
+
+    switch (next.Sender)
+    {
+    case PARTY_IDLE:
+
+        //
+        // WdfRequestMarkCancelableEx fails on a request already
+        // cancelled, the cancel routine never runs.
+        //
+
+        if (next.CancelRequested)
+        {
+            Complete(pExploration, &next, 'S');
+            next.Sender = PARTY_DONE;
+        }
+        else
+        {
+            next.Cancelable = true;
+            next.Sender = 1;
+        }
+        break;
+
+    case 1:
+
+        //
+        // WdfRequestSend, which may fail.
+        //
+
+        {
+            MODEL failed = next;
+
+            failed.Sender = 10;
+
+            if (failed.CancelRoutine)
+            {
+                pExploration->SendFailedCancelled++;
+            }
+
+            Explore(pExploration, &failed);
+        }
+
+        next.Sent = true;
+        next.InController = true;
+        next.Sender = 2;
+        break;
+
+    case 2:
+        next.Sender = (SpbForwardStateSent(&next.State) && !pExploration->Broken) ? 3 : 4;
+        break;
+
+    case 3:
+        CancelSentRequest(pExploration, &next);
+        next.Sender = 4;
+        break;
+
+    case 4:
+        if (SpbForwardStateDone(&next.State, FORWARD_STATE_SEND_DONE))
+        {
+            Complete(pExploration, &next, 'S');
+        }
+
+        next.Sender = PARTY_DONE;
+        break;
+
+    case 10:
+
+        //
+        // Send failed, the caller completes the pair unless the
+        // cancel routine owns it.
+        //
+
+        if (Unmark(&next))
+        {
+            Complete(pExploration, &next, 'S');
+            next.Sender = PARTY_DONE;
+        }
+        else
+        {
+            next.Sender = 11;
+        }
+        break;
+
+    case 11:
+        if (SpbForwardStateDone(
+                &next.State,
+                FORWARD_STATE_SEND_DONE | FORWARD_STATE_COMPLETING))
+        {
+            Complete(pExploration, &next, 'S');
+        }
+
+        next.Sender = PARTY_DONE;
+        break;
+    }
+
+    Explore(pExploration, &next);
+}
+
+static
+VOID
+StepCancel(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    )
+/*++
+
+  Routine Description:
+
+    This routine runs the next step of SpbPeripheralOnCancel.
+
+--*/
+{
+    MODEL next = *pModel;
+
+    Touch(pExploration, &next);
+
+    switch (next.Cancel)
+    {
+    case PARTY_IDLE:
+        next.Cancel = SpbForwardStateCancelled(&next.State) ? 1 : 2;
+        break;
+
+    case 1:
+        CancelSentRequest(pExploration, &next);
+        next.Cancel = 2;
+        break;
+
+    case 2:
+        if (SpbForwardStateDone(&next.State, FORWARD_STATE_CANCEL_DONE))
+        {
+            Complete(pExploration, &next, 'C');
+        }
+
+        next.Cancel = PARTY_DONE;
+        break;
+    }
+
+    Explore(pExploration, &next);
+}
+
+static
+VOID
+StepCompletion(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    )
+/*++
+
+  Routine Description:
+
+    This routine runs the next step of SpbPeripheralOnCompletion.
+
+--*/
+{
+    MODEL next = *pModel;
+
+    Touch(pExploration, &next);
+
+    switch (next.Completion)
+    {
+    case PARTY_IDLE:
+
+        //
+        // Out of the controller, the status of the pair is kept.
+        //
+
+        next.InController = false;
+        next.Completion = 1;
+        break;
+
+    case 1:
+        next.CompletionUnmarked = Unmark(&next);
+        next.Completion = 2;
+        break;
+
+    case 2:
+        if (SpbForwardStateDone(
+                &next.State,
+                FORWARD_STATE_COMPLETING |
+                    (next.CompletionUnmarked ? FORWARD_STATE_CANCEL_DONE : 0)))
+        {
+            Complete(pExploration, &next, 'K');
+        }
+
+        next.Completion = PARTY_DONE;
+        break;
+    }
+
+    Explore(pExploration, &next);
+}
+
+static
+VOID
+Explore(
+    _Inout_ EXPLORATION*  pExploration,
+    _In_    const MODEL*  pModel
+    )
+/*++
+
+  Routine Description:
+
+    This routine tries every step that can come next, and checks
+    the outcome of an interleaving once none can.
+
+--*/
+{
+    bool stepped = false;
+
+    if (pModel->Sender != PARTY_DONE)
+    {
+        StepSender(pExploration, pModel);
+        stepped = true;
+    }
+
+    if (pModel->CancelRoutine && pModel->Cancel != PARTY_DONE)
+    {
+        StepCancel(pExploration, pModel);
+        stepped = true;
+    }
+
+    if (pModel->Completion != PARTY_DONE &&
+        (pModel->Completion != PARTY_IDLE ||
+         (pModel->InController && (pExploration->Spontaneous || pModel->CancelSent))))
+    {
+        StepCompletion(pExploration, pModel);
+        stepped = true;
+    }
+
+    //
+    // The framework cancels the client request until it is
+    // completed, calling the cancel routine if it is cancelable.
+    //
+
+    if (!pModel->CancelRequested && pModel->Completions == 0)
+    {
+        MODEL next = *pModel;
+
+        next.CancelRequested = true;
+
+        if (Unmark(&next))
+        {
+            next.CancelRoutine = true;
+        }
+
+        Explore(pExploration, &next);
+        stepped = true;
+    }
+
+    if (stepped)
+    {
+        return;
+    }
+
+    pExploration->Interleavings++;
+
+    if (pModel->Completions != 1)
+    {
+        Violation(pExploration, (pModel->Completions == 0) ?
+            "pair never completed" : "pair completed twice");
+        return;
+    }
+
+    pExploration->CompletedBy[(UCHAR)pModel->CompletedBy]++;
+
+    if (pModel->CancelRoutine && pModel->Sent)
+    {
+        pExploration->SentCancelled++;
+    }
+}
+
+static
+VOID
+Run(
+    _Inout_ EXPLORATION*  pExploration
+    )
+{
+    MODEL model = {};
+
+    model.State = FORWARD_STATE_SUBMITTED;
+
+    Explore(pExploration, &model);
+
+    printf("forward_test: %s controller%s: %lu interleavings, "
+        "completed by sender %lu, cancel %lu, completion %lu\n",
+        pExploration->Spontaneous ? "completing" : "hung",
+        pExploration->Broken ? " (broken sender)" : "",
+        (unsigned long)pExploration->Interleavings,
+        (unsigned long)pExploration->CompletedBy['S'],
+        (unsigned long)pExploration->CompletedBy['C'],
+        (unsigned long)pExploration->CompletedBy['K']);
+}
+
+static
+VOID
+TestTransitions(
+    VOID
+    )
+{
+    volatile LONG state;
+
+    //
+    // The sender cancels a request cancelled before it was sent,
+    // unless it already completed.
+    //
+
+    state = FORWARD_STATE_SUBMITTED;
+    CHECK(!SpbForwardStateSent(&state));
+    CHECK_EQ(state, FORWARD_STATE_SENT);
+
+    state = FORWARD_STATE_CANCELLED;
+    CHECK(SpbForwardStateSent(&state));
+
+    state = FORWARD_STATE_CANCELLED | FORWARD_STATE_COMPLETING;
+    CHECK(!SpbForwardStateSent(&state));
+
+    //
+    // The cancel routine only cancels a request in the controller.
+    //
+
+    state = FORWARD_STATE_SUBMITTED;
+    CHECK(!SpbForwardStateCancelled(&state));
+    CHECK_EQ(state, FORWARD_STATE_CANCELLED);
+
+    state = FORWARD_STATE_SENT;
+    CHECK(SpbForwardStateCancelled(&state));
+
+    state = FORWARD_STATE_SENT | FORWARD_STATE_COMPLETING;
+    CHECK(!SpbForwardStateCancelled(&state));
+
+    //
+    // Only the last done bit completes, and only once.
+    //
+
+    for (LONG initial = 0; initial <= FORWARD_STATE_DONE; initial++)
+    {
+        for (LONG flags = 1; flags <= FORWARD_STATE_DONE; flags++)
+        {
+            if ((flags & ~FORWARD_STATE_DONE) != 0)
+            {
+                continue;
+            }
+
+            state = initial;
+
+            CHECK_EQ(SpbForwardStateDone(&state, flags),
+                ((initial & FORWARD_STATE_DONE) != FORWARD_STATE_DONE) &&
+                (((initial | flags) & FORWARD_STATE_DONE) == FORWARD_STATE_DONE));
+            CHECK_EQ(state, initial | flags);
+        }
+    }
+}
+
+int
+main(
+    VOID
+    )
+{
+    EXPLORATION completing = {};
+    EXPLORATION hung = {};
+    EXPLORATION broken = {};
+
+    TestTransitions();
+
+    completing.Spontaneous = true;
+    Run(&completing);
+
+    CHECK_EQ(completing.Violations, 0);
+    CHECK(completing.Interleavings != 0);
+
+    //
+    // Every party completes the pair in some interleaving, and the
+    // send failing after the client request was cancelled, or the
+    // request being cancelled once sent, are covered.
+    //
+
+    CHECK(completing.CompletedBy['S'] != 0);
+    CHECK(completing.CompletedBy['C'] != 0);
+    CHECK(completing.CompletedBy['K'] != 0);
+    CHECK(completing.SendFailedCancelled != 0);
+    CHECK(completing.SentCancelled != 0);
+
+    //
+    // A controller which only completes cancelled requests still
+    // completes every pair, the cancellation is never lost.
+    //
+
+    Run(&hung);
+
+    CHECK_EQ(hung.Violations, 0);
+    CHECK(hung.Interleavings != 0);
+
+    //
+    // Without the sender cancelling on behalf of a cancel routine
+    // which ran too early, some pairs hang.
+    //
+
+    broken.Broken = true;
+    Run(&broken);
+
+    CHECK(broken.Violations != 0);
+
+    return HostTestReport("forward_test");
+}
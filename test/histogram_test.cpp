@@ -0,0 +1,249 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    histogram_test.cpp
+
+Abstract:
+
+    This module tests the bucket boundaries of the latency
+    histograms of spbprobe.h and the percentiles reconstructed
+    from them.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "spbprobe.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+static
+VOID
+TestBuckets(
+    VOID
+    )
+{
+    ULONGLONG lower = 0;
+
+    //
+    // Values below SUB_COUNT have a bucket each.
+    //
+
+    for (ULONG value = 0; value < SPB_PROBE_HISTOGRAM_SUB_COUNT; value++)
+    {
+        CHECK_EQ(SpbProbeHistogramBucket(value), value);
+        CHECK_EQ(SpbProbeHistogramBucketLimit(value), value + 1);
+    }
+
+    //
+    // Buckets tile the 32-bit range: every bucket starts at the
+    // limit of the previous one, its first and last values map to
+    // it, and its width is at most 1/16 of its lower bound.
+    //
+
+    for (ULONG bucket = 0; bucket < SPB_PROBE_HISTOGRAM_BUCKETS; bucket++)
+    {
+        ULONGLONG limit = SpbProbeHistogramBucketLimit(bucket);
+
+        CHECK(limit > lower);
+        CHECK_EQ(SpbProbeHistogramBucket((ULONG)lower), bucket);
+        CHECK_EQ(SpbProbeHistogramBucket((ULONG)(limit - 1)), bucket);
+
+        if (lower >= SPB_PROBE_HISTOGRAM_SUB_COUNT)
+        {
+            CHECK((limit - lower) * SPB_PROBE_HISTOGRAM_SUB_COUNT <= lower);
+        }
+
+        lower = limit;
+
+        if (limit > MAXULONG)
+        {
+            CHECK_EQ(bucket, SPB_PROBE_HISTOGRAM_BUCKETS - 1);
+            break;
+        }
+    }
+
+    CHECK_EQ(lower, (ULONGLONG)MAXULONG + 1);
+    CHECK_EQ(SpbProbeHistogramBucket(MAXULONG), SPB_PROBE_HISTOGRAM_BUCKETS - 1);
+
+    //
+    // Powers of two and their neighbours.
+    //
+
+    for (ULONG shift = SPB_PROBE_HISTOGRAM_SUB_BITS; shift < 32; shift++)
+    {
+        ULONG value = 1UL << shift;
+        ULONG bucket = SpbProbeHistogramBucket(value);
+
+        CHECK_EQ(SpbProbeHistogramBucket(value - 1), bucket - 1);
+        CHECK(SpbProbeHistogramBucketLimit(bucket - 1) == value);
+        CHECK_EQ(bucket % SPB_PROBE_HISTOGRAM_SUB_COUNT, 0);
+    }
+}
+
+static
+VOID
+Record(
+    _Inout_ PSPB_PROBE_HISTOGRAM  pHistogram,
+    _In_    ULONG                 Value
+    )
+{
+    pHistogram->Count++;
+    pHistogram->Sum += Value;
+    pHistogram->Buckets[SpbProbeHistogramBucket(Value)]++;
+
+    if (Value > pHistogram->Max)
+    {
+        pHistogram->Max = Value;
+    }
+}
+
+static
+VOID
+CheckPercentiles(
+    _In_  const SPB_PROBE_HISTOGRAM*  pHistogram,
+    _In_  std::vector<ULONG>          Values
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks that every reconstructed percentile is
+    an upper bound of the exact one, within a bucket of it.
+
+--*/
+{
+    static const ULONG percentiles[] =
+    {
+        0, 1, 10000, 500000, 900000, 990000, 999000, 999999, 1000000
+    };
+
+    std::sort(Values.begin(), Values.end());
+
+    for (ULONG i = 0; i < ARRAYSIZE(percentiles); i++)
+    {
+        ULONGLONG rank = ((ULONGLONG)Values.size() * percentiles[i] + 999999) / 1000000;
+        ULONG exact = Values[(rank == 0) ? 0 : rank - 1];
+        ULONGLONG estimate = SpbProbeHistogramPercentile(pHistogram, percentiles[i]);
+
+        CHECK(estimate >= exact);
+        CHECK(estimate < SpbProbeHistogramBucketLimit(SpbProbeHistogramBucket(exact)));
+        CHECK(estimate <= pHistogram->Max);
+    }
+
+    CHECK_EQ(SpbProbeHistogramPercentile(pHistogram, 1000000), Values.back());
+}
+
+static
+VOID
+TestPercentiles(
+    VOID
+    )
+{
+    SPB_PROBE_HISTOGRAM histogram = {};
+    std::vector<ULONG> values;
+    std::mt19937 random(12);
+
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 990000), 0);
+
+    //
+    // A single value is every percentile.
+    //
+
+    Record(&histogram, 1234);
+    values.push_back(1234);
+
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 0), 1234);
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 500000), 1234);
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 1000000), 1234);
+
+    //
+    // Small exact values.
+    //
+
+    histogram = {};
+    values.clear();
+
+    for (ULONG value = 0; value < 10; value++)
+    {
+        Record(&histogram, value);
+        values.push_back(value);
+    }
+
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 500000), 4);
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 900000), 8);
+    CHECK_EQ(SpbProbeHistogramPercentile(&histogram, 990000), 9);
+    CheckPercentiles(&histogram, values);
+
+    //
+    // A latency-like distribution: mostly around 100 us, with a
+    // long tail up to seconds.
+    //
+
+    histogram = {};
+    values.clear();
+
+    {
+        std::lognormal_distribution<double> latency(4.6, 0.8);
+
+        for (ULONG i = 0; i < 100000; i++)
+        {
+            double sample = latency(random);
+            ULONG value = (sample > 4e9) ? 4000000000UL : (ULONG)sample;
+
+            if (i % 1000 == 0)
+            {
+                value = 1000000 + i;
+            }
+
+            Record(&histogram, value);
+            values.push_back(value);
+        }
+    }
+
+    CheckPercentiles(&histogram, values);
+
+    //
+    // Uniform over the whole 32-bit range, extremes included.
+    //
+
+    histogram = {};
+    values.clear();
+
+    for (ULONG i = 0; i < 10000; i++)
+    {
+        ULONG value = (ULONG)random();
+
+        Record(&histogram, value);
+        values.push_back(value);
+    }
+
+    Record(&histogram, 0);
+    values.push_back(0);
+    Record(&histogram, MAXULONG);
+    values.push_back(MAXULONG);
+
+    CheckPercentiles(&histogram, values);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestBuckets();
+    TestPercentiles();
+
+    return HostTestReport("histogram_test");
+}
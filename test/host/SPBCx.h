@@ -0,0 +1,376 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    SPBCx.h
+
+Abstract:
+
+    This module contains the SPB class extension types and methods
+    the driver uses, implemented by the mock framework of
+    wdfhost.cpp. The transfer list and its initializers keep the
+    definitions of spb.h, as the mock controller parses the lists
+    the driver builds.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOST_SPBCX_H_
+#define _HOST_SPBCX_H_
+
+#include "wdf.h"
+
+/////////////////////////////////////////////////
+//
+// spb.h
+//
+/////////////////////////////////////////////////
+
+#define IOCTL_SPB_LOCK_CONTROLLER   CTL_CODE(FILE_DEVICE_CONTROLLER, 0x100, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_UNLOCK_CONTROLLER CTL_CODE(FILE_DEVICE_CONTROLLER, 0x101, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_EXECUTE_SEQUENCE  CTL_CODE(FILE_DEVICE_CONTROLLER, 0x102, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_LOCK_CONNECTION   CTL_CODE(FILE_DEVICE_CONTROLLER, 0x103, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_UNLOCK_CONNECTION CTL_CODE(FILE_DEVICE_CONTROLLER, 0x104, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_FULL_DUPLEX       CTL_CODE(FILE_DEVICE_CONTROLLER, 0x105, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+typedef enum _SPB_TRANSFER_DIRECTION
+{
+    SpbTransferDirectionNone,
+    SpbTransferDirectionFromDevice,
+    SpbTransferDirectionToDevice,
+    SpbTransferDirectionMax
+}
+SPB_TRANSFER_DIRECTION;
+
+typedef enum _SPB_TRANSFER_BUFFER_FORMAT
+{
+    SpbTransferBufferFormatInvalid = 0,
+    SpbTransferBufferFormatSimple,
+    SpbTransferBufferFormatList,
+    SpbTransferBufferFormatSimpleNonPaged,
+    SpbTransferBufferFormatMdl,
+    SpbTransferBufferFormatMax
+}
+SPB_TRANSFER_BUFFER_FORMAT;
+
+typedef struct _SPB_TRANSFER_BUFFER_LIST_ENTRY
+{
+    PVOID Buffer;
+    ULONG BufferCb;
+}
+SPB_TRANSFER_BUFFER_LIST_ENTRY, *PSPB_TRANSFER_BUFFER_LIST_ENTRY;
+
+typedef struct _SPB_TRANSFER_BUFFER
+{
+    SPB_TRANSFER_BUFFER_FORMAT Format;
+
+    union
+    {
+        struct
+        {
+            PVOID Buffer;
+            ULONG BufferCb;
+        } Simple;
+
+        struct
+        {
+            PSPB_TRANSFER_BUFFER_LIST_ENTRY List;
+            ULONG ListCe;
+        } BufferList;
+
+        PMDL Mdl;
+    };
+}
+SPB_TRANSFER_BUFFER, *PSPB_TRANSFER_BUFFER;
+
+typedef struct _SPB_TRANSFER_LIST_ENTRY
+{
+    SPB_TRANSFER_DIRECTION Direction;
+    ULONG DelayInUs;
+    SPB_TRANSFER_BUFFER Buffer;
+}
+SPB_TRANSFER_LIST_ENTRY, *PSPB_TRANSFER_LIST_ENTRY;
+
+typedef struct _SPB_TRANSFER_LIST
+{
+    ULONG Size;
+    ULONG Reserved;
+    ULONG TransferCount;
+    SPB_TRANSFER_LIST_ENTRY Transfers[1];
+}
+SPB_TRANSFER_LIST, *PSPB_TRANSFER_LIST;
+
+#define SPB_TRANSFER_LIST_AND_ENTRIES(n)                    \
+    struct                                                  \
+    {                                                       \
+        SPB_TRANSFER_LIST List;                             \
+        SPB_TRANSFER_LIST_ENTRY ExtraEntriesArray[(n) - 1]; \
+    }
+
+FORCEINLINE
+VOID
+SPB_TRANSFER_LIST_INIT(
+    _Out_ PSPB_TRANSFER_LIST  List,
+    _In_  ULONG               TransferCount
+    )
+{
+    RtlZeroMemory(List,
+        FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+        TransferCount * sizeof(SPB_TRANSFER_LIST_ENTRY));
+
+    List->Size = sizeof(SPB_TRANSFER_LIST);
+    List->TransferCount = TransferCount;
+}
+
+FORCEINLINE
+SPB_TRANSFER_LIST_ENTRY
+SPB_TRANSFER_LIST_ENTRY_INIT_NON_PAGED(
+    _In_  SPB_TRANSFER_DIRECTION  Direction,
+    _In_  ULONG                   DelayInUs,
+    _In_  PVOID                   Buffer,
+    _In_  ULONG                   BufferCb
+    )
+{
+    SPB_TRANSFER_LIST_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.Direction = Direction;
+    entry.DelayInUs = DelayInUs;
+    entry.Buffer.Format = SpbTransferBufferFormatSimpleNonPaged;
+    entry.Buffer.Simple.Buffer = Buffer;
+    entry.Buffer.Simple.BufferCb = BufferCb;
+
+    return entry;
+}
+
+FORCEINLINE
+SPB_TRANSFER_LIST_ENTRY
+SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+    _In_  SPB_TRANSFER_DIRECTION  Direction,
+    _In_  ULONG                   DelayInUs,
+    _In_  PMDL                    Mdl
+    )
+{
+    SPB_TRANSFER_LIST_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.Direction = Direction;
+    entry.DelayInUs = DelayInUs;
+    entry.Buffer.Format = SpbTransferBufferFormatMdl;
+    entry.Buffer.Mdl = Mdl;
+
+    return entry;
+}
+
+/////////////////////////////////////////////////
+//
+// spbcx.h
+//
+/////////////////////////////////////////////////
+
+typedef struct HOST_TARGET*         SPBTARGET;
+typedef WDFREQUEST                  SPBREQUEST;
+
+typedef enum _SPB_REQUEST_TYPE
+{
+    SpbRequestTypeUndefined = 0,
+    SpbRequestTypeRead,
+    SpbRequestTypeWrite,
+    SpbRequestTypeSequence,
+    SpbRequestTypeLockController,
+    SpbRequestTypeUnlockController,
+    SpbRequestTypeLockConnection,
+    SpbRequestTypeUnlockConnection,
+    SpbRequestTypeOther,
+    SpbRequestTypeMax
+}
+SPB_REQUEST_TYPE;
+
+typedef enum _SPB_REQUEST_SEQUENCE_POSITION
+{
+    SpbRequestSequencePositionInvalid = 0,
+    SpbRequestSequencePositionFirst,
+    SpbRequestSequencePositionContinue,
+    SpbRequestSequencePositionLast,
+    SpbRequestSequencePositionSingle,
+    SpbRequestSequencePositionMax
+}
+SPB_REQUEST_SEQUENCE_POSITION;
+
+typedef struct _SPB_REQUEST_PARAMETERS
+{
+    ULONG                           Size;
+    SPB_REQUEST_SEQUENCE_POSITION   Position;
+    SPB_REQUEST_TYPE                Type;
+    size_t                          Length;
+    ULONG                           SequenceTransferCount;
+}
+SPB_REQUEST_PARAMETERS, *PSPB_REQUEST_PARAMETERS;
+
+FORCEINLINE
+VOID
+SPB_REQUEST_PARAMETERS_INIT(
+    _Out_ PSPB_REQUEST_PARAMETERS  Parameters
+    )
+{
+    RtlZeroMemory(Parameters, sizeof(SPB_REQUEST_PARAMETERS));
+    Parameters->Size = sizeof(SPB_REQUEST_PARAMETERS);
+}
+
+typedef struct _SPB_TRANSFER_DESCRIPTOR
+{
+    ULONG                   Size;
+    SPB_TRANSFER_DIRECTION  Direction;
+    size_t                  TransferLength;
+    ULONG                   DelayInUs;
+}
+SPB_TRANSFER_DESCRIPTOR, *PSPB_TRANSFER_DESCRIPTOR;
+
+FORCEINLINE
+VOID
+SPB_TRANSFER_DESCRIPTOR_INIT(
+    _Out_ PSPB_TRANSFER_DESCRIPTOR  Descriptor
+    )
+{
+    RtlZeroMemory(Descriptor, sizeof(SPB_TRANSFER_DESCRIPTOR));
+    Descriptor->Size = sizeof(SPB_TRANSFER_DESCRIPTOR);
+}
+
+typedef struct _SPB_CONNECTION_PARAMETERS
+{
+    ULONG       Size;
+    PCWSTR      ConnectionTag;
+    PVOID       ConnectionParameters;
+}
+SPB_CONNECTION_PARAMETERS, *PSPB_CONNECTION_PARAMETERS;
+
+FORCEINLINE
+VOID
+SPB_CONNECTION_PARAMETERS_INIT(
+    _Out_ PSPB_CONNECTION_PARAMETERS  Parameters
+    )
+{
+    RtlZeroMemory(Parameters, sizeof(SPB_CONNECTION_PARAMETERS));
+    Parameters->Size = sizeof(SPB_CONNECTION_PARAMETERS);
+}
+
+typedef NTSTATUS EVT_SPB_TARGET_CONNECT(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target);
+typedef EVT_SPB_TARGET_CONNECT *PFN_SPB_TARGET_CONNECT;
+
+typedef VOID EVT_SPB_TARGET_DISCONNECT(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target);
+typedef EVT_SPB_TARGET_DISCONNECT *PFN_SPB_TARGET_DISCONNECT;
+
+typedef VOID EVT_SPB_CONTROLLER_LOCK(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request);
+typedef EVT_SPB_CONTROLLER_LOCK *PFN_SPB_CONTROLLER_LOCK;
+
+typedef VOID EVT_SPB_CONTROLLER_UNLOCK(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request);
+typedef EVT_SPB_CONTROLLER_UNLOCK *PFN_SPB_CONTROLLER_UNLOCK;
+
+typedef VOID EVT_SPB_CONTROLLER_READ(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request, _In_ size_t Length);
+typedef EVT_SPB_CONTROLLER_READ *PFN_SPB_CONTROLLER_READ;
+
+typedef VOID EVT_SPB_CONTROLLER_WRITE(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request, _In_ size_t Length);
+typedef EVT_SPB_CONTROLLER_WRITE *PFN_SPB_CONTROLLER_WRITE;
+
+typedef VOID EVT_SPB_CONTROLLER_SEQUENCE(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request, _In_ ULONG TransferCount);
+typedef EVT_SPB_CONTROLLER_SEQUENCE *PFN_SPB_CONTROLLER_SEQUENCE;
+
+typedef VOID EVT_SPB_CONTROLLER_OTHER(_In_ WDFDEVICE Controller, _In_ SPBTARGET Target, _In_ SPBREQUEST Request, _In_ size_t OutputBufferLength, _In_ size_t InputBufferLength, _In_ ULONG IoControlCode);
+typedef EVT_SPB_CONTROLLER_OTHER *PFN_SPB_CONTROLLER_OTHER;
+
+typedef struct _SPB_CONTROLLER_CONFIG
+{
+    ULONG                           Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE      ControllerDispatchType;
+    WDF_TRI_STATE                   PowerManaged;
+    PFN_SPB_TARGET_CONNECT          EvtSpbTargetConnect;
+    PFN_SPB_TARGET_DISCONNECT       EvtSpbTargetDisconnect;
+    PFN_SPB_CONTROLLER_LOCK         EvtSpbControllerLock;
+    PFN_SPB_CONTROLLER_UNLOCK       EvtSpbControllerUnlock;
+    PFN_SPB_CONTROLLER_READ         EvtSpbIoRead;
+    PFN_SPB_CONTROLLER_WRITE        EvtSpbIoWrite;
+    PFN_SPB_CONTROLLER_SEQUENCE     EvtSpbIoSequence;
+}
+SPB_CONTROLLER_CONFIG, *PSPB_CONTROLLER_CONFIG;
+
+FORCEINLINE
+VOID
+SPB_CONTROLLER_CONFIG_INIT(
+    _Out_ PSPB_CONTROLLER_CONFIG  Config
+    )
+{
+    RtlZeroMemory(Config, sizeof(SPB_CONTROLLER_CONFIG));
+    Config->Size = sizeof(SPB_CONTROLLER_CONFIG);
+    Config->ControllerDispatchType = WdfIoQueueDispatchSequential;
+    Config->PowerManaged = WdfUseDefault;
+}
+
+NTSTATUS
+SpbDeviceInitConfig(
+    _Inout_ PWDFDEVICE_INIT  DeviceInit
+    );
+
+NTSTATUS
+SpbDeviceInitialize(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PSPB_CONTROLLER_CONFIG  Config
+    );
+
+VOID
+SpbControllerSetIoOtherCallback(
+    _In_      WDFDEVICE                     FxDevice,
+    _In_      PFN_SPB_CONTROLLER_OTHER      EvtSpbIoOther,
+    _In_opt_  PFN_WDF_IO_IN_CALLER_CONTEXT  EvtIoInCallerContext
+    );
+
+VOID
+SpbControllerSetTargetAttributes(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PWDF_OBJECT_ATTRIBUTES  TargetAttributes
+    );
+
+VOID
+SpbControllerSetRequestAttributes(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PWDF_OBJECT_ATTRIBUTES  RequestAttributes
+    );
+
+VOID
+SpbTargetGetConnectionParameters(
+    _In_  SPBTARGET                   SpbTarget,
+    _Out_ PSPB_CONNECTION_PARAMETERS  ConnectionParameters
+    );
+
+VOID
+SpbRequestGetParameters(
+    _In_  SPBREQUEST               SpbRequest,
+    _Out_ PSPB_REQUEST_PARAMETERS  Parameters
+    );
+
+VOID
+SpbRequestGetTransferParameters(
+    _In_      SPBREQUEST                SpbRequest,
+    _In_      ULONG                     Index,
+    _Out_opt_ PSPB_TRANSFER_DESCRIPTOR  TransferDescriptor,
+    _Outptr_opt_ PMDL*                  TransferBuffer
+    );
+
+NTSTATUS
+SpbRequestCaptureIoOtherTransferList(
+    _In_  SPBREQUEST  SpbRequest
+    );
+
+VOID
+SpbRequestComplete(
+    _In_  SPBREQUEST  SpbRequest,
+    _In_  NTSTATUS    CompletionStatus
+    );
+
+#endif // _HOST_SPBCX_H_
@@ -0,0 +1,107 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    hosttest.h
+
+Abstract:
+
+    This module contains the checks and timing helpers shared by
+    the host tests and benchmarks.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOSTTEST_H_
+#define _HOSTTEST_H_
+
+#include <stdio.h>
+#include <time.h>
+
+static ULONG g_HostChecks;
+static ULONG g_HostFailures;
+
+#define CHECK(e)                                                    \
+    do                                                              \
+    {                                                               \
+        g_HostChecks++;                                             \
+        if (!(e))                                                   \
+        {                                                           \
+            g_HostFailures++;                                       \
+            fprintf(stderr, "%s(%d): check failed: %s\n",           \
+                __FILE__, __LINE__, #e);                            \
+        }                                                           \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                              \
+    do                                                              \
+    {                                                               \
+        unsigned long long _a = (unsigned long long)(a);            \
+        unsigned long long _b = (unsigned long long)(b);            \
+        g_HostChecks++;                                             \
+        if (_a != _b)                                               \
+        {                                                           \
+            g_HostFailures++;                                       \
+            fprintf(stderr, "%s(%d): check failed: %s == %s "       \
+                "(%llu != %llu)\n", __FILE__, __LINE__, #a, #b,     \
+                _a, _b);                                            \
+        }                                                           \
+    } while (0)
+
+static
+int
+HostTestReport(
+    const char*  Name
+    )
+/*++
+
+  Routine Description:
+
+    This routine prints the outcome of a test program.
+
+  Return Value:
+
+    The exit code of the test program
+
+--*/
+{
+    printf("%s: %lu checks, %lu failed\n",
+        Name, (unsigned long)g_HostChecks, (unsigned long)g_HostFailures);
+
+    return (g_HostFailures == 0) ? 0 : 1;
+}
+
+static
+double
+HostNow(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns a monotonic time in nanoseconds.
+
+--*/
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+//
+// Keeps the compiler from optimizing a benchmarked result away.
+//
+
+#define HOST_KEEP(v)        __asm__ volatile("" : : "g"(v) : "memory")
+
+#endif // _HOSTTEST_H_
@@ -0,0 +1,300 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    hostwin.h
+
+Abstract:
+
+    This module contains the Windows types, annotations and
+    intrinsics the probe headers use, so that they can be built
+    and tested on a development host with gcc or clang.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOSTWIN_H_
+#define _HOSTWIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/////////////////////////////////////////////////
+//
+// Basic types, sized as on Windows (LLP64).
+//
+/////////////////////////////////////////////////
+
+#define VOID                void
+
+typedef char                CHAR;
+typedef unsigned char       UCHAR;
+typedef short               SHORT;
+typedef unsigned short      USHORT;
+typedef int32_t             LONG;
+typedef uint32_t            ULONG;
+typedef int64_t             LONGLONG;
+typedef uint64_t            ULONGLONG;
+typedef intptr_t            LONG_PTR;
+typedef uintptr_t           ULONG_PTR;
+typedef size_t              SIZE_T;
+typedef UCHAR               BOOLEAN;
+typedef int                 BOOL;
+typedef LONG                NTSTATUS;
+typedef void*               PVOID;
+typedef wchar_t             WCHAR;
+
+typedef CHAR*               PCHAR;
+typedef UCHAR*              PUCHAR;
+typedef USHORT*             PUSHORT;
+typedef LONG*               PLONG;
+typedef ULONG*              PULONG;
+typedef LONGLONG*           PLONGLONG;
+typedef ULONGLONG*          PULONGLONG;
+typedef ULONG_PTR*          PULONG_PTR;
+typedef BOOLEAN*            PBOOLEAN;
+typedef WCHAR*              PWCHAR;
+typedef WCHAR*              PWSTR;
+typedef const WCHAR*        PCWSTR;
+typedef ULONG_PTR           KAFFINITY;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+}
+LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE                1
+#define FALSE               0
+
+#define MAXUCHAR            0xff
+#define MAXUSHORT           0xffff
+#define MAXULONG            0xffffffffUL
+#define MAXLONG             0x7fffffffL
+#define MAXULONGLONG        (~(ULONGLONG)0)
+#define MAXLONGLONG         ((LONGLONG)(MAXULONGLONG >> 1))
+
+#define C_ASSERT(e)         static_assert(e, #e)
+#define FORCEINLINE         static inline __attribute__((always_inline))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define FIELD_OFFSET(type, field)   offsetof(type, field)
+#define ARRAYSIZE(a)        (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a)    ARRAYSIZE(a)
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define METHOD_BUFFERED     0
+#define METHOD_IN_DIRECT    1
+#define METHOD_OUT_DIRECT   2
+#define METHOD_NEITHER      3
+#define FILE_ANY_ACCESS     0
+#define FILE_READ_ACCESS    1
+#define FILE_WRITE_ACCESS   2
+
+/////////////////////////////////////////////////
+//
+// Source annotations, checked by the kernel build only.
+//
+/////////////////////////////////////////////////
+
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(n)
+#define _In_reads_bytes_(n)
+#define _In_reads_opt_(n)
+#define _Out_writes_(n)
+#define _Out_writes_bytes_(n)
+#define _Out_writes_bytes_to_(n, c)
+#define _Outptr_
+#define _Outptr_opt_
+#define _Out_writes_to_(n, c)
+#define _Inout_updates_(n)
+#define _Inout_updates_bytes_(n)
+#define _When_(c, a)
+#define _Requires_lock_held_(l)
+#define _Requires_lock_not_held_(l)
+#define _Acquires_lock_(l)
+#define _Releases_lock_(l)
+#define _IRQL_requires_(i)
+#define _IRQL_requires_max_(i)
+#define _Use_decl_annotations_
+#define _Analysis_assume_(e)
+#define _Success_(e)
+#define _Must_inspect_result_
+
+/////////////////////////////////////////////////
+//
+// Intrinsics.
+//
+/////////////////////////////////////////////////
+
+FORCEINLINE
+BOOLEAN
+BitScanForward(
+    _Out_ ULONG*  Index,
+    _In_  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+    {
+        return FALSE;
+    }
+
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+BitScanReverse(
+    _Out_ ULONG*  Index,
+    _In_  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+    {
+        return FALSE;
+    }
+
+    *Index = 31 - (ULONG)__builtin_clz(Mask);
+    return TRUE;
+}
+
+//
+// The interlocked routines are full barriers, as on Windows.
+// The acquire, release and no fence accessors only need to be
+// atomic and ordered as named.
+//
+
+#define HOST_ATOMIC(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+FORCEINLINE LONG InterlockedIncrement(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(volatile LONG* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(volatile LONG* p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchangeAdd(volatile LONG* p, LONG v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedOr(volatile LONG* p, LONG v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedAnd(volatile LONG* p, LONG v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange(
+    volatile LONG*  p,
+    LONG            Exchange,
+    LONG            Comparand
+    )
+{
+    __atomic_compare_exchange_n(p, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONGLONG InterlockedIncrement64(volatile LONGLONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONGLONG InterlockedExchange64(volatile LONGLONG* p, LONGLONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONGLONG InterlockedExchangeAdd64(volatile LONGLONG* p, LONGLONG v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONGLONG InterlockedAdd64(volatile LONGLONG* p, LONGLONG v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE
+LONGLONG
+InterlockedCompareExchange64(
+    volatile LONGLONG*  p,
+    LONGLONG            Exchange,
+    LONGLONG            Comparand
+    )
+{
+    __atomic_compare_exchange_n(p, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedCompareExchangePointer(
+    PVOID volatile*  p,
+    PVOID            Exchange,
+    PVOID            Comparand
+    )
+{
+    __atomic_compare_exchange_n(p, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedExchangePointer(
+    PVOID volatile*  p,
+    PVOID            v
+    )
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedIncrementNoFence(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONG InterlockedDecrementNoFence(volatile LONG* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONG InterlockedExchangeAddNoFence(volatile LONG* p, LONG v) { return __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+FORCEINLINE
+LONG
+InterlockedCompareExchangeNoFence(
+    volatile LONG*  p,
+    LONG            Exchange,
+    LONG            Comparand
+    )
+{
+    __atomic_compare_exchange_n(p, &Comparand, Exchange, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return Comparand;
+}
+
+FORCEINLINE LONGLONG InterlockedIncrementNoFence64(volatile LONGLONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONGLONG InterlockedExchangeAddNoFence64(volatile LONGLONG* p, LONGLONG v) { return __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+
+FORCEINLINE LONG ReadAcquire(const volatile LONG* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+FORCEINLINE LONG ReadNoFence(const volatile LONG* p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+FORCEINLINE LONGLONG ReadAcquire64(const volatile LONGLONG* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+FORCEINLINE LONGLONG ReadNoFence64(const volatile LONGLONG* p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+FORCEINLINE ULONG ReadULongAcquire(const volatile ULONG* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+FORCEINLINE ULONG ReadULongNoFence(const volatile ULONG* p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+FORCEINLINE ULONGLONG ReadULong64Acquire(const volatile ULONGLONG* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+FORCEINLINE ULONGLONG ReadULong64NoFence(const volatile ULONGLONG* p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+
+FORCEINLINE VOID WriteRelease(volatile LONG* p, LONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WriteNoFence(volatile LONG* p, LONG v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease64(volatile LONGLONG* p, LONGLONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WriteNoFence64(volatile LONGLONG* p, LONGLONG v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteULongRelease(volatile ULONG* p, ULONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WriteULongNoFence(volatile ULONG* p, ULONG v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteULong64Release(volatile ULONGLONG* p, ULONGLONG v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WriteULong64NoFence(volatile ULONGLONG* p, ULONGLONG v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+
+//
+// A test can run another party at the full barriers of the driver,
+// where its lock-free protocols check what a concurrent party did,
+// by setting g_HostBarrierHook.
+//
+
+typedef VOID HOST_BARRIER_HOOK(VOID);
+
+inline HOST_BARRIER_HOOK* g_HostBarrierHook = nullptr;
+
+#define MemoryBarrier()                                             \
+    (__atomic_thread_fence(__ATOMIC_SEQ_CST),                       \
+     (g_HostBarrierHook != nullptr) ? g_HostBarrierHook() : (VOID)0)
+#define YieldProcessor()    __builtin_ia32_pause()
+
+#endif // _HOSTWIN_H_
@@ -0,0 +1,46 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    hostwpp.h
+
+Abstract:
+
+    This module contains the trace macros the WPP preprocessor
+    provides to the kernel build. Traces are dropped on the host,
+    their arguments are still evaluated as in a traced build.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOSTWPP_H_
+#define _HOSTWPP_H_
+
+template <typename... Args>
+static inline
+VOID
+HostTrace(
+    _In_z_ const CHAR*  pFormat,
+    const Args&...      Arguments
+    )
+{
+    UNREFERENCED_PARAMETER(pFormat);
+    (UNREFERENCED_PARAMETER(Arguments), ...);
+}
+
+#define Trace(Level, Flags, Msg, ...)   HostTrace(Msg, ##__VA_ARGS__)
+#define FuncEntry(Flags)                ((void)0)
+#define FuncExit(Flags)                 ((void)0)
+
+#define WPP_INIT_TRACING(DriverObject, RegistryPath) \
+    (UNREFERENCED_PARAMETER(DriverObject), UNREFERENCED_PARAMETER(RegistryPath))
+#define WPP_CLEANUP(DriverObject)       ((void)0)
+
+#endif // _HOSTWPP_H_
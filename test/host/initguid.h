@@ -0,0 +1,20 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    initguid.h
+
+Abstract:
+
+    This module stands for the GUID definition header of the
+    kernel build, the host build defines no GUID.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
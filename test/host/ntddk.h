@@ -0,0 +1,274 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    ntddk.h
+
+Abstract:
+
+    This module contains the kernel types and routines the driver
+    sources use, so that they can be built against the mock
+    framework of wdfhost.cpp. Only what the probe calls is
+    provided, with the semantics it relies on.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOST_NTDDK_H_
+#define _HOST_NTDDK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "hostwin.h"
+
+/////////////////////////////////////////////////
+//
+// Types.
+//
+/////////////////////////////////////////////////
+
+typedef int64_t             LONG64;
+typedef uint64_t            ULONG64;
+typedef char                CCHAR;
+typedef void*               HANDLE;
+typedef WCHAR*              PWCH;
+typedef ULONG               ACCESS_MASK;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _UNICODE_STRING
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH   Buffer;
+}
+UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define DECLARE_CONST_UNICODE_STRING(_var, _string)                 \
+    const UNICODE_STRING _var =                                     \
+    {                                                               \
+        sizeof(_string) - sizeof(WCHAR),                            \
+        sizeof(_string),                                            \
+        (PWCH)(_string)                                             \
+    }
+
+#define DECLARE_UNICODE_STRING_SIZE(_var, _size)                    \
+    WCHAR _var ## _buffer[_size];                                   \
+    UNICODE_STRING _var = { 0, (_size) * sizeof(WCHAR), _var ## _buffer }
+
+/////////////////////////////////////////////////
+//
+// Status codes.
+//
+/////////////////////////////////////////////////
+
+#define NT_SUCCESS(Status)                  (((NTSTATUS)(Status)) >= 0)
+
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                      ((NTSTATUS)0x00000103L)
+#define STATUS_NO_MORE_ENTRIES              ((NTSTATUS)0x8000001AL)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST       ((NTSTATUS)0xC0000010L)
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND        ((NTSTATUS)0xC0000034L)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#define STATUS_INVALID_DEVICE_STATE         ((NTSTATUS)0xC0000184L)
+#define STATUS_DEVICE_BUSY                  ((NTSTATUS)0x80000011L)
+#define STATUS_INFO_LENGTH_MISMATCH         ((NTSTATUS)0xC0000004L)
+#define STATUS_NOT_SUPPORTED                ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED                    ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND                    ((NTSTATUS)0xC0000225L)
+#define STATUS_IO_DEVICE_ERROR              ((NTSTATUS)0xC0000185L)
+
+/////////////////////////////////////////////////
+//
+// Assertions, fatal on the host.
+//
+/////////////////////////////////////////////////
+
+VOID
+HostAssertFailed(
+    _In_z_ const CHAR*  pExpression,
+    _In_z_ const CHAR*  pFile,
+    _In_   int          Line
+    );
+
+#define NT_ASSERT(e) \
+    ((e) ? (void)0 : HostAssertFailed(#e, __FILE__, __LINE__))
+
+#define NT_ASSERTMSG(m, e) \
+    ((e) ? (void)0 : HostAssertFailed(m, __FILE__, __LINE__))
+
+/////////////////////////////////////////////////
+//
+// Memory.
+//
+/////////////////////////////////////////////////
+
+#define PAGE_SIZE           0x1000
+
+#define ALIGN_UP_BY(Length, Alignment) \
+    (((ULONG_PTR)(Length) + (Alignment) - 1) & ~((ULONG_PTR)(Alignment) - 1))
+
+#ifndef min
+#define min(a, b)           (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a, b)           (((a) > (b)) ? (a) : (b))
+#endif
+
+#define RtlCopyMemory(d, s, l)      memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)      memmove((d), (s), (l))
+#define RtlZeroMemory(d, l)         memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)      memset((d), (f), (l))
+#define RtlEqualMemory(a, b, l)     (memcmp((a), (b), (l)) == 0)
+
+FORCEINLINE
+CCHAR
+RtlFindMostSignificantBit(
+    _In_ ULONGLONG  Set
+    )
+{
+    return (Set == 0) ? -1 : (CCHAR)(63 - __builtin_clzll(Set));
+}
+
+// Only the fields the driver reads. An MDL of the host always
+// describes a mapped buffer, MappedSystemVa.
+typedef struct _MDL
+{
+    struct _MDL*  Next;
+    ULONG         ByteCount;
+    PVOID         MappedSystemVa;
+}
+MDL, *PMDL;
+
+typedef enum _MM_PAGE_PRIORITY
+{
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+}
+MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute 0x40000000
+
+#define MmGetMdlByteCount(Mdl)      ((Mdl)->ByteCount)
+
+PVOID
+HostMapMdl(
+    _In_  PMDL  Mdl
+    );
+
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) HostMapMdl(Mdl)
+
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+}
+POOL_TYPE;
+
+PVOID
+ExAllocatePoolWithTag(
+    _In_  POOL_TYPE  PoolType,
+    _In_  SIZE_T     NumberOfBytes,
+    _In_  ULONG      Tag
+    );
+
+VOID
+ExFreePoolWithTag(
+    _In_  PVOID  P,
+    _In_  ULONG  Tag
+    );
+
+/////////////////////////////////////////////////
+//
+// Time and processors.
+//
+/////////////////////////////////////////////////
+
+#define ALL_PROCESSOR_GROUPS        0xffff
+
+typedef struct _PROCESSOR_NUMBER
+{
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+}
+PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    _Out_opt_ PLARGE_INTEGER  PerformanceFrequency
+    );
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    _Out_opt_ PPROCESSOR_NUMBER  ProcNumber
+    );
+
+ULONG
+KeQueryMaximumProcessorCountEx(
+    _In_  USHORT  GroupNumber
+    );
+
+/////////////////////////////////////////////////
+//
+// Resources, registry and files.
+//
+/////////////////////////////////////////////////
+
+#define CmResourceTypeConnection                132
+
+#define CM_RESOURCE_CONNECTION_CLASS_SERIAL     0x02
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C  0x01
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI  0x02
+
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR
+{
+    UCHAR  Type;
+    UCHAR  ShareDisposition;
+    USHORT Flags;
+    union
+    {
+        struct
+        {
+            UCHAR Class;
+            UCHAR Type;
+            UCHAR Reserved1;
+            UCHAR Reserved2;
+            ULONG IdLowPart;
+            ULONG IdHighPart;
+        } Connection;
+    } u;
+}
+CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+#define PLUGPLAY_REGKEY_DEVICE      1
+#define KEY_READ                    0x20019
+
+#define REG_NONE                    0
+#define REG_SZ                      1
+#define REG_BINARY                  3
+#define REG_DWORD                   4
+
+#define GENERIC_READ                0x80000000L
+#define GENERIC_WRITE               0x40000000L
+#define FILE_OPEN                   0x00000001
+#define FILE_ATTRIBUTE_NORMAL       0x00000080
+
+#define FILE_DEVICE_CONTROLLER      0x00000004
+
+#endif // _HOST_NTDDK_H_
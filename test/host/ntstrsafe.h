@@ -0,0 +1,20 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    ntstrsafe.h
+
+Abstract:
+
+    This module stands for the safe string header of the kernel
+    build, the driver calls none of its routines.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
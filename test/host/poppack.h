@@ -0,0 +1,21 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    poppack.h
+
+Abstract:
+
+    This module restores the packing changed by pshpack1.h.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#pragma pack(pop)
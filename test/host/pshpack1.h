@@ -0,0 +1,22 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    pshpack1.h
+
+Abstract:
+
+    This module packs the structures that follow on byte
+    boundaries, until poppack.h.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#pragma pack(push, 1)
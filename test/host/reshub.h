@@ -0,0 +1,71 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    reshub.h
+
+Abstract:
+
+    This module contains the resource hub definitions the driver
+    uses to name its connections and read the connection
+    properties of a target.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOST_RESHUB_H_
+#define _HOST_RESHUB_H_
+
+#define RESOURCE_HUB_PATH_SIZE      64
+
+FORCEINLINE
+VOID
+RESOURCE_HUB_CREATE_PATH_FROM_ID(
+    _Inout_ PUNICODE_STRING  Path,
+    _In_    ULONG            IdLowPart,
+    _In_    ULONG            IdHighPart
+    )
+{
+    int length = swprintf(
+        Path->Buffer,
+        Path->MaximumLength / sizeof(WCHAR),
+        L"\\Device\\RESOURCE_HUB\\%0*llx",
+        16,
+        ((unsigned long long)IdHighPart << 32) | IdLowPart);
+
+    Path->Length = (USHORT)(length * sizeof(WCHAR));
+}
+
+typedef struct _RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER
+{
+    ULONG PropertiesLength;
+    UCHAR ConnectionProperties[1];
+}
+RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER, *PRH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER;
+
+#include "pshpack1.h"
+
+typedef struct _PNP_SERIAL_BUS_DESCRIPTOR
+{
+    UCHAR  Tag;
+    USHORT Length;
+    UCHAR  RevisionId;
+    UCHAR  ResourceSourceIndex;
+    UCHAR  SerialBusType;
+    UCHAR  GeneralFlags;
+    USHORT TypeSpecificFlags;
+    UCHAR  TypeSpecificRevisionId;
+    USHORT TypeDataLength;
+}
+PNP_SERIAL_BUS_DESCRIPTOR, *PPNP_SERIAL_BUS_DESCRIPTOR;
+
+#include "poppack.h"
+
+#endif // _HOST_RESHUB_H_
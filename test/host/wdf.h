@@ -0,0 +1,899 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    wdf.h
+
+Abstract:
+
+    This module contains the KMDF types and methods the driver
+    uses, implemented by the mock framework of wdfhost.cpp. The
+    structures keep the layout and the field names of KMDF, minus
+    the fields the driver never touches.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _HOST_WDF_H_
+#define _HOST_WDF_H_
+
+#include "ntddk.h"
+
+/////////////////////////////////////////////////
+//
+// Handles.
+//
+/////////////////////////////////////////////////
+
+typedef void*                       WDFOBJECT;
+typedef void*                       WDFCONTEXT;
+
+typedef struct HOST_DRIVER*         WDFDRIVER;
+typedef struct HOST_DEVICE*         WDFDEVICE;
+typedef struct HOST_QUEUE*          WDFQUEUE;
+typedef struct HOST_REQUEST*        WDFREQUEST;
+typedef struct HOST_IO_TARGET*      WDFIOTARGET;
+typedef struct HOST_MEMORY*         WDFMEMORY;
+typedef struct HOST_SPIN_LOCK*      WDFSPINLOCK;
+typedef struct HOST_WORK_ITEM*      WDFWORKITEM;
+typedef struct HOST_TIMER*          WDFTIMER;
+typedef struct HOST_KEY*            WDFKEY;
+typedef struct HOST_RESOURCE_LIST*  WDFCMRESLIST;
+typedef struct HOST_INTERRUPT*      WDFINTERRUPT;
+
+typedef struct WDFDEVICE_INIT       WDFDEVICE_INIT, *PWDFDEVICE_INIT;
+
+#define WDF_NO_HANDLE               NULL
+#define WDF_NO_OBJECT_ATTRIBUTES    NULL
+#define WDF_NO_SEND_OPTIONS         NULL
+
+typedef enum _WDF_TRI_STATE
+{
+    WdfFalse = FALSE,
+    WdfTrue = TRUE,
+    WdfUseDefault = 2,
+}
+WDF_TRI_STATE;
+
+/////////////////////////////////////////////////
+//
+// Objects and contexts.
+//
+/////////////////////////////////////////////////
+
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO
+{
+    ULONG        Size;
+    const CHAR*  ContextName;
+    size_t       ContextSize;
+}
+WDF_OBJECT_CONTEXT_TYPE_INFO, *PWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(_In_ WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_CLEANUP *PFN_WDF_OBJECT_CONTEXT_CLEANUP;
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_DESTROY(_In_ WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_DESTROY *PFN_WDF_OBJECT_CONTEXT_DESTROY;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES
+{
+    ULONG                                   Size;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP          EvtCleanupCallback;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY          EvtDestroyCallback;
+    WDFOBJECT                               ParentObject;
+    size_t                                  ContextSizeOverride;
+    const WDF_OBJECT_CONTEXT_TYPE_INFO*     ContextTypeInfo;
+}
+WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+FORCEINLINE
+VOID
+WDF_OBJECT_ATTRIBUTES_INIT(
+    _Out_ PWDF_OBJECT_ATTRIBUTES  Attributes
+    )
+{
+    RtlZeroMemory(Attributes, sizeof(WDF_OBJECT_ATTRIBUTES));
+    Attributes->Size = sizeof(WDF_OBJECT_ATTRIBUTES);
+}
+
+PVOID
+HostObjectGetContext(
+    _In_  WDFOBJECT                            Handle,
+    _In_  const WDF_OBJECT_CONTEXT_TYPE_INFO*  TypeInfo
+    );
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, _castingfunction)  \
+    inline const WDF_OBJECT_CONTEXT_TYPE_INFO WDF_##_contexttype##_TYPE_INFO = \
+    {                                                                       \
+        sizeof(WDF_OBJECT_CONTEXT_TYPE_INFO),                               \
+        #_contexttype,                                                      \
+        sizeof(_contexttype),                                               \
+    };                                                                      \
+    FORCEINLINE _contexttype* _castingfunction(_In_ WDFOBJECT Handle)       \
+    {                                                                       \
+        return (_contexttype*)HostObjectGetContext(                         \
+            Handle, &WDF_##_contexttype##_TYPE_INFO);                       \
+    }
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(_attributes, _contexttype)  \
+    (WDF_OBJECT_ATTRIBUTES_INIT(_attributes),                               \
+     (_attributes)->ContextTypeInfo = &WDF_##_contexttype##_TYPE_INFO)
+
+VOID
+WdfObjectDelete(
+    _In_  WDFOBJECT  Object
+    );
+
+/////////////////////////////////////////////////
+//
+// Driver and device.
+//
+/////////////////////////////////////////////////
+
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit);
+typedef EVT_WDF_DRIVER_DEVICE_ADD *PFN_WDF_DRIVER_DEVICE_ADD;
+
+typedef struct _WDF_DRIVER_CONFIG
+{
+    ULONG                       Size;
+    PFN_WDF_DRIVER_DEVICE_ADD   EvtDriverDeviceAdd;
+    ULONG                       DriverInitFlags;
+    ULONG                       DriverPoolTag;
+}
+WDF_DRIVER_CONFIG, *PWDF_DRIVER_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_DRIVER_CONFIG_INIT(
+    _Out_ PWDF_DRIVER_CONFIG         Config,
+    _In_  PFN_WDF_DRIVER_DEVICE_ADD  EvtDriverDeviceAdd
+    )
+{
+    RtlZeroMemory(Config, sizeof(WDF_DRIVER_CONFIG));
+    Config->Size = sizeof(WDF_DRIVER_CONFIG);
+    Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+NTSTATUS
+WdfDriverCreate(
+    _In_      PDRIVER_OBJECT          DriverObject,
+    _In_      PCUNICODE_STRING        RegistryPath,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  DriverAttributes,
+    _In_      PWDF_DRIVER_CONFIG      DriverConfig,
+    _Out_opt_ WDFDRIVER*              Driver
+    );
+
+typedef enum _WDF_POWER_DEVICE_STATE
+{
+    WdfPowerDeviceInvalid = 0,
+    WdfPowerDeviceD0,
+    WdfPowerDeviceD1,
+    WdfPowerDeviceD2,
+    WdfPowerDeviceD3,
+    WdfPowerDeviceD3Final,
+    WdfPowerDevicePrepareForHibernation,
+}
+WDF_POWER_DEVICE_STATE;
+
+typedef NTSTATUS EVT_WDF_DEVICE_PREPARE_HARDWARE(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST ResourcesRaw, _In_ WDFCMRESLIST ResourcesTranslated);
+typedef EVT_WDF_DEVICE_PREPARE_HARDWARE *PFN_WDF_DEVICE_PREPARE_HARDWARE;
+
+typedef NTSTATUS EVT_WDF_DEVICE_RELEASE_HARDWARE(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST ResourcesTranslated);
+typedef EVT_WDF_DEVICE_RELEASE_HARDWARE *PFN_WDF_DEVICE_RELEASE_HARDWARE;
+
+typedef NTSTATUS EVT_WDF_DEVICE_D0_ENTRY(_In_ WDFDEVICE Device, _In_ WDF_POWER_DEVICE_STATE PreviousState);
+typedef EVT_WDF_DEVICE_D0_ENTRY *PFN_WDF_DEVICE_D0_ENTRY;
+
+typedef NTSTATUS EVT_WDF_DEVICE_D0_EXIT(_In_ WDFDEVICE Device, _In_ WDF_POWER_DEVICE_STATE TargetState);
+typedef EVT_WDF_DEVICE_D0_EXIT *PFN_WDF_DEVICE_D0_EXIT;
+
+typedef BOOLEAN EVT_WDF_INTERRUPT_ISR(_In_ WDFINTERRUPT Interrupt, _In_ ULONG MessageID);
+typedef VOID EVT_WDF_INTERRUPT_DPC(_In_ WDFINTERRUPT Interrupt, _In_ WDFOBJECT AssociatedObject);
+
+typedef struct _WDF_PNPPOWER_EVENT_CALLBACKS
+{
+    ULONG                               Size;
+    PFN_WDF_DEVICE_D0_ENTRY             EvtDeviceD0Entry;
+    PFN_WDF_DEVICE_D0_EXIT              EvtDeviceD0Exit;
+    PFN_WDF_DEVICE_PREPARE_HARDWARE     EvtDevicePrepareHardware;
+    PFN_WDF_DEVICE_RELEASE_HARDWARE     EvtDeviceReleaseHardware;
+}
+WDF_PNPPOWER_EVENT_CALLBACKS, *PWDF_PNPPOWER_EVENT_CALLBACKS;
+
+FORCEINLINE
+VOID
+WDF_PNPPOWER_EVENT_CALLBACKS_INIT(
+    _Out_ PWDF_PNPPOWER_EVENT_CALLBACKS  Callbacks
+    )
+{
+    RtlZeroMemory(Callbacks, sizeof(WDF_PNPPOWER_EVENT_CALLBACKS));
+    Callbacks->Size = sizeof(WDF_PNPPOWER_EVENT_CALLBACKS);
+}
+
+VOID
+WdfDeviceInitSetPnpPowerEventCallbacks(
+    _In_  PWDFDEVICE_INIT                DeviceInit,
+    _In_  PWDF_PNPPOWER_EVENT_CALLBACKS  PnpPowerEventCallbacks
+    );
+
+NTSTATUS
+WdfDeviceCreate(
+    _Inout_   PWDFDEVICE_INIT*        DeviceInit,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  DeviceAttributes,
+    _Out_     WDFDEVICE*              Device
+    );
+
+typedef struct _WDF_DEVICE_STATE
+{
+    ULONG           Size;
+    WDF_TRI_STATE   Disabled;
+    WDF_TRI_STATE   DontDisplayInUI;
+    WDF_TRI_STATE   Failed;
+    WDF_TRI_STATE   NotDisableable;
+    WDF_TRI_STATE   Removed;
+    WDF_TRI_STATE   ResourcesChanged;
+}
+WDF_DEVICE_STATE, *PWDF_DEVICE_STATE;
+
+FORCEINLINE
+VOID
+WDF_DEVICE_STATE_INIT(
+    _Out_ PWDF_DEVICE_STATE  PnpDeviceState
+    )
+{
+    RtlZeroMemory(PnpDeviceState, sizeof(WDF_DEVICE_STATE));
+    PnpDeviceState->Size = sizeof(WDF_DEVICE_STATE);
+    PnpDeviceState->Disabled = WdfUseDefault;
+    PnpDeviceState->DontDisplayInUI = WdfUseDefault;
+    PnpDeviceState->Failed = WdfUseDefault;
+    PnpDeviceState->NotDisableable = WdfUseDefault;
+    PnpDeviceState->Removed = WdfUseDefault;
+    PnpDeviceState->ResourcesChanged = WdfUseDefault;
+}
+
+VOID
+WdfDeviceSetDeviceState(
+    _In_  WDFDEVICE          Device,
+    _In_  PWDF_DEVICE_STATE  DeviceState
+    );
+
+typedef enum _WDF_POWER_POLICY_S0_IDLE_CAPABILITIES
+{
+    IdleCapsInvalid = 0,
+    IdleCannotWakeFromS0,
+    IdleCanWakeFromS0,
+    IdleUsbSelectiveSuspend,
+}
+WDF_POWER_POLICY_S0_IDLE_CAPABILITIES;
+
+typedef enum _WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE
+{
+    DriverManagedIdleTimeout = 0,
+    SystemManagedIdleTimeout,
+    SystemManagedIdleTimeoutWithHint,
+}
+WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE;
+
+typedef struct _WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS
+{
+    ULONG                                   Size;
+    WDF_POWER_POLICY_S0_IDLE_CAPABILITIES   IdleCaps;
+    ULONG                                   IdleTimeout;
+    WDF_TRI_STATE                           Enabled;
+    WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE      IdleTimeoutType;
+}
+WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS, *PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS;
+
+FORCEINLINE
+VOID
+WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
+    _Out_ PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS  Settings,
+    _In_  WDF_POWER_POLICY_S0_IDLE_CAPABILITIES   IdleCaps
+    )
+{
+    RtlZeroMemory(Settings, sizeof(WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS));
+    Settings->Size = sizeof(WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS);
+    Settings->IdleCaps = IdleCaps;
+    Settings->IdleTimeout = 0;
+    Settings->Enabled = WdfUseDefault;
+}
+
+NTSTATUS
+WdfDeviceAssignS0IdleSettings(
+    _In_  WDFDEVICE                               Device,
+    _In_  PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS  Settings
+    );
+
+NTSTATUS
+WdfDeviceStopIdle(
+    _In_  WDFDEVICE  Device,
+    _In_  BOOLEAN    WaitForD0
+    );
+
+VOID
+WdfDeviceResumeIdle(
+    _In_  WDFDEVICE  Device
+    );
+
+NTSTATUS
+WdfDeviceEnqueueRequest(
+    _In_  WDFDEVICE   Device,
+    _In_  WDFREQUEST  Request
+    );
+
+ULONG
+WdfCmResourceListGetCount(
+    _In_  WDFCMRESLIST  List
+    );
+
+PCM_PARTIAL_RESOURCE_DESCRIPTOR
+WdfCmResourceListGetDescriptor(
+    _In_  WDFCMRESLIST  List,
+    _In_  ULONG         Index
+    );
+
+/////////////////////////////////////////////////
+//
+// Registry.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+WdfDeviceOpenRegistryKey(
+    _In_      WDFDEVICE               Device,
+    _In_      ULONG                   DeviceInstanceKeyType,
+    _In_      ACCESS_MASK             DesiredAccess,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  KeyAttributes,
+    _Out_     WDFKEY*                 Key
+    );
+
+NTSTATUS
+WdfRegistryQueryULong(
+    _In_  WDFKEY            Key,
+    _In_  PCUNICODE_STRING  ValueName,
+    _Out_ PULONG            Value
+    );
+
+NTSTATUS
+WdfRegistryQueryValue(
+    _In_      WDFKEY            Key,
+    _In_      PCUNICODE_STRING  ValueName,
+    _In_      ULONG             ValueLength,
+    _Out_opt_ PVOID             Value,
+    _Out_opt_ PULONG            ValueLengthQueried,
+    _Out_opt_ PULONG            ValueType
+    );
+
+VOID
+WdfRegistryClose(
+    _In_  WDFKEY  Key
+    );
+
+/////////////////////////////////////////////////
+//
+// Synchronization, work items and timers.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+WdfSpinLockCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  SpinLockAttributes,
+    _Out_     WDFSPINLOCK*            SpinLock
+    );
+
+VOID
+WdfSpinLockAcquire(
+    _In_  WDFSPINLOCK  SpinLock
+    );
+
+VOID
+WdfSpinLockRelease(
+    _In_  WDFSPINLOCK  SpinLock
+    );
+
+typedef VOID EVT_WDF_WORKITEM(_In_ WDFWORKITEM WorkItem);
+typedef EVT_WDF_WORKITEM *PFN_WDF_WORKITEM;
+
+typedef struct _WDF_WORKITEM_CONFIG
+{
+    ULONG               Size;
+    PFN_WDF_WORKITEM    EvtWorkItemFunc;
+    BOOLEAN             AutomaticSerialization;
+}
+WDF_WORKITEM_CONFIG, *PWDF_WORKITEM_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_WORKITEM_CONFIG_INIT(
+    _Out_ PWDF_WORKITEM_CONFIG  Config,
+    _In_  PFN_WDF_WORKITEM      EvtWorkItemFunc
+    )
+{
+    RtlZeroMemory(Config, sizeof(WDF_WORKITEM_CONFIG));
+    Config->Size = sizeof(WDF_WORKITEM_CONFIG);
+    Config->EvtWorkItemFunc = EvtWorkItemFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS
+WdfWorkItemCreate(
+    _In_  PWDF_WORKITEM_CONFIG    Config,
+    _In_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _Out_ WDFWORKITEM*            WorkItem
+    );
+
+VOID
+WdfWorkItemEnqueue(
+    _In_  WDFWORKITEM  WorkItem
+    );
+
+VOID
+WdfWorkItemFlush(
+    _In_  WDFWORKITEM  WorkItem
+    );
+
+WDFOBJECT
+WdfWorkItemGetParentObject(
+    _In_  WDFWORKITEM  WorkItem
+    );
+
+typedef VOID EVT_WDF_TIMER(_In_ WDFTIMER Timer);
+typedef EVT_WDF_TIMER *PFN_WDF_TIMER;
+
+typedef struct _WDF_TIMER_CONFIG
+{
+    ULONG               Size;
+    PFN_WDF_TIMER       EvtTimerFunc;
+    ULONG               Period;
+    BOOLEAN             AutomaticSerialization;
+    ULONG               TolerableDelay;
+    BOOLEAN             UseHighResolutionTimer;
+}
+WDF_TIMER_CONFIG, *PWDF_TIMER_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_TIMER_CONFIG_INIT(
+    _Out_ PWDF_TIMER_CONFIG  Config,
+    _In_  PFN_WDF_TIMER      EvtTimerFunc
+    )
+{
+    RtlZeroMemory(Config, sizeof(WDF_TIMER_CONFIG));
+    Config->Size = sizeof(WDF_TIMER_CONFIG);
+    Config->EvtTimerFunc = EvtTimerFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+#define WDF_REL_TIMEOUT_IN_US(Time)     ((LONGLONG)(Time) * -10)
+
+NTSTATUS
+WdfTimerCreate(
+    _In_  PWDF_TIMER_CONFIG       Config,
+    _In_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _Out_ WDFTIMER*               Timer
+    );
+
+BOOLEAN
+WdfTimerStart(
+    _In_  WDFTIMER  Timer,
+    _In_  LONGLONG  DueTime
+    );
+
+BOOLEAN
+WdfTimerStop(
+    _In_  WDFTIMER  Timer,
+    _In_  BOOLEAN   Wait
+    );
+
+WDFOBJECT
+WdfTimerGetParentObject(
+    _In_  WDFTIMER  Timer
+    );
+
+/////////////////////////////////////////////////
+//
+// Queues and requests.
+//
+/////////////////////////////////////////////////
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE
+{
+    WdfIoQueueDispatchInvalid = 0,
+    WdfIoQueueDispatchSequential,
+    WdfIoQueueDispatchParallel,
+    WdfIoQueueDispatchManual,
+}
+WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef VOID EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request);
+typedef EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE *PFN_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE;
+
+typedef VOID EVT_WDF_IO_IN_CALLER_CONTEXT(_In_ WDFDEVICE Device, _In_ WDFREQUEST Request);
+typedef EVT_WDF_IO_IN_CALLER_CONTEXT *PFN_WDF_IO_IN_CALLER_CONTEXT;
+
+typedef struct _WDF_IO_QUEUE_CONFIG
+{
+    ULONG                                   Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE              DispatchType;
+    WDF_TRI_STATE                           PowerManaged;
+    BOOLEAN                                 AllowZeroLengthRequests;
+    BOOLEAN                                 DefaultQueue;
+    PFN_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE   EvtIoCanceledOnQueue;
+}
+WDF_IO_QUEUE_CONFIG, *PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_IO_QUEUE_CONFIG_INIT(
+    _Out_ PWDF_IO_QUEUE_CONFIG        Config,
+    _In_  WDF_IO_QUEUE_DISPATCH_TYPE  DispatchType
+    )
+{
+    RtlZeroMemory(Config, sizeof(WDF_IO_QUEUE_CONFIG));
+    Config->Size = sizeof(WDF_IO_QUEUE_CONFIG);
+    Config->DispatchType = DispatchType;
+    Config->PowerManaged = WdfUseDefault;
+}
+
+NTSTATUS
+WdfIoQueueCreate(
+    _In_      WDFDEVICE               Device,
+    _In_      PWDF_IO_QUEUE_CONFIG    Config,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  QueueAttributes,
+    _Out_opt_ WDFQUEUE*               Queue
+    );
+
+WDFDEVICE
+WdfIoQueueGetDevice(
+    _In_  WDFQUEUE  Queue
+    );
+
+NTSTATUS
+WdfIoQueueRetrieveNextRequest(
+    _In_  WDFQUEUE     Queue,
+    _Out_ WDFREQUEST*  OutRequest
+    );
+
+typedef enum _WDF_REQUEST_TYPE
+{
+    WdfRequestTypeCreate = 0x0,
+    WdfRequestTypeClose = 0x2,
+    WdfRequestTypeRead = 0x3,
+    WdfRequestTypeWrite = 0x4,
+    WdfRequestTypeDeviceControl = 0xE,
+    WdfRequestTypeDeviceControlInternal = 0xF,
+    WdfRequestTypeOther = 0x1B,
+}
+WDF_REQUEST_TYPE;
+
+typedef struct _WDF_REQUEST_PARAMETERS
+{
+    USHORT              Size;
+    UCHAR               MinorFunction;
+    WDF_REQUEST_TYPE    Type;
+    union
+    {
+        struct
+        {
+            size_t      OutputBufferLength;
+            size_t      InputBufferLength;
+            ULONG       IoControlCode;
+            PVOID       Type3InputBuffer;
+        } DeviceIoControl;
+    } Parameters;
+}
+WDF_REQUEST_PARAMETERS, *PWDF_REQUEST_PARAMETERS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_PARAMETERS_INIT(
+    _Out_ PWDF_REQUEST_PARAMETERS  Parameters
+    )
+{
+    RtlZeroMemory(Parameters, sizeof(WDF_REQUEST_PARAMETERS));
+    Parameters->Size = sizeof(WDF_REQUEST_PARAMETERS);
+}
+
+typedef struct _IO_STATUS_BLOCK
+{
+    NTSTATUS    Status;
+    ULONG_PTR   Information;
+}
+IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef struct _WDF_REQUEST_COMPLETION_PARAMS
+{
+    ULONG               Size;
+    WDF_REQUEST_TYPE    Type;
+    IO_STATUS_BLOCK     IoStatus;
+}
+WDF_REQUEST_COMPLETION_PARAMS, *PWDF_REQUEST_COMPLETION_PARAMS;
+
+typedef VOID EVT_WDF_REQUEST_COMPLETION_ROUTINE(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target, _In_ PWDF_REQUEST_COMPLETION_PARAMS Params, _In_ WDFCONTEXT Context);
+typedef EVT_WDF_REQUEST_COMPLETION_ROUTINE *PFN_WDF_REQUEST_COMPLETION_ROUTINE;
+
+typedef VOID EVT_WDF_REQUEST_CANCEL(_In_ WDFREQUEST Request);
+typedef EVT_WDF_REQUEST_CANCEL *PFN_WDF_REQUEST_CANCEL;
+
+#define WDF_REQUEST_REUSE_NO_FLAGS  0x00000000
+
+typedef struct _WDF_REQUEST_REUSE_PARAMS
+{
+    ULONG       Size;
+    ULONG       Flags;
+    NTSTATUS    Status;
+}
+WDF_REQUEST_REUSE_PARAMS, *PWDF_REQUEST_REUSE_PARAMS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_REUSE_PARAMS_INIT(
+    _Out_ PWDF_REQUEST_REUSE_PARAMS  Params,
+    _In_  ULONG                      Flags,
+    _In_  NTSTATUS                   Status
+    )
+{
+    RtlZeroMemory(Params, sizeof(WDF_REQUEST_REUSE_PARAMS));
+    Params->Size = sizeof(WDF_REQUEST_REUSE_PARAMS);
+    Params->Flags = Flags;
+    Params->Status = Status;
+}
+
+typedef struct _WDF_REQUEST_SEND_OPTIONS WDF_REQUEST_SEND_OPTIONS, *PWDF_REQUEST_SEND_OPTIONS;
+
+typedef struct _WDFMEMORY_OFFSET
+{
+    size_t BufferOffset;
+    size_t BufferLength;
+}
+WDFMEMORY_OFFSET, *PWDFMEMORY_OFFSET;
+
+NTSTATUS
+WdfRequestCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  RequestAttributes,
+    _In_opt_  WDFIOTARGET             IoTarget,
+    _Out_     WDFREQUEST*             Request
+    );
+
+NTSTATUS
+WdfRequestReuse(
+    _In_  WDFREQUEST                 Request,
+    _In_  PWDF_REQUEST_REUSE_PARAMS  ReuseParams
+    );
+
+VOID
+WdfRequestGetParameters(
+    _In_  WDFREQUEST               Request,
+    _Out_ PWDF_REQUEST_PARAMETERS  Parameters
+    );
+
+NTSTATUS
+WdfRequestGetStatus(
+    _In_  WDFREQUEST  Request
+    );
+
+NTSTATUS
+WdfRequestRetrieveInputBuffer(
+    _In_      WDFREQUEST  Request,
+    _In_      size_t      MinimumRequiredLength,
+    _Outptr_  PVOID*      Buffer,
+    _Out_opt_ size_t*     Length
+    );
+
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(
+    _In_      WDFREQUEST  Request,
+    _In_      size_t      MinimumRequiredSize,
+    _Outptr_  PVOID*      Buffer,
+    _Out_opt_ size_t*     Length
+    );
+
+NTSTATUS
+WdfRequestRetrieveInputMemory(
+    _In_  WDFREQUEST  Request,
+    _Out_ WDFMEMORY*  Memory
+    );
+
+NTSTATUS
+WdfRequestRetrieveOutputMemory(
+    _In_  WDFREQUEST  Request,
+    _Out_ WDFMEMORY*  Memory
+    );
+
+NTSTATUS
+WdfRequestRetrieveOutputWdmMdl(
+    _In_  WDFREQUEST  Request,
+    _Out_ PMDL*       Mdl
+    );
+
+NTSTATUS
+WdfRequestForwardToIoQueue(
+    _In_  WDFREQUEST  Request,
+    _In_  WDFQUEUE    DestinationQueue
+    );
+
+NTSTATUS
+WdfRequestMarkCancelableEx(
+    _In_  WDFREQUEST              Request,
+    _In_  PFN_WDF_REQUEST_CANCEL  EvtRequestCancel
+    );
+
+NTSTATUS
+WdfRequestUnmarkCancelable(
+    _In_  WDFREQUEST  Request
+    );
+
+VOID
+WdfRequestSetCompletionRoutine(
+    _In_      WDFREQUEST                          Request,
+    _In_opt_  PFN_WDF_REQUEST_COMPLETION_ROUTINE  CompletionRoutine,
+    _In_opt_  WDFCONTEXT                          CompletionContext
+    );
+
+BOOLEAN
+WdfRequestSend(
+    _In_      WDFREQUEST                 Request,
+    _In_      WDFIOTARGET                Target,
+    _In_opt_  PWDF_REQUEST_SEND_OPTIONS  Options
+    );
+
+BOOLEAN
+WdfRequestCancelSentRequest(
+    _In_  WDFREQUEST  Request
+    );
+
+VOID
+WdfRequestComplete(
+    _In_  WDFREQUEST  Request,
+    _In_  NTSTATUS    Status
+    );
+
+VOID
+WdfRequestCompleteWithInformation(
+    _In_  WDFREQUEST  Request,
+    _In_  NTSTATUS    Status,
+    _In_  ULONG_PTR   Information
+    );
+
+/////////////////////////////////////////////////
+//
+// Memory objects.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+WdfMemoryCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _In_      POOL_TYPE               PoolType,
+    _In_opt_  ULONG                   PoolTag,
+    _In_      size_t                  BufferSize,
+    _Out_     WDFMEMORY*              Memory,
+    _Outptr_opt_ PVOID*               Buffer
+    );
+
+NTSTATUS
+WdfMemoryCreatePreallocated(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _In_      PVOID                   Buffer,
+    _In_      size_t                  BufferSize,
+    _Out_     WDFMEMORY*              Memory
+    );
+
+/////////////////////////////////////////////////
+//
+// I/O targets.
+//
+/////////////////////////////////////////////////
+
+typedef enum _WDF_IO_TARGET_SENT_IO_ACTION
+{
+    WdfIoTargetSentIoUndefined = 0,
+    WdfIoTargetCancelSentIo,
+    WdfIoTargetWaitForSentIoToComplete,
+    WdfIoTargetLeaveSentIoPending,
+}
+WDF_IO_TARGET_SENT_IO_ACTION;
+
+typedef enum _WDF_IO_TARGET_OPEN_TYPE
+{
+    WdfIoTargetOpenUndefined = 0,
+    WdfIoTargetOpenUseExistingDevice,
+    WdfIoTargetOpenByName,
+}
+WDF_IO_TARGET_OPEN_TYPE;
+
+typedef struct _WDF_IO_TARGET_OPEN_PARAMS
+{
+    ULONG                       Size;
+    WDF_IO_TARGET_OPEN_TYPE     Type;
+    UNICODE_STRING              TargetDeviceName;
+    ACCESS_MASK                 DesiredAccess;
+    ULONG                       ShareAccess;
+    ULONG                       FileAttributes;
+    ULONG                       CreateDisposition;
+    ULONG                       CreateOptions;
+}
+WDF_IO_TARGET_OPEN_PARAMS, *PWDF_IO_TARGET_OPEN_PARAMS;
+
+FORCEINLINE
+VOID
+WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(
+    _Out_ PWDF_IO_TARGET_OPEN_PARAMS  Params,
+    _In_  PCUNICODE_STRING            TargetDeviceName,
+    _In_  ACCESS_MASK                 DesiredAccess
+    )
+{
+    RtlZeroMemory(Params, sizeof(WDF_IO_TARGET_OPEN_PARAMS));
+    Params->Size = sizeof(WDF_IO_TARGET_OPEN_PARAMS);
+    Params->Type = WdfIoTargetOpenByName;
+    Params->TargetDeviceName = *TargetDeviceName;
+    Params->DesiredAccess = DesiredAccess;
+    Params->CreateDisposition = FILE_OPEN;
+}
+
+NTSTATUS
+WdfIoTargetCreate(
+    _In_      WDFDEVICE               Device,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  IoTargetAttributes,
+    _Out_     WDFIOTARGET*            IoTarget
+    );
+
+NTSTATUS
+WdfIoTargetOpen(
+    _In_  WDFIOTARGET                 IoTarget,
+    _In_  PWDF_IO_TARGET_OPEN_PARAMS  OpenParams
+    );
+
+NTSTATUS
+WdfIoTargetStart(
+    _In_  WDFIOTARGET  IoTarget
+    );
+
+VOID
+WdfIoTargetStop(
+    _In_  WDFIOTARGET                   IoTarget,
+    _In_  WDF_IO_TARGET_SENT_IO_ACTION  Action
+    );
+
+VOID
+WdfIoTargetClose(
+    _In_  WDFIOTARGET  IoTarget
+    );
+
+NTSTATUS
+WdfIoTargetFormatRequestForIoctl(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_      ULONG              IoctlCode,
+    _In_opt_  WDFMEMORY          InputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  InputBufferOffset,
+    _In_opt_  WDFMEMORY          OutputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  OutputBufferOffset
+    );
+
+NTSTATUS
+WdfIoTargetFormatRequestForRead(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_opt_  WDFMEMORY          OutputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  OutputBufferOffset,
+    _In_opt_  PLONGLONG          DeviceOffset
+    );
+
+NTSTATUS
+WdfIoTargetFormatRequestForWrite(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_opt_  WDFMEMORY          InputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  InputBufferOffset,
+    _In_opt_  PLONGLONG          DeviceOffset
+    );
+
+#endif // _HOST_WDF_H_
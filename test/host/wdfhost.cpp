@@ -0,0 +1,2891 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    wdfhost.cpp
+
+Abstract:
+
+    This module contains the mock framework of wdfhost.h: the KMDF,
+    SPBCx and kernel routines the driver calls, the SPB controller
+    its forward requests are sent to, and the peripheral side
+    submitting client requests.
+
+    The mock keeps to the rules the framework enforces on a
+    verified driver: a request is completed once, never while it
+    is cancelable, a sent request is reused before it is formatted
+    again, a spin lock is not acquired twice. A broken rule is an
+    assertion failure, which ends the test.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "wdfhost.h"
+#include "reshub.h"
+
+HOST_COUNTERS g_HostCounters;
+
+/////////////////////////////////////////////////
+//
+// Objects.
+//
+/////////////////////////////////////////////////
+
+struct HOST_OBJECT
+{
+    const WDF_OBJECT_CONTEXT_TYPE_INFO*  ContextType = nullptr;
+    PVOID                                Context = nullptr;
+    HOST_OBJECT*                         Parent = nullptr;
+
+    // Created by the driver, rather than by the framework on
+    // behalf of a peripheral.
+    BOOLEAN                              Counted = FALSE;
+
+    virtual ~HOST_OBJECT()
+    {
+        free(Context);
+    }
+};
+
+struct HOST_DRIVER : HOST_OBJECT
+{
+};
+
+struct HOST_MEMORY : HOST_OBJECT
+{
+    PVOID    Buffer = nullptr;
+    size_t   Size = 0;
+    BOOLEAN  Owned = FALSE;
+
+    ~HOST_MEMORY()
+    {
+        if (Owned)
+        {
+            free(Buffer);
+        }
+    }
+};
+
+struct HOST_SPIN_LOCK : HOST_OBJECT
+{
+    BOOLEAN  Held = FALSE;
+};
+
+struct HOST_WORK_ITEM : HOST_OBJECT
+{
+    PFN_WDF_WORKITEM  Function = nullptr;
+    BOOLEAN           Queued = FALSE;
+
+    ~HOST_WORK_ITEM();
+};
+
+struct HOST_TIMER : HOST_OBJECT
+{
+    PFN_WDF_TIMER  Function = nullptr;
+    BOOLEAN        Started = FALSE;
+    LONGLONG       DueTime = 0;
+
+    ~HOST_TIMER();
+};
+
+struct HOST_KEY
+{
+    struct HOST_DEVICE*  Device;
+};
+
+struct HOST_RESOURCE_LIST
+{
+    std::vector<CM_PARTIAL_RESOURCE_DESCRIPTOR> Descriptors;
+};
+
+struct HOST_REGISTRY_VALUE
+{
+    std::wstring        Name;
+    ULONG               Type;
+    std::vector<UCHAR>  Data;
+};
+
+struct HOST_DEVICE : HOST_OBJECT
+{
+    WDF_PNPPOWER_EVENT_CALLBACKS        Pnp = {};
+    SPB_CONTROLLER_CONFIG               Spb = {};
+    PFN_SPB_CONTROLLER_OTHER            EvtSpbIoOther = nullptr;
+    PFN_WDF_IO_IN_CALLER_CONTEXT        EvtIoInCallerContext = nullptr;
+    WDF_OBJECT_ATTRIBUTES               TargetAttributes = {};
+    WDF_OBJECT_ATTRIBUTES               RequestAttributes = {};
+    std::vector<HOST_REGISTRY_VALUE>    Values;
+    HOST_RESOURCE_LIST                  Resources;
+
+    BOOLEAN                             Started = FALSE;
+    BOOLEAN                             InD0 = FALSE;
+    LONG                                IdleReferences = 0;
+
+    // Requests of the SPB queue not presented yet, and the
+    // ones presented the driver did not complete or forward.
+    std::deque<struct HOST_REQUEST*>    SpbQueue;
+    ULONG                               Presented = 0;
+};
+
+struct WDFDEVICE_INIT
+{
+    WDF_PNPPOWER_EVENT_CALLBACKS  Pnp;
+    const HOST_VALUE*             pValues;
+    ULONG                         ValueCount;
+    HOST_DEVICE*                  Device;
+};
+
+struct HOST_QUEUE : HOST_OBJECT
+{
+    HOST_DEVICE*                        Device = nullptr;
+    WDF_IO_QUEUE_CONFIG                 Config = {};
+    std::deque<struct HOST_REQUEST*>    Requests;
+};
+
+struct HOST_IO_TARGET : HOST_OBJECT
+{
+    HOST_DEVICE*                        Device = nullptr;
+    BOOLEAN                             Opened = FALSE;
+    BOOLEAN                             Started = FALSE;
+    LONGLONG                            ConnectionId = 0;
+
+    // Requests sent while the target is stopped.
+    std::deque<struct HOST_REQUEST*>    Held;
+};
+
+struct HOST_TARGET : HOST_OBJECT
+{
+    HOST_DEVICE*        Device = nullptr;
+    std::vector<UCHAR>  Properties;
+};
+
+typedef enum HOST_REQUEST_STATE
+{
+    HostStateIdle,
+    HostStateQueued,
+    HostStatePresented,
+    HostStateOnQueue,
+    HostStateOwned,
+    HostStateCompleted,
+}
+HOST_REQUEST_STATE;
+
+struct HOST_BUFFER
+{
+    SPB_TRANSFER_DIRECTION  Direction;
+    ULONG                   DelayInUs;
+    std::vector<UCHAR>      Data;
+    MDL                     Mdl;
+};
+
+struct HOST_REQUEST : HOST_OBJECT
+{
+    // Client side.
+    HOST_DEVICE*                        Device = nullptr;
+    HOST_TARGET*                        Target = nullptr;
+    HOST_REQUEST_STATE                  State = HostStateIdle;
+    SPB_REQUEST_TYPE                    SpbType = SpbRequestTypeUndefined;
+    ULONG                               IoControlCode = 0;
+    std::vector<HOST_BUFFER>            Buffers;
+    HOST_MEMORY                         InputMemory;
+    HOST_MEMORY                         OutputMemory;
+    HOST_QUEUE*                         Queue = nullptr;
+    PFN_WDF_REQUEST_CANCEL              CancelRoutine = nullptr;
+    BOOLEAN                             CancelRequested = FALSE;
+    BOOLEAN                             CancelRan = FALSE;
+    NTSTATUS                            Status = STATUS_SUCCESS;
+    ULONG_PTR                           Information = 0;
+
+    // Forward side.
+    ULONG                               FormatKind = 0;
+    ULONG                               FormatCode = 0;
+    HOST_MEMORY*                        FormatMemory = nullptr;
+    size_t                              FormatOffset = 0;
+    size_t                              FormatLength = 0;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE  CompletionRoutine = nullptr;
+    WDFCONTEXT                          CompletionContext = nullptr;
+    HOST_IO_TARGET*                     SentTarget = nullptr;
+    BOOLEAN                             Sent = FALSE;
+    BOOLEAN                             CancelSent = FALSE;
+    BOOLEAN                             NeedsReuse = FALSE;
+    NTSTATUS                            WireStatus = STATUS_SUCCESS;
+};
+
+static HOST_DRIVER g_HostDriver;
+static PFN_WDF_DRIVER_DEVICE_ADD g_HostDeviceAdd;
+static BOOLEAN g_HostLoaded;
+
+static std::vector<HOST_OBJECT*> g_HostObjects;
+static std::vector<HOST_DEVICE*> g_HostDevices;
+static std::deque<HOST_WORK_ITEM*> g_HostWorkItems;
+
+// Timers started and not expired, oldest first.
+static std::deque<HOST_TIMER*> g_HostTimers;
+
+// Requests the controller holds, oldest first.
+static std::deque<HOST_REQUEST*> g_HostController;
+
+static std::vector<HOST_WIRE_REQUEST> g_HostWire;
+static BOOLEAN g_HostWireLogging = TRUE;
+static BOOLEAN g_HostInline;
+
+static BOOLEAN g_HostClockVirtual;
+static LONGLONG g_HostClock;
+
+static ULONG g_HostDepth;
+
+HOST_WORK_ITEM::~HOST_WORK_ITEM()
+{
+    for (auto i = g_HostWorkItems.begin(); i != g_HostWorkItems.end(); ++i)
+    {
+        if (*i == this)
+        {
+            g_HostWorkItems.erase(i);
+            break;
+        }
+    }
+}
+
+HOST_TIMER::~HOST_TIMER()
+{
+    for (auto i = g_HostTimers.begin(); i != g_HostTimers.end(); ++i)
+    {
+        if (*i == this)
+        {
+            g_HostTimers.erase(i);
+            break;
+        }
+    }
+}
+
+static
+VOID
+HostObjectInit(
+    _In_      HOST_OBJECT*                  pObject,
+    _In_opt_  const WDF_OBJECT_ATTRIBUTES*  pAttributes,
+    _In_opt_  HOST_OBJECT*                  pParent,
+    _In_      BOOLEAN                       Counted
+    )
+{
+    if (pAttributes != nullptr)
+    {
+        if (pAttributes->ContextTypeInfo != nullptr)
+        {
+            size_t size = (pAttributes->ContextSizeOverride != 0) ?
+                pAttributes->ContextSizeOverride :
+                pAttributes->ContextTypeInfo->ContextSize;
+
+            pObject->ContextType = pAttributes->ContextTypeInfo;
+            pObject->Context = calloc(1, size);
+            NT_ASSERT(pObject->Context != nullptr);
+        }
+
+        if (pAttributes->ParentObject != nullptr)
+        {
+            pParent = (HOST_OBJECT*)pAttributes->ParentObject;
+        }
+    }
+
+    pObject->Parent = pParent;
+    pObject->Counted = Counted;
+
+    g_HostObjects.push_back(pObject);
+
+    if (Counted)
+    {
+        g_HostCounters.ObjectCreates++;
+    }
+}
+
+static
+VOID
+HostObjectDelete(
+    _In_  HOST_OBJECT*  pObject
+    )
+{
+    for (size_t i = 0; i < g_HostObjects.size(); )
+    {
+        if (g_HostObjects[i]->Parent == pObject)
+        {
+            HostObjectDelete(g_HostObjects[i]);
+            i = 0;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    for (size_t i = 0; i < g_HostObjects.size(); i++)
+    {
+        if (g_HostObjects[i] == pObject)
+        {
+            g_HostObjects.erase(g_HostObjects.begin() + i);
+            break;
+        }
+    }
+
+    if (pObject->Counted)
+    {
+        g_HostCounters.ObjectDeletes++;
+    }
+
+    delete pObject;
+}
+
+PVOID
+HostObjectGetContext(
+    _In_  WDFOBJECT                            Handle,
+    _In_  const WDF_OBJECT_CONTEXT_TYPE_INFO*  TypeInfo
+    )
+{
+    HOST_OBJECT* pObject = (HOST_OBJECT*)Handle;
+
+    NT_ASSERT(pObject != nullptr);
+    NT_ASSERTMSG("Object has no context of this type",
+        pObject->ContextType == TypeInfo);
+
+    return pObject->Context;
+}
+
+/////////////////////////////////////////////////
+//
+// Kernel routines.
+//
+/////////////////////////////////////////////////
+
+VOID
+HostAssertFailed(
+    _In_z_ const CHAR*  pExpression,
+    _In_z_ const CHAR*  pFile,
+    _In_   int          Line
+    )
+{
+    fprintf(stderr, "%s:%d: assertion failed: %s\n", pFile, Line, pExpression);
+    abort();
+}
+
+PVOID
+HostMapMdl(
+    _In_  PMDL  Mdl
+    )
+{
+    g_HostCounters.MdlMappings++;
+
+    return Mdl->MappedSystemVa;
+}
+
+PVOID
+ExAllocatePoolWithTag(
+    _In_  POOL_TYPE  PoolType,
+    _In_  SIZE_T     NumberOfBytes,
+    _In_  ULONG      Tag
+    )
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    g_HostCounters.PoolAllocations++;
+
+    return malloc(NumberOfBytes);
+}
+
+VOID
+ExFreePoolWithTag(
+    _In_  PVOID  P,
+    _In_  ULONG  Tag
+    )
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    g_HostCounters.PoolFrees++;
+
+    free(P);
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    _Out_opt_ PLARGE_INTEGER  PerformanceFrequency
+    )
+{
+    LARGE_INTEGER counter;
+
+    if (PerformanceFrequency != nullptr)
+    {
+        PerformanceFrequency->QuadPart = HOST_CLOCK_FREQUENCY;
+    }
+
+    if (g_HostClockVirtual)
+    {
+        counter.QuadPart = g_HostClock;
+    }
+    else
+    {
+        counter.QuadPart = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() / 100;
+    }
+
+    return counter;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    _Out_opt_ PPROCESSOR_NUMBER  ProcNumber
+    )
+{
+    if (ProcNumber != nullptr)
+    {
+        RtlZeroMemory(ProcNumber, sizeof(PROCESSOR_NUMBER));
+    }
+
+    return 0;
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(
+    _In_  USHORT  GroupNumber
+    )
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return 1;
+}
+
+VOID
+HostClockSet(
+    _In_  LONGLONG  Ticks
+    )
+{
+    g_HostClockVirtual = TRUE;
+    g_HostClock = Ticks;
+}
+
+/////////////////////////////////////////////////
+//
+// Scheduling.
+//
+/////////////////////////////////////////////////
+
+static VOID HostSettle(VOID);
+
+//
+// Entered by every call of wdfhost.h. The requests are
+// presented, the work items run and the sent requests
+// cancelled when the outermost call returns.
+//
+
+class HOST_CALL
+{
+public:
+    HOST_CALL()
+    {
+        g_HostDepth++;
+    }
+
+    ~HOST_CALL()
+    {
+        if (g_HostDepth == 1)
+        {
+            HostSettle();
+        }
+
+        g_HostDepth--;
+    }
+};
+
+static
+VOID
+HostPowerUp(
+    _In_  HOST_DEVICE*  pDevice
+    )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (pDevice->Pnp.EvtDeviceD0Entry != nullptr)
+    {
+        status = pDevice->Pnp.EvtDeviceD0Entry(pDevice, WdfPowerDeviceD3);
+    }
+
+    NT_ASSERT(NT_SUCCESS(status));
+
+    pDevice->InD0 = TRUE;
+    g_HostCounters.D0Entries++;
+}
+
+static
+VOID
+HostPowerDown(
+    _In_  HOST_DEVICE*  pDevice
+    )
+{
+    if (pDevice->Pnp.EvtDeviceD0Exit != nullptr)
+    {
+        pDevice->Pnp.EvtDeviceD0Exit(pDevice, WdfPowerDeviceD3);
+    }
+
+    pDevice->InD0 = FALSE;
+    g_HostCounters.D0Exits++;
+}
+
+static
+VOID
+HostPresent(
+    _In_  HOST_DEVICE*   pDevice,
+    _In_  HOST_REQUEST*  pRequest
+    )
+{
+    HOST_TARGET* pTarget = pRequest->Target;
+    size_t length = 0;
+
+    for (const HOST_BUFFER& buffer : pRequest->Buffers)
+    {
+        length += buffer.Data.size();
+    }
+
+    switch (pRequest->SpbType)
+    {
+    case SpbRequestTypeLockController:
+        pDevice->Spb.EvtSpbControllerLock(pDevice, pTarget, pRequest);
+        break;
+
+    case SpbRequestTypeUnlockController:
+        pDevice->Spb.EvtSpbControllerUnlock(pDevice, pTarget, pRequest);
+        break;
+
+    case SpbRequestTypeRead:
+        pDevice->Spb.EvtSpbIoRead(pDevice, pTarget, pRequest, length);
+        break;
+
+    case SpbRequestTypeWrite:
+        pDevice->Spb.EvtSpbIoWrite(pDevice, pTarget, pRequest, length);
+        break;
+
+    case SpbRequestTypeSequence:
+        pDevice->Spb.EvtSpbIoSequence(
+            pDevice,
+            pTarget,
+            pRequest,
+            (ULONG)pRequest->Buffers.size());
+        break;
+
+    default:
+        pDevice->EvtSpbIoOther(
+            pDevice,
+            pTarget,
+            pRequest,
+            pRequest->OutputMemory.Size,
+            pRequest->InputMemory.Size,
+            pRequest->IoControlCode);
+        break;
+    }
+}
+
+static
+BOOLEAN
+HostDispatch(
+    _In_  HOST_DEVICE*  pDevice
+    )
+{
+    BOOLEAN presented = FALSE;
+
+    while (!pDevice->SpbQueue.empty() &&
+           ((pDevice->Spb.ControllerDispatchType != WdfIoQueueDispatchSequential) ||
+            (pDevice->Presented == 0)))
+    {
+        HOST_REQUEST* pRequest = pDevice->SpbQueue.front();
+
+        if (!pDevice->InD0)
+        {
+            HostPowerUp(pDevice);
+        }
+
+        pDevice->SpbQueue.pop_front();
+        pRequest->State = HostStatePresented;
+        pDevice->Presented++;
+
+        HostPresent(pDevice, pRequest);
+        presented = TRUE;
+    }
+
+    return presented;
+}
+
+static VOID HostControllerFinish(HOST_REQUEST* pRequest, NTSTATUS Status);
+
+static
+BOOLEAN
+HostCancelSent(
+    VOID
+    )
+{
+    for (HOST_REQUEST* pRequest : g_HostController)
+    {
+        if (pRequest->CancelSent)
+        {
+            HostControllerFinish(pRequest, STATUS_CANCELLED);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+VOID
+HostSettle(
+    VOID
+    )
+{
+    BOOLEAN progress;
+
+    do
+    {
+        progress = HostCancelSent();
+
+        for (size_t i = 0; i < g_HostDevices.size(); i++)
+        {
+            progress |= HostDispatch(g_HostDevices[i]);
+        }
+
+        if (!g_HostWorkItems.empty())
+        {
+            HOST_WORK_ITEM* pWorkItem = g_HostWorkItems.front();
+
+            g_HostWorkItems.pop_front();
+            pWorkItem->Queued = FALSE;
+            g_HostCounters.WorkItemRuns++;
+
+            pWorkItem->Function(pWorkItem);
+            progress = TRUE;
+        }
+    }
+    while (progress);
+}
+
+VOID
+HostRun(
+    VOID
+    )
+{
+    HOST_CALL call;
+}
+
+ULONG
+HostTimerExpire(
+    VOID
+    )
+{
+    HOST_CALL call;
+    std::deque<HOST_TIMER*> expired;
+
+    //
+    // Timers started by the callbacks wait for the next call.
+    //
+
+    expired.swap(g_HostTimers);
+
+    for (HOST_TIMER* pTimer : expired)
+    {
+        pTimer->Started = FALSE;
+    }
+
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        g_HostCounters.TimerRuns++;
+        expired[i]->Function(expired[i]);
+    }
+
+    return (ULONG)expired.size();
+}
+
+/////////////////////////////////////////////////
+//
+// Driver and device.
+//
+/////////////////////////////////////////////////
+
+extern "C"
+NTSTATUS
+DriverEntry(
+    _In_  PDRIVER_OBJECT   pDriverObject,
+    _In_  PUNICODE_STRING  pRegistryPath
+    );
+
+NTSTATUS
+WdfDriverCreate(
+    _In_      PDRIVER_OBJECT          DriverObject,
+    _In_      PCUNICODE_STRING        RegistryPath,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  DriverAttributes,
+    _In_      PWDF_DRIVER_CONFIG      DriverConfig,
+    _Out_opt_ WDFDRIVER*              Driver
+    )
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+    UNREFERENCED_PARAMETER(DriverAttributes);
+
+    g_HostDeviceAdd = DriverConfig->EvtDriverDeviceAdd;
+
+    if (Driver != nullptr)
+    {
+        *Driver = &g_HostDriver;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfDeviceInitSetPnpPowerEventCallbacks(
+    _In_  PWDFDEVICE_INIT                DeviceInit,
+    _In_  PWDF_PNPPOWER_EVENT_CALLBACKS  PnpPowerEventCallbacks
+    )
+{
+    DeviceInit->Pnp = *PnpPowerEventCallbacks;
+}
+
+NTSTATUS
+SpbDeviceInitConfig(
+    _Inout_ PWDFDEVICE_INIT  DeviceInit
+    )
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceCreate(
+    _Inout_   PWDFDEVICE_INIT*        DeviceInit,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  DeviceAttributes,
+    _Out_     WDFDEVICE*              Device
+    )
+{
+    PWDFDEVICE_INIT pInit = *DeviceInit;
+    HOST_DEVICE* pDevice = new HOST_DEVICE;
+
+    HostObjectInit(pDevice, DeviceAttributes, nullptr, TRUE);
+
+    pDevice->Pnp = pInit->Pnp;
+
+    for (ULONG i = 0; i < pInit->ValueCount; i++)
+    {
+        const HOST_VALUE* pValue = &pInit->pValues[i];
+        HOST_REGISTRY_VALUE value;
+
+        value.Name = pValue->Name;
+
+        if (pValue->Data != nullptr)
+        {
+            value.Type = REG_BINARY;
+            value.Data.assign(
+                (const UCHAR*)pValue->Data,
+                (const UCHAR*)pValue->Data + pValue->Length);
+        }
+        else
+        {
+            value.Type = REG_DWORD;
+            value.Data.assign(
+                (const UCHAR*)&pValue->Value,
+                (const UCHAR*)&pValue->Value + sizeof(ULONG));
+        }
+
+        pDevice->Values.push_back(value);
+    }
+
+    pInit->Device = pDevice;
+    g_HostDevices.push_back(pDevice);
+
+    *DeviceInit = nullptr;
+    *Device = pDevice;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfDeviceSetDeviceState(
+    _In_  WDFDEVICE          Device,
+    _In_  PWDF_DEVICE_STATE  DeviceState
+    )
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(DeviceState);
+}
+
+NTSTATUS
+WdfDeviceAssignS0IdleSettings(
+    _In_  WDFDEVICE                               Device,
+    _In_  PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS  Settings
+    )
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(Settings);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceStopIdle(
+    _In_  WDFDEVICE  Device,
+    _In_  BOOLEAN    WaitForD0
+    )
+{
+    Device->IdleReferences++;
+
+    if (!Device->InD0)
+    {
+        HostPowerUp(Device);
+
+        return WaitForD0 ? STATUS_SUCCESS : STATUS_PENDING;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfDeviceResumeIdle(
+    _In_  WDFDEVICE  Device
+    )
+{
+    NT_ASSERTMSG("Idle resumed more than stopped", Device->IdleReferences > 0);
+
+    Device->IdleReferences--;
+}
+
+NTSTATUS
+WdfDeviceEnqueueRequest(
+    _In_  WDFDEVICE   Device,
+    _In_  WDFREQUEST  Request
+    )
+{
+    Request->State = HostStateQueued;
+    Device->SpbQueue.push_back(Request);
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+WdfCmResourceListGetCount(
+    _In_  WDFCMRESLIST  List
+    )
+{
+    return (ULONG)List->Descriptors.size();
+}
+
+PCM_PARTIAL_RESOURCE_DESCRIPTOR
+WdfCmResourceListGetDescriptor(
+    _In_  WDFCMRESLIST  List,
+    _In_  ULONG         Index
+    )
+{
+    return (Index < List->Descriptors.size()) ? &List->Descriptors[Index] : nullptr;
+}
+
+WDFDEVICE
+HostDeviceAdd(
+    _In_reads_(Count) const HOST_VALUE*  pValues,
+    _In_  ULONG                          Count
+    )
+{
+    HOST_CALL call;
+    WDFDEVICE_INIT init;
+    NTSTATUS status;
+
+    if (!g_HostLoaded)
+    {
+        status = DriverEntry(nullptr, nullptr);
+        NT_ASSERT(NT_SUCCESS(status));
+
+        g_HostLoaded = TRUE;
+    }
+
+    RtlZeroMemory(&init, sizeof(init));
+    init.pValues = pValues;
+    init.ValueCount = Count;
+
+    status = g_HostDeviceAdd(&g_HostDriver, &init);
+
+    if (!NT_SUCCESS(status))
+    {
+        return nullptr;
+    }
+
+    return init.Device;
+}
+
+NTSTATUS
+HostDeviceStart(
+    _In_  WDFDEVICE                        Device,
+    _In_reads_(Count) const LONGLONG*      pConnectionIds,
+    _In_  ULONG                            Count
+    )
+{
+    HOST_CALL call;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    Device->Resources.Descriptors.clear();
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        CM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
+
+        RtlZeroMemory(&descriptor, sizeof(descriptor));
+        descriptor.Type = CmResourceTypeConnection;
+        descriptor.u.Connection.Class = CM_RESOURCE_CONNECTION_CLASS_SERIAL;
+        descriptor.u.Connection.Type = CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C;
+        descriptor.u.Connection.IdLowPart = (ULONG)pConnectionIds[i];
+        descriptor.u.Connection.IdHighPart = (ULONG)(pConnectionIds[i] >> 32);
+
+        Device->Resources.Descriptors.push_back(descriptor);
+    }
+
+    if (Device->Pnp.EvtDevicePrepareHardware != nullptr)
+    {
+        status = Device->Pnp.EvtDevicePrepareHardware(
+            Device,
+            &Device->Resources,
+            &Device->Resources);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        Device->Started = TRUE;
+        HostPowerUp(Device);
+    }
+
+    return status;
+}
+
+BOOLEAN
+HostDeviceIdle(
+    _In_  WDFDEVICE  Device
+    )
+{
+    HOST_CALL call;
+
+    if (!Device->InD0 ||
+        (Device->IdleReferences != 0) ||
+        !Device->SpbQueue.empty() ||
+        (Device->Presented != 0))
+    {
+        return FALSE;
+    }
+
+    HostPowerDown(Device);
+
+    return TRUE;
+}
+
+BOOLEAN
+HostDeviceInD0(
+    _In_  WDFDEVICE  Device
+    )
+{
+    return Device->InD0;
+}
+
+VOID
+HostDeviceRemove(
+    _In_  WDFDEVICE  Device
+    )
+{
+    {
+        HOST_CALL call;
+
+        if (Device->InD0)
+        {
+            HostPowerDown(Device);
+        }
+
+        if (Device->Started && (Device->Pnp.EvtDeviceReleaseHardware != nullptr))
+        {
+            Device->Pnp.EvtDeviceReleaseHardware(Device, &Device->Resources);
+        }
+
+        Device->Started = FALSE;
+    }
+
+    for (size_t i = 0; i < g_HostDevices.size(); i++)
+    {
+        if (g_HostDevices[i] == Device)
+        {
+            g_HostDevices.erase(g_HostDevices.begin() + i);
+            break;
+        }
+    }
+
+    HostObjectDelete(Device);
+}
+
+/////////////////////////////////////////////////
+//
+// Registry.
+//
+/////////////////////////////////////////////////
+
+static
+const HOST_REGISTRY_VALUE*
+HostFindValue(
+    _In_  HOST_DEVICE*      pDevice,
+    _In_  PCUNICODE_STRING  pName
+    )
+{
+    size_t length = pName->Length / sizeof(WCHAR);
+
+    for (const HOST_REGISTRY_VALUE& value : pDevice->Values)
+    {
+        if ((value.Name.size() == length) &&
+            (wmemcmp(value.Name.data(), pName->Buffer, length) == 0))
+        {
+            return &value;
+        }
+    }
+
+    return nullptr;
+}
+
+NTSTATUS
+WdfDeviceOpenRegistryKey(
+    _In_      WDFDEVICE               Device,
+    _In_      ULONG                   DeviceInstanceKeyType,
+    _In_      ACCESS_MASK             DesiredAccess,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  KeyAttributes,
+    _Out_     WDFKEY*                 Key
+    )
+{
+    UNREFERENCED_PARAMETER(DeviceInstanceKeyType);
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(KeyAttributes);
+
+    *Key = new HOST_KEY{ Device };
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryULong(
+    _In_  WDFKEY            Key,
+    _In_  PCUNICODE_STRING  ValueName,
+    _Out_ PULONG            Value
+    )
+{
+    const HOST_REGISTRY_VALUE* pValue = HostFindValue(Key->Device, ValueName);
+
+    if (pValue == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    if (pValue->Type != REG_DWORD)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlCopyMemory(Value, pValue->Data.data(), sizeof(ULONG));
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryValue(
+    _In_      WDFKEY            Key,
+    _In_      PCUNICODE_STRING  ValueName,
+    _In_      ULONG             ValueLength,
+    _Out_opt_ PVOID             Value,
+    _Out_opt_ PULONG            ValueLengthQueried,
+    _Out_opt_ PULONG            ValueType
+    )
+{
+    const HOST_REGISTRY_VALUE* pValue = HostFindValue(Key->Device, ValueName);
+
+    if (pValue == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    if (ValueLengthQueried != nullptr)
+    {
+        *ValueLengthQueried = (ULONG)pValue->Data.size();
+    }
+
+    if (ValueType != nullptr)
+    {
+        *ValueType = pValue->Type;
+    }
+
+    if (ValueLength < pValue->Data.size())
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (Value != nullptr)
+    {
+        RtlCopyMemory(Value, pValue->Data.data(), pValue->Data.size());
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfRegistryClose(
+    _In_  WDFKEY  Key
+    )
+{
+    delete Key;
+}
+
+/////////////////////////////////////////////////
+//
+// Synchronization and work items.
+//
+/////////////////////////////////////////////////
+
+VOID
+WdfObjectDelete(
+    _In_  WDFOBJECT  Object
+    )
+{
+    HostObjectDelete((HOST_OBJECT*)Object);
+}
+
+NTSTATUS
+WdfSpinLockCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  SpinLockAttributes,
+    _Out_     WDFSPINLOCK*            SpinLock
+    )
+{
+    HOST_SPIN_LOCK* pLock = new HOST_SPIN_LOCK;
+
+    HostObjectInit(pLock, SpinLockAttributes, nullptr, TRUE);
+    *SpinLock = pLock;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfSpinLockAcquire(
+    _In_  WDFSPINLOCK  SpinLock
+    )
+{
+    NT_ASSERTMSG("Spin lock acquired recursively", !SpinLock->Held);
+
+    SpinLock->Held = TRUE;
+}
+
+VOID
+WdfSpinLockRelease(
+    _In_  WDFSPINLOCK  SpinLock
+    )
+{
+    NT_ASSERTMSG("Spin lock released but not held", SpinLock->Held);
+
+    SpinLock->Held = FALSE;
+}
+
+NTSTATUS
+WdfWorkItemCreate(
+    _In_  PWDF_WORKITEM_CONFIG    Config,
+    _In_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _Out_ WDFWORKITEM*            WorkItem
+    )
+{
+    HOST_WORK_ITEM* pWorkItem = new HOST_WORK_ITEM;
+
+    HostObjectInit(pWorkItem, Attributes, nullptr, TRUE);
+    pWorkItem->Function = Config->EvtWorkItemFunc;
+    *WorkItem = pWorkItem;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfWorkItemEnqueue(
+    _In_  WDFWORKITEM  WorkItem
+    )
+{
+    if (!WorkItem->Queued)
+    {
+        WorkItem->Queued = TRUE;
+        g_HostWorkItems.push_back(WorkItem);
+    }
+}
+
+VOID
+WdfWorkItemFlush(
+    _In_  WDFWORKITEM  WorkItem
+    )
+{
+    if (WorkItem->Queued)
+    {
+        WorkItem->Queued = FALSE;
+
+        for (auto i = g_HostWorkItems.begin(); i != g_HostWorkItems.end(); ++i)
+        {
+            if (*i == WorkItem)
+            {
+                g_HostWorkItems.erase(i);
+                break;
+            }
+        }
+
+        g_HostCounters.WorkItemRuns++;
+        WorkItem->Function(WorkItem);
+    }
+}
+
+WDFOBJECT
+WdfWorkItemGetParentObject(
+    _In_  WDFWORKITEM  WorkItem
+    )
+{
+    return WorkItem->Parent;
+}
+
+NTSTATUS
+WdfTimerCreate(
+    _In_  PWDF_TIMER_CONFIG       Config,
+    _In_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _Out_ WDFTIMER*               Timer
+    )
+{
+    HOST_TIMER* pTimer = new HOST_TIMER;
+
+    NT_ASSERTMSG("Periodic timers are not supported", Config->Period == 0);
+
+    HostObjectInit(pTimer, Attributes, nullptr, TRUE);
+    pTimer->Function = Config->EvtTimerFunc;
+    *Timer = pTimer;
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+WdfTimerStart(
+    _In_  WDFTIMER  Timer,
+    _In_  LONGLONG  DueTime
+    )
+{
+    BOOLEAN started = Timer->Started;
+
+    Timer->DueTime = DueTime;
+
+    if (!started)
+    {
+        Timer->Started = TRUE;
+        g_HostTimers.push_back(Timer);
+    }
+
+    return started;
+}
+
+BOOLEAN
+WdfTimerStop(
+    _In_  WDFTIMER  Timer,
+    _In_  BOOLEAN   Wait
+    )
+{
+    UNREFERENCED_PARAMETER(Wait);
+
+    if (!Timer->Started)
+    {
+        return FALSE;
+    }
+
+    Timer->Started = FALSE;
+
+    for (auto i = g_HostTimers.begin(); i != g_HostTimers.end(); ++i)
+    {
+        if (*i == Timer)
+        {
+            g_HostTimers.erase(i);
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+WDFOBJECT
+WdfTimerGetParentObject(
+    _In_  WDFTIMER  Timer
+    )
+{
+    return Timer->Parent;
+}
+
+/////////////////////////////////////////////////
+//
+// Queues and requests.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+WdfIoQueueCreate(
+    _In_      WDFDEVICE               Device,
+    _In_      PWDF_IO_QUEUE_CONFIG    Config,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  QueueAttributes,
+    _Out_opt_ WDFQUEUE*               Queue
+    )
+{
+    HOST_QUEUE* pQueue = new HOST_QUEUE;
+
+    NT_ASSERTMSG("Only manual queues are created by the driver",
+        Config->DispatchType == WdfIoQueueDispatchManual);
+
+    HostObjectInit(pQueue, QueueAttributes, Device, TRUE);
+    pQueue->Device = Device;
+    pQueue->Config = *Config;
+
+    if (Queue != nullptr)
+    {
+        *Queue = pQueue;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+WDFDEVICE
+WdfIoQueueGetDevice(
+    _In_  WDFQUEUE  Queue
+    )
+{
+    return Queue->Device;
+}
+
+NTSTATUS
+WdfIoQueueRetrieveNextRequest(
+    _In_  WDFQUEUE     Queue,
+    _Out_ WDFREQUEST*  OutRequest
+    )
+{
+    if (Queue->Requests.empty())
+    {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    *OutRequest = Queue->Requests.front();
+    Queue->Requests.pop_front();
+
+    (*OutRequest)->State = HostStateOwned;
+    (*OutRequest)->Queue = nullptr;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  RequestAttributes,
+    _In_opt_  WDFIOTARGET             IoTarget,
+    _Out_     WDFREQUEST*             Request
+    )
+{
+    HOST_REQUEST* pRequest = new HOST_REQUEST;
+
+    UNREFERENCED_PARAMETER(IoTarget);
+
+    HostObjectInit(pRequest, RequestAttributes, nullptr, TRUE);
+    g_HostCounters.RequestCreates++;
+
+    *Request = pRequest;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestReuse(
+    _In_  WDFREQUEST                 Request,
+    _In_  PWDF_REQUEST_REUSE_PARAMS  ReuseParams
+    )
+{
+    NT_ASSERTMSG("Request reused while sent", !Request->Sent);
+
+    Request->FormatKind = 0;
+    Request->FormatCode = 0;
+    Request->FormatMemory = nullptr;
+    Request->CompletionRoutine = nullptr;
+    Request->CompletionContext = nullptr;
+    Request->CancelSent = FALSE;
+    Request->NeedsReuse = FALSE;
+    Request->Status = ReuseParams->Status;
+    Request->Information = 0;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfRequestGetParameters(
+    _In_  WDFREQUEST               Request,
+    _Out_ PWDF_REQUEST_PARAMETERS  Parameters
+    )
+{
+    Parameters->Type = WdfRequestTypeDeviceControl;
+    Parameters->Parameters.DeviceIoControl.IoControlCode = Request->IoControlCode;
+    Parameters->Parameters.DeviceIoControl.InputBufferLength = Request->InputMemory.Size;
+    Parameters->Parameters.DeviceIoControl.OutputBufferLength = Request->OutputMemory.Size;
+}
+
+NTSTATUS
+WdfRequestGetStatus(
+    _In_  WDFREQUEST  Request
+    )
+{
+    return Request->Status;
+}
+
+static
+NTSTATUS
+HostRetrieveBuffer(
+    _In_      HOST_MEMORY*  pMemory,
+    _In_      size_t        MinimumLength,
+    _Outptr_  PVOID*        Buffer,
+    _Out_opt_ size_t*       Length
+    )
+{
+    if ((pMemory->Size == 0) || (pMemory->Size < MinimumLength))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Buffer = pMemory->Buffer;
+
+    if (Length != nullptr)
+    {
+        *Length = pMemory->Size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveInputBuffer(
+    _In_      WDFREQUEST  Request,
+    _In_      size_t      MinimumRequiredLength,
+    _Outptr_  PVOID*      Buffer,
+    _Out_opt_ size_t*     Length
+    )
+{
+    return HostRetrieveBuffer(&Request->InputMemory, MinimumRequiredLength, Buffer, Length);
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(
+    _In_      WDFREQUEST  Request,
+    _In_      size_t      MinimumRequiredSize,
+    _Outptr_  PVOID*      Buffer,
+    _Out_opt_ size_t*     Length
+    )
+{
+    return HostRetrieveBuffer(&Request->OutputMemory, MinimumRequiredSize, Buffer, Length);
+}
+
+NTSTATUS
+WdfRequestRetrieveInputMemory(
+    _In_  WDFREQUEST  Request,
+    _Out_ WDFMEMORY*  Memory
+    )
+{
+    if (Request->InputMemory.Size == 0)
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Memory = &Request->InputMemory;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputMemory(
+    _In_  WDFREQUEST  Request,
+    _Out_ WDFMEMORY*  Memory
+    )
+{
+    if (Request->OutputMemory.Size == 0)
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Memory = &Request->OutputMemory;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputWdmMdl(
+    _In_  WDFREQUEST  Request,
+    _Out_ PMDL*       Mdl
+    )
+{
+    for (HOST_BUFFER& buffer : Request->Buffers)
+    {
+        if ((buffer.Direction == SpbTransferDirectionFromDevice) &&
+            (buffer.Data.data() == Request->OutputMemory.Buffer))
+        {
+            *Mdl = &buffer.Mdl;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_BUFFER_TOO_SMALL;
+}
+
+NTSTATUS
+WdfRequestForwardToIoQueue(
+    _In_  WDFREQUEST  Request,
+    _In_  WDFQUEUE    DestinationQueue
+    )
+{
+    NT_ASSERT((Request->State == HostStatePresented) ||
+              (Request->State == HostStateOwned));
+
+    if (Request->State == HostStatePresented)
+    {
+        Request->Device->Presented--;
+    }
+
+    Request->State = HostStateOnQueue;
+    Request->Queue = DestinationQueue;
+    DestinationQueue->Requests.push_back(Request);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestMarkCancelableEx(
+    _In_  WDFREQUEST              Request,
+    _In_  PFN_WDF_REQUEST_CANCEL  EvtRequestCancel
+    )
+{
+    NT_ASSERT(Request->State != HostStateCompleted);
+    NT_ASSERTMSG("Request marked cancelable twice", Request->CancelRoutine == nullptr);
+
+    if (Request->CancelRequested)
+    {
+        return STATUS_CANCELLED;
+    }
+
+    Request->CancelRoutine = EvtRequestCancel;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestUnmarkCancelable(
+    _In_  WDFREQUEST  Request
+    )
+{
+    if (Request->CancelRoutine != nullptr)
+    {
+        Request->CancelRoutine = nullptr;
+        return STATUS_SUCCESS;
+    }
+
+    NT_ASSERTMSG("Request unmarked but not cancelable", Request->CancelRan);
+
+    return STATUS_CANCELLED;
+}
+
+VOID
+WdfRequestSetCompletionRoutine(
+    _In_      WDFREQUEST                          Request,
+    _In_opt_  PFN_WDF_REQUEST_COMPLETION_ROUTINE  CompletionRoutine,
+    _In_opt_  WDFCONTEXT                          CompletionContext
+    )
+{
+    Request->CompletionRoutine = CompletionRoutine;
+    Request->CompletionContext = CompletionContext;
+}
+
+static
+VOID
+HostClientComplete(
+    _In_  HOST_REQUEST*  pRequest,
+    _In_  NTSTATUS       Status,
+    _In_  ULONG_PTR      Information
+    )
+{
+    NT_ASSERTMSG("Request completed twice", pRequest->State != HostStateCompleted);
+    NT_ASSERTMSG("Request completed while on a queue", pRequest->State != HostStateOnQueue);
+    NT_ASSERTMSG("Request completed while cancelable", pRequest->CancelRoutine == nullptr);
+
+    if (pRequest->State == HostStatePresented)
+    {
+        pRequest->Device->Presented--;
+    }
+
+    pRequest->State = HostStateCompleted;
+    pRequest->Status = Status;
+    pRequest->Information = Information;
+}
+
+VOID
+WdfRequestComplete(
+    _In_  WDFREQUEST  Request,
+    _In_  NTSTATUS    Status
+    )
+{
+    HostClientComplete(Request, Status, Request->Information);
+}
+
+VOID
+WdfRequestCompleteWithInformation(
+    _In_  WDFREQUEST  Request,
+    _In_  NTSTATUS    Status,
+    _In_  ULONG_PTR   Information
+    )
+{
+    HostClientComplete(Request, Status, Information);
+}
+
+/////////////////////////////////////////////////
+//
+// Memory objects.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+WdfMemoryCreate(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _In_      POOL_TYPE               PoolType,
+    _In_opt_  ULONG                   PoolTag,
+    _In_      size_t                  BufferSize,
+    _Out_     WDFMEMORY*              Memory,
+    _Outptr_opt_ PVOID*               Buffer
+    )
+{
+    HOST_MEMORY* pMemory = new HOST_MEMORY;
+
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(PoolTag);
+
+    HostObjectInit(pMemory, Attributes, nullptr, TRUE);
+    g_HostCounters.MemoryCreates++;
+
+    pMemory->Buffer = calloc(1, BufferSize);
+    pMemory->Size = BufferSize;
+    pMemory->Owned = TRUE;
+
+    *Memory = pMemory;
+
+    if (Buffer != nullptr)
+    {
+        *Buffer = pMemory->Buffer;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfMemoryCreatePreallocated(
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  Attributes,
+    _In_      PVOID                   Buffer,
+    _In_      size_t                  BufferSize,
+    _Out_     WDFMEMORY*              Memory
+    )
+{
+    HOST_MEMORY* pMemory = new HOST_MEMORY;
+
+    HostObjectInit(pMemory, Attributes, nullptr, TRUE);
+    g_HostCounters.MemoryCreates++;
+
+    pMemory->Buffer = Buffer;
+    pMemory->Size = BufferSize;
+
+    *Memory = pMemory;
+
+    return STATUS_SUCCESS;
+}
+
+/////////////////////////////////////////////////
+//
+// Controller.
+//
+/////////////////////////////////////////////////
+
+//
+// Walks the transfers of a sent request as the controller
+// reads them, recording them in pWire if set and filling the
+// reads if Fill is set. Returns the status the controller
+// fails a malformed transfer list with.
+//
+
+static
+NTSTATUS
+HostWalkTransfers(
+    _In_      HOST_REQUEST*        pRequest,
+    _In_opt_  HOST_WIRE_REQUEST*   pWire,
+    _In_      BOOLEAN              Fill,
+    _Out_     ULONG_PTR*           pTotal
+    )
+{
+    PUCHAR pBuffer = nullptr;
+    size_t length = 0;
+    ULONG count = 0;
+
+    *pTotal = 0;
+
+    if (pRequest->FormatMemory != nullptr)
+    {
+        NT_ASSERT(pRequest->FormatOffset + pRequest->FormatLength <=
+                  pRequest->FormatMemory->Size);
+
+        pBuffer = (PUCHAR)pRequest->FormatMemory->Buffer + pRequest->FormatOffset;
+        length = pRequest->FormatLength;
+    }
+
+    auto transfer = [&](SPB_TRANSFER_DIRECTION Direction,
+                        ULONG DelayInUs,
+                        SPB_TRANSFER_BUFFER_FORMAT Format,
+                        PUCHAR pData,
+                        ULONG Length,
+                        PMDL pMdl)
+    {
+        ULONG total = 0;
+
+        if (pMdl != nullptr)
+        {
+            for (PMDL pNext = pMdl; pNext != nullptr; pNext = pNext->Next)
+            {
+                total += pNext->ByteCount;
+            }
+        }
+        else
+        {
+            total = Length;
+        }
+
+        if ((pWire != nullptr) && (count < HOST_WIRE_MAX_TRANSFERS))
+        {
+            HOST_WIRE_TRANSFER* pTransfer = &pWire->Transfers[count];
+            ULONG copied = 0;
+
+            pTransfer->Direction = Direction;
+            pTransfer->DelayInUs = DelayInUs;
+            pTransfer->Length = total;
+            pTransfer->Format = Format;
+            RtlZeroMemory(pTransfer->Data, sizeof(pTransfer->Data));
+
+            if (Direction == SpbTransferDirectionToDevice)
+            {
+                for (PMDL pNext = pMdl; (pNext != nullptr) && (copied < HOST_WIRE_MAX_DATA); pNext = pNext->Next)
+                {
+                    ULONG span = min(pNext->ByteCount, HOST_WIRE_MAX_DATA - copied);
+                    RtlCopyMemory(pTransfer->Data + copied, pNext->MappedSystemVa, span);
+                    copied += span;
+                }
+
+                if (pMdl == nullptr)
+                {
+                    RtlCopyMemory(pTransfer->Data, pData, min(Length, (ULONG)HOST_WIRE_MAX_DATA));
+                }
+            }
+        }
+
+        if (Fill && (Direction == SpbTransferDirectionFromDevice))
+        {
+            ULONG offset = 0;
+
+            if (pMdl == nullptr)
+            {
+                for (ULONG i = 0; i < Length; i++)
+                {
+                    pData[i] = HOST_READ_PATTERN(i);
+                }
+            }
+
+            for (PMDL pNext = pMdl; pNext != nullptr; pNext = pNext->Next)
+            {
+                for (ULONG i = 0; i < pNext->ByteCount; i++, offset++)
+                {
+                    ((PUCHAR)pNext->MappedSystemVa)[i] = HOST_READ_PATTERN(offset);
+                }
+            }
+        }
+
+        *pTotal += total;
+        count += 1;
+    };
+
+    switch (pRequest->FormatKind)
+    {
+    case HOST_WIRE_READ:
+        transfer(SpbTransferDirectionFromDevice, 0, SpbTransferBufferFormatSimple, pBuffer, (ULONG)length, nullptr);
+        break;
+
+    case HOST_WIRE_WRITE:
+        transfer(SpbTransferDirectionToDevice, 0, SpbTransferBufferFormatSimple, pBuffer, (ULONG)length, nullptr);
+        break;
+
+    default:
+        if ((pRequest->FormatCode == IOCTL_SPB_EXECUTE_SEQUENCE) ||
+            (pRequest->FormatCode == IOCTL_SPB_FULL_DUPLEX))
+        {
+            PSPB_TRANSFER_LIST pList = (PSPB_TRANSFER_LIST)pBuffer;
+
+            //
+            // The checks SPBCx makes before the list reaches the
+            // controller driver.
+            //
+
+            if ((pList == nullptr) ||
+                (length < FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers)) ||
+                (pList->Size != sizeof(SPB_TRANSFER_LIST)) ||
+                (pList->TransferCount == 0) ||
+                (length < FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+                    pList->TransferCount * sizeof(SPB_TRANSFER_LIST_ENTRY)) ||
+                ((pRequest->FormatCode == IOCTL_SPB_FULL_DUPLEX) &&
+                    (pList->TransferCount != 2)))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            for (ULONG i = 0; i < pList->TransferCount; i++)
+            {
+                const SPB_TRANSFER_LIST_ENTRY* pEntry = &pList->Transfers[i];
+
+                if ((pEntry->Direction != SpbTransferDirectionFromDevice) &&
+                    (pEntry->Direction != SpbTransferDirectionToDevice))
+                {
+                    return STATUS_INVALID_PARAMETER;
+                }
+
+                switch (pEntry->Buffer.Format)
+                {
+                case SpbTransferBufferFormatSimple:
+                case SpbTransferBufferFormatSimpleNonPaged:
+                    if ((pEntry->Buffer.Simple.Buffer == nullptr) ||
+                        (pEntry->Buffer.Simple.BufferCb == 0))
+                    {
+                        return STATUS_INVALID_PARAMETER;
+                    }
+
+                    transfer(
+                        pEntry->Direction,
+                        pEntry->DelayInUs,
+                        pEntry->Buffer.Format,
+                        (PUCHAR)pEntry->Buffer.Simple.Buffer,
+                        pEntry->Buffer.Simple.BufferCb,
+                        nullptr);
+                    break;
+
+                case SpbTransferBufferFormatMdl:
+                    if (pEntry->Buffer.Mdl == nullptr)
+                    {
+                        return STATUS_INVALID_PARAMETER;
+                    }
+
+                    transfer(
+                        pEntry->Direction,
+                        pEntry->DelayInUs,
+                        pEntry->Buffer.Format,
+                        nullptr,
+                        0,
+                        pEntry->Buffer.Mdl);
+                    break;
+
+                default:
+                    return STATUS_INVALID_PARAMETER;
+                }
+            }
+        }
+        break;
+    }
+
+    if (pWire != nullptr)
+    {
+        pWire->TransferCount = count;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+HostControllerAccept(
+    _In_  HOST_REQUEST*  pRequest
+    )
+{
+    ULONG_PTR total;
+
+    g_HostCounters.Sends++;
+
+    if (g_HostWireLogging)
+    {
+        g_HostWire.emplace_back();
+
+        HOST_WIRE_REQUEST* pWire = &g_HostWire.back();
+
+        pWire->Kind = pRequest->FormatKind;
+        pWire->IoControlCode = pRequest->FormatCode;
+        pWire->ConnectionId = pRequest->SentTarget->ConnectionId;
+        pWire->TransferCount = 0;
+        pWire->Status = HostWalkTransfers(pRequest, pWire, FALSE, &total);
+        pRequest->WireStatus = pWire->Status;
+    }
+    else
+    {
+        pRequest->WireStatus = HostWalkTransfers(pRequest, nullptr, FALSE, &total);
+    }
+
+    g_HostController.push_back(pRequest);
+
+    if (g_HostInline)
+    {
+        HostControllerFinish(pRequest, STATUS_SUCCESS);
+    }
+}
+
+static
+VOID
+HostControllerFinish(
+    _In_  HOST_REQUEST*  pRequest,
+    _In_  NTSTATUS       Status
+    )
+{
+    WDF_REQUEST_COMPLETION_PARAMS params;
+    ULONG_PTR information = 0;
+
+    for (auto i = g_HostController.begin(); i != g_HostController.end(); ++i)
+    {
+        if (*i == pRequest)
+        {
+            g_HostController.erase(i);
+            break;
+        }
+    }
+
+    if (!NT_SUCCESS(pRequest->WireStatus))
+    {
+        Status = pRequest->WireStatus;
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        HostWalkTransfers(pRequest, nullptr, TRUE, &information);
+    }
+
+    g_HostCounters.ControllerCompletions++;
+
+    pRequest->Sent = FALSE;
+    pRequest->CancelSent = FALSE;
+    pRequest->NeedsReuse = TRUE;
+    pRequest->Status = Status;
+    pRequest->Information = information;
+
+    RtlZeroMemory(&params, sizeof(params));
+    params.Size = sizeof(params);
+    params.Type = WdfRequestTypeDeviceControlInternal;
+    params.IoStatus.Status = Status;
+    params.IoStatus.Information = information;
+
+    if (pRequest->CompletionRoutine != nullptr)
+    {
+        pRequest->CompletionRoutine(
+            pRequest,
+            pRequest->SentTarget,
+            &params,
+            pRequest->CompletionContext);
+    }
+}
+
+ULONG
+HostControllerPending(
+    VOID
+    )
+{
+    return (ULONG)g_HostController.size();
+}
+
+BOOLEAN
+HostControllerComplete(
+    _In_  NTSTATUS  Status
+    )
+{
+    HOST_CALL call;
+
+    if (g_HostController.empty())
+    {
+        return FALSE;
+    }
+
+    HostControllerFinish(g_HostController.front(), Status);
+
+    return TRUE;
+}
+
+VOID
+HostControllerSetInline(
+    _In_  BOOLEAN  Inline
+    )
+{
+    g_HostInline = Inline;
+}
+
+ULONG
+HostWireCount(
+    VOID
+    )
+{
+    return (ULONG)g_HostWire.size();
+}
+
+const HOST_WIRE_REQUEST*
+HostWireGet(
+    _In_  ULONG  Index
+    )
+{
+    NT_ASSERT(Index < g_HostWire.size());
+
+    return &g_HostWire[Index];
+}
+
+VOID
+HostWireClear(
+    VOID
+    )
+{
+    g_HostWire.clear();
+}
+
+VOID
+HostWireSetLogging(
+    _In_  BOOLEAN  Logging
+    )
+{
+    g_HostWireLogging = Logging;
+}
+
+/////////////////////////////////////////////////
+//
+// Sending requests.
+//
+/////////////////////////////////////////////////
+
+BOOLEAN
+WdfRequestSend(
+    _In_      WDFREQUEST                 Request,
+    _In_      WDFIOTARGET                Target,
+    _In_opt_  PWDF_REQUEST_SEND_OPTIONS  Options
+    )
+{
+    UNREFERENCED_PARAMETER(Options);
+
+    NT_ASSERTMSG("Request sent twice", !Request->Sent);
+    NT_ASSERTMSG("Request sent again before being reused", !Request->NeedsReuse);
+    NT_ASSERTMSG("Request sent but not formatted", Request->FormatKind != 0);
+
+    if (!Target->Opened)
+    {
+        Request->Status = STATUS_INVALID_DEVICE_STATE;
+        return FALSE;
+    }
+
+    Request->Sent = TRUE;
+    Request->CancelSent = FALSE;
+    Request->SentTarget = Target;
+
+    if (!Target->Started)
+    {
+        Target->Held.push_back(Request);
+        return TRUE;
+    }
+
+    HostControllerAccept(Request);
+
+    return TRUE;
+}
+
+BOOLEAN
+WdfRequestCancelSentRequest(
+    _In_  WDFREQUEST  Request
+    )
+{
+    if (!Request->Sent)
+    {
+        return FALSE;
+    }
+
+    Request->CancelSent = TRUE;
+
+    return TRUE;
+}
+
+/////////////////////////////////////////////////
+//
+// I/O targets.
+//
+/////////////////////////////////////////////////
+
+static
+VOID
+HostTargetCancel(
+    _In_  HOST_IO_TARGET*  pTarget
+    )
+{
+    while (!pTarget->Held.empty())
+    {
+        HOST_REQUEST* pRequest = pTarget->Held.front();
+
+        pTarget->Held.pop_front();
+        g_HostController.push_back(pRequest);
+        HostControllerFinish(pRequest, STATUS_CANCELLED);
+    }
+
+    for (BOOLEAN found = TRUE; found; )
+    {
+        found = FALSE;
+
+        for (HOST_REQUEST* pRequest : g_HostController)
+        {
+            if (pRequest->SentTarget == pTarget)
+            {
+                HostControllerFinish(pRequest, STATUS_CANCELLED);
+                found = TRUE;
+                break;
+            }
+        }
+    }
+}
+
+NTSTATUS
+WdfIoTargetCreate(
+    _In_      WDFDEVICE               Device,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES  IoTargetAttributes,
+    _Out_     WDFIOTARGET*            IoTarget
+    )
+{
+    HOST_IO_TARGET* pTarget = new HOST_IO_TARGET;
+
+    HostObjectInit(pTarget, IoTargetAttributes, Device, TRUE);
+    g_HostCounters.TargetCreates++;
+
+    pTarget->Device = Device;
+    *IoTarget = pTarget;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoTargetOpen(
+    _In_  WDFIOTARGET                 IoTarget,
+    _In_  PWDF_IO_TARGET_OPEN_PARAMS  OpenParams
+    )
+{
+    static const WCHAR prefix[] = L"\\Device\\RESOURCE_HUB\\";
+    const size_t prefixLength = ARRAYSIZE(prefix) - 1;
+
+    std::wstring name(
+        OpenParams->TargetDeviceName.Buffer,
+        OpenParams->TargetDeviceName.Length / sizeof(WCHAR));
+
+    g_HostCounters.TargetOpens++;
+
+    NT_ASSERTMSG("Target opened twice", !IoTarget->Opened);
+
+    if (name.compare(0, prefixLength, prefix) != 0)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    LONGLONG id = (LONGLONG)wcstoull(name.c_str() + prefixLength, nullptr, 16);
+
+    for (const CM_PARTIAL_RESOURCE_DESCRIPTOR& descriptor : IoTarget->Device->Resources.Descriptors)
+    {
+        if (id == (LONGLONG)(((ULONGLONG)descriptor.u.Connection.IdHighPart << 32) |
+                             descriptor.u.Connection.IdLowPart))
+        {
+            IoTarget->ConnectionId = id;
+            IoTarget->Opened = TRUE;
+            IoTarget->Started = TRUE;
+
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS
+WdfIoTargetStart(
+    _In_  WDFIOTARGET  IoTarget
+    )
+{
+    NT_ASSERTMSG("Target started but not open", IoTarget->Opened);
+
+    g_HostCounters.TargetStarts++;
+    IoTarget->Started = TRUE;
+
+    while (!IoTarget->Held.empty())
+    {
+        HOST_REQUEST* pRequest = IoTarget->Held.front();
+
+        IoTarget->Held.pop_front();
+        HostControllerAccept(pRequest);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfIoTargetStop(
+    _In_  WDFIOTARGET                   IoTarget,
+    _In_  WDF_IO_TARGET_SENT_IO_ACTION  Action
+    )
+{
+    g_HostCounters.TargetStops++;
+    IoTarget->Started = FALSE;
+
+    if (Action == WdfIoTargetCancelSentIo)
+    {
+        HostTargetCancel(IoTarget);
+    }
+}
+
+VOID
+WdfIoTargetClose(
+    _In_  WDFIOTARGET  IoTarget
+    )
+{
+    IoTarget->Started = FALSE;
+    HostTargetCancel(IoTarget);
+    IoTarget->Opened = FALSE;
+}
+
+static
+NTSTATUS
+HostFormat(
+    _In_      HOST_REQUEST*      pRequest,
+    _In_      ULONG              Kind,
+    _In_      ULONG              IoctlCode,
+    _In_opt_  HOST_MEMORY*       pMemory,
+    _In_opt_  PWDFMEMORY_OFFSET  pOffset
+    )
+{
+    NT_ASSERTMSG("Request formatted while sent", !pRequest->Sent);
+    NT_ASSERTMSG("Request formatted again before being reused", !pRequest->NeedsReuse);
+
+    pRequest->FormatKind = Kind;
+    pRequest->FormatCode = IoctlCode;
+    pRequest->FormatMemory = pMemory;
+    pRequest->FormatOffset = 0;
+    pRequest->FormatLength = (pMemory != nullptr) ? pMemory->Size : 0;
+
+    if ((pMemory != nullptr) && (pOffset != nullptr))
+    {
+        pRequest->FormatOffset = pOffset->BufferOffset;
+        pRequest->FormatLength = pOffset->BufferLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoTargetFormatRequestForIoctl(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_      ULONG              IoctlCode,
+    _In_opt_  WDFMEMORY          InputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  InputBufferOffset,
+    _In_opt_  WDFMEMORY          OutputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  OutputBufferOffset
+    )
+{
+    UNREFERENCED_PARAMETER(IoTarget);
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferOffset);
+
+    return HostFormat(Request, HOST_WIRE_IOCTL, IoctlCode, InputBuffer, InputBufferOffset);
+}
+
+NTSTATUS
+WdfIoTargetFormatRequestForRead(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_opt_  WDFMEMORY          OutputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  OutputBufferOffset,
+    _In_opt_  PLONGLONG          DeviceOffset
+    )
+{
+    UNREFERENCED_PARAMETER(IoTarget);
+    UNREFERENCED_PARAMETER(DeviceOffset);
+
+    return HostFormat(Request, HOST_WIRE_READ, 0, OutputBuffer, OutputBufferOffset);
+}
+
+NTSTATUS
+WdfIoTargetFormatRequestForWrite(
+    _In_      WDFIOTARGET        IoTarget,
+    _In_      WDFREQUEST         Request,
+    _In_opt_  WDFMEMORY          InputBuffer,
+    _In_opt_  PWDFMEMORY_OFFSET  InputBufferOffset,
+    _In_opt_  PLONGLONG          DeviceOffset
+    )
+{
+    UNREFERENCED_PARAMETER(IoTarget);
+    UNREFERENCED_PARAMETER(DeviceOffset);
+
+    return HostFormat(Request, HOST_WIRE_WRITE, 0, InputBuffer, InputBufferOffset);
+}
+
+/////////////////////////////////////////////////
+//
+// SPB class extension.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+SpbDeviceInitialize(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PSPB_CONTROLLER_CONFIG  Config
+    )
+{
+    FxDevice->Spb = *Config;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SpbControllerSetIoOtherCallback(
+    _In_      WDFDEVICE                     FxDevice,
+    _In_      PFN_SPB_CONTROLLER_OTHER      EvtSpbIoOther,
+    _In_opt_  PFN_WDF_IO_IN_CALLER_CONTEXT  EvtIoInCallerContext
+    )
+{
+    FxDevice->EvtSpbIoOther = EvtSpbIoOther;
+    FxDevice->EvtIoInCallerContext = EvtIoInCallerContext;
+}
+
+VOID
+SpbControllerSetTargetAttributes(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PWDF_OBJECT_ATTRIBUTES  TargetAttributes
+    )
+{
+    FxDevice->TargetAttributes = *TargetAttributes;
+}
+
+VOID
+SpbControllerSetRequestAttributes(
+    _In_  WDFDEVICE               FxDevice,
+    _In_  PWDF_OBJECT_ATTRIBUTES  RequestAttributes
+    )
+{
+    FxDevice->RequestAttributes = *RequestAttributes;
+}
+
+VOID
+SpbTargetGetConnectionParameters(
+    _In_  SPBTARGET                   SpbTarget,
+    _Out_ PSPB_CONNECTION_PARAMETERS  ConnectionParameters
+    )
+{
+    ConnectionParameters->ConnectionTag = L"";
+    ConnectionParameters->ConnectionParameters = SpbTarget->Properties.data();
+}
+
+VOID
+SpbRequestGetParameters(
+    _In_  SPBREQUEST               SpbRequest,
+    _Out_ PSPB_REQUEST_PARAMETERS  Parameters
+    )
+{
+    Parameters->Position = SpbRequestSequencePositionSingle;
+    Parameters->Type = SpbRequest->SpbType;
+    Parameters->Length = 0;
+    Parameters->SequenceTransferCount = (ULONG)SpbRequest->Buffers.size();
+
+    for (const HOST_BUFFER& buffer : SpbRequest->Buffers)
+    {
+        Parameters->Length += buffer.Data.size();
+    }
+}
+
+VOID
+SpbRequestGetTransferParameters(
+    _In_      SPBREQUEST                SpbRequest,
+    _In_      ULONG                     Index,
+    _Out_opt_ PSPB_TRANSFER_DESCRIPTOR  TransferDescriptor,
+    _Outptr_opt_ PMDL*                  TransferBuffer
+    )
+{
+    NT_ASSERTMSG("Transfer index out of range", Index < SpbRequest->Buffers.size());
+
+    HOST_BUFFER* pBuffer = &SpbRequest->Buffers[Index];
+
+    if (TransferDescriptor != nullptr)
+    {
+        TransferDescriptor->Direction = pBuffer->Direction;
+        TransferDescriptor->TransferLength = pBuffer->Data.size();
+        TransferDescriptor->DelayInUs = pBuffer->DelayInUs;
+    }
+
+    if (TransferBuffer != nullptr)
+    {
+        *TransferBuffer = &pBuffer->Mdl;
+    }
+}
+
+NTSTATUS
+SpbRequestCaptureIoOtherTransferList(
+    _In_  SPBREQUEST  SpbRequest
+    )
+{
+    UNREFERENCED_PARAMETER(SpbRequest);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SpbRequestComplete(
+    _In_  SPBREQUEST  SpbRequest,
+    _In_  NTSTATUS    CompletionStatus
+    )
+{
+    HostClientComplete(SpbRequest, CompletionStatus, SpbRequest->Information);
+}
+
+/////////////////////////////////////////////////
+//
+// Peripheral side.
+//
+/////////////////////////////////////////////////
+
+#include "pshpack1.h"
+
+typedef struct HOST_I2C_DESCRIPTOR
+{
+    PNP_SERIAL_BUS_DESCRIPTOR SerialBusDescriptor;
+    ULONG ConnectionSpeed;
+    USHORT SlaveAddress;
+}
+HOST_I2C_DESCRIPTOR;
+
+typedef struct HOST_SPI_DESCRIPTOR
+{
+    PNP_SERIAL_BUS_DESCRIPTOR SerialBusDescriptor;
+    ULONG ConnectionSpeed;
+    UCHAR DataBitLength;
+    UCHAR Phase;
+    UCHAR Polarity;
+    USHORT DeviceSelection;
+}
+HOST_SPI_DESCRIPTOR;
+
+#include "poppack.h"
+
+SPBTARGET
+HostTargetConnect(
+    _In_  WDFDEVICE  Device,
+    _In_  ULONG      BusType,
+    _In_  USHORT     Address,
+    _In_  ULONG      ConnectionSpeed
+    )
+{
+    HOST_CALL call;
+    HOST_TARGET* pTarget = new HOST_TARGET;
+    ULONG propertiesLength = (BusType == HOST_BUS_I2C) ?
+        sizeof(HOST_I2C_DESCRIPTOR) : sizeof(HOST_SPI_DESCRIPTOR);
+    PRH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER pConnection;
+    PNP_SERIAL_BUS_DESCRIPTOR* pDescriptor;
+
+    HostObjectInit(pTarget, &Device->TargetAttributes, nullptr, FALSE);
+    pTarget->Device = Device;
+    pTarget->Properties.resize(
+        FIELD_OFFSET(RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER, ConnectionProperties) +
+        propertiesLength);
+
+    pConnection = (PRH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER)pTarget->Properties.data();
+    pConnection->PropertiesLength = propertiesLength;
+
+    pDescriptor = (PNP_SERIAL_BUS_DESCRIPTOR*)pConnection->ConnectionProperties;
+    pDescriptor->Tag = 0x8e;
+    pDescriptor->Length = (USHORT)(propertiesLength - 3);
+    pDescriptor->SerialBusType = (UCHAR)BusType;
+
+    if (BusType == HOST_BUS_I2C)
+    {
+        HOST_I2C_DESCRIPTOR* pI2c = (HOST_I2C_DESCRIPTOR*)pDescriptor;
+
+        pI2c->ConnectionSpeed = ConnectionSpeed;
+        pI2c->SlaveAddress = Address;
+    }
+    else
+    {
+        HOST_SPI_DESCRIPTOR* pSpi = (HOST_SPI_DESCRIPTOR*)pDescriptor;
+
+        pSpi->ConnectionSpeed = ConnectionSpeed;
+        pSpi->DataBitLength = 8;
+    }
+
+    if (!NT_SUCCESS(Device->Spb.EvtSpbTargetConnect(Device, pTarget)))
+    {
+        HostObjectDelete(pTarget);
+        return nullptr;
+    }
+
+    return pTarget;
+}
+
+VOID
+HostTargetDisconnect(
+    _In_  SPBTARGET  Target
+    )
+{
+    HOST_CALL call;
+
+    if (Target->Device->Spb.EvtSpbTargetDisconnect != nullptr)
+    {
+        Target->Device->Spb.EvtSpbTargetDisconnect(Target->Device, Target);
+    }
+
+    HostObjectDelete(Target);
+}
+
+//
+// Hands a client request to the driver in the caller context if
+// it is an IOCTL and the driver asked for them, else queues it
+// for presentation.
+//
+
+static
+VOID
+HostClientQueue(
+    _In_  HOST_REQUEST*  pRequest
+    )
+{
+    HOST_DEVICE* pDevice = pRequest->Device;
+
+    if ((pRequest->SpbType == SpbRequestTypeOther) &&
+        (pDevice->EvtIoInCallerContext != nullptr))
+    {
+        pRequest->State = HostStateOwned;
+        pDevice->EvtIoInCallerContext(pDevice, pRequest);
+        return;
+    }
+
+    pRequest->State = HostStateQueued;
+    pDevice->SpbQueue.push_back(pRequest);
+}
+
+static
+HOST_REQUEST*
+HostClientCreate(
+    _In_  HOST_TARGET*                           pTarget,
+    _In_  SPB_REQUEST_TYPE                       Type,
+    _In_  ULONG                                  IoControlCode,
+    _In_reads_(Count) const HOST_TRANSFER*       pTransfers,
+    _In_  ULONG                                  Count
+    )
+{
+    HOST_REQUEST* pRequest = new HOST_REQUEST;
+
+    HostObjectInit(pRequest, &pTarget->Device->RequestAttributes, nullptr, FALSE);
+
+    pRequest->Device = pTarget->Device;
+    pRequest->Target = pTarget;
+    pRequest->SpbType = Type;
+    pRequest->Buffers.resize(Count);
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        HOST_BUFFER* pBuffer = &pRequest->Buffers[i];
+
+        pBuffer->Direction = pTransfers[i].Direction;
+        pBuffer->DelayInUs = pTransfers[i].DelayInUs;
+
+        if (pTransfers[i].pData != nullptr)
+        {
+            pBuffer->Data.assign(pTransfers[i].pData, pTransfers[i].pData + pTransfers[i].Length);
+        }
+        else
+        {
+            pBuffer->Data.assign(pTransfers[i].Length, 0);
+        }
+
+        pBuffer->Mdl.Next = nullptr;
+        pBuffer->Mdl.ByteCount = pTransfers[i].Length;
+        pBuffer->Mdl.MappedSystemVa = pBuffer->Data.data();
+    }
+
+    if (Type == SpbRequestTypeRead)
+    {
+        pRequest->OutputMemory.Buffer = pRequest->Buffers[0].Data.data();
+        pRequest->OutputMemory.Size = pRequest->Buffers[0].Data.size();
+    }
+
+    if (Type == SpbRequestTypeWrite)
+    {
+        pRequest->InputMemory.Buffer = pRequest->Buffers[0].Data.data();
+        pRequest->InputMemory.Size = pRequest->Buffers[0].Data.size();
+    }
+
+    // The input buffer of an IOCTL is its first write, the output
+    // buffer its first read, as for a full duplex transfer.
+    if (Type == SpbRequestTypeOther)
+    {
+        pRequest->IoControlCode = IoControlCode;
+
+        for (ULONG i = Count; i-- > 0;)
+        {
+            HOST_MEMORY* pMemory =
+                (pRequest->Buffers[i].Direction == SpbTransferDirectionToDevice) ?
+                &pRequest->InputMemory : &pRequest->OutputMemory;
+
+            pMemory->Buffer = pRequest->Buffers[i].Data.data();
+            pMemory->Size = pRequest->Buffers[i].Data.size();
+        }
+    }
+
+    HostClientQueue(pRequest);
+
+    return pRequest;
+}
+
+WDFREQUEST
+HostSubmitLock(
+    _In_  SPBTARGET  Target
+    )
+{
+    HOST_CALL call;
+
+    return HostClientCreate(Target, SpbRequestTypeLockController, 0, nullptr, 0);
+}
+
+WDFREQUEST
+HostSubmitUnlock(
+    _In_  SPBTARGET  Target
+    )
+{
+    HOST_CALL call;
+
+    return HostClientCreate(Target, SpbRequestTypeUnlockController, 0, nullptr, 0);
+}
+
+WDFREQUEST
+HostSubmitRead(
+    _In_  SPBTARGET  Target,
+    _In_  ULONG      Length
+    )
+{
+    HOST_CALL call;
+    HOST_TRANSFER transfer = { SpbTransferDirectionFromDevice, 0, Length, nullptr };
+
+    return HostClientCreate(Target, SpbRequestTypeRead, 0, &transfer, 1);
+}
+
+WDFREQUEST
+HostSubmitWrite(
+    _In_  SPBTARGET                  Target,
+    _In_reads_(Length) const UCHAR*  pData,
+    _In_  ULONG                      Length
+    )
+{
+    HOST_CALL call;
+    HOST_TRANSFER transfer = { SpbTransferDirectionToDevice, 0, Length, pData };
+
+    return HostClientCreate(Target, SpbRequestTypeWrite, 0, &transfer, 1);
+}
+
+WDFREQUEST
+HostSubmitSequence(
+    _In_  SPBTARGET                          Target,
+    _In_reads_(Count) const HOST_TRANSFER*   pTransfers,
+    _In_  ULONG                              Count
+    )
+{
+    HOST_CALL call;
+
+    return HostClientCreate(Target, SpbRequestTypeSequence, 0, pTransfers, Count);
+}
+
+WDFREQUEST
+HostSubmitFullDuplex(
+    _In_  SPBTARGET                       Target,
+    _In_reads_(WriteLength) const UCHAR*  pData,
+    _In_  ULONG                           WriteLength,
+    _In_  ULONG                           ReadLength
+    )
+{
+    HOST_CALL call;
+    const HOST_TRANSFER transfers[] =
+    {
+        { SpbTransferDirectionToDevice, 0, WriteLength, pData },
+        { SpbTransferDirectionFromDevice, 0, ReadLength, nullptr },
+    };
+
+    return HostClientCreate(
+        Target,
+        SpbRequestTypeOther,
+        IOCTL_SPB_FULL_DUPLEX,
+        transfers,
+        ARRAYSIZE(transfers));
+}
+
+WDFREQUEST
+HostSubmitIoctl(
+    _In_  SPBTARGET                       Target,
+    _In_  ULONG                           IoControlCode,
+    _In_reads_(InputLength) const VOID*   pInput,
+    _In_  ULONG                           InputLength,
+    _In_  ULONG                           OutputLength
+    )
+{
+    HOST_CALL call;
+    HOST_TRANSFER transfers[2];
+    ULONG count = 0;
+
+    if (InputLength != 0)
+    {
+        transfers[count++] = { SpbTransferDirectionToDevice, 0, InputLength, (const UCHAR*)pInput };
+    }
+
+    if (OutputLength != 0)
+    {
+        transfers[count++] = { SpbTransferDirectionFromDevice, 0, OutputLength, nullptr };
+    }
+
+    return HostClientCreate(Target, SpbRequestTypeOther, IoControlCode, transfers, count);
+}
+
+BOOLEAN
+HostRequestCompleted(
+    _In_  WDFREQUEST  Request
+    )
+{
+    return Request->State == HostStateCompleted;
+}
+
+NTSTATUS
+HostRequestStatus(
+    _In_  WDFREQUEST  Request
+    )
+{
+    return Request->Status;
+}
+
+ULONG_PTR
+HostRequestInformation(
+    _In_  WDFREQUEST  Request
+    )
+{
+    return Request->Information;
+}
+
+const UCHAR*
+HostRequestData(
+    _In_  WDFREQUEST  Request,
+    _In_  ULONG       Index
+    )
+{
+    NT_ASSERT(Index < Request->Buffers.size());
+
+    return Request->Buffers[Index].Data.data();
+}
+
+VOID
+HostRequestCancel(
+    _In_  WDFREQUEST  Request
+    )
+{
+    HOST_CALL call;
+
+    if (Request->State == HostStateCompleted)
+    {
+        return;
+    }
+
+    Request->CancelRequested = TRUE;
+
+    if (Request->State == HostStateQueued)
+    {
+        std::deque<HOST_REQUEST*>& queue = Request->Device->SpbQueue;
+
+        for (auto i = queue.begin(); i != queue.end(); ++i)
+        {
+            if (*i == Request)
+            {
+                queue.erase(i);
+                break;
+            }
+        }
+
+        Request->State = HostStateOwned;
+        HostClientComplete(Request, STATUS_CANCELLED, 0);
+    }
+    else if (Request->State == HostStateOnQueue)
+    {
+        HOST_QUEUE* pQueue = Request->Queue;
+
+        for (auto i = pQueue->Requests.begin(); i != pQueue->Requests.end(); ++i)
+        {
+            if (*i == Request)
+            {
+                pQueue->Requests.erase(i);
+                break;
+            }
+        }
+
+        Request->State = HostStateOwned;
+        Request->Queue = nullptr;
+
+        if (pQueue->Config.EvtIoCanceledOnQueue != nullptr)
+        {
+            pQueue->Config.EvtIoCanceledOnQueue(pQueue, Request);
+        }
+        else
+        {
+            HostClientComplete(Request, STATUS_CANCELLED, 0);
+        }
+    }
+    else if (Request->CancelRoutine != nullptr)
+    {
+        PFN_WDF_REQUEST_CANCEL routine = Request->CancelRoutine;
+
+        Request->CancelRoutine = nullptr;
+        Request->CancelRan = TRUE;
+        routine(Request);
+    }
+}
+
+VOID
+HostRequestResubmit(
+    _In_  WDFREQUEST  Request
+    )
+{
+    HOST_CALL call;
+
+    NT_ASSERTMSG("Request resubmitted before completion", Request->State == HostStateCompleted);
+
+    Request->CancelRequested = FALSE;
+    Request->CancelRan = FALSE;
+    Request->Status = STATUS_SUCCESS;
+    Request->Information = 0;
+
+    // SPBCx presents every request with a zeroed context.
+    if (Request->Context != nullptr)
+    {
+        RtlZeroMemory(Request->Context, Request->ContextType->ContextSize);
+    }
+
+    HostClientQueue(Request);
+}
+
+VOID
+HostRequestFree(
+    _In_  WDFREQUEST  Request
+    )
+{
+    NT_ASSERTMSG("Request freed before completion", Request->State == HostStateCompleted);
+
+    HostObjectDelete(Request);
+}
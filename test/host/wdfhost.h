@@ -0,0 +1,364 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    wdfhost.h
+
+Abstract:
+
+    This module contains the interface of the mock framework the
+    driver sources are linked with on the host. It plays the
+    framework, SPBCx and the peripheral drivers on one side of the
+    probe, and the true SPB controller on the other side.
+
+    Everything runs on the calling thread. Client requests are
+    presented to the driver, and work items run, when a call of
+    this interface returns to its caller. The controller keeps
+    the requests sent to it until the caller completes them, in
+    order, or completes them as they are sent once inline mode is
+    set. Every request sent is logged with its transfers as they
+    would go on the wire.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#ifndef _WDFHOST_H_
+#define _WDFHOST_H_
+
+#include "SPBCx.h"
+
+/////////////////////////////////////////////////
+//
+// Counters of the calls the driver makes.
+//
+/////////////////////////////////////////////////
+
+typedef struct HOST_COUNTERS
+{
+    // Pool blocks and framework objects, the driver's own
+    // and the ones it creates on behalf of a request.
+    ULONGLONG PoolAllocations;
+    ULONGLONG PoolFrees;
+    ULONGLONG ObjectCreates;
+    ULONGLONG ObjectDeletes;
+    ULONGLONG MemoryCreates;
+    ULONGLONG RequestCreates;
+
+    // SPB controller handles.
+    ULONGLONG TargetCreates;
+    ULONGLONG TargetOpens;
+    ULONGLONG TargetStarts;
+    ULONGLONG TargetStops;
+
+    // Power transitions of the device.
+    ULONGLONG D0Entries;
+    ULONGLONG D0Exits;
+
+    ULONGLONG MdlMappings;
+    ULONGLONG Sends;
+    ULONGLONG ControllerCompletions;
+    ULONGLONG WorkItemRuns;
+    ULONGLONG TimerRuns;
+}
+HOST_COUNTERS;
+
+extern HOST_COUNTERS g_HostCounters;
+
+/////////////////////////////////////////////////
+//
+// Device and targets.
+//
+/////////////////////////////////////////////////
+
+// A value of the device key, a REG_DWORD unless Data is set.
+typedef struct HOST_VALUE
+{
+    const WCHAR*  Name;
+    ULONG         Value;
+    const VOID*   Data;
+    ULONG         Length;
+}
+HOST_VALUE;
+
+// Creates a device with the given device key values.
+WDFDEVICE
+HostDeviceAdd(
+    _In_reads_(Count) const HOST_VALUE*  pValues,
+    _In_  ULONG                          Count
+    );
+
+// Prepares the hardware with one I2C connection resource per
+// ID, then enters D0.
+NTSTATUS
+HostDeviceStart(
+    _In_  WDFDEVICE                        Device,
+    _In_reads_(Count) const LONGLONG*      pConnectionIds,
+    _In_  ULONG                            Count
+    );
+
+// Leaves D0 if nothing keeps the device in it, as the idle
+// timeout would.
+BOOLEAN
+HostDeviceIdle(
+    _In_  WDFDEVICE  Device
+    );
+
+BOOLEAN
+HostDeviceInD0(
+    _In_  WDFDEVICE  Device
+    );
+
+// Leaves D0 and releases the hardware, then deletes the device.
+VOID
+HostDeviceRemove(
+    _In_  WDFDEVICE  Device
+    );
+
+#define HOST_BUS_I2C    1
+#define HOST_BUS_SPI    2
+
+// Opens a target, the resource hub connection of a peripheral
+// at Address.
+SPBTARGET
+HostTargetConnect(
+    _In_  WDFDEVICE  Device,
+    _In_  ULONG      BusType,
+    _In_  USHORT     Address,
+    _In_  ULONG      ConnectionSpeed
+    );
+
+VOID
+HostTargetDisconnect(
+    _In_  SPBTARGET  Target
+    );
+
+/////////////////////////////////////////////////
+//
+// Client requests.
+//
+/////////////////////////////////////////////////
+
+typedef struct HOST_TRANSFER
+{
+    SPB_TRANSFER_DIRECTION  Direction;
+    ULONG                   DelayInUs;
+    ULONG                   Length;
+
+    // Bytes of a write, NULL for a read.
+    const UCHAR*            pData;
+}
+HOST_TRANSFER;
+
+WDFREQUEST
+HostSubmitLock(
+    _In_  SPBTARGET  Target
+    );
+
+WDFREQUEST
+HostSubmitUnlock(
+    _In_  SPBTARGET  Target
+    );
+
+WDFREQUEST
+HostSubmitRead(
+    _In_  SPBTARGET  Target,
+    _In_  ULONG      Length
+    );
+
+WDFREQUEST
+HostSubmitWrite(
+    _In_  SPBTARGET                  Target,
+    _In_reads_(Length) const UCHAR*  pData,
+    _In_  ULONG                      Length
+    );
+
+WDFREQUEST
+HostSubmitSequence(
+    _In_  SPBTARGET                          Target,
+    _In_reads_(Count) const HOST_TRANSFER*   pTransfers,
+    _In_  ULONG                              Count
+    );
+
+// Submits IOCTL_SPB_FULL_DUPLEX, a write then a read.
+WDFREQUEST
+HostSubmitFullDuplex(
+    _In_  SPBTARGET                       Target,
+    _In_reads_(WriteLength) const UCHAR*  pData,
+    _In_  ULONG                           WriteLength,
+    _In_  ULONG                           ReadLength
+    );
+
+// Submits an IOCTL with a copy of InputLength bytes of pInput as
+// input buffer and an output buffer of OutputLength bytes, either
+// of them omitted when its length is 0. For HostRequestData, the
+// output buffer follows the input buffer.
+WDFREQUEST
+HostSubmitIoctl(
+    _In_  SPBTARGET                       Target,
+    _In_  ULONG                           IoControlCode,
+    _In_reads_(InputLength) const VOID*   pInput,
+    _In_  ULONG                           InputLength,
+    _In_  ULONG                           OutputLength
+    );
+
+BOOLEAN
+HostRequestCompleted(
+    _In_  WDFREQUEST  Request
+    );
+
+NTSTATUS
+HostRequestStatus(
+    _In_  WDFREQUEST  Request
+    );
+
+ULONG_PTR
+HostRequestInformation(
+    _In_  WDFREQUEST  Request
+    );
+
+// Returns the buffer of a transfer of a client request.
+const UCHAR*
+HostRequestData(
+    _In_  WDFREQUEST  Request,
+    _In_  ULONG       Index
+    );
+
+// Cancels a client request, wherever it is.
+VOID
+HostRequestCancel(
+    _In_  WDFREQUEST  Request
+    );
+
+// Submits a completed client request again, with the same
+// transfers, as a client reusing its request does.
+VOID
+HostRequestResubmit(
+    _In_  WDFREQUEST  Request
+    );
+
+// Deletes a completed client request.
+VOID
+HostRequestFree(
+    _In_  WDFREQUEST  Request
+    );
+
+/////////////////////////////////////////////////
+//
+// Controller.
+//
+/////////////////////////////////////////////////
+
+#define HOST_WIRE_READ              1
+#define HOST_WIRE_WRITE             2
+#define HOST_WIRE_IOCTL             3
+
+#define HOST_WIRE_MAX_TRANSFERS     128
+#define HOST_WIRE_MAX_DATA          16
+
+typedef struct HOST_WIRE_TRANSFER
+{
+    SPB_TRANSFER_DIRECTION      Direction;
+    ULONG                       DelayInUs;
+    ULONG                       Length;
+    SPB_TRANSFER_BUFFER_FORMAT  Format;
+
+    // First bytes of a write.
+    UCHAR                       Data[HOST_WIRE_MAX_DATA];
+}
+HOST_WIRE_TRANSFER;
+
+typedef struct HOST_WIRE_REQUEST
+{
+    ULONG               Kind;
+    ULONG               IoControlCode;
+    LONGLONG            ConnectionId;
+
+    // STATUS_INVALID_PARAMETER if the controller rejected the
+    // transfer list, the request is then failed.
+    NTSTATUS            Status;
+
+    ULONG               TransferCount;
+    HOST_WIRE_TRANSFER  Transfers[HOST_WIRE_MAX_TRANSFERS];
+}
+HOST_WIRE_REQUEST;
+
+// Requests sent and not completed yet.
+ULONG
+HostControllerPending(
+    VOID
+    );
+
+// Completes the oldest request sent, reads return a pattern and
+// every byte counts as transferred on success. Returns FALSE if
+// no request is pending.
+BOOLEAN
+HostControllerComplete(
+    _In_  NTSTATUS  Status
+    );
+
+// Completes every request when it is sent, inside WdfRequestSend.
+VOID
+HostControllerSetInline(
+    _In_  BOOLEAN  Inline
+    );
+
+// Byte Offset of a read transfer returns.
+#define HOST_READ_PATTERN(Offset)   ((UCHAR)(0xa5 + (Offset)))
+
+ULONG
+HostWireCount(
+    VOID
+    );
+
+const HOST_WIRE_REQUEST*
+HostWireGet(
+    _In_  ULONG  Index
+    );
+
+VOID
+HostWireClear(
+    VOID
+    );
+
+// Logging is on by default, benchmarks turn it off.
+VOID
+HostWireSetLogging(
+    _In_  BOOLEAN  Logging
+    );
+
+/////////////////////////////////////////////////
+//
+// Scheduling and time.
+//
+/////////////////////////////////////////////////
+
+// Runs the queued work items and the cancellations in progress.
+VOID
+HostRun(
+    VOID
+    );
+
+// Runs the callbacks of the started timers as if their due time
+// had passed, whatever it is, and returns how many ran.
+ULONG
+HostTimerExpire(
+    VOID
+    );
+
+// KeQueryPerformanceCounter returns Ticks, at 10 MHz, instead of
+// the host clock from now on.
+VOID
+HostClockSet(
+    _In_  LONGLONG  Ticks
+    );
+
+#define HOST_CLOCK_FREQUENCY        10000000
+
+#endif // _WDFHOST_H_
@@ -0,0 +1,22 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    wdm.h
+
+Abstract:
+
+    This module stands for the WDM header of the kernel build,
+    everything the driver uses from it is in ntddk.h.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "ntddk.h"
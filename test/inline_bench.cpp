@@ -0,0 +1,204 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    inline_bench.cpp
+
+Abstract:
+
+    This module times register reads of growing size through the
+    driver in the full capture mode, against the mock controller of
+    host/wdfhost.h completing every transfer as it is sent, and
+    counts the MDL mappings each read costs. A read is a sequence of
+    a one byte write of the register address and the read itself.
+
+    Every size is timed with the default settings, which collapse
+    repeated requests, first reading the same register over and
+    over, then alternating between two registers so that no request
+    repeats the one before it. It is also timed with every request
+    recorded, payload included, and with every request recorded
+    through a filter testing the first byte of the register write.
+
+    A request repeating the previous one is only read by the repeat
+    detection. Otherwise, with the default settings the repeat
+    detection and the records both read the payload, and with the
+    filter the filter and the records do: the probe then copies the
+    payload of a small request once, and reads the copy.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "spbprobe.h"
+
+#define ROUNDS      25
+#define ITERATIONS  10000
+
+#define PROBES      4
+
+static const ULONG s_Sizes[] = { 1, 2, 4, 8, 16, 32, 63, 64, 128 };
+
+static const UCHAR s_Registers[2] = { 0x10, 0x11 };
+
+typedef struct BENCH_PROBE
+{
+    const CHAR* Name;
+    WDFDEVICE Device;
+    SPBTARGET Target;
+    BOOLEAN Alternate;
+    WDFREQUEST Requests[ARRAYSIZE(s_Sizes)][ARRAYSIZE(s_Registers)];
+    double Best[ARRAYSIZE(s_Sizes)];
+    ULONGLONG Mappings[ARRAYSIZE(s_Sizes)];
+}
+BENCH_PROBE;
+
+static
+VOID
+BenchProbeOpen(
+    _Out_ BENCH_PROBE*  pProbe,
+    _In_z_ const CHAR*  Name,
+    _In_  ULONG         Repeats,
+    _In_  BOOLEAN       Alternate,
+    _In_  BOOLEAN       Filter
+    )
+{
+    SPB_PROBE_FILTER_BUILDER builder;
+    ULONG count;
+
+    SpbProbeFilterBuilderInit(&builder);
+    SpbProbeFilterBuilderAddField(&builder, SPB_PROBE_FILTER_FIELD_DIRECTION,
+        MAXULONG, SPB_PROBE_FILTER_EQ, SPB_PROBE_DIRECTION_WRITE);
+    SpbProbeFilterBuilderAddByte(&builder, 0, 0xff, SPB_PROBE_FILTER_EQ, s_Registers[0]);
+    count = SpbProbeFilterBuilderFinish(&builder);
+
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureMode", SPB_PROBE_MODE_FULL, nullptr, 0 },
+        { L"CaptureRepeats", Repeats, nullptr, 0 },
+        { L"CaptureLength", 256, nullptr, 0 },
+        { L"CaptureFilter", 0, builder.Program, count * (ULONG)sizeof(SPB_PROBE_FILTER_INSN) },
+    };
+    const LONGLONG id = 1;
+
+    pProbe->Name = Name;
+    pProbe->Alternate = Alternate;
+    pProbe->Device = HostDeviceAdd(values, Filter ? ARRAYSIZE(values) : ARRAYSIZE(values) - 1);
+    HostDeviceStart(pProbe->Device, &id, 1);
+    pProbe->Target = HostTargetConnect(pProbe->Device, HOST_BUS_I2C, 0x50, 400000);
+
+    for (ULONG i = 0; i < ARRAYSIZE(s_Sizes); i++)
+    {
+        for (ULONG r = 0; r < ARRAYSIZE(s_Registers); r++)
+        {
+            const HOST_TRANSFER sequence[] =
+            {
+                { SpbTransferDirectionToDevice, 0, 1, &s_Registers[r] },
+                { SpbTransferDirectionFromDevice, 0, s_Sizes[i], nullptr },
+            };
+
+            pProbe->Requests[i][r] = HostSubmitSequence(pProbe->Target, sequence, ARRAYSIZE(sequence));
+        }
+
+        pProbe->Best[i] = 1e300;
+        pProbe->Mappings[i] = 0;
+    }
+}
+
+static
+VOID
+BenchProbeClose(
+    _In_  BENCH_PROBE*  pProbe
+    )
+{
+    for (ULONG i = 0; i < ARRAYSIZE(s_Sizes); i++)
+    {
+        for (ULONG r = 0; r < ARRAYSIZE(s_Registers); r++)
+        {
+            HostRequestFree(pProbe->Requests[i][r]);
+        }
+    }
+
+    HostTargetDisconnect(pProbe->Target);
+    HostDeviceRemove(pProbe->Device);
+}
+
+static
+VOID
+BenchSize(
+    _Inout_ BENCH_PROBE*  pProbe,
+    _In_    ULONG         Index
+    )
+{
+    ULONGLONG mappings = g_HostCounters.MdlMappings;
+    double start = HostNow();
+    double time;
+
+    for (ULONG i = 0; i < ITERATIONS; i++)
+    {
+        WDFREQUEST request = pProbe->Requests[Index][pProbe->Alternate ? (i & 1) : 0];
+
+        HostRequestResubmit(request);
+        HOST_KEEP(request);
+    }
+
+    time = (HostNow() - start) / ITERATIONS;
+
+    pProbe->Mappings[Index] += g_HostCounters.MdlMappings - mappings;
+
+    if (time < pProbe->Best[Index])
+    {
+        pProbe->Best[Index] = time;
+    }
+}
+
+int
+main(
+    VOID
+    )
+{
+    BENCH_PROBE probes[PROBES];
+
+    HostWireSetLogging(FALSE);
+    HostControllerSetInline(TRUE);
+
+    BenchProbeOpen(&probes[0], "default, same register", 1, FALSE, FALSE);
+    BenchProbeOpen(&probes[1], "default, two registers", 1, TRUE, FALSE);
+    BenchProbeOpen(&probes[2], "every record", 0, FALSE, FALSE);
+    BenchProbeOpen(&probes[3], "filtered", 0, FALSE, TRUE);
+
+    for (ULONG round = 0; round < ROUNDS; round++)
+    {
+        for (ULONG i = 0; i < ARRAYSIZE(s_Sizes); i++)
+        {
+            for (ULONG probe = 0; probe < PROBES; probe++)
+            {
+                BenchSize(&probes[probe], i);
+            }
+        }
+    }
+
+    for (ULONG probe = 0; probe < PROBES; probe++)
+    {
+        for (ULONG i = 0; i < ARRAYSIZE(s_Sizes); i++)
+        {
+            printf("inline_bench: %-22s, read of %3lu bytes: %.1f ns, %.2f MDL mappings\n",
+                probes[probe].Name,
+                (unsigned long)s_Sizes[i],
+                probes[probe].Best[i],
+                (double)probes[probe].Mappings[i] / ((double)ROUNDS * ITERATIONS));
+        }
+
+        BenchProbeClose(&probes[probe]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    latency_test.cpp
+
+Abstract:
+
+    This module runs the driver against the mock controller of
+    host/wdfhost.h on the virtual clock, and checks the latency
+    histograms IOCTL_SPB_PROBE_QUERY_LATENCY returns: every client
+    request completed is counted once, in the histogram of its
+    kind and the bucket of its latency, and the query validates
+    its connection index and output buffer.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "spbprobe.h"
+
+#define TEST_ADDRESS        0x50
+
+// Ticks of the virtual clock per microsecond.
+#define TEST_TICKS_PER_US   (HOST_CLOCK_FREQUENCY / 1000000)
+
+static LONGLONG s_Now;
+
+typedef struct TEST_KIND
+{
+    ULONG Count;
+    ULONG Max;
+    ULONGLONG Sum;
+}
+TEST_KIND;
+
+//
+// Completes the request the controller holds Latency us after
+// Request reached the driver.
+//
+
+static
+VOID
+TestComplete(
+    WDFREQUEST  Request,
+    ULONG       Latency,
+    NTSTATUS    Status
+    )
+{
+    s_Now += (LONGLONG)Latency * TEST_TICKS_PER_US;
+    HostClockSet(s_Now);
+
+    CHECK(HostControllerComplete(Status));
+    CHECK(HostRequestCompleted(Request));
+    CHECK_EQ(HostRequestStatus(Request), Status);
+
+    HostRequestFree(Request);
+
+    // Time passes between requests.
+    s_Now += 1000 * TEST_TICKS_PER_US;
+    HostClockSet(s_Now);
+}
+
+//
+// Queries the histograms of the connection at Index, or of the
+// first one if Index is MAXULONG, into pLatency.
+//
+
+static
+NTSTATUS
+TestQuery(
+    SPBTARGET            Target,
+    ULONG                Index,
+    ULONG                OutputLength,
+    SPB_PROBE_LATENCY*   pLatency
+    )
+{
+    WDFREQUEST query;
+    NTSTATUS status;
+
+    if (Index == MAXULONG)
+    {
+        query = HostSubmitIoctl(Target, IOCTL_SPB_PROBE_QUERY_LATENCY, nullptr, 0, OutputLength);
+    }
+    else
+    {
+        query = HostSubmitIoctl(Target, IOCTL_SPB_PROBE_QUERY_LATENCY, &Index, sizeof(Index), OutputLength);
+    }
+
+    // Answered right away, not queued behind client requests.
+    CHECK(HostRequestCompleted(query));
+    status = HostRequestStatus(query);
+
+    if (NT_SUCCESS(status))
+    {
+        CHECK_EQ(HostRequestInformation(query), sizeof(SPB_PROBE_LATENCY));
+        memcpy(pLatency, HostRequestData(query, (Index == MAXULONG) ? 0 : 1), sizeof(*pLatency));
+
+        CHECK_EQ(pLatency->Version, SPB_PROBE_LATENCY_VERSION);
+        CHECK_EQ(pLatency->KindCount, SPB_PROBE_KIND_COUNT);
+        CHECK_EQ(pLatency->BucketCount, SPB_PROBE_HISTOGRAM_BUCKETS);
+    }
+    else
+    {
+        CHECK_EQ(HostRequestInformation(query), 0);
+    }
+
+    HostRequestFree(query);
+
+    return status;
+}
+
+//
+// Checks a histogram against the values expected, recorded one
+// by one in pValues.
+//
+
+static
+VOID
+TestHistogram(
+    const SPB_PROBE_HISTOGRAM*  pHistogram,
+    const ULONG*                pValues,
+    ULONG                       Count
+    )
+{
+    ULONG buckets[SPB_PROBE_HISTOGRAM_BUCKETS] = {};
+    ULONGLONG sum = 0;
+    ULONG max = 0;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        buckets[SpbProbeHistogramBucket(pValues[i])]++;
+        sum += pValues[i];
+        max = (pValues[i] > max) ? pValues[i] : max;
+    }
+
+    CHECK_EQ(pHistogram->Count, Count);
+    CHECK_EQ(pHistogram->Max, max);
+    CHECK_EQ(pHistogram->Sum, sum);
+    CHECK(memcmp(pHistogram->Buckets, buckets, sizeof(buckets)) == 0);
+}
+
+static
+VOID
+TestLatency(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Reads, writes and sequences of one and several transfers,
+    some failing, each completed after a known latency: their
+    histograms hold exactly those latencies, the other kinds
+    nothing, and a request still in flight is not counted yet.
+
+--*/
+{
+    const LONGLONG ids[] = { 0x2a, 0x2b };
+    const UCHAR data[] = { 0x10, 0x20, 0x30 };
+    const ULONG reads[] = { 250, 7, 1000000 };
+    const ULONG writes[] = { 12, 3000 };
+    const ULONG sequences1[] = { 40 };
+    const ULONG sequencesN[] = { 15, 16, 17 };
+    SPB_PROBE_LATENCY latency;
+    WDFDEVICE device;
+    SPBTARGET target;
+    WDFREQUEST request;
+
+    // A request arriving at tick 0 would not be stamped.
+    s_Now = TEST_TICKS_PER_US;
+    HostClockSet(s_Now);
+
+    device = HostDeviceAdd(nullptr, 0);
+    CHECK(device != nullptr);
+    CHECK_EQ(HostDeviceStart(device, ids, ARRAYSIZE(ids)), STATUS_SUCCESS);
+
+    target = HostTargetConnect(device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(target != nullptr);
+
+    CHECK_EQ(TestQuery(target, MAXULONG, sizeof(latency), &latency), STATUS_SUCCESS);
+
+    for (ULONG kind = 0; kind < SPB_PROBE_KIND_COUNT; kind++)
+    {
+        TestHistogram(&latency.Histograms[kind], nullptr, 0);
+    }
+
+    request = HostSubmitRead(target, 4);
+    TestComplete(request, reads[0], STATUS_SUCCESS);
+    request = HostSubmitRead(target, 1);
+    TestComplete(request, reads[1], STATUS_IO_DEVICE_ERROR);
+
+    request = HostSubmitWrite(target, data, sizeof(data));
+    TestComplete(request, writes[0], STATUS_SUCCESS);
+    request = HostSubmitWrite(target, data, 1);
+    TestComplete(request, writes[1], STATUS_SUCCESS);
+
+    HOST_TRANSFER transfers[] =
+    {
+        { SpbTransferDirectionToDevice, 0, 1, data },
+        { SpbTransferDirectionFromDevice, 0, 2, nullptr },
+    };
+
+    request = HostSubmitSequence(target, transfers, 1);
+    TestComplete(request, sequences1[0], STATUS_SUCCESS);
+
+    for (ULONG i = 0; i < ARRAYSIZE(sequencesN); i++)
+    {
+        request = HostSubmitSequence(target, transfers, ARRAYSIZE(transfers));
+        TestComplete(request, sequencesN[i], STATUS_SUCCESS);
+    }
+
+    // Still in flight, and not counted.
+    request = HostSubmitRead(target, 2);
+
+    CHECK_EQ(TestQuery(target, MAXULONG, sizeof(latency), &latency), STATUS_SUCCESS);
+
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_READ], reads, 2);
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_WRITE], writes, ARRAYSIZE(writes));
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_SEQUENCE_1], sequences1, ARRAYSIZE(sequences1));
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_SEQUENCE_N], sequencesN, ARRAYSIZE(sequencesN));
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_FULL_DUPLEX], nullptr, 0);
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_LOCK], nullptr, 0);
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_UNLOCK], nullptr, 0);
+
+    // Queries are not counted as requests of their own.
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_OTHER], nullptr, 0);
+
+    TestComplete(request, reads[2], STATUS_SUCCESS);
+
+    // Index 0 is the first connection, as without an index.
+    CHECK_EQ(TestQuery(target, 0, sizeof(latency), &latency), STATUS_SUCCESS);
+    TestHistogram(&latency.Histograms[SPB_PROBE_KIND_READ], reads, ARRAYSIZE(reads));
+
+    // The second connection saw nothing.
+    CHECK_EQ(TestQuery(target, 1, sizeof(latency), &latency), STATUS_SUCCESS);
+
+    for (ULONG kind = 0; kind < SPB_PROBE_KIND_COUNT; kind++)
+    {
+        TestHistogram(&latency.Histograms[kind], nullptr, 0);
+    }
+
+    CHECK_EQ(TestQuery(target, 2, sizeof(latency), &latency), STATUS_INVALID_PARAMETER);
+    CHECK(!NT_SUCCESS(TestQuery(target, MAXULONG, sizeof(latency) - 1, &latency)));
+
+    CHECK_EQ(HostControllerPending(), 0);
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+
+    CHECK_EQ(g_HostCounters.ObjectCreates, g_HostCounters.ObjectDeletes);
+    CHECK_EQ(g_HostCounters.PoolAllocations, g_HostCounters.PoolFrees);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestLatency();
+
+    return HostTestReport("latency_test");
+}
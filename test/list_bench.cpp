@@ -0,0 +1,156 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    list_bench.cpp
+
+Abstract:
+
+    This module counts the allocations the driver makes for each
+    request sent with a transfer list, a full duplex transfer and
+    sequences of one and two transfers, and times the requests
+    against the mock controller of host/wdfhost.h completing every
+    transfer as it is sent.
+
+    Every framework object, memory object and pool block the driver
+    creates while the requests run is counted, after a first round
+    that lets one-time allocations happen.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+
+#define ROUNDS      25
+#define ITERATIONS  20000
+
+static const UCHAR s_Register[] = { 0x10, 0x20, 0x30, 0x40 };
+
+typedef struct BENCH_KIND
+{
+    const CHAR* Name;
+    WDFREQUEST Request;
+    double Best;
+    ULONGLONG Objects;
+    ULONGLONG Memories;
+    ULONGLONG Pool;
+}
+BENCH_KIND;
+
+static
+double
+BenchRequest(
+    _In_  WDFREQUEST  Request
+    )
+{
+    double start = HostNow();
+
+    for (ULONG i = 0; i < ITERATIONS; i++)
+    {
+        HostRequestResubmit(Request);
+        HOST_KEEP(Request);
+    }
+
+    return (HostNow() - start) / ITERATIONS;
+}
+
+int
+main(
+    VOID
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureMode", 0, nullptr, 0 },
+    };
+    const HOST_TRANSFER sequence[] =
+    {
+        { SpbTransferDirectionToDevice, 0, 1, s_Register },
+        { SpbTransferDirectionFromDevice, 0, 2, nullptr },
+    };
+    const LONGLONG id = 1;
+    BENCH_KIND kinds[3];
+    WDFDEVICE device;
+    SPBTARGET target;
+
+    HostWireSetLogging(FALSE);
+    HostControllerSetInline(TRUE);
+
+    device = HostDeviceAdd(values, ARRAYSIZE(values));
+    HostDeviceStart(device, &id, 1);
+    target = HostTargetConnect(device, HOST_BUS_I2C, 0x50, 400000);
+
+    kinds[0].Name = "full duplex 4+4 bytes";
+    kinds[0].Request = HostSubmitFullDuplex(target, s_Register, sizeof(s_Register), 4);
+    kinds[1].Name = "sequence of 1 transfer";
+    kinds[1].Request = HostSubmitSequence(target, sequence, 1);
+    kinds[2].Name = "sequence of 2 transfers";
+    kinds[2].Request = HostSubmitSequence(target, sequence, 2);
+
+    for (ULONG i = 0; i < ARRAYSIZE(kinds); i++)
+    {
+        kinds[i].Best = 1e300;
+        kinds[i].Objects = 0;
+        kinds[i].Memories = 0;
+        kinds[i].Pool = 0;
+    }
+
+    for (ULONG round = 0; round < ROUNDS; round++)
+    {
+        for (ULONG i = 0; i < ARRAYSIZE(kinds); i++)
+        {
+            HOST_COUNTERS before = g_HostCounters;
+            double time = BenchRequest(kinds[i].Request);
+
+            if (!HostRequestCompleted(kinds[i].Request) ||
+                !NT_SUCCESS(HostRequestStatus(kinds[i].Request)))
+            {
+                printf("list_bench: %s failed\n", kinds[i].Name);
+                return 1;
+            }
+
+            if (round == 0)
+            {
+                continue;
+            }
+
+            kinds[i].Objects += g_HostCounters.ObjectCreates - before.ObjectCreates;
+            kinds[i].Memories += g_HostCounters.MemoryCreates - before.MemoryCreates;
+            kinds[i].Pool += g_HostCounters.PoolAllocations - before.PoolAllocations;
+
+            if (time < kinds[i].Best)
+            {
+                kinds[i].Best = time;
+            }
+        }
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(kinds); i++)
+    {
+        double requests = (double)(ROUNDS - 1) * ITERATIONS;
+
+        printf("list_bench: %s: %.1f ns per request, %.2f objects (%.2f memory), "
+            "%.2f pool blocks per request\n",
+            kinds[i].Name,
+            kinds[i].Best,
+            kinds[i].Objects / requests,
+            kinds[i].Memories / requests,
+            kinds[i].Pool / requests);
+
+        HostRequestFree(kinds[i].Request);
+    }
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    mdl_test.cpp
+
+Abstract:
+
+    This module checks the MDL span iterator of peripheral.h on
+    MDL chains built by hand: every split of a transfer across
+    MDLs, empty MDLs included, reads back the bytes RequestGetByte
+    returns one at a time, each MDL is mapped once, skipped MDLs
+    are not mapped, a transfer shorter than its chain stops at its
+    length and an MDL which cannot be mapped stops the walk.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "internal.h"
+#include "peripheral.h"
+
+#define TEST_LENGTH     64
+#define TEST_MAX_MDLS   8
+
+static UCHAR s_Data[TEST_LENGTH];
+
+typedef struct TEST_CHAIN
+{
+    MDL Mdls[TEST_MAX_MDLS];
+    ULONG Count;
+}
+TEST_CHAIN;
+
+//
+// Splits s_Data across Count MDLs of the lengths given, the
+// lengths adding up to at most TEST_LENGTH.
+//
+
+static
+PMDL
+TestChainInit(
+    TEST_CHAIN*     pChain,
+    const ULONG*    pLengths,
+    ULONG           Count
+    )
+{
+    ULONG offset = 0;
+
+    pChain->Count = Count;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        pChain->Mdls[i].Next = (i + 1 < Count) ? &pChain->Mdls[i + 1] : nullptr;
+        pChain->Mdls[i].ByteCount = pLengths[i];
+        pChain->Mdls[i].MappedSystemVa = &s_Data[offset];
+        offset += pLengths[i];
+    }
+
+    return &pChain->Mdls[0];
+}
+
+static
+VOID
+TestCopy(
+    const ULONG*    pLengths,
+    ULONG           Count,
+    size_t          Length
+    )
+/*++
+
+  Routine Description:
+
+    Copies a transfer of Length bytes in one call, then in spans
+    of every size from 1 to 7 bytes, and compares both with the
+    bytes RequestGetByte reads.
+
+--*/
+{
+    TEST_CHAIN chain;
+    PMDL pMdl = TestChainInit(&chain, pLengths, Count);
+    MDL_SPAN_ITERATOR span;
+    UCHAR copy[TEST_LENGTH];
+    size_t copied;
+    ULONG holding = 0;
+    size_t offset = 0;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        holding += (pLengths[i] != 0 && offset < Length) ? 1 : 0;
+        offset += pLengths[i];
+    }
+
+    ULONGLONG mappings = g_HostCounters.MdlMappings;
+
+    MdlSpanIteratorInit(&span, pMdl, Length);
+    CHECK_EQ(MdlSpanCopy(&span, copy, Length, &copied), STATUS_SUCCESS);
+    CHECK_EQ(copied, Length);
+    CHECK(memcmp(copy, s_Data, Length) == 0);
+
+    // The MDLs holding the transfer are mapped once each.
+    CHECK_EQ(g_HostCounters.MdlMappings - mappings, holding);
+
+    // Nothing is left past the transfer.
+    PUCHAR pSpan;
+    size_t spanLength;
+
+    CHECK_EQ(MdlSpanIteratorNext(&span, 1, &pSpan, &spanLength), STATUS_NO_MORE_ENTRIES);
+    CHECK(pSpan == nullptr);
+    CHECK_EQ(spanLength, 0);
+
+    for (size_t step = 1; step < 8; step++)
+    {
+        offset = 0;
+
+        memset(copy, 0, sizeof(copy));
+        MdlSpanIteratorInit(&span, pMdl, Length);
+
+        while (offset < Length)
+        {
+            size_t chunk = min(step, Length - offset);
+
+            CHECK_EQ(MdlSpanCopy(&span, &copy[offset], chunk, &copied), STATUS_SUCCESS);
+            CHECK_EQ(copied, chunk);
+            offset += chunk;
+        }
+
+        CHECK(memcmp(copy, s_Data, Length) == 0);
+    }
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        UCHAR byte = 0;
+
+        CHECK_EQ(RequestGetByte(pMdl, Length, i, &byte), STATUS_SUCCESS);
+        CHECK_EQ(byte, s_Data[i]);
+    }
+
+    UCHAR byte;
+
+    CHECK_EQ(RequestGetByte(pMdl, Length, Length, &byte), STATUS_INFO_LENGTH_MISMATCH);
+}
+
+static
+VOID
+TestSplits(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Every split of a 9 byte transfer across three MDLs, each of
+    0 to 9 bytes, with the transfer ending anywhere in the chain.
+
+--*/
+{
+    for (ULONG a = 0; a <= 9; a++)
+    {
+        for (ULONG b = 0; a + b <= 9; b++)
+        {
+            ULONG lengths[] = { a, b, 9 - a - b };
+
+            for (size_t length = 0; length <= 9; length++)
+            {
+                TestCopy(lengths, ARRAYSIZE(lengths), length);
+            }
+        }
+    }
+
+    // Longer chains, with empty MDLs in between.
+    const ULONG lengths[] = { 5, 0, 0, 17, 1, 0, 30, 11 };
+
+    TestCopy(lengths, ARRAYSIZE(lengths), TEST_LENGTH);
+    TestCopy(lengths, ARRAYSIZE(lengths), 23);
+}
+
+static
+VOID
+TestSkip(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Skipping the middle of a transfer, as head-tail truncation
+    does, lands on the right byte and never maps the MDLs it
+    skips entirely.
+
+--*/
+{
+    const ULONG lengths[] = { 4, 8, 8, 8, 4 };
+    TEST_CHAIN chain;
+    PMDL pMdl = TestChainInit(&chain, lengths, ARRAYSIZE(lengths));
+    MDL_SPAN_ITERATOR span;
+    UCHAR head[6];
+    UCHAR tail[6];
+    size_t copied;
+
+    ULONGLONG mappings = g_HostCounters.MdlMappings;
+
+    MdlSpanIteratorInit(&span, pMdl, 32);
+    CHECK_EQ(MdlSpanCopy(&span, head, sizeof(head), &copied), STATUS_SUCCESS);
+    MdlSpanSkip(&span, 32 - 2 * sizeof(tail));
+    CHECK_EQ(MdlSpanCopy(&span, tail, sizeof(tail), &copied), STATUS_SUCCESS);
+    CHECK_EQ(copied, sizeof(tail));
+
+    CHECK(memcmp(head, &s_Data[0], sizeof(head)) == 0);
+    CHECK(memcmp(tail, &s_Data[32 - sizeof(tail)], sizeof(tail)) == 0);
+
+    // The first two MDLs for the head, the last two for the tail.
+    CHECK_EQ(g_HostCounters.MdlMappings - mappings, 4);
+
+    // A skip past the end stops at the end of the transfer.
+    MdlSpanIteratorInit(&span, pMdl, 10);
+    MdlSpanSkip(&span, 100);
+    CHECK_EQ(span.Remaining, 0);
+    CHECK_EQ(MdlSpanCopy(&span, head, 1, &copied), STATUS_NO_MORE_ENTRIES);
+    CHECK_EQ(copied, 0);
+}
+
+static
+VOID
+TestShortChain(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A transfer longer than its MDL chain copies what the chain
+    holds, and an MDL which cannot be mapped stops the copy with
+    STATUS_INSUFFICIENT_RESOURCES after the bytes before it.
+
+--*/
+{
+    const ULONG lengths[] = { 3, 5 };
+    TEST_CHAIN chain;
+    PMDL pMdl = TestChainInit(&chain, lengths, ARRAYSIZE(lengths));
+    MDL_SPAN_ITERATOR span;
+    UCHAR copy[16];
+    size_t copied;
+
+    MdlSpanIteratorInit(&span, pMdl, sizeof(copy));
+    CHECK_EQ(MdlSpanCopy(&span, copy, sizeof(copy), &copied), STATUS_NO_MORE_ENTRIES);
+    CHECK_EQ(copied, 8);
+    CHECK(memcmp(copy, s_Data, 8) == 0);
+
+    chain.Mdls[1].MappedSystemVa = nullptr;
+
+    MdlSpanIteratorInit(&span, pMdl, 8);
+    CHECK_EQ(MdlSpanCopy(&span, copy, 8, &copied), STATUS_INSUFFICIENT_RESOURCES);
+    CHECK_EQ(copied, 3);
+
+    UCHAR byte;
+
+    CHECK_EQ(RequestGetByte(pMdl, 8, 2, &byte), STATUS_SUCCESS);
+    CHECK_EQ(RequestGetByte(pMdl, 8, 3, &byte), STATUS_INFO_LENGTH_MISMATCH);
+}
+
+static
+VOID
+TestInline(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    An iterator over a copy of the transfer hands it out as one
+    span, bounded by MaxLength, and never maps anything.
+
+--*/
+{
+    MDL_SPAN_ITERATOR span;
+    PUCHAR pSpan;
+    size_t spanLength;
+    UCHAR copy[TEST_LENGTH];
+    size_t copied;
+
+    ULONGLONG mappings = g_HostCounters.MdlMappings;
+
+    MdlSpanIteratorInitInline(&span, s_Data, 20);
+
+    CHECK_EQ(MdlSpanIteratorNext(&span, 8, &pSpan, &spanLength), STATUS_SUCCESS);
+    CHECK(pSpan == &s_Data[0]);
+    CHECK_EQ(spanLength, 8);
+
+    MdlSpanSkip(&span, 2);
+
+    CHECK_EQ(MdlSpanCopy(&span, copy, sizeof(copy), &copied), STATUS_NO_MORE_ENTRIES);
+    CHECK_EQ(copied, 10);
+    CHECK(memcmp(copy, &s_Data[10], 10) == 0);
+
+    CHECK_EQ(g_HostCounters.MdlMappings, mappings);
+}
+
+int
+main(
+    VOID
+    )
+{
+    for (ULONG i = 0; i < TEST_LENGTH; i++)
+    {
+        s_Data[i] = (UCHAR)(0x80 + i * 7);
+    }
+
+    TestSplits();
+    TestSkip();
+    TestShortChain();
+    TestInline();
+
+    return HostTestReport("mdl_test");
+}
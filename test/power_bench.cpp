@@ -0,0 +1,219 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    power_bench.cpp
+
+Abstract:
+
+    This module measures the power transitions of the device under
+    each IdlePolicy, and the latency they add to the reads of a
+    client, on the virtual clock of host/wdfhost.h.
+
+    The client keeps a target connected and a capture channel
+    attached. It sends BURST_READS reads READ_PERIOD apart, then
+    stays quiet for BURST_GAP, longer than the idle timeout, after
+    which the device idles out of D0 if nothing holds it there. A
+    read reaching the device out of D0 waits RESUME_LATENCY for the
+    device to come back before its BUS_TIME on the bus. The resume
+    latency is a model, the mock itself powers up instantly.
+
+    The performance policy is also measured without a channel, when
+    it behaves as the client policy.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "spbprobe.h"
+
+// Times in 100 ns ticks of the virtual clock. The idle timeout is
+// the one the device asks for while the monitor is on.
+#define IDLE_TIMEOUT        (2000 * 10000LL)
+#define RESUME_LATENCY      (5 * 10000LL)
+#define BUS_TIME            200
+#define READ_PERIOD         (1 * 10000LL)
+#define BURST_GAP           (5000 * 10000LL)
+
+#define BURST_READS         16
+#define BURSTS              200
+
+#define CHANNEL_LENGTH      (64 * 1024)
+
+typedef struct BENCH_POLICY
+{
+    const CHAR* Name;
+    ULONG IdlePolicy;
+    BOOLEAN Channel;
+}
+BENCH_POLICY;
+
+static const BENCH_POLICY s_Policies[] =
+{
+    { "connected", 0, TRUE },
+    { "client", 1, TRUE },
+    { "performance", 2, TRUE },
+    { "performance, no channel", 2, FALSE },
+};
+
+static
+BOOLEAN
+BenchPolicy(
+    _In_  const BENCH_POLICY*  pPolicy
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"IdlePolicy", pPolicy->IdlePolicy, nullptr, 0 },
+    };
+    const LONGLONG id = 1;
+    LONGLONG now = 0;
+    LONGLONG idleSince = 0;
+    LONGLONG idleTime = 0;
+    LONGLONG firstTotal = 0;
+    LONGLONG firstMax = 0;
+    LONGLONG otherMax = 0;
+    ULONGLONG entries;
+    ULONGLONG exits;
+    WDFDEVICE device;
+    SPBTARGET target;
+    WDFREQUEST channel = nullptr;
+    WDFREQUEST request;
+
+    HostClockSet(0);
+
+    device = HostDeviceAdd(values, ARRAYSIZE(values));
+    HostDeviceStart(device, &id, 1);
+    target = HostTargetConnect(device, HOST_BUS_I2C, 0x50, 400000);
+
+    if (pPolicy->Channel)
+    {
+        channel = HostSubmitIoctl(target, IOCTL_SPB_PROBE_MAP_CAPTURE, nullptr, 0, CHANNEL_LENGTH);
+
+        if (HostRequestCompleted(channel))
+        {
+            printf("power_bench: %s: channel not attached, %08lx\n",
+                pPolicy->Name,
+                (unsigned long)HostRequestStatus(channel));
+            return FALSE;
+        }
+    }
+
+    request = HostSubmitRead(target, 4);
+    HostControllerComplete(STATUS_SUCCESS);
+
+    entries = g_HostCounters.D0Entries;
+    exits = g_HostCounters.D0Exits;
+
+    for (ULONG burst = 0; burst < BURSTS; burst++)
+    {
+        //
+        // The idle timeout runs out during the gap.
+        //
+
+        now += IDLE_TIMEOUT;
+        HostClockSet(now);
+
+        if (HostDeviceIdle(device))
+        {
+            idleSince = now;
+        }
+
+        now += BURST_GAP - IDLE_TIMEOUT;
+
+        for (ULONG i = 0; i < BURST_READS; i++)
+        {
+            BOOLEAN wasInD0 = HostDeviceInD0(device);
+            LONGLONG latency;
+
+            HostClockSet(now);
+            HostRequestResubmit(request);
+
+            if (!wasInD0)
+            {
+                idleTime += now - idleSince;
+            }
+
+            latency = (wasInD0 ? 0 : RESUME_LATENCY) + BUS_TIME;
+
+            HostClockSet(now + latency);
+
+            if (!HostControllerComplete(STATUS_SUCCESS) ||
+                !HostRequestCompleted(request) ||
+                !NT_SUCCESS(HostRequestStatus(request)))
+            {
+                printf("power_bench: %s: read failed\n", pPolicy->Name);
+                return FALSE;
+            }
+
+            if (i == 0)
+            {
+                firstTotal += latency;
+                firstMax = max(firstMax, latency);
+            }
+            else
+            {
+                otherMax = max(otherMax, latency);
+            }
+
+            now += READ_PERIOD;
+        }
+    }
+
+    printf("power_bench: %-23s: %.2f D0 entries, %.2f exits per burst, "
+        "first read %.1f us (max %.1f us), others max %.1f us, out of D0 %.0f%%\n",
+        pPolicy->Name,
+        (double)(g_HostCounters.D0Entries - entries) / BURSTS,
+        (double)(g_HostCounters.D0Exits - exits) / BURSTS,
+        firstTotal / 10.0 / BURSTS,
+        firstMax / 10.0,
+        otherMax / 10.0,
+        100.0 * idleTime / now);
+
+    if (channel != nullptr)
+    {
+        HostRequestCancel(channel);
+        HostRequestFree(channel);
+    }
+
+    HostRequestFree(request);
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+
+    return TRUE;
+}
+
+int
+main(
+    VOID
+    )
+{
+    HostWireSetLogging(FALSE);
+
+    printf("power_bench: %u reads %lld ms apart every %lld s, idle timeout %lld s, "
+        "resume %lld ms\n",
+        BURST_READS,
+        (long long)(READ_PERIOD / 10000),
+        (long long)(BURST_GAP / 10000000),
+        (long long)(IDLE_TIMEOUT / 10000000),
+        (long long)(RESUME_LATENCY / 10000));
+
+    for (ULONG i = 0; i < ARRAYSIZE(s_Policies); i++)
+    {
+        if (!BenchPolicy(&s_Policies[i]))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
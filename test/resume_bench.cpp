@@ -0,0 +1,167 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    resume_bench.cpp
+
+Abstract:
+
+    This module times the first read after the device comes back
+    to D0, against the mock controller of host/wdfhost.h completing
+    every transfer as it is sent, and counts the framework work the
+    resume costs.
+
+    A cycle disconnects the target, lets the device idle out of D0,
+    then connects a target again, which brings the device back to
+    D0, and sends a read. The same cycle without the idle, the
+    device staying in D0, gives the cost of the connect and the
+    read alone.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+
+#define ROUNDS      25
+#define ITERATIONS  2000
+
+typedef struct BENCH_CYCLE
+{
+    const CHAR* Name;
+    BOOLEAN Idle;
+    double Best;
+    HOST_COUNTERS Counts;
+}
+BENCH_CYCLE;
+
+static
+BOOLEAN
+BenchCycle(
+    _In_    WDFDEVICE      Device,
+    _Inout_ SPBTARGET*     pTarget,
+    _Inout_ BENCH_CYCLE*   pCycle
+    )
+{
+    HOST_COUNTERS before;
+    double time = 0;
+
+    for (ULONG i = 0; i < ITERATIONS; i++)
+    {
+        WDFREQUEST request;
+        double start;
+
+        HostTargetDisconnect(*pTarget);
+
+        if (pCycle->Idle && !HostDeviceIdle(Device))
+        {
+            printf("resume_bench: device did not idle\n");
+            return FALSE;
+        }
+
+        before = g_HostCounters;
+        start = HostNow();
+
+        *pTarget = HostTargetConnect(Device, HOST_BUS_I2C, 0x50, 400000);
+        request = HostSubmitRead(*pTarget, 4);
+
+        time += HostNow() - start;
+
+        if (!HostRequestCompleted(request) ||
+            !NT_SUCCESS(HostRequestStatus(request)))
+        {
+            printf("resume_bench: %s: read failed, %08lx\n",
+                pCycle->Name,
+                (unsigned long)HostRequestStatus(request));
+            return FALSE;
+        }
+
+        HostRequestFree(request);
+
+        pCycle->Counts.D0Entries += g_HostCounters.D0Entries - before.D0Entries;
+        pCycle->Counts.ObjectCreates += g_HostCounters.ObjectCreates - before.ObjectCreates;
+        pCycle->Counts.TargetCreates += g_HostCounters.TargetCreates - before.TargetCreates;
+        pCycle->Counts.TargetOpens += g_HostCounters.TargetOpens - before.TargetOpens;
+        pCycle->Counts.TargetStarts += g_HostCounters.TargetStarts - before.TargetStarts;
+    }
+
+    time /= ITERATIONS;
+
+    if (time < pCycle->Best)
+    {
+        pCycle->Best = time;
+    }
+
+    return TRUE;
+}
+
+int
+main(
+    VOID
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CaptureMode", 0, nullptr, 0 },
+    };
+    const LONGLONG id = 1;
+    BENCH_CYCLE cycles[2] = {};
+    WDFDEVICE device;
+    SPBTARGET target;
+
+    HostWireSetLogging(FALSE);
+    HostControllerSetInline(TRUE);
+
+    device = HostDeviceAdd(values, ARRAYSIZE(values));
+    HostDeviceStart(device, &id, 1);
+    target = HostTargetConnect(device, HOST_BUS_I2C, 0x50, 400000);
+
+    cycles[0].Name = "reconnect in D0";
+    cycles[0].Idle = FALSE;
+    cycles[1].Name = "reconnect after idle";
+    cycles[1].Idle = TRUE;
+
+    for (ULONG i = 0; i < ARRAYSIZE(cycles); i++)
+    {
+        cycles[i].Best = 1e300;
+    }
+
+    for (ULONG round = 0; round < ROUNDS; round++)
+    {
+        for (ULONG i = 0; i < ARRAYSIZE(cycles); i++)
+        {
+            if (!BenchCycle(device, &target, &cycles[i]))
+            {
+                return 1;
+            }
+        }
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(cycles); i++)
+    {
+        double count = (double)ROUNDS * ITERATIONS;
+
+        printf("resume_bench: %s: %.1f ns to the first read, %.2f D0 entries, "
+            "%.2f objects, %.2f targets created, %.2f opened, %.2f started\n",
+            cycles[i].Name,
+            cycles[i].Best,
+            cycles[i].Counts.D0Entries / count,
+            cycles[i].Counts.ObjectCreates / count,
+            cycles[i].Counts.TargetCreates / count,
+            cycles[i].Counts.TargetOpens / count,
+            cycles[i].Counts.TargetStarts / count);
+    }
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    ring_test.cpp
+
+Abstract:
+
+    This module checks the capture ring of capture.cpp through
+    SpbCaptureReserve, SpbCaptureCommit and SpbCaptureDrain on a
+    device with a capture channel attached: an entry reserved but
+    not committed holds back the drain and the records after it,
+    a full ring drops the record and reports it in the channel,
+    drained space is reserved again, an entry which does not fit
+    before the end of the ring is padded over to its start, a
+    record bigger than the ring is dropped, and the records reach
+    the channel when the drain work item runs.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "internal.h"
+#include "capture.h"
+
+#define TEST_CONNECTION_ID  0x2a
+#define TEST_ADDRESS        0x50
+
+// Room for a full ring of records, the data area of the channel
+// being the largest power of two fitting after its header.
+#define TEST_CHANNEL_LENGTH (256 * 1024)
+
+// Ring entries of TEST_ENTRY_SIZE bytes, header included.
+#define TEST_ENTRY_SIZE     1024
+#define TEST_RECORD_SIZE    (TEST_ENTRY_SIZE - sizeof(PBC_CAPTURE_ENTRY))
+#define TEST_RING_ENTRIES   (CAPTURE_RING_SIZE / TEST_ENTRY_SIZE)
+
+#define TEST_MAX_RECORDS    (2 * TEST_RING_ENTRIES)
+
+C_ASSERT(TEST_RECORD_SIZE <= sizeof(SPB_PROBE_RECORD) + SPB_PROBE_RECORD_MAX_PAYLOAD);
+
+typedef struct TEST_RING
+{
+    WDFDEVICE Device;
+    SPBTARGET Target;
+    WDFREQUEST Channel;
+    PPBC_DEVICE pDevice;
+    PPBC_CAPTURE_RING pRing;
+
+    // TransferLength of the records read, in order.
+    ULONG RecordCount;
+    ULONG Records[TEST_MAX_RECORDS];
+}
+TEST_RING;
+
+static
+VOID
+TestRingOpen(
+    TEST_RING*  pTest
+    )
+{
+    const LONGLONG id = TEST_CONNECTION_ID;
+
+    memset(pTest, 0, sizeof(*pTest));
+
+    pTest->Device = HostDeviceAdd(nullptr, 0);
+    CHECK(pTest->Device != nullptr);
+    CHECK_EQ(HostDeviceStart(pTest->Device, &id, 1), STATUS_SUCCESS);
+
+    pTest->Target = HostTargetConnect(pTest->Device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(pTest->Target != nullptr);
+
+    pTest->Channel = HostSubmitIoctl(
+        pTest->Target,
+        IOCTL_SPB_PROBE_MAP_CAPTURE,
+        nullptr,
+        0,
+        TEST_CHANNEL_LENGTH);
+
+    CHECK(!HostRequestCompleted(pTest->Channel));
+
+    pTest->pDevice = GetDeviceContext(pTest->Device);
+
+    // One processor on the host, so one ring.
+    CHECK_EQ(pTest->pDevice->Capture.RingCount, 1);
+    pTest->pRing = &pTest->pDevice->Capture.pRings[0];
+
+    CHECK_EQ(pTest->pRing->Head, 0);
+    CHECK_EQ(pTest->pRing->Tail, 0);
+}
+
+static
+VOID
+TestRingClose(
+    TEST_RING*  pTest
+    )
+{
+    HostRequestCancel(pTest->Channel);
+    CHECK_EQ(HostRequestStatus(pTest->Channel), STATUS_CANCELLED);
+    HostRequestFree(pTest->Channel);
+
+    HostTargetDisconnect(pTest->Target);
+    HostDeviceRemove(pTest->Device);
+
+    CHECK_EQ(g_HostCounters.ObjectCreates, g_HostCounters.ObjectDeletes);
+    CHECK_EQ(g_HostCounters.PoolAllocations, g_HostCounters.PoolFrees);
+}
+
+//
+// Reserves a record of Size bytes tagged with Tag, left to the
+// caller to commit. Returns NULL if the record was dropped.
+//
+
+static
+PSPB_PROBE_RECORD
+TestReserve(
+    TEST_RING*  pTest,
+    ULONG       Size,
+    ULONG       Tag
+    )
+{
+    PSPB_PROBE_RECORD pRecord = SpbCaptureReserve(pTest->pDevice, Size);
+
+    if (pRecord != nullptr)
+    {
+        // The space comes back zeroed from the drain.
+        CHECK_EQ(((PPBC_CAPTURE_ENTRY)pRecord - 1)->State, PBC_CAPTURE_ENTRY_FREE);
+
+        memset(pRecord, 0, Size);
+        pRecord->Size = Size;
+        pRecord->Version = SPB_PROBE_RECORD_VERSION;
+        pRecord->Type = SPB_PROBE_RECORD_TYPE_TRANSFER;
+        pRecord->TransferLength = Tag;
+    }
+
+    return pRecord;
+}
+
+static
+VOID
+TestOnRecord(
+    PVOID                    Context,
+    const SPB_PROBE_RECORD*  pRecord
+    )
+{
+    TEST_RING* pTest = (TEST_RING*)Context;
+
+    CHECK_EQ(pRecord->Type, SPB_PROBE_RECORD_TYPE_TRANSFER);
+
+    if (pTest->RecordCount == TEST_MAX_RECORDS)
+    {
+        CHECK(!"too many records");
+        return;
+    }
+
+    pTest->Records[pTest->RecordCount++] = pRecord->TransferLength;
+}
+
+//
+// Reads the channel, the records read are appended to
+// pTest->Records. Returns how many were read.
+//
+
+static
+ULONG
+TestChannelRead(
+    TEST_RING*  pTest
+    )
+{
+    PSPB_PROBE_CHANNEL pChannel =
+        (PSPB_PROBE_CHANNEL)HostRequestData(pTest->Channel, 0);
+
+    CHECK_EQ(pChannel->Magic, SPB_PROBE_CHANNEL_MAGIC);
+    CHECK_EQ(pChannel->Dropped, pTest->pRing->Dropped);
+
+    return SpbProbeChannelRead(pChannel, TestOnRecord, pTest);
+}
+
+static
+ULONG
+TestDrain(
+    TEST_RING*  pTest
+    )
+{
+    SpbCaptureDrain(pTest->pDevice);
+
+    return TestChannelRead(pTest);
+}
+
+static
+VOID
+TestCommitOrder(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A record committed after a reserved one waits for it: the
+    drain stops at the uncommitted entry and hands both over in
+    reservation order once it is committed.
+
+--*/
+{
+    TEST_RING test;
+
+    TestRingOpen(&test);
+
+    PSPB_PROBE_RECORD pFirst = TestReserve(&test, TEST_RECORD_SIZE, 1);
+    PSPB_PROBE_RECORD pSecond = TestReserve(&test, TEST_RECORD_SIZE, 2);
+
+    CHECK(pFirst != nullptr);
+    CHECK(pSecond != nullptr);
+    CHECK_EQ(test.pRing->Head, 2 * TEST_ENTRY_SIZE);
+
+    SpbCaptureCommit(pSecond);
+
+    CHECK_EQ(TestDrain(&test), 0);
+    CHECK_EQ(test.pRing->Tail, 0);
+
+    SpbCaptureCommit(pFirst);
+
+    CHECK_EQ(TestDrain(&test), 2);
+    CHECK_EQ(test.Records[0], 1);
+    CHECK_EQ(test.Records[1], 2);
+    CHECK_EQ(test.pRing->Tail, test.pRing->Head);
+
+    // Nothing is drained twice.
+    CHECK_EQ(TestDrain(&test), 0);
+
+    TestRingClose(&test);
+}
+
+static
+VOID
+TestFull(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Once the ring is full a reservation fails and is counted as
+    dropped, which the drain reports in the channel. The drained
+    space is reserved again.
+
+--*/
+{
+    PSPB_PROBE_RECORD pRecord;
+    TEST_RING test;
+
+    TestRingOpen(&test);
+
+    for (ULONG i = 0; i < TEST_RING_ENTRIES; i++)
+    {
+        pRecord = TestReserve(&test, TEST_RECORD_SIZE, i);
+        CHECK(pRecord != nullptr);
+
+        if (pRecord != nullptr)
+        {
+            SpbCaptureCommit(pRecord);
+        }
+    }
+
+    CHECK_EQ(test.pRing->Head, CAPTURE_RING_SIZE);
+
+    // Not even the smallest record fits anymore.
+    CHECK(TestReserve(&test, sizeof(SPB_PROBE_RECORD), 0) == nullptr);
+    CHECK_EQ(test.pRing->Dropped, 1);
+    CHECK_EQ(test.pRing->Head, CAPTURE_RING_SIZE);
+
+    CHECK_EQ(TestDrain(&test), TEST_RING_ENTRIES);
+    CHECK_EQ(test.pRing->Tail, CAPTURE_RING_SIZE);
+
+    for (ULONG i = 0; i < TEST_RING_ENTRIES; i++)
+    {
+        CHECK_EQ(test.Records[i], i);
+    }
+
+    // The drained space is free again, and zeroed.
+    for (ULONG i = 0; i < CAPTURE_RING_SIZE; i++)
+    {
+        if (test.pRing->pData[i] != 0)
+        {
+            CHECK(!"drained space not zeroed");
+            break;
+        }
+    }
+
+    pRecord = TestReserve(&test, TEST_RECORD_SIZE, 100);
+    CHECK(pRecord != nullptr);
+    CHECK(pRecord == (PSPB_PROBE_RECORD)(test.pRing->pData + sizeof(PBC_CAPTURE_ENTRY)));
+
+    if (pRecord != nullptr)
+    {
+        SpbCaptureCommit(pRecord);
+    }
+
+    CHECK_EQ(TestDrain(&test), 1);
+    CHECK_EQ(test.Records[TEST_RING_ENTRIES], 100);
+    CHECK_EQ(test.pRing->Dropped, 1);
+
+    TestRingClose(&test);
+}
+
+static
+VOID
+TestWrap(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    An entry which does not fit before the end of the ring starts
+    over at its beginning, the end being padded. The padding
+    counts against the free space, and never reaches the channel.
+
+--*/
+{
+    const ULONG last = TEST_RING_ENTRIES - 1;
+    PSPB_PROBE_RECORD pRecord;
+    TEST_RING test;
+
+    TestRingOpen(&test);
+
+    for (ULONG i = 0; i < last; i++)
+    {
+        pRecord = TestReserve(&test, TEST_RECORD_SIZE, i);
+        CHECK(pRecord != nullptr);
+
+        if (pRecord != nullptr)
+        {
+            SpbCaptureCommit(pRecord);
+        }
+    }
+
+    //
+    // One entry is left before the end of the ring. A double one
+    // would fit in the free space only without its padding.
+    //
+
+    CHECK(TestReserve(&test, TEST_ENTRY_SIZE + TEST_RECORD_SIZE, 0) == nullptr);
+    CHECK_EQ(test.pRing->Dropped, 1);
+    CHECK_EQ(test.pRing->Head, last * TEST_ENTRY_SIZE);
+
+    CHECK_EQ(TestDrain(&test), last);
+
+    pRecord = TestReserve(&test, TEST_ENTRY_SIZE + TEST_RECORD_SIZE, 200);
+    CHECK(pRecord == (PSPB_PROBE_RECORD)(test.pRing->pData + sizeof(PBC_CAPTURE_ENTRY)));
+    CHECK_EQ(test.pRing->Head, CAPTURE_RING_SIZE + 2 * TEST_ENTRY_SIZE);
+
+    // The padding is drained up to the uncommitted entry.
+    CHECK_EQ(TestDrain(&test), 0);
+    CHECK_EQ(test.pRing->Tail, CAPTURE_RING_SIZE);
+
+    if (pRecord != nullptr)
+    {
+        SpbCaptureCommit(pRecord);
+    }
+
+    CHECK_EQ(TestDrain(&test), 1);
+    CHECK_EQ(test.Records[last], 200);
+    CHECK_EQ(test.pRing->Tail, test.pRing->Head);
+
+    TestRingClose(&test);
+}
+
+static
+VOID
+TestOversize(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A record which cannot fit in an empty ring is dropped
+    without touching the ring.
+
+--*/
+{
+    TEST_RING test;
+
+    TestRingOpen(&test);
+
+    CHECK(SpbCaptureReserve(test.pDevice, CAPTURE_RING_SIZE) == nullptr);
+    CHECK_EQ(test.pRing->Dropped, 1);
+    CHECK_EQ(test.pRing->Head, 0);
+
+    // The largest one that fits takes the whole ring.
+    PSPB_PROBE_RECORD pRecord = TestReserve(
+        &test,
+        CAPTURE_RING_SIZE - sizeof(PBC_CAPTURE_ENTRY),
+        300);
+
+    CHECK(pRecord != nullptr);
+    CHECK_EQ(test.pRing->Head, CAPTURE_RING_SIZE);
+
+    if (pRecord != nullptr)
+    {
+        SpbCaptureCommit(pRecord);
+    }
+
+    CHECK_EQ(TestDrain(&test), 1);
+    CHECK_EQ(test.Records[0], 300);
+
+    TestRingClose(&test);
+}
+
+static
+VOID
+TestDrainWorkItem(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Scheduling the drain only queues its work item, once however
+    many times it is scheduled, and the records reach the channel
+    when the work item runs. A drain finding another one running
+    leaves the rings to it. A completed request schedules the
+    drain of its record.
+
+--*/
+{
+    PSPB_PROBE_RECORD pRecord;
+    TEST_RING test;
+
+    TestRingOpen(&test);
+
+    for (ULONG i = 0; i < 2; i++)
+    {
+        pRecord = TestReserve(&test, TEST_RECORD_SIZE, i + 1);
+        CHECK(pRecord != nullptr);
+
+        if (pRecord != nullptr)
+        {
+            SpbCaptureCommit(pRecord);
+        }
+    }
+
+    ULONGLONG runs = g_HostCounters.WorkItemRuns;
+
+    SpbCaptureScheduleDrain(test.pDevice);
+    SpbCaptureScheduleDrain(test.pDevice);
+
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs);
+    CHECK_EQ(TestChannelRead(&test), 0);
+    CHECK_EQ(test.pRing->Tail, 0);
+
+    HostRun();
+
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs + 1);
+    CHECK_EQ(TestChannelRead(&test), 2);
+    CHECK_EQ(test.Records[0], 1);
+    CHECK_EQ(test.Records[1], 2);
+
+    // Nothing is left queued.
+    HostRun();
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs + 1);
+
+    //
+    // The work item running while another consumer drains the
+    // rings returns without touching them.
+    //
+
+    pRecord = TestReserve(&test, TEST_RECORD_SIZE, 3);
+    CHECK(pRecord != nullptr);
+
+    if (pRecord != nullptr)
+    {
+        SpbCaptureCommit(pRecord);
+    }
+
+    test.pDevice->Capture.Draining = 1;
+
+    SpbCaptureScheduleDrain(test.pDevice);
+    HostRun();
+
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs + 2);
+    CHECK_EQ(TestChannelRead(&test), 0);
+    CHECK_EQ(test.pRing->Tail, test.pRing->Head - TEST_ENTRY_SIZE);
+
+    test.pDevice->Capture.Draining = 0;
+
+    SpbCaptureScheduleDrain(test.pDevice);
+    HostRun();
+
+    CHECK_EQ(TestChannelRead(&test), 1);
+    CHECK_EQ(test.Records[2], 3);
+
+    //
+    // A read completed by the controller schedules one drain,
+    // run before the call completing it returns.
+    //
+
+    runs = g_HostCounters.WorkItemRuns;
+
+    WDFREQUEST request = HostSubmitRead(test.Target, 4);
+
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs);
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK(HostRequestCompleted(request));
+    HostRequestFree(request);
+
+    CHECK_EQ(g_HostCounters.WorkItemRuns, runs + 1);
+    CHECK_EQ(TestChannelRead(&test), 1);
+    CHECK_EQ(test.Records[3], 4);
+
+    CHECK_EQ(HostControllerPending(), 0);
+
+    TestRingClose(&test);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestCommitOrder();
+    TestFull();
+    TestWrap();
+    TestOversize();
+    TestDrainWorkItem();
+
+    return HostTestReport("ring_test");
+}
@@ -0,0 +1,262 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    sequence_test.cpp
+
+Abstract:
+
+    This module runs the driver against the mock controller of
+    host/wdfhost.h and checks the sequences it forwards, up to
+    FORWARD_MAX_TRANSFERS entries: every transfer reaches the wire
+    with its direction, delay and length, longer sequences are
+    failed without being sent, and a write held in a lock window
+    only rides along a sequence with room for it.
+
+Environment:
+
+    user-mode, host only
+
+Revision History:
+
+--*/
+
+#include "hostwin.h"
+#include "hosttest.h"
+#include "wdfhost.h"
+#include "internal.h"
+
+#define TEST_CONNECTION_ID  0x2a
+#define TEST_ADDRESS        0x50
+
+static UCHAR s_Data[FORWARD_MAX_TRANSFERS + 1];
+
+static
+WDFDEVICE
+TestDeviceOpen(
+    SPBTARGET*  pTarget
+    )
+{
+    const HOST_VALUE values[] =
+    {
+        { L"CoalesceLocks", 1, nullptr, 0 },
+        { L"QueueDepth", 2, nullptr, 0 },
+    };
+    const LONGLONG id = TEST_CONNECTION_ID;
+    WDFDEVICE device;
+
+    device = HostDeviceAdd(values, ARRAYSIZE(values));
+    CHECK(device != nullptr);
+    CHECK_EQ(HostDeviceStart(device, &id, 1), STATUS_SUCCESS);
+
+    *pTarget = HostTargetConnect(device, HOST_BUS_I2C, TEST_ADDRESS, 400000);
+    CHECK(*pTarget != nullptr);
+
+    return device;
+}
+
+//
+// Transfer Index of a test sequence: the directions alternate,
+// and the delay and length grow with the index.
+//
+
+static
+VOID
+TestTransfer(
+    ULONG           Index,
+    HOST_TRANSFER*  pTransfer
+    )
+{
+    pTransfer->Direction = (Index % 2 == 0) ?
+        SpbTransferDirectionToDevice :
+        SpbTransferDirectionFromDevice;
+    pTransfer->DelayInUs = Index * 10;
+    pTransfer->Length = Index + 1;
+    pTransfer->pData = (Index % 2 == 0) ? s_Data : nullptr;
+}
+
+static
+WDFREQUEST
+TestSubmitSequence(
+    SPBTARGET  Target,
+    ULONG      Count
+    )
+{
+    HOST_TRANSFER transfers[FORWARD_MAX_TRANSFERS + 1];
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        TestTransfer(i, &transfers[i]);
+    }
+
+    return HostSubmitSequence(Target, transfers, Count);
+}
+
+static
+VOID
+TestSequenceLengths(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Sequences of 1 to FORWARD_MAX_TRANSFERS transfers are sent as
+    they are, one entry per transfer.
+
+--*/
+{
+    SPBTARGET target;
+    WDFDEVICE device = TestDeviceOpen(&target);
+
+    for (ULONG count = 1; count <= FORWARD_MAX_TRANSFERS; count++)
+    {
+        ULONG_PTR length = 0;
+
+        HostWireClear();
+
+        WDFREQUEST request = TestSubmitSequence(target, count);
+
+        CHECK_EQ(HostWireCount(), 1);
+
+        const HOST_WIRE_REQUEST* pWire = HostWireGet(0);
+
+        CHECK_EQ(pWire->Kind, HOST_WIRE_IOCTL);
+        CHECK_EQ(pWire->IoControlCode, IOCTL_SPB_EXECUTE_SEQUENCE);
+        CHECK_EQ(pWire->Status, STATUS_SUCCESS);
+        CHECK_EQ(pWire->TransferCount, count);
+
+        for (ULONG i = 0; i < pWire->TransferCount; i++)
+        {
+            HOST_TRANSFER expected;
+
+            TestTransfer(i, &expected);
+
+            CHECK_EQ(pWire->Transfers[i].Direction, expected.Direction);
+            CHECK_EQ(pWire->Transfers[i].DelayInUs, expected.DelayInUs);
+            CHECK_EQ(pWire->Transfers[i].Length, expected.Length);
+            CHECK_EQ(pWire->Transfers[i].Format, SpbTransferBufferFormatMdl);
+
+            length += expected.Length;
+        }
+
+        CHECK(HostControllerComplete(STATUS_SUCCESS));
+        CHECK(HostRequestCompleted(request));
+        CHECK_EQ(HostRequestStatus(request), STATUS_SUCCESS);
+        CHECK_EQ(HostRequestInformation(request), length);
+
+        HostRequestFree(request);
+    }
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+}
+
+//
+// Completes a lock or unlock request on the controller.
+//
+
+static
+VOID
+TestLockWindow(
+    WDFREQUEST  Request
+    )
+{
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK_EQ(HostRequestStatus(Request), STATUS_SUCCESS);
+    HostRequestFree(Request);
+}
+
+static
+VOID
+TestSequenceTooLong(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    A sequence of FORWARD_MAX_TRANSFERS + 1 transfers is failed
+    with STATUS_NOT_SUPPORTED, nothing is sent and the forward
+    request serves the next sequence. A sequence of
+    FORWARD_MAX_TRANSFERS has no room for a held write, which is
+    sent alone ahead of it.
+
+--*/
+{
+    SPBTARGET target;
+    WDFDEVICE device = TestDeviceOpen(&target);
+    WDFREQUEST request;
+    WDFREQUEST write;
+
+    HostWireClear();
+
+    request = TestSubmitSequence(target, FORWARD_MAX_TRANSFERS + 1);
+
+    CHECK(HostRequestCompleted(request));
+    CHECK_EQ(HostRequestStatus(request), STATUS_NOT_SUPPORTED);
+    CHECK_EQ(HostRequestInformation(request), 0);
+    CHECK_EQ(HostWireCount(), 0);
+    HostRequestFree(request);
+
+    //
+    // The held write takes the first entry of the list.
+    //
+
+    TestLockWindow(HostSubmitLock(target));
+    write = HostSubmitWrite(target, s_Data, 1);
+
+    request = TestSubmitSequence(target, FORWARD_MAX_TRANSFERS);
+
+    CHECK_EQ(HostWireCount(), 3);
+    CHECK_EQ(HostWireGet(1)->Kind, HOST_WIRE_WRITE);
+    CHECK_EQ(HostWireGet(2)->TransferCount, FORWARD_MAX_TRANSFERS);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK_EQ(HostRequestStatus(write), STATUS_SUCCESS);
+    CHECK_EQ(HostRequestStatus(request), STATUS_SUCCESS);
+    HostRequestFree(write);
+    HostRequestFree(request);
+
+    TestLockWindow(HostSubmitUnlock(target));
+
+    HostWireClear();
+
+    TestLockWindow(HostSubmitLock(target));
+    write = HostSubmitWrite(target, s_Data, 1);
+
+    request = TestSubmitSequence(target, FORWARD_MAX_TRANSFERS - 1);
+
+    CHECK_EQ(HostWireCount(), 2);
+    CHECK_EQ(HostWireGet(1)->TransferCount, FORWARD_MAX_TRANSFERS);
+    CHECK_EQ(HostWireGet(1)->Transfers[0].Format, SpbTransferBufferFormatMdl);
+    CHECK_EQ(HostWireGet(1)->Transfers[0].Length, 1);
+    CHECK_EQ(HostWireGet(1)->Transfers[1].DelayInUs, 0);
+    CHECK_EQ(HostWireGet(1)->Transfers[2].DelayInUs, 10);
+
+    CHECK(HostControllerComplete(STATUS_SUCCESS));
+    CHECK_EQ(HostRequestStatus(write), STATUS_SUCCESS);
+    CHECK_EQ(HostRequestStatus(request), STATUS_SUCCESS);
+    HostRequestFree(write);
+    HostRequestFree(request);
+
+    TestLockWindow(HostSubmitUnlock(target));
+    CHECK_EQ(HostWireCount(), 3);
+
+    HostTargetDisconnect(target);
+    HostDeviceRemove(device);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestSequenceLengths();
+    TestSequenceTooLong();
+
+    return HostTestReport("sequence_test");
+}